@@ -0,0 +1,920 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// cxxopts:
+#include <cxxopts.hpp>
+
+// STL:
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+// readybase:
+#include <AbstractRD.hpp>
+#include <DisplacedSurfaceFilter.hpp>
+#include <FormulaOpenCLImageRD.hpp>
+#include <GrayScottImageRD.hpp>
+#include <GrayScottMeshRD.hpp>
+#include <MeshGenerators.hpp>
+#include <MeshRelaxation.hpp>
+#include <NativeKernel.hpp>
+#include <OpenCL_utils.hpp>
+#include <Properties.hpp>
+#include <scene_items.hpp>
+#include <StochasticGrayScottImageRD.hpp>
+#include <super_time_stepping.hpp>
+#include <SystemFactory.hpp>
+#include <utils.hpp>
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkPolyData.h>
+#include <vtkSmartPointer.h>
+#include <vtkUnstructuredGrid.h>
+#include <vtkXMLDataElement.h>
+#include <vtkXMLUtilities.h>
+
+using namespace std;
+
+// -------------------------------------------------------------------------------------------------------------
+/*
+        Microbenchmarks for the expensive parts of readybase, timed in isolation.
+
+        Each benchmark is run at several problem sizes (multiplied by --scale where that makes sense) and repeated
+        until --min-time has passed. The results are printed as a table and can be written out (with --json) in
+        the same format as Google Benchmark, so that runs before and after a change can be compared with its tools.
+*/
+// -------------------------------------------------------------------------------------------------------------
+
+/// Timing for one benchmark at one size, in the manner of Google Benchmark's State.
+class BenchmarkState
+{
+    public:
+
+        BenchmarkState(int size, double min_seconds)
+            : size(size), iterations(0), items_processed(0), real_seconds(0.0), cpu_seconds(0.0)
+            , min_seconds(min_seconds), started(false) {}
+
+        /// Call as the condition of the timed loop: the setup before the first call is not timed.
+        bool KeepRunning()
+        {
+            if (!this->started)
+            {
+                this->started = true;
+                this->real_start = chrono::steady_clock::now();
+                this->cpu_start = clock();
+                return true;
+            }
+            this->iterations++;
+            this->real_seconds = chrono::duration<double>(chrono::steady_clock::now() - this->real_start).count();
+            if (this->real_seconds < this->min_seconds)
+                return true;
+            this->cpu_seconds = double(clock() - this->cpu_start) / CLOCKS_PER_SEC;
+            return false;
+        }
+
+        /// How many cells (or points, or characters) each iteration handles, for the throughput column.
+        void SetItemsPerIteration(long long n) { this->items_processed = n; }
+
+        int size;
+        long long iterations;
+        long long items_processed;
+        double real_seconds;
+        double cpu_seconds;
+        map<string, double> counters; ///< other figures to report, as Google Benchmark's user counters
+
+    private:
+
+        double min_seconds;
+        bool started;
+        chrono::steady_clock::time_point real_start;
+        clock_t cpu_start;
+};
+
+// -------------------------------------------------------------------------------------------------------------
+
+struct Benchmark
+{
+    string name;
+    vector<int> sizes;
+    bool scale_sizes; // (some sizes are levels of subdivision, which grow exponentially)
+    function<void(BenchmarkState&)> run;
+};
+
+struct BenchmarkResult
+{
+    string name;
+    long long iterations;
+    double real_seconds_per_iteration;
+    double cpu_seconds_per_iteration;
+    double items_per_second;
+    map<string, double> counters;
+};
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Gives the benchmarks access to the neighbor search, which otherwise only runs when a mesh is copied in.
+class NeighborSearchMeshRD : public GrayScottMeshRD
+{
+    public:
+
+        void ComputeVertexNeighbors() { this->ComputeCellNeighbors(TNeighborhood::VERTEX_NEIGHBORS); }
+        void ComputeFaceNeighbors() { this->ComputeCellNeighbors(TNeighborhood::FACE_NEIGHBORS); }
+};
+
+// -------------------------------------------------------------------------------------------------------------
+
+string GetOverlayStack(const string& stack_name)
+{
+    if (stack_name == "constant")
+        return "<overlay chemical=\"a\"><overwrite /><constant value=\"1\" /><everywhere /></overlay>"
+               "<overlay chemical=\"b\"><overwrite /><constant value=\"0\" /><everywhere /></overlay>";
+    else if (stack_name == "noise")
+        return "<overlay chemical=\"a\"><overwrite /><white_noise low=\"0\" high=\"1\" /><everywhere /></overlay>"
+               "<overlay chemical=\"b\"><overwrite /><perlin_noise scale=\"16\" num_octaves=\"8\" /><everywhere /></overlay>";
+    else if (stack_name == "shapes")
+    {
+        ostringstream oss;
+        oss << "<overlay chemical=\"a\"><overwrite /><constant value=\"1\" /><everywhere /></overlay>";
+        for (int i = 0; i < 8; i++)
+        {
+            const float x = 0.1f + 0.1f * i;
+            oss << "<overlay chemical=\"b\"><add /><gaussian height=\"0.5\" sigma=\"0.05\"><point3D x=\"" << x
+                << "\" y=\"0.5\" z=\"0.5\" /></gaussian><circle radius=\"0.1\"><point3D x=\"" << x
+                << "\" y=\"0.5\" z=\"0.5\" /></circle></overlay>";
+            oss << "<overlay chemical=\"a\"><multiply /><linear_gradient val1=\"0.5\" val2=\"1\"><point3D x=\"0\" y=\"0\" z=\"0\" />"
+                << "<point3D x=\"1\" y=\"1\" z=\"1\" /></linear_gradient><rectangle><point3D x=\"" << x - 0.05f
+                << "\" y=\"0.2\" z=\"0.2\" /><point3D x=\"" << x + 0.05f << "\" y=\"0.8\" z=\"0.8\" /></rectangle></overlay>";
+        }
+        return oss.str();
+    }
+    throw runtime_error("GetOverlayStack : unknown stack: " + stack_name);
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Counts the integer operations in a kernel's reads from its input buffers, and in any test of whether the reads are
+/// all inside the image, along the path that a work-item away from the boundary takes. (Where the kernel branches on
+/// that test only the first branch is counted. The reads inside loops are counted once.)
+int CountInteriorIndexOperations(const string& kernel_source)
+{
+    auto count_operations = [](const string& code) {
+        int n = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const string two = code.substr(i, 2);
+            if (two == "&&" || two == ">=" || two == "<=")
+            {
+                n++;
+                i++;
+            }
+            else if (string("+-*/%&<>").find(code[i]) != string::npos)
+                n++;
+            else if ((code.compare(i, 4, "min(") == 0 || code.compare(i, 4, "max(") == 0)
+                && (i == 0 || !(isalnum(code[i - 1]) || code[i - 1] == '_')))
+                n++;
+        }
+        return n;
+    };
+    int n = 0;
+    istringstream lines(kernel_source);
+    string line;
+    string skip_until; // (the line that closes the boundary branch being skipped, if any)
+    vector<string> interior_branch_ends;
+    while (getline(lines, line))
+    {
+        const size_t first = line.find_first_not_of(' ');
+        const string indent = line.substr(0, first == string::npos ? line.size() : first);
+        if (!skip_until.empty())
+        {
+            if (line == skip_until)
+                skip_until.clear();
+            continue;
+        }
+        if (line.compare(indent.size(), 10, "if (index_") == 0)
+        {
+            n += count_operations(line.substr(indent.size() + 4, line.rfind(')') - indent.size() - 4));
+            interior_branch_ends.push_back(indent + "} else {");
+            continue;
+        }
+        if (!interior_branch_ends.empty() && line == interior_branch_ends.back())
+        {
+            skip_until = indent + "}";
+            interior_branch_ends.pop_back();
+            continue;
+        }
+        for (size_t start = line.find("_in["); start != string::npos; start = line.find("_in[", start))
+        {
+            start += 4;
+            int depth = 1;
+            size_t end = start;
+            while (end < line.size() && depth > 0)
+            {
+                if (line[end] == '[') depth++;
+                else if (line[end] == ']') depth--;
+                end++;
+            }
+            n += count_operations(line.substr(start, end - 1 - start));
+        }
+    }
+    return n;
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Makes a Gray-Scott image system of the given size, with the given stack of overlays as its initial pattern.
+unique_ptr<ImageRD> MakeImageSystem(int x, int y, int z, const string& stack_name)
+{
+    const string rd_xml = "<RD format_version=\"6\"><rule type=\"inbuilt\" name=\"Gray-Scott\">"
+        "<param name=\"timestep\">1</param><param name=\"D_a\">0.082</param><param name=\"D_b\">0.041</param>"
+        "<param name=\"k\">0.06</param><param name=\"F\">0.035</param></rule>"
+        "<initial_pattern_generator>" + GetOverlayStack(stack_name) + "</initial_pattern_generator></RD>";
+    vtkSmartPointer<vtkXMLDataElement> rd = vtkSmartPointer<vtkXMLDataElement>::Take(
+        vtkXMLUtilities::ReadElementFromString(rd_xml.c_str()));
+    if (!rd)
+        throw runtime_error("MakeImageSystem : failed to parse XML");
+    unique_ptr<ImageRD> system = make_unique<GrayScottImageRD>();
+    bool warn_to_update;
+    system->InitializeFromXML(rd, warn_to_update);
+    system->SetDimensionsAndNumberOfChemicals(x, y, z, 2);
+    system->GenerateInitialPattern();
+    return system;
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Makes the generated meshes, at the given size.
+void GenerateMesh(const string& generator, int size, vtkUnstructuredGrid* mesh)
+{
+    if (generator == "GeodesicSphere")                   MeshGenerators::GetGeodesicSphere(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "Torus")                       MeshGenerators::GetTorus(size, size * 5 / 4, mesh, 2, VTK_FLOAT);
+    else if (generator == "TriangularMesh")              MeshGenerators::GetTriangularMesh(size, size, mesh, 2, VTK_FLOAT);
+    else if (generator == "HexagonalMesh")               MeshGenerators::GetHexagonalMesh(size, size, mesh, 2, VTK_FLOAT);
+    else if (generator == "RhombilleTiling")             MeshGenerators::GetRhombilleTiling(size, size, mesh, 2, VTK_FLOAT);
+    else if (generator == "PenroseTilingRhombi")         MeshGenerators::GetPenroseTiling(size, 0, mesh, 2, VTK_FLOAT);
+    else if (generator == "PenroseTilingDartsAndKites")  MeshGenerators::GetPenroseTiling(size, 1, mesh, 2, VTK_FLOAT);
+    else if (generator == "RandomDelaunay2D")            MeshGenerators::GetRandomDelaunay2D(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "RandomVoronoi2D")             MeshGenerators::GetRandomVoronoi2D(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "RandomVoronoi2DLloyd")        MeshGenerators::GetRandomVoronoi2D(size, mesh, 2, VTK_FLOAT, 10);
+    else if (generator == "RandomDelaunay3D")            MeshGenerators::GetRandomDelaunay3D(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "BodyCentredCubicHoneycomb")   MeshGenerators::GetBodyCentredCubicHoneycomb(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "FaceCentredCubicHoneycomb")   MeshGenerators::GetFaceCentredCubicHoneycomb(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "DiamondCells")                MeshGenerators::GetDiamondCells(size, mesh, 2, VTK_FLOAT);
+    else if (generator == "HyperbolicPlaneTiling")       MeshGenerators::GetHyperbolicPlaneTiling(5, 4, size, mesh, 2, VTK_FLOAT);
+    else if (generator == "HyperbolicSpaceTessellation") MeshGenerators::GetHyperbolicSpaceTessellation(4, 3, 5, size, mesh, 2, VTK_FLOAT);
+    else throw runtime_error("GenerateMesh : unknown generator: " + generator);
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+vector<Benchmark> GetBenchmarks()
+{
+    vector<Benchmark> benchmarks;
+
+    // --- MeshGenerators::Get* ---
+    struct { const char* name; vector<int> sizes; bool scale_sizes; } generators[] = {
+        { "GeodesicSphere", { 4, 5, 6 }, false },
+        { "Torus", { 50, 100, 200 }, true },
+        { "TriangularMesh", { 50, 100, 200 }, true },
+        { "HexagonalMesh", { 50, 100, 200 }, true },
+        { "RhombilleTiling", { 50, 100, 200 }, true },
+        { "PenroseTilingRhombi", { 7, 8, 9 }, false },
+        { "PenroseTilingDartsAndKites", { 6, 7, 8 }, false },
+        { "RandomDelaunay2D", { 1000, 5000, 20000 }, true },
+        { "RandomVoronoi2D", { 1000, 5000, 20000 }, true },
+        { "RandomVoronoi2DLloyd", { 1000, 5000, 20000 }, true },
+        { "RandomDelaunay3D", { 500, 1000, 2000 }, true },
+        { "BodyCentredCubicHoneycomb", { 5, 10, 20 }, true },
+        { "FaceCentredCubicHoneycomb", { 5, 10, 15 }, true },
+        { "DiamondCells", { 5, 10, 20 }, true },
+        { "HyperbolicPlaneTiling", { 4, 5, 6 }, false },
+        { "HyperbolicSpaceTessellation", { 2, 3, 4 }, false },
+    };
+    for (const auto& generator : generators)
+    {
+        const string name = generator.name;
+        benchmarks.push_back({ "MeshGenerators::Get" + name, generator.sizes, generator.scale_sizes,
+            [name](BenchmarkState& state) {
+                long long n_cells = 0;
+                while (state.KeepRunning())
+                {
+                    vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+                    GenerateMesh(name, state.size, mesh);
+                    n_cells = mesh->GetNumberOfCells();
+                }
+                state.SetItemsPerIteration(n_cells);
+            } });
+    }
+
+    // --- MeshRD::ComputeCellNeighbors ---
+    struct { const char* name; const char* generator; vector<int> sizes; bool face_neighbors; } neighbor_searches[] = {
+        { "TriangularMesh/vertex", "TriangularMesh", { 50, 100, 200 }, false },
+        { "HexagonalMesh/vertex", "HexagonalMesh", { 50, 100, 200 }, false },
+        { "BodyCentredCubicHoneycomb/face", "BodyCentredCubicHoneycomb", { 5, 10, 20 }, true },
+        { "RandomDelaunay3D/face", "RandomDelaunay3D", { 500, 1000, 2000 }, true },
+    };
+    for (const auto& search : neighbor_searches)
+    {
+        const string generator = search.generator;
+        const bool face_neighbors = search.face_neighbors;
+        benchmarks.push_back({ string("MeshRD::ComputeCellNeighbors/") + search.name, search.sizes, true,
+            [generator, face_neighbors](BenchmarkState& state) {
+                vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+                GenerateMesh(generator, state.size, mesh);
+                NeighborSearchMeshRD system;
+                system.CopyFromMesh(mesh);
+                while (state.KeepRunning())
+                {
+                    if (face_neighbors)
+                        system.ComputeFaceNeighbors();
+                    else
+                        system.ComputeVertexNeighbors();
+                }
+                state.SetItemsPerIteration(system.GetNumberOfCells());
+            } });
+    }
+
+    // --- MeshRelaxation::Relax and the stable timestep estimate ---
+    // (the size is the number of points that the random Voronoi mesh is made from)
+    const pair<string, MeshRelaxation::Method> relaxation_methods[3] = {
+        { "laplacian", MeshRelaxation::Method::Laplacian },
+        { "centroidal", MeshRelaxation::Method::Centroidal },
+        { "equalize", MeshRelaxation::Method::EqualizeCellSizes } };
+    for (const auto& method : relaxation_methods)
+    {
+        benchmarks.push_back({ "MeshRelaxation::Relax/" + method.first, { 1000, 5000, 20000 }, true,
+            [method](BenchmarkState& state) {
+                const int n_iterations = 10;
+                vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+                GenerateMesh("RandomVoronoi2D", state.size, mesh);
+                while (state.KeepRunning())
+                    MeshRelaxation::Relax(mesh, method.second, n_iterations);
+                state.SetItemsPerIteration(mesh->GetNumberOfCells() * n_iterations);
+            } });
+    }
+    benchmarks.push_back({ "MeshRD::EstimateLaplacianSpectralRadius", { 1000, 5000, 20000 }, true,
+        [](BenchmarkState& state) {
+            vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+            GenerateMesh("RandomVoronoi2D", state.size, mesh);
+            GrayScottMeshRD system;
+            system.CopyFromMesh(mesh);
+            while (state.KeepRunning())
+                system.EstimateLaplacianSpectralRadius();
+            state.SetItemsPerIteration(system.GetNumberOfCells());
+        } });
+
+    // --- ImageRD::GenerateInitialPattern ---
+    for (const string stack_name : { "constant", "noise", "shapes" })
+    {
+        benchmarks.push_back({ "ImageRD::GenerateInitialPattern/2D/" + stack_name, { 128, 256, 512 }, true,
+            [stack_name](BenchmarkState& state) {
+                unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, 1, stack_name);
+                while (state.KeepRunning())
+                    system->GenerateInitialPattern();
+                state.SetItemsPerIteration(system->GetNumberOfCells());
+            } });
+        benchmarks.push_back({ "ImageRD::GenerateInitialPattern/3D/" + stack_name, { 32, 64, 128 }, true,
+            [stack_name](BenchmarkState& state) {
+                unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, state.size, stack_name);
+                while (state.KeepRunning())
+                    system->GenerateInitialPattern();
+                state.SetItemsPerIteration(system->GetNumberOfCells());
+            } });
+    }
+
+    // --- SaveFile and SystemFactory::CreateFromFile ---
+    benchmarks.push_back({ "SaveFile+CreateFromFile/image", { 128, 256, 512 }, true,
+        [](BenchmarkState& state) {
+            unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, 1, "noise");
+            Properties render_settings("render_settings");
+            SetDefaultRenderSettings(render_settings);
+            const string filename = "rdybench_round_trip." + system->GetFileExtension();
+            while (state.KeepRunning())
+            {
+                system->SaveFile(filename.c_str(), render_settings, false);
+                bool warn_to_update;
+                SystemFactory::CreateFromFile(filename.c_str(), false, 0, 0, render_settings, warn_to_update);
+            }
+            remove(filename.c_str());
+            state.SetItemsPerIteration(system->GetNumberOfCells());
+        } });
+    benchmarks.push_back({ "SaveFile+CreateFromFile/mesh", { 50, 100, 200 }, true,
+        [](BenchmarkState& state) {
+            vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+            GenerateMesh("TriangularMesh", state.size, mesh);
+            GrayScottMeshRD system;
+            system.CopyFromMesh(mesh);
+            Properties render_settings("render_settings");
+            SetDefaultRenderSettings(render_settings);
+            const string filename = "rdybench_round_trip." + system.GetFileExtension();
+            while (state.KeepRunning())
+            {
+                system.SaveFile(filename.c_str(), render_settings, false);
+                bool warn_to_update;
+                SystemFactory::CreateFromFile(filename.c_str(), false, 0, 0, render_settings, warn_to_update);
+            }
+            remove(filename.c_str());
+            state.SetItemsPerIteration(system.GetNumberOfCells());
+        } });
+
+    // --- ImageRD::Resample: up to twice the size and back ---
+    // (the size is the side of a 2D grid)
+    benchmarks.push_back({ "ImageRD::Resample/2D", { 128, 256, 512 }, true,
+        [](BenchmarkState& state) {
+            unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, 1, "noise");
+            while (state.KeepRunning())
+            {
+                system->Resample(2 * state.size, 2 * state.size, 1);
+                system->Resample(state.size, state.size, 1);
+            }
+            state.SetItemsPerIteration(system->GetNumberOfCells() * 5); // (4 cells made on the way up, 1 on the way down)
+        } });
+
+    // --- GrayScottImageRD::Update in each update order ---
+    // (the size is the side of a 3D grid)
+    const pair<string, GrayScottImageRD::UpdateOrder> update_orders[3] = {
+        { "double_buffered", GrayScottImageRD::UpdateOrder::DoubleBuffered },
+        { "wavefront", GrayScottImageRD::UpdateOrder::Wavefront },
+        { "red_black", GrayScottImageRD::UpdateOrder::RedBlack } };
+    for (const auto& update_order : update_orders)
+    {
+        benchmarks.push_back({ "GrayScottImageRD::Update/" + update_order.first, { 32, 64, 128 }, true,
+            [update_order](BenchmarkState& state) {
+                const int n_steps = 10;
+                unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, state.size, "noise");
+                static_cast<GrayScottImageRD&>(*system).SetUpdateOrder(update_order.second);
+                while (state.KeepRunning())
+                    system->Update(n_steps);
+                state.SetItemsPerIteration(system->GetNumberOfCells() * n_steps);
+            } });
+    }
+
+    // --- StochasticGrayScottImageRD::Update: tau-leaping with a random stream per cell ---
+    // (the size is the side of a 2D grid)
+    benchmarks.push_back({ "StochasticGrayScottImageRD::Update", { 128, 256, 512 }, true,
+        [](BenchmarkState& state) {
+            const int n_steps = 4;
+            StochasticGrayScottImageRD system;
+            system.SetDimensionsAndNumberOfChemicals(state.size, state.size, 1, 2);
+            system.BlankImage(0.5f);
+            while (state.KeepRunning())
+                system.Update(n_steps);
+            state.SetItemsPerIteration(system.GetNumberOfCells() * n_steps);
+        } });
+
+    // --- AssembleFormulaKernelSource and the keyword scan inside it ---
+    // (the size is the dimensionality of the arena)
+    const string formula =
+        "delta_a = D_a * laplacian_a - a*b*b + F*(1-a) + bilaplacian_c;\n"
+        "delta_b = D_b * laplacian_b + a*b*b - (F+k)*b + gradient_mag_squared_a;\n"
+        "delta_c = laplacian_c + x_gradient_d - y_gradient_d;\n"
+        "delta_d = bilaplacian_d - laplacian_a * (x_pos + y_pos);\n";
+    const vector<AbstractRD::Parameter> parameters = { { "D_a", 0.082f }, { "D_b", 0.041f }, { "F", 0.035f }, { "k", 0.06f } };
+    benchmarks.push_back({ "GetFormulaStencilRadii", { 1, 2, 3 }, false,
+        [formula](BenchmarkState& state) {
+            int stencil_radii[3];
+            while (state.KeepRunning())
+                GetFormulaStencilRadii(formula, 4, state.size, AbstractRD::Accuracy::High, stencil_radii);
+            state.SetItemsPerIteration(formula.size());
+        } });
+    for (const bool use_local_memory : { false, true })
+    {
+        benchmarks.push_back({ string("AssembleFormulaKernelSource/") + (use_local_memory ? "local_memory" : "global_memory"),
+            { 1, 2, 3 }, false,
+            [formula, parameters, use_local_memory](BenchmarkState& state) {
+                const int block_size[3] = { 4, 1, 1 };
+                const size_t local_work_size[3] = { 8, 8, 1 };
+                while (state.KeepRunning())
+                    AssembleFormulaKernelSource(formula, 4, state.size, parameters, AbstractRD::Accuracy::High, true,
+                        VTK_FLOAT, "float", "f", block_size, use_local_memory, local_work_size, nullptr);
+                state.SetItemsPerIteration(formula.size());
+            } });
+    }
+
+    // --- peeling the boundary off formula kernels: the integer operations in their reads, and running them ---
+    // (the size is the dimensionality of the arena, or the size of the grid; running needs native kernels)
+    for (const bool use_local_memory : { false, true })
+    {
+        for (const bool peel_boundary : { false, true })
+        {
+            const string variant = string(use_local_memory ? "local_memory" : "global_memory")
+                + (peel_boundary ? "/peeled" : "/wrapped");
+            benchmarks.push_back({ "AssembleFormulaKernelSource/boundary/" + variant, { 1, 2, 3 }, false,
+                [formula, parameters, use_local_memory, peel_boundary](BenchmarkState& state) {
+                    const int block_size[3] = { 4, 1, 1 };
+                    const size_t local_work_size[3] = { 8, 8, 1 };
+                    string source;
+                    while (state.KeepRunning())
+                        source = AssembleFormulaKernelSource(formula, 4, state.size, parameters,
+                            AbstractRD::Accuracy::High, true, VTK_FLOAT, "float", "f", block_size, use_local_memory,
+                            local_work_size, nullptr, false, false, false, peel_boundary);
+                    state.SetItemsPerIteration(formula.size());
+                    state.counters["interior_index_ops"] = CountInteriorIndexOperations(source);
+                } });
+        }
+    }
+    if (NativeKernel::IsSupported())
+    {
+        const string gray_scott_formula = "delta_a = D_a * laplacian_a - a*b*b + F*(1-a);\n"
+            "delta_b = D_b * laplacian_b + a*b*b - (F+k)*b;\n";
+        const vector<AbstractRD::Parameter> gray_scott_parameters = { { "timestep", 1.0f }, { "D_a", 0.082f },
+            { "D_b", 0.041f }, { "F", 0.035f }, { "k", 0.06f } };
+        for (const bool peel_boundary : { false, true })
+        {
+            benchmarks.push_back({ string("NativeKernel::Run/boundary/") + (peel_boundary ? "peeled" : "wrapped"),
+                { 256, 512, 1024 }, true,
+                [gray_scott_formula, gray_scott_parameters, peel_boundary](BenchmarkState& state) {
+                    const int single_cells[3] = { 1, 1, 1 };
+                    const size_t local_work_size[3] = { 1, 1, 1 };
+                    NativeKernel kernel;
+                    kernel.Build(AssembleFormulaKernelSource(gray_scott_formula, 2, 2, gray_scott_parameters,
+                        AbstractRD::Accuracy::Medium, true, VTK_FLOAT, "float", "f", single_cells, false,
+                        local_work_size, nullptr, true, false, false, peel_boundary));
+                    // (the wrapping needs a power-of-two size)
+                    const size_t n = size_t(1) << int(ceil(log2(max(1, state.size))));
+                    const size_t global_range[3] = { n, n, 1 };
+                    vector<float> a_in(n * n, 1.0f), b_in(n * n), a_out(n * n), b_out(n * n);
+                    for (size_t i = 0; i < b_in.size(); i++)
+                        b_in[i] = float(i % 7) / 7.0f;
+                    while (state.KeepRunning())
+                        kernel.Run({ a_in.data(), b_in.data(), a_out.data(), b_out.data() }, global_range);
+                    state.SetItemsPerIteration(n * n);
+                } });
+        }
+    }
+
+    // --- buffer and image storage for the OpenCL chemicals: kernel generation and running ---
+    // (the size is the dimensionality of the arena, or the size of the grid; running needs an OpenCL device)
+    for (const bool use_image_storage : { false, true })
+    {
+        const string variant = use_image_storage ? "images" : "buffers";
+        benchmarks.push_back({ "AssembleFormulaKernelSource/" + variant, { 1, 2, 3 }, false,
+            [formula, parameters, use_image_storage](BenchmarkState& state) {
+                const int block_size[3] = { 4, 1, 1 };
+                const size_t local_work_size[3] = { 8, 8, 1 };
+                while (state.KeepRunning())
+                    AssembleFormulaKernelSource(formula, 4, state.size, parameters, AbstractRD::Accuracy::High, true,
+                        VTK_FLOAT, "float", "f", block_size, false, local_work_size, nullptr, true, use_image_storage);
+                state.SetItemsPerIteration(formula.size());
+            } });
+        if (OpenCL_utils::IsOpenCLAvailable())
+        {
+            benchmarks.push_back({ "FormulaOpenCLImageRD::Update/" + variant, { 256, 512, 1024 }, true,
+                [use_image_storage](BenchmarkState& state) {
+                    const int n_steps = 100;
+                    FormulaOpenCLImageRD system(0, 0, VTK_FLOAT); // (Gray-Scott, on the first device)
+                    system.SetUseImageStorage(use_image_storage);
+                    system.SetDimensionsAndNumberOfChemicals(state.size, state.size, 1, 2);
+                    system.BlankImage(0.5f);
+                    system.Update(1); // (builds the kernel)
+                    while (state.KeepRunning())
+                        system.Update(n_steps);
+                    state.SetItemsPerIteration(system.GetNumberOfCells() * n_steps);
+                } });
+        }
+    }
+
+    // --- super-time-stepping: stage count estimate, kernel generation and running ---
+    // (the size is the dimensionality of the arena, or the size of the grid; running needs an OpenCL device)
+    benchmarks.push_back({ "EstimateFormulaSpectralRadius", { 1, 2, 3 }, false,
+        [formula, parameters](BenchmarkState& state) {
+            map<string, double> keyword_radii;
+            for (const string chem : { "a", "b", "c", "d" })
+            {
+                keyword_radii["laplacian_" + chem] = 4.0 * state.size;
+                keyword_radii["bilaplacian_" + chem] = 16.0 * state.size * state.size;
+            }
+            double spectral_radius;
+            while (state.KeepRunning())
+                EstimateFormulaSpectralRadius(formula, parameters, keyword_radii, spectral_radius);
+            state.SetItemsPerIteration(formula.size());
+        } });
+    benchmarks.push_back({ "AssembleFormulaKernelSource/super_time_stepping", { 1, 2, 3 }, false,
+        [formula, parameters](BenchmarkState& state) {
+            const int block_size[3] = { 4, 1, 1 };
+            const size_t local_work_size[3] = { 8, 8, 1 };
+            while (state.KeepRunning())
+                AssembleFormulaKernelSource(formula, 4, state.size, parameters, AbstractRD::Accuracy::High, true,
+                    VTK_FLOAT, "float", "f", block_size, false, local_work_size, nullptr, true, false, true);
+            state.SetItemsPerIteration(formula.size());
+        } });
+    if (OpenCL_utils::IsOpenCLAvailable())
+    {
+        for (const bool use_super_time_stepping : { false, true })
+        {
+            // fast diffusion, so that forward Euler needs timestep <= 0.25 while the stages can take a much longer one
+            // (the items are cells times units of simulated time, which both variants cover the same amount of)
+            const string variant = use_super_time_stepping ? "super_time_stepping" : "forward_euler";
+            benchmarks.push_back({ "FormulaOpenCLImageRD::Update/" + variant, { 256, 512, 1024 }, true,
+                [use_super_time_stepping](BenchmarkState& state) {
+                    const float timestep = use_super_time_stepping ? 4.0f : 0.25f;
+                    const int n_steps = use_super_time_stepping ? 4 : 64;
+                    FormulaOpenCLImageRD system(0, 0, VTK_FLOAT); // (Gray-Scott, on the first device)
+                    for (int i = 0; i < system.GetNumberOfParameters(); i++)
+                    {
+                        const string name = system.GetParameterName(i);
+                        if (name == "timestep") system.SetParameterValue(i, timestep);
+                        else if (name == "D_a") system.SetParameterValue(i, 1.0f);
+                        else if (name == "D_b") system.SetParameterValue(i, 0.5f);
+                    }
+                    system.SetUseSuperTimeStepping(use_super_time_stepping);
+                    system.SetDimensionsAndNumberOfChemicals(state.size, state.size, 1, 2);
+                    system.BlankImage(0.5f);
+                    system.Update(1); // (builds the kernel)
+                    while (state.KeepRunning())
+                        system.Update(n_steps);
+                    state.SetItemsPerIteration(system.GetNumberOfCells() * 16);
+                } });
+        }
+    }
+
+    // --- large neighborhoods: kernel generation, compilation and running ---
+    // (the size is the radius of the direct neighbor access, or the dimensionality, or the size of the grid)
+    benchmarks.push_back({ "AssembleFormulaKernelSource/large_radius", { 4, 8, 16 }, false,
+        [parameters](BenchmarkState& state) {
+            const string r = to_string(state.size);
+            const string large_formula = "delta_a = a_e" + r + " + a_w" + r + " + a_n" + r + " + a_s" + r + " - 4*a;\n"
+                "delta_b = laplacian_b;\n";
+            const int block_size[3] = { 4, 1, 1 };
+            const size_t local_work_size[3] = { 8, 8, 1 };
+            while (state.KeepRunning())
+                AssembleFormulaKernelSource(large_formula, 2, 2, parameters, AbstractRD::Accuracy::Medium, true,
+                    VTK_FLOAT, "float", "f", block_size, true, local_work_size, nullptr);
+            state.SetItemsPerIteration(large_formula.size());
+        } });
+    if (NativeKernel::IsSupported())
+    {
+        const string large_stencil_formula = "delta_a = trilaplacian_a + gaussian_a;\n";
+        const vector<AbstractRD::Parameter> timestep = { { "timestep", 0.001f } };
+        for (const bool loop_large_stencils : { false, true })
+        {
+            const string variant = loop_large_stencils ? "looped" : "unrolled";
+            benchmarks.push_back({ "NativeKernel::Build/large_stencils/" + variant, { 1, 2, 3 }, false,
+                [large_stencil_formula, timestep, loop_large_stencils](BenchmarkState& state) {
+                    const int single_cells[3] = { 1, 1, 1 };
+                    const size_t local_work_size[3] = { 1, 1, 1 };
+                    const string source = AssembleFormulaKernelSource(large_stencil_formula, 1, state.size, timestep,
+                        AbstractRD::Accuracy::Medium, true, VTK_FLOAT, "float", "f", single_cells, false, local_work_size,
+                        nullptr, loop_large_stencils);
+                    while (state.KeepRunning())
+                    {
+                        NativeKernel kernel; // (a new one each time, since Build does nothing if the source is unchanged)
+                        kernel.Build(source);
+                    }
+                    state.SetItemsPerIteration(source.size());
+                } });
+            benchmarks.push_back({ "NativeKernel::Run/large_stencils/" + variant, { 32, 64 }, true,
+                [large_stencil_formula, timestep, loop_large_stencils](BenchmarkState& state) {
+                    const int single_cells[3] = { 1, 1, 1 };
+                    const size_t local_work_size[3] = { 1, 1, 1 };
+                    NativeKernel kernel;
+                    kernel.Build(AssembleFormulaKernelSource(large_stencil_formula, 1, 3, timestep,
+                        AbstractRD::Accuracy::Medium, true, VTK_FLOAT, "float", "f", single_cells, false, local_work_size,
+                        nullptr, loop_large_stencils));
+                    // (the wrapping needs a power-of-two size)
+                    const size_t n = size_t(1) << int(ceil(log2(max(1, state.size))));
+                    const size_t global_range[3] = { n, n, n };
+                    vector<float> a_in(n * n * n), a_out(n * n * n);
+                    for (size_t i = 0; i < a_in.size(); i++)
+                        a_in[i] = float(i % 7) / 7.0f;
+                    while (state.KeepRunning())
+                        kernel.Run({ a_in.data(), a_out.data() }, global_range);
+                    state.SetItemsPerIteration(n * n * n);
+                } });
+        }
+    }
+
+    // --- ImageRD::GetAsMesh ---
+    benchmarks.push_back({ "ImageRD::GetAsMesh/2D", { 128, 256, 512 }, true,
+        [](BenchmarkState& state) {
+            unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, 1, "shapes");
+            Properties render_settings("render_settings");
+            SetDefaultRenderSettings(render_settings);
+            render_settings.GetProperty("active_chemical").SetChemical("b");
+            while (state.KeepRunning())
+            {
+                // (change a value, as a timestep would, otherwise the filters kept from the last call have nothing to do)
+                system->SetValue(0.5f, 0.5f, 0.5f, 0.0f, render_settings);
+                vtkSmartPointer<vtkPolyData> out = vtkSmartPointer<vtkPolyData>::New();
+                system->GetAsMesh(out, render_settings);
+            }
+            state.SetItemsPerIteration(system->GetNumberOfCells());
+        } });
+    benchmarks.push_back({ "ImageRD::GetAsMesh/3D", { 32, 64, 128 }, true,
+        [](BenchmarkState& state) {
+            unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, state.size, "shapes");
+            Properties render_settings("render_settings");
+            SetDefaultRenderSettings(render_settings);
+            render_settings.GetProperty("active_chemical").SetChemical("b");
+            render_settings.GetProperty("contour_level").SetFloat(0.25f);
+            while (state.KeepRunning())
+            {
+                // (change a value, as a timestep would, otherwise the filters kept from the last call have nothing to do)
+                system->SetValue(0.5f, 0.5f, 0.5f, 0.0f, render_settings);
+                vtkSmartPointer<vtkPolyData> out = vtkSmartPointer<vtkPolyData>::New();
+                system->GetAsMesh(out, render_settings);
+            }
+            state.SetItemsPerIteration(system->GetNumberOfCells());
+        } });
+
+    // --- DisplacedSurfaceFilter, as when rendering the height view of a 2D system after each timestep ---
+    benchmarks.push_back({ "DisplacedSurfaceFilter/2D", { 256, 512, 1024 }, true,
+        [](BenchmarkState& state) {
+            unique_ptr<ImageRD> system = MakeImageSystem(state.size, state.size, 1, "noise");
+            const vector<float> values = system->GetData(1);
+            vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+            image->SetDimensions(state.size, state.size, 1);
+            image->AllocateScalars(VTK_FLOAT, 1);
+            copy(values.begin(), values.end(), static_cast<float*>(image->GetScalarPointer()));
+            vtkSmartPointer<DisplacedSurfaceFilter> surface = vtkSmartPointer<DisplacedSurfaceFilter>::New();
+            surface->SetInputData(image);
+            surface->SetScaleFactor(10.0);
+            surface->Update(); // (the quads are made once, outside the timing)
+            while (state.KeepRunning())
+            {
+                image->Modified();
+                surface->Update();
+            }
+            state.SetItemsPerIteration(system->GetNumberOfCells());
+        } });
+
+    return benchmarks;
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+string FormatTime(double seconds)
+{
+    ostringstream oss;
+    oss << fixed << setprecision(3) << seconds * 1000.0 << " ms";
+    return oss.str();
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+string EscapeJSON(const string& s)
+{
+    string escaped;
+    for (const char c : s)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Writes the results in the format that Google Benchmark uses, so that its compare.py can read them.
+void WriteJSON(const string& filename, const vector<BenchmarkResult>& results, const string& executable)
+{
+    ofstream out(filename);
+    if (!out)
+        throw runtime_error("WriteJSON : failed to open file: " + filename);
+
+    const time_t now = time(nullptr);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    out << "{\n";
+    out << "  \"context\": {\n";
+    out << "    \"date\": \"" << date << "\",\n";
+    out << "    \"executable\": \"" << EscapeJSON(executable) << "\",\n";
+    out << "    \"num_cpus\": " << thread::hardware_concurrency() << ",\n";
+#ifdef NDEBUG
+    out << "    \"library_build_type\": \"release\"\n";
+#else
+    out << "    \"library_build_type\": \"debug\"\n";
+#endif
+    out << "  },\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& result = results[i];
+        out << "    {\n";
+        out << "      \"name\": \"" << EscapeJSON(result.name) << "\",\n";
+        out << "      \"run_name\": \"" << EscapeJSON(result.name) << "\",\n";
+        out << "      \"run_type\": \"iteration\",\n";
+        out << "      \"iterations\": " << result.iterations << ",\n";
+        out << "      \"real_time\": " << setprecision(10) << result.real_seconds_per_iteration * 1e9 << ",\n";
+        out << "      \"cpu_time\": " << setprecision(10) << result.cpu_seconds_per_iteration * 1e9 << ",\n";
+        out << "      \"time_unit\": \"ns\",\n";
+        out << "      \"items_per_second\": " << setprecision(10) << result.items_per_second;
+        for (const pair<const string, double>& counter : result.counters)
+            out << ",\n      \"" << EscapeJSON(counter.first) << "\": " << setprecision(10) << counter.second;
+        out << "\n";
+        out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+    vtkObject::GlobalWarningDisplayOff();
+    NativeKernel::SetAllowed(true); // (the benchmarks only compile kernels of their own)
+
+    double scale = 1.0;
+    double min_time = 0.5;
+    string filter;
+    string json_out;
+    bool list_only = false;
+
+    cxxopts::Options options("rdybench", "Microbenchmarks for readybase");
+    options.add_options()
+        ("h,help", "Print the help message")
+        ("f,filter", "Only run the benchmarks whose name contains this text", cxxopts::value<string>(filter))
+        ("s,scale", "Multiply the problem sizes by this (where they are not levels of subdivision)", cxxopts::value<double>(scale)->default_value("1"))
+        ("t,min-time", "Repeat each benchmark for at least this many seconds", cxxopts::value<double>(min_time)->default_value("0.5"))
+        ("j,json", "Write the results to this file, in the JSON format of Google Benchmark", cxxopts::value<string>(json_out))
+        ("l,list", "List the benchmarks without running them", cxxopts::value<bool>(list_only)->default_value("false"))
+        ;
+
+    try {
+        const cxxopts::ParseResult args = options.parse(argc, argv);
+        if (args.count("help"))
+        {
+            cout << options.help() << endl;
+            return EXIT_SUCCESS;
+        }
+    }
+    catch (const cxxopts::OptionParseException& e)
+    {
+        cout << "Argument error: " << e.what() << endl;
+        cout << options.help() << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<BenchmarkResult> results;
+    try
+    {
+        cout << left << setw(64) << "Benchmark" << right << setw(16) << "Time" << setw(16) << "CPU"
+             << setw(12) << "Iterations" << setw(20) << "Items/s" << "\n";
+        cout << string(128, '-') << "\n";
+        for (const Benchmark& benchmark : GetBenchmarks())
+        {
+            if (benchmark.name.find(filter) == string::npos)
+                continue;
+            for (const int base_size : benchmark.sizes)
+            {
+                const int size = benchmark.scale_sizes ? max(1, int(lround(base_size * scale))) : base_size;
+                const string name = benchmark.name + "/" + to_string(size);
+                if (list_only)
+                {
+                    cout << name << "\n";
+                    continue;
+                }
+                BenchmarkState state(size, min_time);
+                benchmark.run(state);
+                const long long n = max(1LL, state.iterations);
+                BenchmarkResult result{ name, state.iterations, state.real_seconds / n, state.cpu_seconds / n,
+                    state.real_seconds > 0.0 ? state.items_processed * n / state.real_seconds : 0.0, state.counters };
+                cout << left << setw(64) << name << right << setw(16) << FormatTime(result.real_seconds_per_iteration)
+                     << setw(16) << FormatTime(result.cpu_seconds_per_iteration) << setw(12) << result.iterations
+                     << setw(20) << setprecision(4) << result.items_per_second;
+                for (const pair<const string, double>& counter : result.counters)
+                    cout << "  " << counter.first << "=" << counter.second;
+                cout << endl;
+                results.push_back(result);
+            }
+        }
+        if (!json_out.empty())
+            WriteJSON(json_out, results, argv[0]);
+    }
+    catch (const exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
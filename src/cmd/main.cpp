@@ -19,16 +19,26 @@
 #include <cxxopts.hpp>
 
 // STL:
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 
 // readybase:
 #include <AbstractRD.hpp>
+#include <MeshRD.hpp>
+#include <NativeKernel.hpp>
 #include <OpenCL_utils.hpp>
 #include <OpenCLImageRD.hpp>
 #include <Properties.hpp>
 #include <scene_items.hpp>
 #include <SystemFactory.hpp>
+#include <utils.hpp>
+
+// VTK:
+#include <vtkSmartPointer.h>
+#include <vtkUnstructuredGrid.h>
 
 using namespace std;
 
@@ -56,6 +66,141 @@ void printSeparator()
     cout << "================================\n";
 }
 
+// -------------------------------------------------------------------------------------------------------------
+
+void printStatistics(const AbstractRD& system, bool print_histogram)
+{
+    const vector<ChemicalStatistics>& statistics = system.GetStatistics();
+    for (size_t i = 0; i < statistics.size(); i++)
+    {
+        const ChemicalStatistics& s = statistics[i];
+        cout << "timestep=" << system.GetStatisticsTimestep() << " chemical=" << GetChemicalName(i)
+             << " min=" << s.minimum << " max=" << s.maximum << " mean=" << s.mean << " variance=" << s.variance;
+        if ( print_histogram )
+        {
+            cout << " histogram=[";
+            for (size_t b = 0; b < s.histogram.size(); b++)
+                cout << (b > 0 ? "," : "") << s.histogram[b];
+            cout << "]";
+        }
+        cout << "\n";
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Reads dimensions written as e.g. "512x512x1".
+void parseDimensions(const string& s, int dimensions[3])
+{
+    istringstream iss(s);
+    char x1 = 0, x2 = 0;
+    if (!(iss >> dimensions[0] >> x1 >> dimensions[1] >> x2 >> dimensions[2]) || x1 != 'x' || x2 != 'x'
+        || dimensions[0] < 1 || dimensions[1] < 1 || dimensions[2] < 1)
+        throw runtime_error("Expected dimensions like 512x512x1, got: " + s);
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Reads a coarse-to-fine schedule written as e.g. "4:2000,2:1000": run with the grid divided by 4 for 2000
+/// iterations, then divided by 2 for 1000 iterations.
+vector<pair<int, int>> parseCoarseToFineSchedule(const string& s)
+{
+    vector<pair<int, int>> stages;
+    istringstream iss(s);
+    string stage;
+    while (getline(iss, stage, ','))
+    {
+        istringstream stage_iss(stage);
+        int divisor = 0, iterations = -1;
+        char colon = 0;
+        if (!(stage_iss >> divisor >> colon >> iterations) || colon != ':' || divisor < 1 || iterations < 0)
+            throw runtime_error("Expected a coarse-to-fine schedule like 4:2000,2:1000, got: " + s);
+        stages.push_back({ divisor, iterations });
+    }
+    return stages;
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Develops the pattern on coarser grids first, resampling it between stages and back to the full size at the end.
+void runCoarseToFine(AbstractRD& system, const vector<pair<int, int>>& stages)
+{
+    const int full_size[3] = { static_cast<int>(system.GetX()), static_cast<int>(system.GetY()), static_cast<int>(system.GetZ()) };
+
+    // a coarse cell stands for several fine ones, so formulas get a wider grid spacing to keep the pattern's scale
+    const bool scale_dx = system.GetRuleType() == "formula";
+    const bool had_dx = system.IsParameter("dx");
+    const float dx = had_dx ? system.GetParameterValueByName("dx") : 1.0f;
+    if (scale_dx && !had_dx)
+        system.AddParameter("dx", dx);
+    if (!scale_dx)
+        cout << "Note: only formula rules have a grid spacing (dx) to widen, so the coarse stages will make "
+                "features a number of coarse cells across, not fine ones.\n";
+    int i_dx = 0;
+    while (i_dx < system.GetNumberOfParameters() && system.GetParameterName(i_dx) != "dx")
+        i_dx++;
+
+    for (const pair<int, int>& stage : stages)
+    {
+        int size[3];
+        for (int i = 0; i < 3; i++)
+            size[i] = max(1, full_size[i] / stage.first);
+        system.Resample(size[0], size[1], size[2]);
+        if (scale_dx)
+            system.SetParameterValue(i_dx, dx * stage.first);
+        cout << "Run at " << size[0] << "x" << size[1] << "x" << size[2] << " for " << stage.second << " steps...\n";
+        system.Update(stage.second);
+    }
+
+    system.Resample(full_size[0], full_size[1], full_size[2]);
+    if (scale_dx && had_dx)
+        system.SetParameterValue(i_dx, dx);
+    else if (scale_dx)
+        system.DeleteParameter(i_dx);
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Reads a mesh relaxation written as e.g. "equalize:50": the method (laplacian, centroidal or equalize) and how many
+/// iterations of it to run.
+void parseMeshRelaxation(const string& s, MeshRelaxation::Method& method, int& n_iterations)
+{
+    const size_t colon = s.find(':');
+    const string name = s.substr(0, colon);
+    if (name == "laplacian")
+        method = MeshRelaxation::Method::Laplacian;
+    else if (name == "centroidal")
+        method = MeshRelaxation::Method::Centroidal;
+    else if (name == "equalize")
+        method = MeshRelaxation::Method::EqualizeCellSizes;
+    else
+        throw runtime_error("Expected a mesh relaxation like equalize:50 (or laplacian or centroidal), got: " + s);
+    n_iterations = colon == string::npos ? 0 : atoi(s.substr(colon + 1).c_str());
+    if (n_iterations < 1)
+        throw runtime_error("Expected a number of iterations of at least 1, got: " + s);
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+void printMeshQuality(const MeshRD& system, const string& when)
+{
+    vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+    system.GetMesh(mesh);
+    double smallest, largest;
+    MeshRelaxation::GetCellAreaRange(mesh, smallest, largest);
+    cout << when << ": smallest_cell_area=" << smallest << " largest_cell_area=" << largest
+         << " neighbor_weights=" << (system.GetDistanceWeightedNeighbors() ? "distance" : "equal")
+         << " laplacian_spectral_radius=" << system.EstimateLaplacianSpectralRadius();
+    const double timestep = system.EstimateMaximumStableTimestep();
+    if (timestep > 0.0)
+        cout << " max_stable_timestep=" << timestep;
+    else
+        cout << " max_stable_timestep=unknown";
+    cout << "\n";
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
 int main(int argc,char *argv[])
 {
     vtkObject::GlobalWarningDisplayOff();
@@ -86,6 +231,12 @@ int main(int argc,char *argv[])
     std::string vti_out;
     int opencl_platform = 0;
     int opencl_device = 0;
+    int stats_interval = 0;
+    bool print_performance = false;
+    std::string resample_to;
+    std::string coarse_to_fine;
+    std::string relax_mesh;
+    bool allow_native_kernels = false;
     bool verbose = false;
 
     cxxopts::Options options("rdy", "Command-line version of Ready");
@@ -108,6 +259,12 @@ int main(int argc,char *argv[])
             // TODO don't crash if incorrect, fail more gracefully!
             ("l,opencl-platform", "OpenCL platform number (Currently will crash if incorrect!)", cxxopts::value<int>(opencl_platform))
             ("g,opencl-device", "OpenCL device number (Currently will crash if incorrect!)", cxxopts::value<int>(opencl_device))
+            ("c,print-performance", "Print where the time went when running (compute, kernel builds, transfers)", cxxopts::value<bool>(print_performance)->default_value("false"))
+            ("R,resample", "Resample the loaded pattern to new dimensions, keeping it (e.g. 512x512x1)", cxxopts::value<string>(resample_to))
+            ("C,coarse-to-fine", "Before the N iterations, develop the pattern on coarser grids: a list of divisor:iterations (e.g. 4:2000,2:1000)", cxxopts::value<string>(coarse_to_fine))
+            ("M,relax-mesh", "Even out the cells of a mesh: method:iterations, where the method is laplacian, centroidal or equalize (e.g. equalize:50)", cxxopts::value<string>(relax_mesh))
+            ("t,stats-interval", "Print the range, mean and variance of each chemical every N iterations (with -v: also a histogram)", cxxopts::value<int>(stats_interval)->default_value("0"))
+            ("allow-native-kernels", "Without OpenCL, compile rules as native code to run them on the CPU. Only use this on files you trust!", cxxopts::value<bool>(allow_native_kernels)->default_value("false"))
             ("v,verbose", "Verbose output.", cxxopts::value<bool>(verbose)->default_value("false"))
             ;
     }
@@ -156,6 +313,13 @@ int main(int argc,char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (allow_native_kernels)
+    {
+        NativeKernel::SetAllowed(true);
+        // Still print (despite not verbose) since it's a warning:
+        cout << "Warning: rules that can't use OpenCL will be compiled and run as native code. Only do this with files you trust.\n";
+    }
+
     const bool is_opencl_available = OpenCL_utils::IsOpenCLAvailable();
     if( is_opencl_available )
     {
@@ -194,6 +358,36 @@ int main(int argc,char *argv[])
                 cout << "System updated to zeroth step..\n";
             }
 
+            if ( !resample_to.empty() )
+            {
+                int dimensions[3];
+                parseDimensions( resample_to, dimensions );
+                if ( !system->HasEditableDimensions() )
+                    throw runtime_error( "This system's dimensions can't be changed, so it can't be resampled." );
+                system->Resample( dimensions[0], dimensions[1], dimensions[2] );
+                if (verbose)
+                {
+                    cout << "Resampled to " << resample_to << "\n";
+                }
+            }
+
+            if ( !relax_mesh.empty() )
+            {
+                MeshRD* mesh_system = dynamic_cast<MeshRD*>( system.get() );
+                if ( !mesh_system )
+                    throw runtime_error( "Only mesh systems (vtu files) can be relaxed." );
+                MeshRelaxation::Method method;
+                int n_iterations;
+                parseMeshRelaxation( relax_mesh, method, n_iterations );
+                cout << "\n";
+                cout << "Mesh relaxation:\n";
+                printSeparator();
+                printMeshQuality( *mesh_system, "before" );
+                mesh_system->RelaxMesh( method, n_iterations );
+                printMeshQuality( *mesh_system, "after" );
+                printSeparator();
+            }
+
             if ( print_reagent_info )
             {
                 int num_chemicals = system->GetNumberOfChemicals();
@@ -359,8 +553,47 @@ int main(int argc,char *argv[])
 
         if ( numiter > 0 )
         {
+            if ( !coarse_to_fine.empty() )
+            {
+                if ( !system->HasEditableDimensions() )
+                    throw runtime_error( "This system's dimensions can't be changed, so it can't be run coarse-to-fine." );
+                runCoarseToFine( *system, parseCoarseToFineSchedule( coarse_to_fine ) );
+            }
+
             cout << "Run the simulation for " << numiter << " steps...\n";
-            system->Update( numiter );
+            if ( stats_interval > 0 )
+            {
+                // run in stretches, summarising the chemicals after each
+                for ( int done = 0; done < numiter; )
+                {
+                    const int n = min( stats_interval, numiter - done );
+                    system->Update( n );
+                    done += n;
+                    system->UpdateStatistics();
+                    printStatistics( *system, verbose );
+                }
+            }
+            else
+            {
+                system->Update( numiter );
+            }
+
+            if ( print_performance )
+            {
+                const PerformanceCounters& counters = system->GetPerformanceCounters();
+                cout << "\n";
+                cout << "Performance:\n";
+                cout << "================================\n";
+                cout << "steps=" << counters.steps << "\n";
+                cout << "compute_seconds=" << counters.compute_seconds << "\n";
+                cout << "build_seconds=" << counters.build_seconds << "\n";
+                cout << "pipeline_seconds=" << counters.pipeline_seconds << "\n";
+                cout << "kernel_launches=" << counters.kernel_launches << "\n";
+                cout << "readbacks=" << counters.readbacks << "\n";
+                cout << "bytes_uploaded=" << counters.bytes_uploaded << "\n";
+                cout << "bytes_downloaded=" << counters.bytes_downloaded << "\n";
+                cout << "================================\n";
+            }
 
             if ( !vti_out.empty() )
             {
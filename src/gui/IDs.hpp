@@ -125,5 +125,8 @@ namespace ID
 
         // RecordingDialog:
         SourceCombo,
+
+        // timers:
+        KernelBuildTimer,
     }; 
 };
@@ -39,6 +39,7 @@
 
 // STL:
 #include <algorithm>
+#include <cmath>
 #include <string>
 
 using namespace std;
@@ -54,6 +55,8 @@ const wxString InfoPanel::kernel_label = _("Kernel");
 const wxString InfoPanel::dimensions_label = _("Dimensions");
 const wxString InfoPanel::block_size_label = _("Block size");
 const wxString InfoPanel::use_local_memory_label = _("Use local memory");
+const wxString InfoPanel::use_image_storage_label = _("Use image storage");
+const wxString InfoPanel::super_time_stepping_label = _("Super-time-stepping");
 const wxString InfoPanel::number_of_cells_label = _("Number of cells");
 const wxString InfoPanel::wrap_label = _("Toroidal wrap-around");
 const wxString InfoPanel::data_type_label = _("Data type");
@@ -202,12 +205,38 @@ void InfoPanel::UpdatePanel(const AbstractRD& system)
 
     contents += AppendRow(use_local_memory_label, use_local_memory_label, system.GetUseLocalMemory() ? _("true") : _("false"), true);
 
+    if (system.HasEditableImageStorage())
+        contents += AppendRow(use_image_storage_label, use_image_storage_label, system.GetUseImageStorage() ? _("true") : _("false"), true);
+
+    if (system.HasEditableSuperTimeStepping())
+    {
+        wxString stages;
+        if (system.GetUseSuperTimeStepping() && system.GetNumberOfStagesPerTimestep() > 0)
+            stages = wxString::Format(_(" (%d stages per timestep)"), system.GetNumberOfStagesPerTimestep());
+        contents += AppendRow(super_time_stepping_label, super_time_stepping_label,
+            (system.GetUseSuperTimeStepping() ? _("on") : _("off")) + stages, true);
+    }
+
     if (system.HasEditableWrapOption())
         contents += AppendRow(wrap_label, wrap_label, system.GetWrap() ? _("on") : _("off"), true);
 
     contents += AppendRow(data_type_label, data_type_label, system.GetDataType() == VTK_DOUBLE ? _("double") : _("float"),
         system.HasEditableDataType());
 
+    if (system.GetStatisticsInterval() > 0)
+    {
+        // (the summaries are only computed every so often, e.g. for auto_range)
+        const vector<ChemicalStatistics>& statistics = system.GetStatistics();
+        for (int iChem = 0; iChem < (int)statistics.size() && iChem < system.GetNumberOfChemicals(); iChem++)
+        {
+            const ChemicalStatistics& s = statistics[iChem];
+            wxString label = wxString::Format(_("Range of %s"), wxString(GetChemicalName(iChem).c_str(), wxConvUTF8));
+            contents += AppendRow(label, label, wxString::Format(_("%s to %s (mean %s, s.d. %s, at timestep %d)"),
+                FormatFloat(s.minimum, 4), FormatFloat(s.maximum, 4), FormatFloat(s.mean, 4),
+                FormatFloat(sqrt(s.variance), 4), system.GetStatisticsTimestep()), false);
+        }
+    }
+
     contents += _T("</table>");
 
     contents += wxT("<h5><center>");
@@ -261,6 +290,32 @@ void InfoPanel::UpdatePanel(const AbstractRD& system)
         else throw runtime_error("InfoPanel::Update : unrecognised type: "+type);
     }
 
+    contents += _T("</table>");
+
+    contents += wxT("<h5><center>");
+    contents += _("Performance:");
+    contents += wxT("</h5></center>");
+    contents += wxT("<table border=0 cellspacing=0 cellpadding=4 width=\"100%\">");
+
+    rownum = 1;
+
+    const PerformanceCounters& counters = system.GetPerformanceCounters();
+    const wxString compute_time_label = _("Compute time");
+    const wxString kernel_launches_label = _("Kernel launches");
+    const wxString build_time_label = _("Kernel build time");
+    const wxString transfers_label = _("Transfers");
+    const wxString pipeline_time_label = _("Render pipeline time");
+    contents += AppendRow(compute_time_label, compute_time_label, wxString::Format(_("%s s for %lld timesteps"),
+        FormatFloat(counters.compute_seconds, 3), counters.steps), false);
+    contents += AppendRow(kernel_launches_label, kernel_launches_label, wxString::Format(wxT("%lld"), counters.kernel_launches),
+        false);
+    contents += AppendRow(build_time_label, build_time_label, FormatFloat(counters.build_seconds, 3) + _(" s"), false);
+    if (counters.readbacks > 0 || counters.bytes_uploaded > 0)
+        contents += AppendRow(transfers_label, transfers_label, wxString::Format(_("%s MB up, %s MB down in %lld readbacks"),
+            FormatFloat(counters.bytes_uploaded / 1048576.0f, 1), FormatFloat(counters.bytes_downloaded / 1048576.0f, 1),
+            counters.readbacks), false);
+    contents += AppendRow(pipeline_time_label, pipeline_time_label, FormatFloat(counters.pipeline_seconds, 3) + _(" s"), false);
+
     contents += _T("</table></body></html>");
 
     html->SaveScrollPos();
@@ -611,7 +666,12 @@ void InfoPanel::ChangeDimensions()
             if (answer == wxCANCEL)
                 continue;
         }
-        if(frame->SetDimensions(newx, newy, newz)) break;
+        const int answer = wxMessageBox(
+            _("Resample the current pattern to the new size? (Otherwise a new initial pattern is generated.)"),
+            _("Change the dimensions"), wxYES_NO | wxCANCEL);
+        if (answer == wxCANCEL)
+            continue;
+        if(frame->SetDimensions(newx, newy, newz, answer == wxYES)) break;
     } while(true);
 }
 
@@ -683,6 +743,24 @@ void InfoPanel::ChangeUseLocalMemory()
 
 // -----------------------------------------------------------------------------
 
+void InfoPanel::ChangeUseImageStorage()
+{
+    AbstractRD& sys = frame->GetCurrentRDSystem();
+    sys.SetUseImageStorage(!sys.GetUseImageStorage());
+    this->UpdatePanel(sys);
+}
+
+// -----------------------------------------------------------------------------
+
+void InfoPanel::ChangeSuperTimeStepping()
+{
+    AbstractRD& sys = frame->GetCurrentRDSystem();
+    sys.SetUseSuperTimeStepping(!sys.GetUseSuperTimeStepping());
+    this->UpdatePanel(sys);
+}
+
+// -----------------------------------------------------------------------------
+
 void InfoPanel::ChangeWrapOption()
 {
     AbstractRD& sys = frame->GetCurrentRDSystem();
@@ -736,6 +814,12 @@ void InfoPanel::ChangeInfo(const wxString& label)
     } else if ( label == use_local_memory_label ) {
         ChangeUseLocalMemory();
 
+    } else if ( label == use_image_storage_label ) {
+        ChangeUseImageStorage();
+
+    } else if ( label == super_time_stepping_label ) {
+        ChangeSuperTimeStepping();
+
     } else if ( label == wrap_label ) {
         ChangeWrapOption();
 
@@ -84,6 +84,8 @@ class InfoPanel : public wxPanel
         static const wxString dimensions_label;
         static const wxString block_size_label;
         static const wxString use_local_memory_label;
+        static const wxString use_image_storage_label;
+        static const wxString super_time_stepping_label;
         static const wxString number_of_cells_label;
         static const wxString wrap_label;
         static const wxString data_type_label;
@@ -111,6 +113,8 @@ private:
         void ChangeBlockSize();
         void ChangeAccuracy();
         void ChangeUseLocalMemory();
+        void ChangeUseImageStorage();
+        void ChangeSuperTimeStepping();
         void ChangeWrapOption();
         void ChangeDataType();
         
@@ -63,12 +63,13 @@
 // STL:
 #include <string>
 #include <algorithm>
+#include <cmath>
 
 // VTK:
 #include <vtkBMPReader.h>
+#include <vtkCallbackCommand.h>
 #include <vtkCellArray.h>
 #include <vtkCellDataToPointData.h>
-#include <vtkCellPicker.h>
 #include <vtkDoubleArray.h>
 #include <vtkImageChangeInformation.h>
 #include <vtkImageLuminance.h>
@@ -84,6 +85,7 @@
 #include <vtkPointData.h>
 #include <vtkPolyDataNormals.h>
 #include <vtkQuadricDecimation.h>
+#include <vtkRenderer.h>
 #include <vtkRendererCollection.h>
 #include <vtkScalarsToColors.h>
 #include <vtkSmartPointer.h>
@@ -130,6 +132,7 @@ wxString PaneName(int id)
 BEGIN_EVENT_TABLE(MyFrame, wxFrame)
     EVT_ACTIVATE(MyFrame::OnActivate)
     EVT_IDLE(MyFrame::OnIdle)
+    EVT_TIMER(ID::KernelBuildTimer, MyFrame::OnKernelBuildTimer)
     EVT_SIZE(MyFrame::OnSize)
     EVT_CLOSE(MyFrame::OnClose)
     // file menu
@@ -260,12 +263,15 @@ MyFrame::MyFrame(const wxString& title)
     time_at_last_render(0),
     i_timesteps_per_second_buffer(0),
     speed_data_available(false),
+    was_compiling_kernel(false),
+    kernel_build_timer(this, ID::KernelBuildTimer),
     is_recording(false),
     fullscreen(false),
     CurrentCursor(TCursorType::POINTER),
     current_paint_value(0.5f),
     left_mouse_is_down(false),
-    right_mouse_is_down(false)
+    right_mouse_is_down(false),
+    brush_stroke_pending(false)
 {
     this->SetIcon(wxICON(appicon16));
     #ifdef __WXGTK__
@@ -335,6 +341,7 @@ MyFrame::MyFrame(const wxString& title)
 
 MyFrame::~MyFrame()
 {
+    this->kernel_build_timer.Stop();
     this->SaveSettings(); // save the current settings so it starts up the same next time
     this->aui_mgr.UnInit();
 }
@@ -687,6 +694,20 @@ void MyFrame::InitializeRenderPane()
     // for now the VTK window goes in the center pane (always visible) - we got problems when had in a floating pane
     vtkObject::GlobalWarningDisplayOff(); // (can turn on for debugging)
     this->pVTKWindow = vtkSmartPointer<wxVTKRenderWindowInteractor>::Take(new wxVTKRenderWindowInteractor(this,wxID_ANY));
+    // the chemicals may still be on their way back from the device when a render comes along, e.g. from a resize
+    vtkSmartPointer<vtkCallbackCommand> before_render = vtkSmartPointer<vtkCallbackCommand>::New();
+    before_render->SetClientData(this);
+    before_render->SetCallback([](vtkObject*, unsigned long, void* client_data, void*)
+    {
+        MyFrame* frame = static_cast<MyFrame*>(client_data);
+        try
+        {
+            if(frame->system)
+                frame->system->FinishReadingBack();
+        }
+        catch(const exception&) {} // (we can't throw through VTK's render, so whatever values are there get drawn)
+    });
+    this->pVTKWindow->GetRenderWindow()->AddObserver(vtkCommand::StartEvent, before_render);
     this->aui_mgr.AddPane(this->pVTKWindow,
                   wxAuiPaneInfo()
                   .Name(PaneName(ID::CanvasPane))
@@ -1213,6 +1234,9 @@ void MyFrame::OnIdle(wxIdleEvent& event)
         if (this->IsActive()) this->CheckFocus();
     #endif
 
+    // paint the mouse movements since the last frame in one go
+    this->PaintPendingBrushStroke();
+
     // we drive our simulation loop via idle events
     if (this->is_running)
     {
@@ -1227,6 +1251,10 @@ void MyFrame::OnIdle(wxIdleEvent& event)
             temp_steps = timesteps_per_render - steps_since_last_render;
         }
 
+        // for auto-ranging, have the chemicals summarised once per render
+        const bool auto_range = this->render_settings.GetProperty("auto_range").GetBool();
+        this->system->SetStatisticsInterval(auto_range ? timesteps_per_render : 0);
+
         double time_before = get_time_in_seconds();
 
         try
@@ -1288,6 +1316,13 @@ void MyFrame::OnIdle(wxIdleEvent& event)
                     this->percentage_spent_rendering = 100.0 - 100.0 * this->smoothed_timesteps_per_second / smoothed_cfps;
                 this->i_timesteps_per_second_buffer = 0;
                 this->speed_data_available = true;
+                this->UpdateInfoPane(); // (for the performance counters)
+            }
+
+            if (auto_range && this->FitColorRangeToStatistics())
+            {
+                InitializeVTKPipeline(this->pVTKWindow, *this->system, this->render_settings, false);
+                this->UpdateInfoPane();
             }
 
             if(this->is_recording)
@@ -1312,16 +1347,67 @@ void MyFrame::OnIdle(wxIdleEvent& event)
         event.RequestMore(); // trigger another idle event
     }
 
+    if (this->system && !this->is_running)
+    {
+        // if the rule has been edited then start compiling it now, rather than on the next update
+        // (this is retried on every idle event, so each error is only reported the first time it is seen)
+        try
+        {
+            this->system->StartCompilingKernelIfNeeded();
+            this->kernel_compile_error.clear();
+        }
+        catch(const exception& e)
+        {
+            if (e.what() != this->kernel_compile_error)
+            {
+                this->kernel_compile_error = e.what();
+                MonospaceMessageBox(_("An error occurred when compiling the kernel:\n\n")+wxString(e.what(),wxConvUTF8),_("Error"),wxART_ERROR);
+            }
+        }
+        catch(...)
+        {
+            if (this->kernel_compile_error != "unknown")
+            {
+                this->kernel_compile_error = "unknown";
+                wxMessageBox(_("An unknown error occurred when compiling the kernel"));
+            }
+        }
+    }
+
+    // the kernel may be compiling in the background, keep checking so that we can report when it has finished
+    bool is_compiling_kernel = this->system && this->system->IsCompilingKernel();
+    if (is_compiling_kernel != this->was_compiling_kernel)
+    {
+        this->was_compiling_kernel = is_compiling_kernel;
+        this->SetStatusBarText();
+    }
+    // (while running we get idle events anyway, otherwise a timer wakes us up rather than us spinning)
+    if (is_compiling_kernel && !this->is_running)
+    {
+        if (!this->kernel_build_timer.IsRunning())
+            this->kernel_build_timer.Start(50);
+    }
+    else if (this->kernel_build_timer.IsRunning())
+        this->kernel_build_timer.Stop();
+
     event.Skip();
 }
 
 // ---------------------------------------------------------------------
 
+void MyFrame::OnKernelBuildTimer(wxTimerEvent& event)
+{
+    wxWakeUpIdle(); // (OnIdle checks whether the build has finished)
+}
+
+// ---------------------------------------------------------------------
+
 void MyFrame::SetStatusBarText()
 {
     wxString txt;
     if(this->is_running) txt << _("Running.");
     else txt << _("Stopped.");
+    if(this->system->IsCompilingKernel()) txt << _(" Compiling kernel...");
     txt << _(" Timesteps: ") << this->system->GetTimestepsTaken();
     if(this->speed_data_available)
     {
@@ -1678,7 +1764,13 @@ void MyFrame::OpenFile(const wxString& raw_path, bool remember)
     try
     {
         SetDefaultRenderSettings(this->render_settings);
-        target_system = SystemFactory::CreateFromFile(path.mb_str(),this->is_opencl_available,opencl_platform,opencl_device,this->render_settings,warn_to_update);
+        target_system = SystemFactory::CreateFromFile(path.mb_str(),this->is_opencl_available,opencl_platform,opencl_device,
+            this->render_settings,warn_to_update,[this](double fraction) {
+                wxStatusBar* statusbar = this->GetStatusBar();
+                if (!statusbar) return;
+                statusbar->SetStatusText(wxString::Format(_("Loading... %d%%"),int(fraction*100.0)));
+                statusbar->Update(); // (repaint now, we're not returning to the event loop until loading has finished)
+            });
         this->patterns_panel->SelectPath(path);
         this->SetCurrentRDSystem(move(target_system));
     }
@@ -2368,7 +2460,7 @@ void MyFrame::SetNumberOfChemicals(int n)
 
 // ---------------------------------------------------------------------
 
-bool MyFrame::SetDimensions(int x,int y,int z)
+bool MyFrame::SetDimensions(int x,int y,int z,bool resample)
 {
     try
     {
@@ -2397,7 +2489,10 @@ bool MyFrame::SetDimensions(int x,int y,int z)
             }
         }
         // attempt the size change
-        this->system->SetDimensions(x,y,z);
+        if(resample)
+            this->system->Resample(x,y,z);
+        else
+            this->system->SetDimensions(x,y,z);
     }
     catch(const exception& e)
     {
@@ -2409,8 +2504,11 @@ bool MyFrame::SetDimensions(int x,int y,int z)
         wxMessageBox(_("Dimensions not permitted"));
         return false;
     }
-    this->system->BlankImage();
-    this->system->GenerateInitialPattern();
+    if(!resample)
+    {
+        this->system->BlankImage();
+        this->system->GenerateInitialPattern();
+    }
     InitializeVTKPipeline(this->pVTKWindow, *this->system, this->render_settings, true);
     this->UpdateWindows();
     return true;
@@ -2462,12 +2560,43 @@ void MyFrame::RenderSettingsChanged()
     if (prop.GetInt() < 1) prop.SetInt(1);
     if (prop.GetInt() > MAX_TIMESTEPS_PER_RENDER) prop.SetInt(MAX_TIMESTEPS_PER_RENDER);
 
+    if (this->render_settings.GetProperty("auto_range").GetBool())
+    {
+        // fit the range now, rather than waiting for the next render
+        this->system->UpdateStatistics();
+        this->FitColorRangeToStatistics();
+    }
+
     InitializeVTKPipeline(this->pVTKWindow, *this->system, this->render_settings, false);
     this->UpdateWindows();
 }
 
 // ---------------------------------------------------------------------
 
+bool MyFrame::FitColorRangeToStatistics()
+{
+    const vector<ChemicalStatistics>& statistics = this->system->GetStatistics();
+    const int iChem = IndexFromChemicalName(this->render_settings.GetProperty("active_chemical").GetChemical());
+    if (iChem < 0 || iChem >= (int)statistics.size())
+        return false;
+    const float low = statistics[iChem].minimum;
+    const float high = statistics[iChem].maximum;
+    if (!(high > low))
+        return false; // a uniform chemical has no range to fit
+
+    // rebuilding the pipeline is slow, so ignore small changes
+    Property& low_prop = this->render_settings.GetProperty("low");
+    Property& high_prop = this->render_settings.GetProperty("high");
+    const float tolerance = 0.05f * (high - low);
+    if (fabs(low - low_prop.GetFloat()) < tolerance && fabs(high - high_prop.GetFloat()) < tolerance)
+        return false;
+    low_prop.SetFloat(low);
+    high_prop.SetFloat(high);
+    return true;
+}
+
+// ---------------------------------------------------------------------
+
 void MyFrame::OnAddParameter(wxCommandEvent& event)
 {
     StringDialog dlg(this,_("Add a parameter"),_("Name:"),wxEmptyString,wxDefaultPosition,wxDefaultSize);
@@ -3175,11 +3304,8 @@ void MyFrame::LeftMouseDown(int x, int y)
 {
     this->left_mouse_is_down = true;
 
-    vtkSmartPointer<vtkCellPicker> picker = vtkSmartPointer<vtkCellPicker>::New();
-    picker->SetTolerance(0.000001);
-    int ret = picker->Pick(x,y,0,this->pVTKWindow->GetRenderWindow()->GetRenderers()->GetFirstRenderer());
-    if(!ret) return;
-    double *p = picker->GetPickPosition();
+    double p[3];
+    if(!this->PickPoint(x,y,p)) return;
 
     if(!this->pVTKWindow->GetShiftKey())
     {
@@ -3202,9 +3328,10 @@ void MyFrame::LeftMouseDown(int x, int y)
             break;
             case TCursorType::BRUSH:
             {
-                this->system->SetValuesInRadius(p[0],p[1],p[2],this->brush_sizes[current_brush_size],
-                    this->current_paint_value,this->render_settings);
-                this->pVTKWindow->Refresh();
+                // start a new stroke
+                this->brush_stroke.assign(1,{ float(p[0]), float(p[1]), float(p[2]) });
+                this->brush_stroke_pending = true;
+                this->PaintPendingBrushStroke();
             }
             break;
             case TCursorType::PICKER:
@@ -3227,6 +3354,8 @@ void MyFrame::LeftMouseDown(int x, int y)
 
 void MyFrame::LeftMouseUp(int x, int y)
 {
+    this->PaintPendingBrushStroke();
+    this->brush_stroke.clear();
     this->left_mouse_is_down = false;
     this->erasing = false;
     this->system->SetUndoPoint();
@@ -3234,15 +3363,59 @@ void MyFrame::LeftMouseUp(int x, int y)
 
 // ---------------------------------------------------------------------
 
+bool MyFrame::PickPoint(int x, int y, double p[3])
+{
+    vtkRenderer* renderer = this->pVTKWindow->GetRenderWindow()->GetRenderers()->GetFirstRenderer();
+    if(this->system->CanPickAnalytically(this->render_settings))
+    {
+        // intersect the ray under the mouse with the surface directly
+        double ray[2][4];
+        for(int i = 0; i < 2; i++)
+        {
+            renderer->SetDisplayPoint(x, y, i);
+            renderer->DisplayToWorld();
+            renderer->GetWorldPoint(ray[i]);
+            for(int j = 0; j < 3; j++)
+                ray[i][j] /= ray[i][3];
+        }
+        return this->system->PickAnalytically(ray[0], ray[1], this->render_settings, p);
+    }
+
+    // else read the depth of whatever was rendered under the mouse, rather than ray-casting through the whole scene
+    const double z = renderer->GetZ(x, y);
+    if(z >= 1.0)
+        return false; // (only the background is there)
+    double world_point[4];
+    renderer->SetDisplayPoint(x, y, z);
+    renderer->DisplayToWorld();
+    renderer->GetWorldPoint(world_point);
+    for(int j = 0; j < 3; j++)
+        p[j] = world_point[j] / world_point[3];
+    return true;
+}
+
+// ---------------------------------------------------------------------
+
+void MyFrame::PaintPendingBrushStroke()
+{
+    if(!this->brush_stroke_pending)
+        return;
+    this->system->SetValuesAlongStroke(this->brush_stroke, this->brush_sizes[current_brush_size],
+        this->current_paint_value, this->render_settings);
+    // keep the last point, so that the next part of the stroke joins on
+    this->brush_stroke.erase(this->brush_stroke.begin(), this->brush_stroke.end() - 1);
+    this->brush_stroke_pending = false;
+    this->pVTKWindow->Refresh();
+}
+
+// ---------------------------------------------------------------------
+
 void MyFrame::RightMouseDown(int x, int y)
 {
     this->right_mouse_is_down = true;
 
-    vtkSmartPointer<vtkCellPicker> picker = vtkSmartPointer<vtkCellPicker>::New();
-    picker->SetTolerance(0.000001);
-    int ret = picker->Pick(x,y,0,this->pVTKWindow->GetRenderWindow()->GetRenderers()->GetFirstRenderer());
-    if(!ret) return;
-    double *p = picker->GetPickPosition();
+    double p[3];
+    if(!this->PickPoint(x,y,p)) return;
 
     // color pick
     this->pVTKWindow->SetCursor(*this->picker_cursor);
@@ -3270,11 +3443,8 @@ void MyFrame::MouseMove(int x, int y)
 {
     if(!this->left_mouse_is_down && !this->right_mouse_is_down) return;
 
-    vtkSmartPointer<vtkCellPicker> picker = vtkSmartPointer<vtkCellPicker>::New();
-    picker->SetTolerance(0.000001);
-    int ret = picker->Pick(x,y,0,this->pVTKWindow->GetRenderWindow()->GetRenderers()->GetFirstRenderer());
-    if(!ret) return;
-    double *p = picker->GetPickPosition();
+    double p[3];
+    if(!this->PickPoint(x,y,p)) return;
 
     if(this->left_mouse_is_down && !this->pVTKWindow->GetShiftKey())
     {
@@ -3294,9 +3464,9 @@ void MyFrame::MouseMove(int x, int y)
             break;
             case TCursorType::BRUSH:
             {
-                this->system->SetValuesInRadius(p[0],p[1],p[2],this->brush_sizes[current_brush_size],
-                    this->current_paint_value,this->render_settings);
-                this->pVTKWindow->Refresh();
+                // extend the stroke, to be painted when the events have caught up
+                this->brush_stroke.push_back({ float(p[0]), float(p[1]), float(p[2]) });
+                this->brush_stroke_pending = true;
             }
             break;
             case TCursorType::PICKER:
@@ -25,6 +25,7 @@
 #endif
 #include <wx/aui/aui.h>
 #include <wx/filename.h>
+#include <wx/timer.h>
 
 // local:
 class PatternsPanel;
@@ -61,7 +62,7 @@ class MyFrame : public wxFrame, public IPaintHandler
         void SetParameterName(int iParam,std::string s);
         void SetFormula(std::string s);
         void SetNumberOfChemicals(int n);
-        bool SetDimensions(int x,int y,int z);
+        bool SetDimensions(int x,int y,int z,bool resample=false);
         void SetBlockSize(int x,int y,int z);
         void SetDataType(int data_type);
         Properties& GetRenderSettings() { return this->render_settings; }
@@ -189,6 +190,7 @@ class MyFrame : public wxFrame, public IPaintHandler
         // other event handlers
         void OnActivate(wxActivateEvent& event);
         void OnIdle(wxIdleEvent& event);
+        void OnKernelBuildTimer(wxTimerEvent& event);
         void OnSize(wxSizeEvent& event);
         void OnClose(wxCloseEvent& event);
 
@@ -213,6 +215,9 @@ class MyFrame : public wxFrame, public IPaintHandler
         void UpdateToolbars();
         void SetStatusBarText();
         void RecordFrame();
+        bool FitColorRangeToStatistics();  // returns true if low and high were changed
+        bool PickPoint(int x, int y, double p[3]);  // returns false if nothing paintable is under the mouse
+        void PaintPendingBrushStroke();
 
         bool LoadMesh(const wxFileName& filename, vtkUnstructuredGrid* ug);
         void MakeDefaultImageSystemFromMesh(vtkUnstructuredGrid* ug);
@@ -257,6 +262,11 @@ class MyFrame : public wxFrame, public IPaintHandler
         int i_timesteps_per_second_buffer;
         bool speed_data_available;
 
+        // used for reporting when a kernel build in the background has finished
+        bool was_compiling_kernel;
+        std::string kernel_compile_error; // the last error from starting a build while idle, so it is only shown once
+        wxTimer kernel_build_timer;       // wakes us up to check on the build while nothing else is happening
+
         // used when recording frames to disk
         bool is_recording,record_data_image,record_all_chemicals,record_3D_surface,recording_should_decimate;
         std::string recording_prefix,recording_extension;
@@ -278,6 +288,8 @@ class MyFrame : public wxFrame, public IPaintHandler
         wxString icons_folder;
         bool erasing;
         static const float brush_sizes[5];
+        std::vector<std::array<float,3>> brush_stroke; // the points the mouse has moved through, from the last one painted
+        bool brush_stroke_pending;  // (the stroke is painted once per frame, rather than on every mouse event)
 
         DECLARE_EVENT_TABLE()
 };
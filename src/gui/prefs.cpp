@@ -38,6 +38,9 @@
 #include "wxutils.hpp"           // for Warning, Fatal, Beep
 #include "prefs.hpp"
 
+// readybase:
+#include <NativeKernel.hpp>
+
 // STL:
 #include <algorithm>
 
@@ -92,6 +95,7 @@ int textdlght = 600;             // height of multi-line text dialog
 bool showtips = true;            // show button tips?
 bool repaint_to_erase = false;   // whether painting over the current color reverts to low
 bool allowbeep = true;           // okay to play beep sound?
+bool allow_native_kernels = false; // compile rules as native code when OpenCL is missing?
 bool askonnew = true;            // ask to save changes before creating new pattern?
 bool askonload = true;           // ask to save changes before loading pattern file?
 bool askonquit = true;           // ask to save changes before quitting app?
@@ -931,6 +935,7 @@ void SavePrefs()
     fprintf(f, "repaint_to_erase=%d\n", repaint_to_erase ? 1 : 0);
     fprintf(f, "current_brush_size=%d\n", current_brush_size);
     fprintf(f, "allow_beep=%d\n", allowbeep ? 1 : 0);
+    fprintf(f, "allow_native_kernels=%d\n", allow_native_kernels ? 1 : 0);
     fprintf(f, "ask_on_new=%d\n", askonnew ? 1 : 0);
     fprintf(f, "ask_on_load=%d\n", askonload ? 1 : 0);
     fprintf(f, "ask_on_quit=%d\n", askonquit ? 1 : 0);
@@ -1246,6 +1251,9 @@ void GetPrefs()
             sscanf(value, "%d", &current_brush_size);
             current_brush_size = std::min(2,std::max(0,current_brush_size));
         } else if (strcmp(keyword, "allow_beep") == 0)  { allowbeep = value[0] == '1';
+        } else if (strcmp(keyword, "allow_native_kernels") == 0) {
+            allow_native_kernels = value[0] == '1';
+            NativeKernel::SetAllowed(allow_native_kernels);
         } else if (strcmp(keyword, "ask_on_new") == 0)  { askonnew = value[0] == '1';
         } else if (strcmp(keyword, "ask_on_load") == 0) { askonload = value[0] == '1';
         } else if (strcmp(keyword, "ask_on_quit") == 0) { askonquit = value[0] == '1';
@@ -1332,6 +1340,7 @@ enum
     // Edit prefs
     PREF_ERASE,
     PREF_BEEP,
+    PREF_NATIVE_KERNELS,
     // View prefs
     PREF_SHOW_TIPS,
     // Action prefs
@@ -1845,15 +1854,23 @@ wxPanel* PrefsDialog::CreateEditPrefs(wxWindow* parent)
 
     wxCheckBox* beepcheck = new wxCheckBox(panel, PREF_BEEP, _("Allow beep sound"));
 
+    // allow_native_kernels
+
+    wxCheckBox* nativecheck = new wxCheckBox(panel, PREF_NATIVE_KERNELS,
+        _("Without OpenCL, compile rules as native code to run them (only for files you trust!)"));
+
     // position things
     vbox->AddSpacer(5);
     vbox->Add(erasecheck, 0, wxLEFT | wxRIGHT, LRGAP);
     vbox->AddSpacer(5);
     vbox->Add(beepcheck, 0, wxLEFT | wxRIGHT, LRGAP);
+    vbox->AddSpacer(5);
+    vbox->Add(nativecheck, 0, wxLEFT | wxRIGHT, LRGAP);
 
     // init control values
     erasecheck->SetValue(repaint_to_erase);
     beepcheck->SetValue(allowbeep);
+    nativecheck->SetValue(allow_native_kernels);
 
     topSizer->Add(vbox, 1, wxGROW | wxALL, 5);
     panel->SetSizer(topSizer);
@@ -2140,9 +2157,10 @@ void PrefsDialog::OnButton(wxCommandEvent& event)
 
 void PrefsDialog::OnCheckBoxClicked(wxCommandEvent& event)
 {
-    //int id = event.GetId();
-
-    // no need???
+    if (event.GetId() == PREF_NATIVE_KERNELS && event.IsChecked()) {
+        Warning(_("A rule compiled as native code can do anything that you can do on this computer, such as reading, "
+                  "changing or deleting your files. Only open files from people you trust while this is turned on."));
+    }
 }
 
 // -----------------------------------------------------------------------------
@@ -2288,6 +2306,8 @@ bool PrefsDialog::TransferDataFromWindow()
     // EDIT_PAGE
     repaint_to_erase = GetCheckVal(PREF_ERASE);
     allowbeep     = GetCheckVal(PREF_BEEP);
+    allow_native_kernels = GetCheckVal(PREF_NATIVE_KERNELS);
+    NativeKernel::SetAllowed(allow_native_kernels);
 
     // VIEW_PAGE
     #if wxUSE_TOOLTIPS
@@ -65,6 +65,7 @@ extern int textdlgwd;            // width of multi-line text dialog
 extern int textdlght;            // height of multi-line text dialog
 extern bool showtips;            // show button tips?
 extern bool allowbeep;           // okay to play beep sound?
+extern bool allow_native_kernels; // compile rules as native code when OpenCL is missing?
 extern bool askonnew;            // ask to save changes before creating new pattern?
 extern bool askonload;           // ask to save changes before loading pattern file?
 extern bool askonquit;           // ask to save changes before quitting app?
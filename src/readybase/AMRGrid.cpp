@@ -0,0 +1,821 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "AMRGrid.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <stdexcept>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+/// Division that rounds towards minus infinity.
+static int FloorDivide(int a,int b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+AMRGrid::AMRGrid()
+    : n_chemicals(0)
+    , block_size(0)
+    , time_refinement(1)
+    , wrap(true)
+    , reflux(true)
+    , counters(NULL)
+{
+    for(int i=0;i<3;i++)
+    {
+        this->base_dimensions[i] = 0;
+        this->block_extent[i] = 1;
+        this->refined[i] = 0;
+        this->halo[i] = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool AMRGrid::IsReset(const int base_dimensions[3],int n_chemicals,int n_levels,int block_size,int time_refinement,
+                      bool wrap) const
+{
+    return equal(base_dimensions,base_dimensions+3,this->base_dimensions) && n_chemicals == this->n_chemicals
+        && n_levels == this->GetNumberOfLevels() && block_size == this->block_size
+        && time_refinement == this->time_refinement && wrap == this->wrap;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::Reset(const int base_dimensions[3],int n_chemicals,int n_levels,int block_size,int time_refinement,
+                    bool wrap)
+{
+    if(n_levels < 1 || block_size < 2 || block_size % 2 || time_refinement < 1)
+        throw runtime_error("AMRGrid::Reset : need at least one level, an even block size and a time refinement of at least 1");
+
+    for(int i=0;i<3;i++)
+    {
+        this->base_dimensions[i] = base_dimensions[i];
+        this->refined[i] = (base_dimensions[i] > 1) ? 1 : 0;
+        this->block_extent[i] = this->refined[i] ? block_size : 1;
+    }
+    this->n_chemicals = n_chemicals;
+    this->block_size = block_size;
+    this->time_refinement = time_refinement;
+    this->wrap = wrap;
+
+    this->levels.clear();
+    this->levels.resize(n_levels);
+    for(int iLevel=0;iLevel<n_levels;iLevel++)
+    {
+        Level& level = this->levels[iLevel];
+        for(int i=0;i<3;i++)
+        {
+            level.dimensions[i] = base_dimensions[i] << (this->refined[i] * iLevel);
+            level.n_blocks[i] = (level.dimensions[i] + this->block_extent[i] - 1) / this->block_extent[i];
+        }
+        level.time_previous = level.time_current = 0.0;
+    }
+
+    // level 0 covers everything
+    Level& base = this->levels.front();
+    const size_t n_blocks = (size_t)base.n_blocks[0] * base.n_blocks[1] * base.n_blocks[2];
+    for(size_t key=0;key<n_blocks;key++)
+    {
+        Block& block = base.blocks[key];
+        block.current.assign(n_chemicals,vector<double>(this->GetCellsPerBlock(),0.0));
+        block.previous = block.current;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::SetKernels(const vector<string>& sources,const int halo[3])
+{
+    if(sources.size() != this->levels.size())
+        throw runtime_error("AMRGrid::SetKernels : need one kernel for each level");
+
+    this->kernels.resize(sources.size());
+    for(size_t i=0;i<sources.size();i++)
+    {
+        if(!this->kernels[i])
+            this->kernels[i] = make_unique<NativeKernel>();
+        this->kernels[i]->SetPerformanceCounters(this->counters);
+        this->kernels[i]->Build(sources[i]);
+    }
+    for(int i=0;i<3;i++)
+        this->halo[i] = this->refined[i] ? halo[i] : 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t AMRGrid::GetBlockKey(const Level& level,const int block[3]) const
+{
+    return ((size_t)block[2] * level.n_blocks[1] + block[1]) * level.n_blocks[0] + block[0];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::GetBlockOrigin(const Level& level,size_t key,int origin[3]) const
+{
+    origin[0] = (int)(key % level.n_blocks[0]) * this->block_extent[0];
+    key /= level.n_blocks[0];
+    origin[1] = (int)(key % level.n_blocks[1]) * this->block_extent[1];
+    origin[2] = (int)(key / level.n_blocks[1]) * this->block_extent[2];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+template <typename T> void AMRGrid::SetBaseValues(int i_chemical,const T* values)
+{
+    Level& base = this->levels.front();
+    const int *E = this->block_extent;
+    for(auto& key_block : base.blocks)
+    {
+        int origin[3];
+        this->GetBlockOrigin(base,key_block.first,origin);
+        vector<double>& current = key_block.second.current[i_chemical];
+        for(int z=0;z<E[2] && origin[2]+z<base.dimensions[2];z++)
+            for(int y=0;y<E[1] && origin[1]+y<base.dimensions[1];y++)
+                for(int x=0;x<E[0] && origin[0]+x<base.dimensions[0];x++)
+                    current[(z*E[1]+y)*E[0]+x] = values[((size_t)(origin[2]+z)*base.dimensions[1] + origin[1]+y)
+                        * base.dimensions[0] + origin[0]+x];
+        key_block.second.previous[i_chemical] = current;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+template <typename T> void AMRGrid::GetBaseValues(int i_chemical,T* values) const
+{
+    const Level& base = this->levels.front();
+    const int *E = this->block_extent;
+    for(const auto& key_block : base.blocks)
+    {
+        int origin[3];
+        this->GetBlockOrigin(base,key_block.first,origin);
+        const vector<double>& current = key_block.second.current[i_chemical];
+        for(int z=0;z<E[2] && origin[2]+z<base.dimensions[2];z++)
+            for(int y=0;y<E[1] && origin[1]+y<base.dimensions[1];y++)
+                for(int x=0;x<E[0] && origin[0]+x<base.dimensions[0];x++)
+                    values[((size_t)(origin[2]+z)*base.dimensions[1] + origin[1]+y) * base.dimensions[0] + origin[0]+x]
+                        = (T)current[(z*E[1]+y)*E[0]+x];
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+template <typename T> bool AMRGrid::BaseValuesDiffer(int i_chemical,const T* values) const
+{
+    const Level& base = this->levels.front();
+    const int *E = this->block_extent;
+    for(const auto& key_block : base.blocks)
+    {
+        int origin[3];
+        this->GetBlockOrigin(base,key_block.first,origin);
+        const vector<double>& current = key_block.second.current[i_chemical];
+        for(int z=0;z<E[2] && origin[2]+z<base.dimensions[2];z++)
+            for(int y=0;y<E[1] && origin[1]+y<base.dimensions[1];y++)
+                for(int x=0;x<E[0] && origin[0]+x<base.dimensions[0];x++)
+                    if(values[((size_t)(origin[2]+z)*base.dimensions[1] + origin[1]+y) * base.dimensions[0] + origin[0]+x]
+                        != (T)current[(z*E[1]+y)*E[0]+x])
+                        return true;
+    }
+    return false;
+}
+
+template void AMRGrid::SetBaseValues<float>(int,const float*);
+template void AMRGrid::SetBaseValues<double>(int,const double*);
+template void AMRGrid::GetBaseValues<float>(int,float*) const;
+template void AMRGrid::GetBaseValues<double>(int,double*) const;
+template bool AMRGrid::BaseValuesDiffer<float>(int,const float*) const;
+template bool AMRGrid::BaseValuesDiffer<double>(int,const double*) const;
+
+// ---------------------------------------------------------------------------------------------------------
+
+int AMRGrid::WrapPosition(const Level& level,int axis,int p) const
+{
+    const int n = level.dimensions[axis];
+    return this->wrap ? ((p % n) + n) % n : min(max(p,0),n-1);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::LocateAlongAxis(int axis,const vector<int>& positions,vector<int>& blocks,vector<int>& slots,
+                              vector<int>& offsets) const
+{
+    const int E = this->block_extent[axis];
+    slots.resize(positions.size());
+    offsets.resize(positions.size());
+    for(size_t k=0;k<positions.size();k++)
+    {
+        const int block = positions[k] / E;
+        const auto found = find(blocks.begin(),blocks.end(),block);
+        slots[k] = (int)(found - blocks.begin());
+        if(found == blocks.end())
+            blocks.push_back(block);
+        offsets[k] = positions[k] % E;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vector<const AMRGrid::Block*> AMRGrid::FindBlocks(const Level& level,const vector<int> blocks[3]) const
+{
+    vector<const Block*> found_blocks;
+    for(int bz : blocks[2])
+    {
+        for(int by : blocks[1])
+        {
+            for(int bx : blocks[0])
+            {
+                const int block[3] = { bx, by, bz };
+                const auto found = level.blocks.find(this->GetBlockKey(level,block));
+                found_blocks.push_back(found == level.blocks.end() ? NULL : &found->second);
+            }
+        }
+    }
+    return found_blocks;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::FillPatch(int iLevel,size_t key,double t,const int margin[3],vector<vector<double>>& patches,
+                        size_t first) const
+{
+    const Level& level = this->levels[iLevel];
+    const int *E = this->block_extent;
+    const int *R = this->refined;
+    const int P[3] = { E[0] + 2*margin[0], E[1] + 2*margin[1], E[2] + 2*margin[2] };
+    int origin[3];
+    this->GetBlockOrigin(level,key,origin);
+
+    // find where each row, column and layer of the patch comes from, so that each block is only looked up once: at
+    // this level, and at the level below the two cells either side that we interpolate between where there's no block
+    vector<int> blocks[3], slots[3], offsets[3];
+    vector<int> coarse_blocks[3], lower_slots[3], lower_offsets[3], upper_slots[3], upper_offsets[3];
+    vector<double> weights[3]; // (for the upper cell)
+    for(int i=0;i<3;i++)
+    {
+        vector<int> positions(P[i]);
+        for(int k=0;k<P[i];k++)
+            positions[k] = this->WrapPosition(level,i,origin[i] - margin[i] + k);
+        this->LocateAlongAxis(i,positions,blocks[i],slots[i],offsets[i]);
+        if(iLevel == 0)
+            continue;
+        // (the cell centers of the level below are offset by a quarter of one of its cells)
+        const Level& coarse = this->levels[iLevel-1];
+        vector<int> lower(P[i]), upper(P[i]);
+        weights[i].resize(P[i]);
+        for(int k=0;k<P[i];k++)
+        {
+            const int corner = R[i] ? FloorDivide(positions[k] - 1, 2) : positions[k];
+            lower[k] = this->WrapPosition(coarse,i,corner);
+            upper[k] = this->WrapPosition(coarse,i,corner + R[i]);
+            weights[i][k] = R[i] ? ((positions[k] % 2) ? 0.25 : 0.75) : 0.0;
+        }
+        this->LocateAlongAxis(i,lower,coarse_blocks[i],lower_slots[i],lower_offsets[i]);
+        this->LocateAlongAxis(i,upper,coarse_blocks[i],upper_slots[i],upper_offsets[i]);
+    }
+    const vector<const Block*> same_level = this->FindBlocks(level,blocks);
+    vector<const Block*> level_below;
+    double u = 1.0; // (how far t is between the last two states of the level below)
+    if(iLevel > 0)
+    {
+        const Level& coarse = this->levels[iLevel-1];
+        level_below = this->FindBlocks(coarse,coarse_blocks);
+        if(t < coarse.time_current && coarse.time_current > coarse.time_previous)
+            u = max(0.0,(t - coarse.time_previous) / (coarse.time_current - coarse.time_previous));
+    }
+
+    const size_t NB[2] = { blocks[0].size(), blocks[1].size() };
+    const size_t NCB[2] = { coarse_blocks[0].size(), coarse_blocks[1].size() };
+    size_t i_patch = first;
+    for(int z=0;z<P[2];z++)
+    {
+        for(int y=0;y<P[1];y++)
+        {
+            for(int x=0;x<P[0];x++,i_patch++)
+            {
+                const Block *block = same_level[((size_t)slots[2][z] * NB[1] + slots[1][y]) * NB[0] + slots[0][x]];
+                if(block)
+                {
+                    const size_t i = ((size_t)offsets[2][z] * E[1] + offsets[1][y]) * E[0] + offsets[0][x];
+                    for(int ic=0;ic<this->n_chemicals;ic++)
+                        patches[ic][i_patch] = block->current[ic][i];
+                    continue;
+                }
+                if(iLevel == 0)
+                    throw runtime_error("AMRGrid::FillPatch : level 0 is incomplete");
+
+                for(int ic=0;ic<this->n_chemicals;ic++)
+                    patches[ic][i_patch] = 0.0;
+                for(int dz=0;dz<=R[2];dz++)
+                {
+                    for(int dy=0;dy<=R[1];dy++)
+                    {
+                        for(int dx=0;dx<=R[0];dx++)
+                        {
+                            const Block *coarse_block = level_below[((size_t)(dz ? upper_slots : lower_slots)[2][z]
+                                * NCB[1] + (dy ? upper_slots : lower_slots)[1][y]) * NCB[0]
+                                + (dx ? upper_slots : lower_slots)[0][x]];
+                            if(!coarse_block)
+                                throw runtime_error("AMRGrid::FillPatch : level " + to_string(iLevel)
+                                    + " is not nested in the level below");
+                            const size_t i = ((size_t)(dz ? upper_offsets : lower_offsets)[2][z] * E[1]
+                                + (dy ? upper_offsets : lower_offsets)[1][y]) * E[0]
+                                + (dx ? upper_offsets : lower_offsets)[0][x];
+                            const double w = (dx ? weights[0][x] : 1.0 - weights[0][x])
+                                * (dy ? weights[1][y] : 1.0 - weights[1][y])
+                                * (dz ? weights[2][z] : 1.0 - weights[2][z]);
+                            for(int ic=0;ic<this->n_chemicals;ic++)
+                                patches[ic][i_patch] += w * (u * coarse_block->current[ic][i]
+                                    + (1.0 - u) * coarse_block->previous[ic][i]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+double AMRGrid::Sample(int iLevel,int i_chemical,int x,int y,int z,double t) const
+{
+    const Level& level = this->levels[iLevel];
+    int p[3] = { x, y, z };
+    for(int i=0;i<3;i++)
+        p[i] = this->WrapPosition(level,i,p[i]);
+
+    const int *E = this->block_extent;
+    const int block[3] = { p[0] / E[0], p[1] / E[1], p[2] / E[2] };
+    const auto found = level.blocks.find(this->GetBlockKey(level,block));
+    if(found != level.blocks.end())
+    {
+        const size_t i = ((size_t)(p[2] % E[2]) * E[1] + p[1] % E[1]) * E[0] + p[0] % E[0];
+        const double value = found->second.current[i_chemical][i];
+        if(t >= level.time_current || level.time_current <= level.time_previous)
+            return value;
+        // (a finer level is between our last two states)
+        const double u = max(0.0,(t - level.time_previous) / (level.time_current - level.time_previous));
+        return u * value + (1.0 - u) * found->second.previous[i_chemical][i];
+    }
+    if(iLevel == 0)
+        throw runtime_error("AMRGrid::Sample : level 0 is incomplete");
+
+    // interpolate linearly from the level below, whose cell centers are offset by a quarter of one of its cells
+    int corner[3];
+    double weight[3];
+    for(int i=0;i<3;i++)
+    {
+        if(this->refined[i])
+        {
+            corner[i] = FloorDivide(p[i] - 1, 2);
+            weight[i] = (p[i] % 2) ? 0.25 : 0.75; // (for the cell above the corner)
+        }
+        else
+        {
+            corner[i] = p[i];
+            weight[i] = 0.0;
+        }
+    }
+    double value = 0.0;
+    for(int dz=0;dz<=this->refined[2];dz++)
+    {
+        for(int dy=0;dy<=this->refined[1];dy++)
+        {
+            for(int dx=0;dx<=this->refined[0];dx++)
+            {
+                const double w = (dx ? weight[0] : 1.0 - weight[0]) * (dy ? weight[1] : 1.0 - weight[1])
+                    * (dz ? weight[2] : 1.0 - weight[2]);
+                value += w * this->Sample(iLevel-1, i_chemical, corner[0]+dx, corner[1]+dy, corner[2]+dz, t);
+            }
+        }
+    }
+    return value;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::Step(double timestep)
+{
+    this->AdvanceLevel(0,timestep);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::AdvanceLevel(int iLevel,double timestep)
+{
+    Level& level = this->levels[iLevel];
+    const double t = level.time_current;
+    if(!level.blocks.empty())
+    {
+        if(this->kernels.size() != this->levels.size())
+            throw runtime_error("AMRGrid::AdvanceLevel : kernels not set");
+
+        // copy each block and its ghost cells into a patch, with the patches stacked along z
+        const int *E = this->block_extent;
+        const int *H = this->halo;
+        const int P[3] = { E[0] + 2*H[0], E[1] + 2*H[1], E[2] + 2*H[2] };
+        const size_t patch_cells = (size_t)P[0] * P[1] * P[2];
+        const size_t n_patches = level.blocks.size();
+        vector<vector<double>> in(this->n_chemicals,vector<double>(patch_cells * n_patches));
+        vector<vector<double>> out(this->n_chemicals,vector<double>(patch_cells * n_patches));
+        size_t iPatch = 0;
+        for(const auto& key_block : level.blocks)
+            this->FillPatch(iLevel,key_block.first,t,H,in,iPatch++ * patch_cells);
+
+        vector<void*> args;
+        for(int ic=0;ic<this->n_chemicals;ic++)
+            args.push_back(&in[ic][0]);
+        for(int ic=0;ic<this->n_chemicals;ic++)
+            args.push_back(&out[ic][0]);
+        const size_t global_range[3] = { (size_t)P[0], (size_t)P[1], (size_t)P[2] * n_patches };
+        this->kernels[iLevel]->Run(args,global_range);
+
+        // keep the last state, for interpolating the ghost cells of the next level up
+        iPatch = 0;
+        for(auto& key_block : level.blocks)
+        {
+            Block& block = key_block.second;
+            block.next.resize(this->n_chemicals);
+            for(int ic=0;ic<this->n_chemicals;ic++)
+            {
+                block.next[ic].resize(this->GetCellsPerBlock());
+                const double *patch = &out[ic][iPatch * patch_cells];
+                for(int z=0;z<E[2];z++)
+                    for(int y=0;y<E[1];y++)
+                        for(int x=0;x<E[0];x++)
+                            block.next[ic][(z*E[1]+y)*E[0]+x] = patch[((size_t)(z+H[2])*P[1] + y+H[1])*P[0] + x+H[0]];
+            }
+            block.previous.swap(block.current);
+            block.current.swap(block.next);
+            iPatch++;
+        }
+    }
+    level.time_previous = t;
+    level.time_current = t + timestep;
+
+    if(iLevel+1 < this->GetNumberOfLevels())
+    {
+        for(int i=0;i<this->time_refinement;i++)
+            this->AdvanceLevel(iLevel+1, timestep / this->time_refinement);
+        this->Restrict(iLevel+1);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::Restrict(int fine_level)
+{
+    const Level& fine = this->levels[fine_level];
+    Level& coarse = this->levels[fine_level-1];
+    const int *E = this->block_extent;
+    const int *R = this->refined;
+    const int n_children = 1 << (R[0] + R[1] + R[2]);
+    const int F[3] = { E[0] >> R[0], E[1] >> R[1], E[2] >> R[2] }; // (the cells of the level below under a block)
+
+    // group the fine blocks into regions of blocks that touch
+    map<size_t,size_t> region;
+    for(const auto& key_block : fine.blocks)
+        region[key_block.first] = key_block.first;
+    const auto find_region = [&region](size_t key)
+    {
+        while(region[key] != key)
+        {
+            region[key] = region[region[key]];
+            key = region[key];
+        }
+        return key;
+    };
+    for(const auto& key_block : fine.blocks)
+    {
+        int origin[3];
+        this->GetBlockOrigin(fine,key_block.first,origin);
+        for(int i=0;i<3;i++)
+        {
+            if(!R[i]) continue;
+            int block[3] = { origin[0] / E[0], origin[1] / E[1], origin[2] / E[2] };
+            if(++block[i] == fine.n_blocks[i])
+            {
+                if(!this->wrap) continue;
+                block[i] = 0;
+            }
+            const size_t neighbor = this->GetBlockKey(fine,block);
+            if(fine.blocks.count(neighbor))
+                region[find_region(key_block.first)] = find_region(neighbor);
+        }
+    }
+
+    // replace the coarse cells under each block with the average of the fine cells, noting how much more of each
+    // chemical the fine level ended up with over each region
+    map<size_t,vector<double>> excess;
+    for(const auto& key_block : fine.blocks)
+    {
+        int origin[3];
+        this->GetBlockOrigin(fine,key_block.first,origin);
+        const int coarse_origin[3] = { origin[0] >> R[0], origin[1] >> R[1], origin[2] >> R[2] };
+        const int block[3] = { coarse_origin[0] / E[0], coarse_origin[1] / E[1], coarse_origin[2] / E[2] };
+        auto found = coarse.blocks.find(this->GetBlockKey(coarse,block));
+        if(found == coarse.blocks.end())
+            continue;
+        const int offset[3] = { coarse_origin[0] % E[0], coarse_origin[1] % E[1], coarse_origin[2] % E[2] };
+        vector<double>& region_excess = excess[find_region(key_block.first)];
+        region_excess.resize(this->n_chemicals,0.0);
+        for(int ic=0;ic<this->n_chemicals;ic++)
+        {
+            const vector<double>& values = key_block.second.current[ic];
+            vector<double>& coarse_values = found->second.current[ic];
+            for(int z=0;z<F[2] && coarse_origin[2]+z<coarse.dimensions[2];z++)
+            {
+                for(int y=0;y<F[1] && coarse_origin[1]+y<coarse.dimensions[1];y++)
+                {
+                    for(int x=0;x<F[0] && coarse_origin[0]+x<coarse.dimensions[0];x++)
+                    {
+                        double sum = 0.0;
+                        for(int dz=0;dz<=R[2];dz++)
+                            for(int dy=0;dy<=R[1];dy++)
+                                for(int dx=0;dx<=R[0];dx++)
+                                    sum += values[(((z<<R[2])+dz)*E[1] + (y<<R[1])+dy)*E[0] + (x<<R[0])+dx];
+                        double& coarse_value = coarse_values[((z+offset[2])*E[1] + y+offset[1])*E[0] + x+offset[0]];
+                        region_excess[ic] += sum / n_children - coarse_value;
+                        coarse_value = sum / n_children;
+                    }
+                }
+            }
+        }
+    }
+    if(!this->reflux)
+        return;
+
+    // Refluxing: the coarse cells around a region were stepped with the coarse fluxes across its edge, while the
+    // region itself now has the fine fluxes. For a formula that conserves mass the difference is the excess, so
+    // we take it back out of the coarse cells across the edge, an equal share for each face. (We can't tell the
+    // fluxes through each face apart without knowing the formula.)
+    struct Face { size_t region; Block* block; size_t cell; };
+    vector<Face> faces;
+    map<size_t,int> n_faces;
+    for(const auto& key_block : fine.blocks)
+    {
+        int origin[3];
+        this->GetBlockOrigin(fine,key_block.first,origin);
+        const int coarse_origin[3] = { origin[0] >> R[0], origin[1] >> R[1], origin[2] >> R[2] };
+        const size_t block_region = find_region(key_block.first);
+        for(int z=0;z<F[2] && coarse_origin[2]+z<coarse.dimensions[2];z++)
+        {
+            for(int y=0;y<F[1] && coarse_origin[1]+y<coarse.dimensions[1];y++)
+            {
+                for(int x=0;x<F[0] && coarse_origin[0]+x<coarse.dimensions[0];x++)
+                {
+                    for(int i=0;i<3;i++)
+                    {
+                        if(!R[i]) continue;
+                        for(int d=-1;d<=1;d+=2)
+                        {
+                            int p[3] = { coarse_origin[0]+x, coarse_origin[1]+y, coarse_origin[2]+z };
+                            p[i] += d;
+                            if(p[i] >= coarse_origin[i] && p[i] < coarse_origin[i] + F[i]
+                                && p[i] < coarse.dimensions[i])
+                                continue; // (under the same block)
+                            if(!this->wrap && (p[i] < 0 || p[i] >= coarse.dimensions[i]))
+                                continue; // (nothing flows through the edge of the image)
+                            p[i] = this->WrapPosition(coarse,i,p[i]);
+                            const int fine_block[3] = { (p[0] << R[0]) / E[0], (p[1] << R[1]) / E[1],
+                                (p[2] << R[2]) / E[2] };
+                            if(fine.blocks.count(this->GetBlockKey(fine,fine_block)))
+                                continue; // (under another block of the region)
+                            const int coarse_block[3] = { p[0] / E[0], p[1] / E[1], p[2] / E[2] };
+                            auto found = coarse.blocks.find(this->GetBlockKey(coarse,coarse_block));
+                            if(found == coarse.blocks.end())
+                                continue;
+                            faces.push_back({ block_region, &found->second,
+                                ((size_t)(p[2] % E[2]) * E[1] + p[1] % E[1]) * E[0] + p[0] % E[0] });
+                            n_faces[block_region]++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for(const Face& face : faces)
+    {
+        const vector<double>& region_excess = excess[face.region];
+        for(int ic=0;ic<(int)region_excess.size();ic++)
+            face.block->current[ic][face.cell] -= region_excess[ic] / n_faces[face.region];
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+AMRGrid::Block AMRGrid::MakeBlock(int iLevel,size_t key,double t) const
+{
+    const Level& level = this->levels[iLevel];
+    const int *E = this->block_extent;
+    const int *R = this->refined;
+    const int no_margin[3] = { 0, 0, 0 };
+    Block block;
+    block.current.assign(this->n_chemicals,vector<double>(this->GetCellsPerBlock()));
+    this->FillPatch(iLevel,key,t,no_margin,block.current,0);
+
+    // shift the children of each coarse cell so that they add up to the same amount as it
+    int origin[3];
+    this->GetBlockOrigin(level,key,origin);
+    const int n_children = 1 << (R[0] + R[1] + R[2]);
+    for(int ic=0;ic<this->n_chemicals;ic++)
+    {
+        vector<double>& values = block.current[ic];
+        for(int z=0;z<(E[2]>>R[2]) && origin[2]+(z<<R[2])<level.dimensions[2];z++)
+        {
+            for(int y=0;y<(E[1]>>R[1]) && origin[1]+(y<<R[1])<level.dimensions[1];y++)
+            {
+                for(int x=0;x<(E[0]>>R[0]) && origin[0]+(x<<R[0])<level.dimensions[0];x++)
+                {
+                    double sum = 0.0;
+                    for(int dz=0;dz<=R[2];dz++)
+                        for(int dy=0;dy<=R[1];dy++)
+                            for(int dx=0;dx<=R[0];dx++)
+                                sum += values[(((z<<R[2])+dz)*E[1] + (y<<R[1])+dy)*E[0] + (x<<R[0])+dx];
+                    const double shift = this->Sample(iLevel-1, ic, (origin[0]>>R[0])+x, (origin[1]>>R[1])+y,
+                        (origin[2]>>R[2])+z, t) - sum / n_children;
+                    for(int dz=0;dz<=R[2];dz++)
+                        for(int dy=0;dy<=R[1];dy++)
+                            for(int dx=0;dx<=R[0];dx++)
+                                values[(((z<<R[2])+dz)*E[1] + (y<<R[1])+dy)*E[0] + (x<<R[0])+dx] += shift;
+                }
+            }
+        }
+    }
+    block.previous = block.current;
+    return block;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool AMRGrid::IsNested(int iLevel,size_t key) const
+{
+    if(iLevel < 2)
+        return true; // (level 0 covers everything)
+
+    // every cell of the level below that the block's ghost cells are interpolated from must be at that level
+    const Level& level = this->levels[iLevel];
+    const Level& coarse = this->levels[iLevel-1];
+    int origin[3];
+    this->GetBlockOrigin(level,key,origin);
+    int lo[3], hi[3];
+    for(int i=0;i<3;i++)
+    {
+        if(this->refined[i])
+        {
+            lo[i] = FloorDivide(FloorDivide(origin[i] - this->halo[i] - 1, 2), this->block_extent[i]);
+            hi[i] = FloorDivide(FloorDivide(origin[i] + this->block_extent[i] + this->halo[i], 2), this->block_extent[i]);
+        }
+        else
+            lo[i] = hi[i] = 0;
+    }
+    for(int bz=lo[2];bz<=hi[2];bz++)
+    {
+        for(int by=lo[1];by<=hi[1];by++)
+        {
+            for(int bx=lo[0];bx<=hi[0];bx++)
+            {
+                int block[3] = { bx, by, bz };
+                for(int i=0;i<3;i++)
+                {
+                    const int n = coarse.n_blocks[i];
+                    block[i] = this->wrap ? ((block[i] % n) + n) % n : min(max(block[i],0),n-1);
+                }
+                if(coarse.blocks.find(this->GetBlockKey(coarse,block)) == coarse.blocks.end())
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRGrid::Regrid(int i_chemical,double threshold,double dx)
+{
+    const int *E = this->block_extent;
+    const int *R = this->refined;
+    for(int iLevel=0;iLevel+1<this->GetNumberOfLevels();iLevel++)
+    {
+        const Level& coarse = this->levels[iLevel];
+        Level& fine = this->levels[iLevel+1];
+        const double h = dx / (1 << iLevel);
+        const double t = coarse.time_current;
+
+        // flag the fine blocks over cells where the gradient is steep
+        set<size_t> flagged;
+        for(const auto& key_block : coarse.blocks)
+        {
+            int origin[3];
+            this->GetBlockOrigin(coarse,key_block.first,origin);
+            for(int z=origin[2];z<origin[2]+E[2] && z<coarse.dimensions[2];z++)
+            {
+                for(int y=origin[1];y<origin[1]+E[1] && y<coarse.dimensions[1];y++)
+                {
+                    for(int x=origin[0];x<origin[0]+E[0] && x<coarse.dimensions[0];x++)
+                    {
+                        double gradient_squared = 0.0;
+                        const int p[3] = { x, y, z };
+                        for(int i=0;i<3;i++)
+                        {
+                            if(!R[i]) continue;
+                            int a[3] = { x, y, z }, b[3] = { x, y, z };
+                            a[i]++;
+                            b[i]--;
+                            const double g = (this->Sample(iLevel,i_chemical,a[0],a[1],a[2],t)
+                                - this->Sample(iLevel,i_chemical,b[0],b[1],b[2],t)) / (2.0 * h);
+                            gradient_squared += g * g;
+                        }
+                        if(gradient_squared > threshold * threshold)
+                        {
+                            const int block[3] = { (p[0] << R[0]) / E[0], (p[1] << R[1]) / E[1], (p[2] << R[2]) / E[2] };
+                            flagged.insert(this->GetBlockKey(fine,block));
+                        }
+                    }
+                }
+            }
+        }
+
+        // add a margin of one block all round, so that features stay refined until the next regrid
+        set<size_t> wanted;
+        for(size_t key : flagged)
+        {
+            int origin[3];
+            this->GetBlockOrigin(fine,key,origin);
+            for(int dz=-R[2];dz<=R[2];dz++)
+            {
+                for(int dy=-R[1];dy<=R[1];dy++)
+                {
+                    for(int dx=-R[0];dx<=R[0];dx++)
+                    {
+                        int block[3] = { origin[0]/E[0]+dx, origin[1]/E[1]+dy, origin[2]/E[2]+dz };
+                        bool is_inside = true;
+                        for(int i=0;i<3;i++)
+                        {
+                            const int n = fine.n_blocks[i];
+                            if(this->wrap)
+                                block[i] = ((block[i] % n) + n) % n;
+                            else if(block[i] < 0 || block[i] >= n)
+                                is_inside = false;
+                        }
+                        if(is_inside)
+                        {
+                            const size_t neighbor = this->GetBlockKey(fine,block);
+                            if(this->IsNested(iLevel+1,neighbor))
+                                wanted.insert(neighbor);
+                        }
+                    }
+                }
+            }
+        }
+
+        // remove the blocks no longer wanted, then fill the new ones from the level below
+        for(auto it = fine.blocks.begin(); it != fine.blocks.end(); )
+        {
+            if(wanted.count(it->first))
+                ++it;
+            else
+                it = fine.blocks.erase(it);
+        }
+        map<size_t,Block> new_blocks;
+        for(size_t key : wanted)
+            if(!fine.blocks.count(key))
+                new_blocks[key] = this->MakeBlock(iLevel+1,key,fine.time_current);
+        fine.blocks.insert(make_move_iterator(new_blocks.begin()),make_move_iterator(new_blocks.end()));
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t AMRGrid::GetMemorySize() const
+{
+    size_t n_blocks = 0;
+    for(const Level& level : this->levels)
+        n_blocks += level.blocks.size();
+    // (each block keeps its previous state and a buffer for the next, as well as the current one)
+    return n_blocks * this->n_chemicals * this->GetCellsPerBlock() * sizeof(double) * 3;
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,136 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __AMRGRID__
+#define __AMRGRID__
+
+// local:
+#include "NativeKernel.hpp"
+
+// STL:
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// A hierarchy of ever finer grids over an image, refined only where needed.
+/** Level 0 covers the whole image. Each finer level halves the grid spacing along the non-flat axes, and is made of
+  * square blocks of cells placed only where the level below is refined. Each level takes several shorter timesteps
+  * for each step of the level below (Berger-Oliger subcycling), running its own kernel on all of its blocks at once:
+  * the blocks are padded with ghost cells taken from their neighbors at the same level or, where there are none,
+  * interpolated in space and time from the level below. Afterwards the fine values are averaged back down, so level
+  * 0 always holds the best estimate at its own resolution, and the mass that the fine level moved across the edge of
+  * each refined region differently from the level below is put back into the cells around it (refluxing). The values
+  * are kept as double, whatever the type of the image. */
+class AMRGrid
+{
+    public:
+
+        AMRGrid();
+
+        /// Discard everything and start again with just level 0, for a base image of this size.
+        void Reset(const int base_dimensions[3],int n_chemicals,int n_levels,int block_size,int time_refinement,
+                   bool wrap);
+        bool IsReset(const int base_dimensions[3],int n_chemicals,int n_levels,int block_size,int time_refinement,
+                     bool wrap) const;
+
+        /// Compile the kernel of each level. Each kernel steps all the cells it is given (as double) by that level's
+        /// timestep, reading up to halo[i] cells away along each axis.
+        void SetKernels(const std::vector<std::string>& sources,const int halo[3]);
+        /// Add the kernel builds and runs to these counters (if not NULL).
+        void SetPerformanceCounters(PerformanceCounters* c) { this->counters = c; }
+
+        /// Correct the cells around each refined region after averaging down, so that the total of each chemical
+        /// is kept by formulas that conserve it. (On by default.)
+        void SetRefluxing(bool reflux) { this->reflux = reflux; }
+
+        /// Copy the values of level 0 into or out of a dense image of one chemical (x fastest), of float or double.
+        template <typename T> void SetBaseValues(int i_chemical,const T* values);
+        template <typename T> void GetBaseValues(int i_chemical,T* values) const;
+        template <typename T> bool BaseValuesDiffer(int i_chemical,const T* values) const;
+
+        /// Advance every level by one timestep of level 0, of this length.
+        void Step(double timestep);
+
+        /// Rebuild the refined levels, placing blocks wherever the gradient magnitude of the chemical exceeds the
+        /// threshold at the level below. dx is the grid spacing at level 0.
+        void Regrid(int i_chemical,double threshold,double dx);
+
+        int GetNumberOfLevels() const { return (int)this->levels.size(); }
+        size_t GetNumberOfBlocks(int level) const { return this->levels[level].blocks.size(); }
+        size_t GetMemorySize() const;
+
+    private:
+
+        struct Block
+        {
+            std::vector<std::vector<double>> previous, current, next; ///< one for each chemical
+        };
+
+        struct Level
+        {
+            int dimensions[3];
+            int n_blocks[3];
+            double time_previous, time_current;
+            std::map<size_t,Block> blocks; ///< keyed by block index
+        };
+
+    private:
+
+        void AdvanceLevel(int level,double timestep);
+        void Restrict(int fine_level);
+        Block MakeBlock(int level,size_t key,double t) const;
+        bool IsNested(int level,size_t key) const;
+
+        /// Copy the block with this key at a level, and a margin of cells around it, into a patch (x fastest) at
+        /// first in each chemical's array. Cells with no block at the level are interpolated from the level below.
+        void FillPatch(int level,size_t key,double t,const int margin[3],std::vector<std::vector<double>>& patches,
+                       size_t first) const;
+
+        /// The value of a chemical in a cell of a level at time t, interpolating from the levels below if needed.
+        double Sample(int level,int i_chemical,int x,int y,int z,double t) const;
+
+        /// Wrap or clamp a position along one axis of a level.
+        int WrapPosition(const Level& level,int axis,int p) const;
+        /// Find the block and the offset in it of each position along one axis, with the block given as its index in
+        /// a list of the distinct blocks (added to if needed).
+        void LocateAlongAxis(int axis,const std::vector<int>& positions,std::vector<int>& blocks,
+                             std::vector<int>& slots,std::vector<int>& offsets) const;
+        /// Look up every combination of the distinct blocks along each axis, x fastest. (NULL where a level has none.)
+        std::vector<const Block*> FindBlocks(const Level& level,const std::vector<int> blocks[3]) const;
+
+        size_t GetBlockKey(const Level& level,const int block[3]) const;
+        void GetBlockOrigin(const Level& level,size_t key,int origin[3]) const;
+        size_t GetCellsPerBlock() const { return (size_t)this->block_extent[0]*this->block_extent[1]*this->block_extent[2]; }
+
+    private:
+
+        int base_dimensions[3];
+        int n_chemicals;
+        int block_size;
+        int time_refinement;
+        bool wrap;
+        bool reflux;
+        int block_extent[3]; ///< block_size along the non-flat axes, 1 along the others
+        int refined[3];      ///< 1 along the non-flat axes, 0 along the others
+        int halo[3];
+        std::vector<Level> levels;
+        std::vector<std::unique_ptr<NativeKernel>> kernels; ///< one for each level
+        PerformanceCounters* counters;
+};
+
+#endif
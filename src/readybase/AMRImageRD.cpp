@@ -0,0 +1,218 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "AMRImageRD.hpp"
+#include "FormulaOpenCLImageRD.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <cmath>
+#include <stdexcept>
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+AMRImageRD::AMRImageRD(int data_type)
+    : NativeFormulaImageRD(data_type)
+    , n_levels(3)
+    , amr_block_size(16)
+    , time_refinement(4)
+    , regrid_interval(4)
+    , refine_chemical(0)
+    , refine_threshold(0.1f)
+    , reflux(true)
+    , steps_since_regrid(0)
+{
+    this->grid.SetPerformanceCounters(&this->performance_counters);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vector<AbstractRD::Parameter> AMRImageRD::GetLevelParameters(int level) const
+{
+    // each level has half the grid spacing of the one below, and takes time_refinement steps to its one
+    vector<Parameter> level_parameters = this->parameters;
+    bool has_dx = false;
+    for(Parameter& parameter : level_parameters)
+    {
+        if(parameter.name == "timestep")
+            parameter.value /= (float)pow(this->time_refinement, level);
+        else if(parameter.name == "dx" || parameter.name == "dy" || parameter.name == "dz")
+            parameter.value /= (float)(1 << level);
+        has_dx = has_dx || parameter.name == "dx";
+    }
+    if(!has_dx)
+        level_parameters.push_back({ "dx", 1.0f / (1 << level) });
+    return level_parameters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string AMRImageRD::AssembleKernel(const string& formula,const vector<Parameter>& parameters,int halo[3]) const
+{
+    const int single_cells[3] = { 1, 1, 1 };
+    const size_t local_work_size[3] = { 1, 1, 1 };
+    return AssembleFormulaKernelSource(formula, this->GetNumberOfChemicals(), this->GetArenaDimensionality(),
+        parameters, this->GetAccuracy(), this->wrap, VTK_DOUBLE, "double", "", single_cells, false, local_work_size,
+        halo, false);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+template <typename T> void AMRImageRD::CopyImagesToGrid()
+{
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+        this->grid.SetBaseValues(ic,static_cast<T*>(this->images[ic]->GetScalarPointer()));
+}
+
+template <typename T> void AMRImageRD::CopyGridToImages()
+{
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+        this->grid.GetBaseValues(ic,static_cast<T*>(this->images[ic]->GetScalarPointer()));
+}
+
+template <typename T> bool AMRImageRD::ImagesDifferFromGrid() const
+{
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+        if(this->grid.BaseValuesDiffer(ic,static_cast<T*>(this->images[ic]->GetScalarPointer())))
+            return true;
+    return false;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRImageRD::Regrid()
+{
+    const float dx = this->IsParameter("dx") ? this->GetParameterValueByName("dx") : 1.0f;
+    this->grid.Regrid(this->refine_chemical,this->refine_threshold,dx);
+    this->steps_since_regrid = 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRImageRD::InternalUpdate(int n_steps)
+{
+    const int NC = this->GetNumberOfChemicals();
+    if(this->refine_chemical >= NC)
+        throw runtime_error("AMRImageRD::InternalUpdate : refine_chemical is out of range");
+    const int dimensions[3] = { vtkMath::Round(this->GetX()), vtkMath::Round(this->GetY()), vtkMath::Round(this->GetZ()) };
+
+    // (the kernels are only recompiled if the formula or the parameters have changed)
+    vector<string> sources;
+    int halo[3];
+    for(int level=0;level<this->n_levels;level++)
+        sources.push_back(this->AssembleKernel(this->formula,this->GetLevelParameters(level),halo));
+
+    // start again from the images if they have changed since the last update, e.g. by painting
+    const bool is_double = this->data_type == VTK_DOUBLE;
+    bool is_changed = !this->grid.IsReset(dimensions,NC,this->n_levels,this->amr_block_size,this->time_refinement,
+        this->wrap);
+    if(!is_changed)
+        is_changed = is_double ? this->ImagesDifferFromGrid<double>() : this->ImagesDifferFromGrid<float>();
+    if(is_changed)
+        this->grid.Reset(dimensions,NC,this->n_levels,this->amr_block_size,this->time_refinement,this->wrap);
+    this->grid.SetRefluxing(this->reflux);
+    this->grid.SetKernels(sources,halo);
+    if(is_changed)
+    {
+        if(is_double)
+            this->CopyImagesToGrid<double>();
+        else
+            this->CopyImagesToGrid<float>();
+        this->Regrid();
+    }
+
+    const float timestep = this->GetParameterValueByName("timestep");
+    for(int it=0;it<n_steps;it++)
+    {
+        this->grid.Step(timestep);
+        if(++this->steps_since_regrid >= this->regrid_interval)
+            this->Regrid();
+    }
+
+    if(is_double)
+        this->CopyGridToImages<double>();
+    else
+        this->CopyGridToImages<float>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t AMRImageRD::GetMemorySize() const
+{
+    return ImageRD::GetMemorySize() + this->grid.GetMemorySize();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void AMRImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    NativeFormulaImageRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // amr:
+    vtkSmartPointer<vtkXMLDataElement> xml_amr = rule->FindNestedElementWithName("amr");
+    if(!xml_amr) throw runtime_error("amr node not found in file");
+    read_optional_attribute(xml_amr,"levels",this->n_levels);
+    read_optional_attribute(xml_amr,"block_size",this->amr_block_size);
+    read_optional_attribute(xml_amr,"time_refinement",this->time_refinement);
+    read_optional_attribute(xml_amr,"regrid_interval",this->regrid_interval);
+    read_optional_attribute(xml_amr,"refine_threshold",this->refine_threshold);
+    read_optional_attribute(xml_amr,"reflux",this->reflux);
+    string refine_chemical_name;
+    read_optional_attribute(xml_amr,"refine_chemical",refine_chemical_name);
+    if(!refine_chemical_name.empty())
+        this->refine_chemical = IndexFromChemicalName(refine_chemical_name);
+    if(this->n_levels < 1 || this->amr_block_size < 2 || this->amr_block_size % 2 || this->time_refinement < 1
+        || this->regrid_interval < 1)
+        throw runtime_error("AMRImageRD::InitializeFromXML : invalid amr attributes");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> AMRImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = NativeFormulaImageRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    // amr
+    vtkSmartPointer<vtkXMLDataElement> amr = vtkSmartPointer<vtkXMLDataElement>::New();
+    amr->SetName("amr");
+    amr->SetIntAttribute("levels",this->n_levels);
+    amr->SetIntAttribute("block_size",this->amr_block_size);
+    amr->SetIntAttribute("time_refinement",this->time_refinement);
+    amr->SetIntAttribute("regrid_interval",this->regrid_interval);
+    amr->SetAttribute("refine_chemical",GetChemicalName(this->refine_chemical).c_str());
+    amr->SetFloatAttribute("refine_threshold",this->refine_threshold);
+    amr->SetIntAttribute("reflux",this->reflux?1:0);
+    rule->AddNestedElement(amr);
+
+    return rd;
+}
+
+// ---------------------------------------------------------------------------------------------------------
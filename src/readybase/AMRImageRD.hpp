@@ -0,0 +1,73 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __AMRIMAGERD__
+#define __AMRIMAGERD__
+
+// local:
+#include "NativeFormulaImageRD.hpp"
+#include "AMRGrid.hpp"
+
+/// A formula RD system that refines the grid where one chemical changes steeply.
+/** Uses an AMRGrid: each level runs the formula with its own grid spacing and timestep (any dx, dy or dz parameter is
+  * halved at each level, and the timestep divided by the time refinement). The images show level 0, which holds the
+  * average of the finer levels above it. The grid and the kernels use double, for float images too, so that refluxing
+  * can keep the totals exactly. Specified by an amr element in the rule. */
+class AMRImageRD : public NativeFormulaImageRD
+{
+    public:
+
+        AMRImageRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        size_t GetMemorySize() const override;
+
+    protected:
+
+        void InternalUpdate(int n_steps) override;
+
+        /// (with double data, whatever the type of the images)
+        std::string AssembleKernel(const std::string& formula,const std::vector<Parameter>& parameters,
+                                   int halo[3]) const override;
+
+        /// Copy the images into level 0, or back, or see if they differ from it.
+        template <typename T> void CopyImagesToGrid();
+        template <typename T> void CopyGridToImages();
+        template <typename T> bool ImagesDifferFromGrid() const;
+
+        /// The parameters of the formula at one level of refinement.
+        std::vector<Parameter> GetLevelParameters(int level) const;
+
+        void Regrid();
+
+    protected:
+
+        int n_levels;
+        int amr_block_size;
+        int time_refinement;
+        int regrid_interval;
+        int refine_chemical;
+        float refine_threshold;
+        bool reflux;
+
+        AMRGrid grid;
+        int steps_since_regrid;
+};
+
+#endif
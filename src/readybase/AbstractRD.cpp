@@ -18,9 +18,11 @@
 // local:
 #include "AbstractRD.hpp"
 #include "overlays.hpp"
+#include "utils.hpp"
 
 // STL:
 #include <algorithm>
+#include <cmath>
 
 // SSE:
 #include <xmmintrin.h>
@@ -31,7 +33,12 @@ using namespace std;
 
 AbstractRD::AbstractRD(int data_type)
     : use_local_memory(false)
+    , use_image_storage(false)
+    , use_super_time_stepping(false)
+    , super_time_stepping_stages(0)
     , timesteps_taken(0)
+    , statistics_interval(0)
+    , statistics_timestep(0)
     , need_reload_formula(true)
     , is_modified(false)
     , wrap(true)
@@ -176,6 +183,25 @@ bool AbstractRD::IsParameter(const string& name) const
 
 // ---------------------------------------------------------------------
 
+void AbstractRD::UpdateStatistics()
+{
+    this->statistics = this->ComputeStatistics(AbstractRD::statistics_histogram_bins);
+    this->statistics_timestep = this->timesteps_taken;
+}
+
+// ---------------------------------------------------------------------
+
+void AbstractRD::UpdateStatisticsIfDue(int n_steps)
+{
+    if(this->statistics_interval == 0) return;
+    // (an update of zero steps follows an edit, so the values may have changed anyway)
+    const int N = this->statistics_interval;
+    if(n_steps == 0 || this->statistics.empty() || this->timesteps_taken / N != (this->timesteps_taken - n_steps) / N)
+        this->UpdateStatistics();
+}
+
+// ---------------------------------------------------------------------
+
 void AbstractRD::SetModified(bool m)
 {
     this->is_modified = m;
@@ -311,6 +337,28 @@ bool AbstractRD::CanRedo() const
 
 // ---------------------------------------------------------------------
 
+void AbstractRD::SetValuesAlongStroke(const vector<array<float,3>>& points,float r,float val,const Properties& render_settings)
+{
+    if(points.empty()) return;
+    // dab the brush along each segment, close enough together to leave no gaps
+    const double spacing = max(1e-6, r * hypot3(this->GetX(),this->GetY(),this->GetZ()) / 2.0);
+    if(points.size()==1)
+        this->SetValuesInRadius(points[0][0],points[0][1],points[0][2],r,val,render_settings);
+    for(size_t i=1;i<points.size();i++)
+    {
+        const array<float,3>& a = points[i-1];
+        const array<float,3>& b = points[i];
+        const int n_dabs = max(1,int(ceil(hypot3(b[0]-a[0],b[1]-a[1],b[2]-a[2]) / spacing)));
+        for(int j=(i==1?0:1);j<=n_dabs;j++)
+        {
+            const float t = j / float(n_dabs);
+            this->SetValuesInRadius(a[0]+t*(b[0]-a[0]),a[1]+t*(b[1]-a[1]),a[2]+t*(b[2]-a[2]),r,val,render_settings);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------
+
 void AbstractRD::SetUndoPoint()
 {
     // paint events are treated as a block until (e.g.) mouse up calls this function
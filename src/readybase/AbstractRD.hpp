@@ -20,6 +20,8 @@
 
 // local:
 #include "InitialPatternGenerator.hpp"
+#include "PerformanceCounters.hpp"
+#include "Statistics.hpp"
 class Overlay;
 class Properties;
 
@@ -31,6 +33,7 @@ class vtkPolyData;
 class vtkImageData;
 
 // STL:
+#include <array>
 #include <string>
 #include <vector>
 #include <map>
@@ -59,6 +62,20 @@ class AbstractRD
         /// How many timesteps have we advanced since being initialized?
         int GetTimestepsTaken() const { return this->timesteps_taken; }
 
+        /// Each chemical is summarised (see Statistics.hpp) every N timesteps, or never if N is zero.
+        int GetStatisticsInterval() const { return this->statistics_interval; }
+        void SetStatisticsInterval(int n) { this->statistics_interval = n > 0 ? n : 0; }
+        /// The most recent summaries, one for each chemical. (Empty if none have been computed yet.)
+        const std::vector<ChemicalStatistics>& GetStatistics() const { return this->statistics; }
+        /// The timestep at which the most recent summaries were computed.
+        int GetStatisticsTimestep() const { return this->statistics_timestep; }
+        /// Summarise each chemical now, rather than waiting for the next interval.
+        void UpdateStatistics();
+
+        /// Where the time has gone (and how much data has moved) since the counters were last reset.
+        const PerformanceCounters& GetPerformanceCounters() const { return this->performance_counters; }
+        void ResetPerformanceCounters() { this->performance_counters = PerformanceCounters(); }
+
         /// The formula is a piece of code (currently either an OpenCL snippet or a full OpenCL kernel) that drives the system.
         std::string GetFormula() const { return this->formula; }
         /// Throws std::runtime_error with information if the formula doesn't work.
@@ -69,6 +86,12 @@ class AbstractRD
         virtual bool HasEditableFormula() const =0;
         /// Return the full OpenCL kernel (if available, else the empty string).
         virtual std::string GetKernel() const { return ""; }
+        /// Start compiling the kernel in the background if it has been changed. (Any error is reported by the next update.)
+        virtual void StartCompilingKernelIfNeeded() {}
+        /// Wait for the kernel being compiled, if any, and load it. Throws std::runtime_error if it doesn't build.
+        virtual void FinishCompilingKernel() {}
+        /// Is a new kernel being compiled in the background? (The system can be viewed, edited and run meanwhile.)
+        virtual bool IsCompilingKernel() const { return false; }
 
         /// Returns e.g. "inbuilt", "formula", "kernel", as in the XML.
         virtual std::string GetRuleType() const =0;
@@ -119,6 +142,8 @@ class AbstractRD
         virtual float GetY() const =0;
         virtual float GetZ() const =0;
         virtual void SetDimensions(int /*x*/,int /*y*/,int /*z*/) {}
+        /// Change the dimensions, keeping the pattern by resampling it. (Only for systems with editable dimensions.)
+        virtual void Resample(int /*x*/,int /*y*/,int /*z*/) {}
 
         /// Only some implementations (e.g. FullKernelOpenCLImageRD) can have their block size edited.
         virtual bool HasEditableBlockSize() const { return false; }
@@ -132,6 +157,18 @@ class AbstractRD
         bool GetUseLocalMemory() const { return this->use_local_memory; }
         void SetUseLocalMemory(bool val) { this->use_local_memory = val; this->need_reload_formula = true; }
 
+        /// Only some implementations (e.g. FormulaOpenCLImageRD) can store their chemicals in OpenCL image objects.
+        virtual bool HasEditableImageStorage() const { return false; }
+        bool GetUseImageStorage() const { return this->use_image_storage; }
+        virtual void SetUseImageStorage(bool val) { this->use_image_storage = val; this->need_reload_formula = true; }
+
+        /// Only some implementations (e.g. the formula rules) can take each timestep in several super-time-stepping stages.
+        virtual bool HasEditableSuperTimeStepping() const { return false; }
+        bool GetUseSuperTimeStepping() const { return this->use_super_time_stepping; }
+        virtual void SetUseSuperTimeStepping(bool val) { this->use_super_time_stepping = val; this->need_reload_formula = true; }
+        /// How many stages each timestep takes, or 0 if it is a single forward-Euler step.
+        virtual int GetNumberOfStagesPerTimestep() const { return 0; }
+
         virtual bool HasEditableWrapOption() const { return false; }
         bool GetWrap() const { return this->wrap; }
         virtual void SetWrap(bool w) { this->wrap = w; }
@@ -141,10 +178,11 @@ class AbstractRD
         Accuracy GetAccuracy() const { return this->accuracy; }
         virtual void SetAccuracy(Accuracy acc) { this->accuracy = acc; }
 
-        /// Retrieve the current 3D object as a vtkPolyData.
+        /// Retrieve the current 3D object as a vtkPolyData. This is a shallow copy, and may share arrays with the system
+        /// itself (e.g. the chemical values), so deep copy it if it needs to outlive the next update.
         virtual void GetAsMesh(vtkPolyData *out,const Properties& render_settings) const =0;
 
-        /// Retrieve the current 2D plane as a vtkImageData.
+        /// Retrieve the current 2D plane as a vtkImageData. (Also a shallow copy, but of colors that aren't reused.)
         virtual void GetAs2DImage(vtkImageData *out,const Properties& render_settings) const =0;
         /// Sets the values for a certain chemical from an image
         virtual void SetFrom2DImage(int iChemical, vtkImageData *im) = 0;
@@ -160,6 +198,13 @@ class AbstractRD
         virtual void SetValue(float x,float y,float z,float val,const Properties& render_settings) =0;
         /// Set the value of all cells within radius r of a given location. The radius is expressed as a proportion of the diagonal of the bounding box.
         virtual void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) =0;
+        /// Set the value of all cells within radius r of a polyline, as painted by a brush stroke. The radius is as for SetValuesInRadius().
+        virtual void SetValuesAlongStroke(const std::vector<std::array<float,3>>& points,float r,float val,const Properties& render_settings);
+
+        /// Indicates whether PickAnalytically() can find what is under the mouse, without reading back the rendered scene.
+        virtual bool CanPickAnalytically(const Properties& render_settings) const { return false; }
+        /// Finds where the ray from p1 to p2 first meets a paintable surface, returning false if it misses.
+        virtual bool PickAnalytically(const double p1[3],const double p2[3],const Properties& render_settings,double p[3]) const { return false; }
 
         bool CanUndo() const; ///< Returns true if there is anything to undo.
         bool CanRedo() const; ///< Returns true if there is anything to redo.
@@ -183,6 +228,11 @@ class AbstractRD
 
         virtual std::vector<float> GetData(int i_chemical) const =0;
 
+        /// Wait for the chemicals to arrive in host memory, if they are still being copied back from a device. The
+        /// methods here that use the chemicals call this themselves; only code that reads them some other way, such as
+        /// by rendering them, needs to call it first.
+        virtual void FinishReadingBack() const {}
+
         struct Parameter {
             std::string name;
             float value;
@@ -204,6 +254,9 @@ class AbstractRD
         std::string data_type_string;
         std::string data_type_suffix;
         bool use_local_memory;
+        bool use_image_storage;
+        bool use_super_time_stepping;
+        int super_time_stepping_stages; ///< if not 0, the stages per timestep, instead of the estimate from the formula
 
         InitialPatternGenerator initial_pattern_generator;
 
@@ -211,6 +264,12 @@ class AbstractRD
 
         int timesteps_taken;
 
+        int statistics_interval;
+        std::vector<ChemicalStatistics> statistics;
+        int statistics_timestep;
+
+        PerformanceCounters performance_counters; ///< (kernels and devices add to these too, through a pointer)
+
         std::string formula;
         bool need_reload_formula;
 
@@ -242,6 +301,11 @@ class AbstractRD
         /// Advance the RD system by n timesteps.
         virtual void InternalUpdate(int n_steps)=0;
 
+        /// Summarise each chemical, with n_bins histogram bins.
+        virtual std::vector<ChemicalStatistics> ComputeStatistics(int n_bins) =0;
+        /// Called after n timesteps have been taken: updates the statistics if an interval has passed meanwhile.
+        void UpdateStatisticsIfDue(int n_steps);
+
         virtual void AddPhasePlot(vtkRenderer* pRenderer, float scaling, float low, float high, float posX, float posY, float posZ,
             int iChemX, int iChemY, int iChemZ) =0;
         virtual void FlipPaintAction(PaintAction& cca) =0; ///< Undo/redo this paint action.
@@ -254,6 +318,7 @@ class AbstractRD
     private: // constants
 
         static const int ready_format_version = 6;
+        static const int statistics_histogram_bins = 32;
 };
 
 #endif
@@ -0,0 +1,330 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "BrickedVolume.hpp"
+
+// STL:
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+
+/// Stored at the start of the file, to recognise a volume of the same shape.
+struct BrickedVolumeHeader
+{
+    char magic[8];
+    int dimensions[3];
+    int n_chemicals;
+    int value_size;
+    int brick_size;
+};
+
+static const char MAGIC[8] = { 'R','E','A','D','Y','V','O','L' };
+static const size_t HEADER_BYTES = 4096; // (a page, so that the bricks stay aligned)
+
+// ---------------------------------------------------------------------------
+
+static inline int WrapCoordinate(int i,int n)
+{
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+// ---------------------------------------------------------------------------
+
+BrickedVolume::BrickedVolume()
+    : is_temporary(false)
+    , n_chemicals(0)
+    , value_size(0)
+    , brick_size(0)
+    , brick_bytes(0)
+    , data(NULL)
+    , data_bytes(0)
+{
+    for(int i=0;i<3;i++)
+    {
+        this->dimensions[i] = 0;
+        this->n_bricks[i] = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+BrickedVolume::~BrickedVolume()
+{
+    this->Close();
+}
+
+// ---------------------------------------------------------------------------
+
+bool BrickedVolume::Open(const string& filename,const int dimensions[3],int n_chemicals,int value_size,int brick_size,
+                         bool temporary)
+{
+    this->Close();
+#ifdef _WIN32
+    throw runtime_error("BrickedVolume::Open : out-of-core storage is not supported on this platform");
+#else
+    if(brick_size < 1 || n_chemicals < 1 || value_size < 1)
+        throw runtime_error("BrickedVolume::Open : invalid arguments");
+    size_t n_bricks_total = 1;
+    for(int i=0;i<3;i++)
+    {
+        if(dimensions[i] < 1)
+            throw runtime_error("BrickedVolume::Open : invalid dimensions");
+        this->dimensions[i] = dimensions[i];
+        this->n_bricks[i] = (dimensions[i] + brick_size - 1) / brick_size;
+        n_bricks_total *= this->n_bricks[i];
+    }
+    // (flat dimensions don't need cubic bricks)
+    this->brick_size = brick_size;
+    this->n_chemicals = n_chemicals;
+    this->value_size = value_size;
+    this->brick_bytes = size_t(min(brick_size,dimensions[0])) * min(brick_size,dimensions[1]) * min(brick_size,dimensions[2])
+        * value_size;
+    this->data_bytes = HEADER_BYTES + n_bricks_total * n_chemicals * this->brick_bytes;
+    this->filename = filename;
+    this->is_temporary = temporary;
+
+    BrickedVolumeHeader header;
+    memcpy(header.magic,MAGIC,sizeof(MAGIC));
+    for(int i=0;i<3;i++)
+        header.dimensions[i] = dimensions[i];
+    header.n_chemicals = n_chemicals;
+    header.value_size = value_size;
+    header.brick_size = brick_size;
+
+    int fd;
+    if(temporary)
+    {
+        // mkstemp creates a new file that only we can access, so nothing planted at a guessable name can be
+        // truncated in its place; the mapping keeps the file alive once it is unlinked
+        string name_template = filename + ".XXXXXX";
+        vector<char> name(name_template.begin(),name_template.end());
+        name.push_back('\0');
+        fd = mkstemp(&name[0]);
+        if(fd < 0)
+            throw runtime_error("BrickedVolume::Open : failed to create a temporary file at "+filename);
+        this->filename = &name[0];
+        unlink(&name[0]);
+    }
+    else
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW, 0644);
+    if(fd < 0)
+        throw runtime_error("BrickedVolume::Open : failed to open "+filename);
+    struct stat file_info;
+    if(fstat(fd,&file_info) != 0 || !S_ISREG(file_info.st_mode))
+    {
+        close(fd);
+        throw runtime_error("BrickedVolume::Open : not a regular file: "+filename);
+    }
+    bool is_existing_volume = false;
+    if(file_info.st_size > 0)
+    {
+        BrickedVolumeHeader existing_header;
+        const bool has_header = pread(fd,&existing_header,sizeof(existing_header),0) == sizeof(existing_header);
+        if(!has_header || memcmp(existing_header.magic,MAGIC,sizeof(MAGIC)) != 0)
+        {
+            close(fd);
+            throw runtime_error("BrickedVolume::Open : "+filename+" exists and is not a volume file - refusing to "
+                "overwrite it");
+        }
+        is_existing_volume = size_t(file_info.st_size) == this->data_bytes
+            && memcmp(&existing_header,&header,sizeof(header)) == 0;
+    }
+    if(!is_existing_volume)
+    {
+        // (the file is sparse until written to)
+        if(ftruncate(fd,0) != 0 || ftruncate(fd,off_t(this->data_bytes)) != 0
+            || pwrite(fd,&header,sizeof(header),0) != sizeof(header))
+        {
+            close(fd);
+            throw runtime_error("BrickedVolume::Open : failed to allocate "+filename+" - out of disk space?");
+        }
+    }
+    void* mapped = mmap(NULL, this->data_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // (the mapping keeps the file open)
+    if(mapped == MAP_FAILED)
+        throw runtime_error("BrickedVolume::Open : failed to map "+filename);
+    this->data = static_cast<char*>(mapped);
+    return is_existing_volume;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+void BrickedVolume::Close()
+{
+    if(!this->data) return;
+#ifndef _WIN32
+    if(!this->is_temporary)
+        msync(this->data, this->data_bytes, MS_SYNC);
+    munmap(this->data, this->data_bytes); // (a temporary file was unlinked in Open, so this releases it)
+#endif
+    this->data = NULL;
+    this->data_bytes = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+char* BrickedVolume::GetValuePointer(int i_chemical,int x,int y,int z) const
+{
+    const int B = this->brick_size;
+    const size_t i_brick = (size_t(z / B) * this->n_bricks[1] + y / B) * this->n_bricks[0] + x / B;
+    const int BX = min(B,this->dimensions[0]);
+    const int BY = min(B,this->dimensions[1]);
+    const size_t i_value = (size_t(z % B) * BY + y % B) * BX + x % B;
+    return this->data + HEADER_BYTES + (i_brick * this->n_chemicals + i_chemical) * this->brick_bytes
+        + i_value * this->value_size;
+}
+
+// ---------------------------------------------------------------------------
+
+void BrickedVolume::ReadBox(int i_chemical,const int origin[3],const int size[3],void* dense) const
+{
+    const int B = this->brick_size;
+    const int X = this->dimensions[0];
+    char* target = static_cast<char*>(dense);
+    for(int z=origin[2];z<origin[2]+size[2];z++)
+    {
+        const int wz = WrapCoordinate(z,this->dimensions[2]);
+        for(int y=origin[1];y<origin[1]+size[1];y++)
+        {
+            const int wy = WrapCoordinate(y,this->dimensions[1]);
+            // copy the row in runs that lie within a single brick
+            for(int x=origin[0];x<origin[0]+size[0];)
+            {
+                const int wx = WrapCoordinate(x,X);
+                const int run = min(origin[0] + size[0] - x, min(B - wx % B, X - wx));
+                const size_t run_bytes = size_t(run) * this->value_size;
+                memcpy(target, this->GetValuePointer(i_chemical,wx,wy,wz), run_bytes);
+                target += run_bytes;
+                x += run;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void BrickedVolume::WriteBox(int i_chemical,const int origin[3],const int size[3],const void* dense)
+{
+    for(int i=0;i<3;i++)
+        if(origin[i] < 0 || origin[i] + size[i] > this->dimensions[i])
+            throw runtime_error("BrickedVolume::WriteBox : box out of range");
+    const int B = this->brick_size;
+    const char* source = static_cast<const char*>(dense);
+    for(int z=origin[2];z<origin[2]+size[2];z++)
+    {
+        for(int y=origin[1];y<origin[1]+size[1];y++)
+        {
+            for(int x=origin[0];x<origin[0]+size[0];)
+            {
+                const int run = min(origin[0] + size[0] - x, B - x % B);
+                const size_t run_bytes = size_t(run) * this->value_size;
+                memcpy(this->GetValuePointer(i_chemical,x,y,z), source, run_bytes);
+                source += run_bytes;
+                x += run;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void BrickedVolume::Prefetch(const int origin[3],const int size[3]) const
+{
+#ifndef _WIN32
+    const int B = this->brick_size;
+    const long PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    const size_t all_chemicals_bytes = this->brick_bytes * this->n_chemicals;
+    for(int bz=origin[2]/B-1;bz<=(origin[2]+size[2])/B;bz++)
+    {
+        for(int by=origin[1]/B-1;by<=(origin[1]+size[1])/B;by++)
+        {
+            for(int bx=origin[0]/B-1;bx<=(origin[0]+size[0])/B;bx++)
+            {
+                // (the chemicals of a brick are together in the file)
+                const int x = WrapCoordinate(bx * B,this->n_bricks[0] * B);
+                const int y = WrapCoordinate(by * B,this->n_bricks[1] * B);
+                const int z = WrapCoordinate(bz * B,this->n_bricks[2] * B);
+                const size_t start = this->GetValuePointer(0,x,y,z) - this->data;
+                const size_t page_start = start - start % PAGE_SIZE;
+                madvise(this->data + page_start, start + all_chemicals_bytes - page_start, MADV_WILLNEED);
+            }
+        }
+    }
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+void BrickedVolume::Flush() const
+{
+#ifndef _WIN32
+    if(this->data)
+        msync(this->data, this->data_bytes, MS_ASYNC);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+void BrickedVolume::SaveCopy(const string& filename) const
+{
+#ifdef _WIN32
+    throw runtime_error("BrickedVolume::SaveCopy : out-of-core storage is not supported on this platform");
+#else
+    if(!this->data)
+        throw runtime_error("BrickedVolume::SaveCopy : no volume is open");
+    const int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW, 0644);
+    if(fd < 0)
+        throw runtime_error("BrickedVolume::SaveCopy : failed to open "+filename);
+    struct stat file_info;
+    char magic[sizeof(MAGIC)];
+    if(fstat(fd,&file_info) != 0 || !S_ISREG(file_info.st_mode) || (file_info.st_size > 0
+        && (pread(fd,magic,sizeof(magic),0) != sizeof(magic) || memcmp(magic,MAGIC,sizeof(MAGIC)) != 0)))
+    {
+        close(fd);
+        throw runtime_error("BrickedVolume::SaveCopy : "+filename+" exists and is not a volume file - refusing to "
+            "overwrite it");
+    }
+    bool ok = ftruncate(fd,0) == 0;
+    for(size_t done=0;ok && done<this->data_bytes;)
+    {
+        const ssize_t n = write(fd, this->data + done, this->data_bytes - done);
+        ok = n > 0;
+        done += ok ? size_t(n) : 0;
+    }
+    close(fd);
+    if(!ok)
+        throw runtime_error("BrickedVolume::SaveCopy : failed to write "+filename+" - out of disk space?");
+#endif
+}
+
+// ---------------------------------------------------------------------------
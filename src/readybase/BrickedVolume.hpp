@@ -0,0 +1,85 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __BRICKEDVOLUME__
+#define __BRICKEDVOLUME__
+
+// STL:
+#include <string>
+
+/// Values of each chemical on a 3D grid, kept in a memory-mapped file rather than in RAM.
+/** The grid is divided into cubic bricks, stored one after another in z,y,x order, with the chemicals of each brick
+  * together, so that the cells of a region are close together in the file. Only the parts of the file that are being
+  * used need be in memory, so the grid can be larger than RAM. (POSIX only for now.) */
+class BrickedVolume
+{
+    public:
+
+        BrickedVolume();
+        ~BrickedVolume();
+
+        /// Map the file, creating it if needed. Returns true if the file already held a volume of this shape, in
+        /// which case its values are kept. An existing file that isn't a volume is never overwritten. If temporary,
+        /// filename is only a prefix: a new file with a unique name is created and unlinked at once, so that nothing
+        /// is left behind even if we crash.
+        bool Open(const std::string& filename,const int dimensions[3],int n_chemicals,int value_size,int brick_size,
+                  bool temporary);
+        void Close();
+        bool IsOpen() const { return this->data != NULL; }
+
+        const int* GetDimensions() const { return this->dimensions; }
+        int GetBrickSize() const { return this->brick_size; }
+
+        /// Copy a box of values of one chemical into a dense array (x fastest). Coordinates outside the volume wrap
+        /// around.
+        void ReadBox(int i_chemical,const int origin[3],const int size[3],void* dense) const;
+        /// Copy a dense array (x fastest) into a box of values of one chemical. The box must lie inside the volume.
+        void WriteBox(int i_chemical,const int origin[3],const int size[3],const void* dense);
+
+        /// Ask the OS to start reading in the bricks of this box (wrapping around), without waiting.
+        void Prefetch(const int origin[3],const int size[3]) const;
+        /// Schedule the writing of any changes back to the file.
+        void Flush() const;
+
+        /// Write a copy of the volume to another file, which Open() can then reopen. An existing file that isn't a
+        /// volume is never overwritten.
+        void SaveCopy(const std::string& filename) const;
+
+    private:
+
+        char* GetValuePointer(int i_chemical,int x,int y,int z) const;
+
+    private:
+
+        std::string filename;
+        bool is_temporary;
+        int dimensions[3];
+        int n_bricks[3];
+        int n_chemicals;
+        int value_size;
+        int brick_size;
+        size_t brick_bytes; ///< size of one chemical of one brick
+        char* data;         ///< the mapped file
+        size_t data_bytes;
+
+    private: // deliberately not implemented, to prevent use
+
+        BrickedVolume(BrickedVolume&);
+        BrickedVolume& operator=(BrickedVolume&);
+};
+
+#endif
@@ -0,0 +1,254 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "DisplacedSurfaceFilter.hpp"
+
+// VTK:
+#include <vtkCellArray.h>
+#include <vtkDataArray.h>
+#include <vtkFloatArray.h>
+#include <vtkImageData.h>
+#include <vtkInformation.h>
+#include <vtkInformationVector.h>
+#include <vtkObjectFactory.h>
+#include <vtkPointData.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+vtkStandardNewMacro(DisplacedSurfaceFilter);
+
+// ---------------------------------------------------------------------
+
+/// Call task(first,last) for each chunk of the n rows, the chunks after the first on threads of their own.
+template <typename Task>
+static void RunChunks(size_t n,size_t row_length,const Task& task)
+{
+    const size_t MIN_CHUNK_SIZE = 16384; // (small images aren't worth starting threads for)
+    const size_t n_chunks = max(size_t(1), min(size_t(thread::hardware_concurrency()), n * row_length / MIN_CHUNK_SIZE));
+    const size_t CHUNK_SIZE = (n + n_chunks - 1) / n_chunks;
+    vector<thread> threads;
+    for(size_t i=1;i<n_chunks;i++)
+        threads.emplace_back([&task,i,n,CHUNK_SIZE]() { task(min(n, i * CHUNK_SIZE), min(n, (i+1) * CHUNK_SIZE)); });
+    task(0, min(n, CHUNK_SIZE));
+    for(thread& t : threads)
+        t.join();
+}
+
+// ---------------------------------------------------------------------
+
+/// Sets the height of each vertex from its pixel, and its normal from the central differences of the heights.
+template <typename T>
+static void Displace(const T* values,int X,int Y,double z0,double scale,const double spacing[3],float* xyz,float* normals)
+{
+    RunChunks(Y, X, [&](size_t first,size_t last)
+    {
+        for(size_t y=first;y<last;y++)
+        {
+            const size_t row = y * X;
+            const size_t row_below = (y>0 ? y-1 : y) * X;
+            const size_t row_above = (static_cast<int>(y)<Y-1 ? y+1 : y) * X;
+            const double dy = (row_above - row_below) / X * spacing[1];
+            for(int x=0;x<X;x++)
+            {
+                xyz[(row+x)*3+2] = static_cast<float>(z0 + scale * values[row+x]);
+                const int left = max(0, x-1);
+                const int right = min(X-1, x+1);
+                const double dx = (right - left) * spacing[0];
+                const double dzdx = dx > 0 ? scale * (values[row+right] - values[row+left]) / dx : 0.0;
+                const double dzdy = dy > 0 ? scale * (values[row_above+x] - values[row_below+x]) / dy : 0.0;
+                const double length = sqrt(dzdx*dzdx + dzdy*dzdy + 1.0);
+                normals[(row+x)*3+0] = static_cast<float>(-dzdx / length);
+                normals[(row+x)*3+1] = static_cast<float>(-dzdy / length);
+                normals[(row+x)*3+2] = static_cast<float>(1.0 / length);
+            }
+        }
+    });
+}
+
+// ---------------------------------------------------------------------
+
+DisplacedSurfaceFilter::DisplacedSurfaceFilter()
+    : ScaleFactor(1.0)
+    , GenerateTextureCoordinates(false)
+{
+    this->dimensions[0] = this->dimensions[1] = 0;
+    for(int i=0;i<3;i++)
+    {
+        this->origin[i] = 0.0;
+        this->spacing[i] = 1.0;
+    }
+}
+
+// ---------------------------------------------------------------------
+
+int DisplacedSurfaceFilter::FillInputPortInformation(int vtkNotUsed(port),vtkInformation* info)
+{
+    info->Set(vtkAlgorithm::INPUT_REQUIRED_DATA_TYPE(), "vtkImageData");
+    return 1;
+}
+
+// ---------------------------------------------------------------------
+
+void DisplacedSurfaceFilter::BuildTopology(int X,int Y,const double origin[3],const double spacing[3])
+{
+    this->dimensions[0] = X;
+    this->dimensions[1] = Y;
+    for(int i=0;i<3;i++)
+    {
+        this->origin[i] = origin[i];
+        this->spacing[i] = spacing[i];
+    }
+    const vtkIdType n_points = static_cast<vtkIdType>(X) * Y;
+
+    this->points = vtkSmartPointer<vtkPoints>::New();
+    this->points->SetDataTypeToFloat();
+    this->points->SetNumberOfPoints(n_points);
+    float* xyz = static_cast<float*>(this->points->GetVoidPointer(0));
+    for(int y=0;y<Y;y++)
+    {
+        for(int x=0;x<X;x++)
+        {
+            const vtkIdType i = static_cast<vtkIdType>(y) * X + x;
+            xyz[i*3+0] = static_cast<float>(origin[0] + x * spacing[0]);
+            xyz[i*3+1] = static_cast<float>(origin[1] + y * spacing[1]);
+            xyz[i*3+2] = static_cast<float>(origin[2]);
+        }
+    }
+
+    // same quads and the same winding as vtkImageDataGeometryFilter, so the normals point up
+    this->quads = vtkSmartPointer<vtkCellArray>::New();
+    for(int y=0;y<Y-1;y++)
+    {
+        for(int x=0;x<X-1;x++)
+        {
+            const vtkIdType i = static_cast<vtkIdType>(y) * X + x;
+            this->quads->InsertNextCell(4);
+            this->quads->InsertCellPoint(i);
+            this->quads->InsertCellPoint(i + 1);
+            this->quads->InsertCellPoint(i + 1 + X);
+            this->quads->InsertCellPoint(i + X);
+        }
+    }
+
+    this->normals = vtkSmartPointer<vtkFloatArray>::New();
+    this->normals->SetName("Normals");
+    this->normals->SetNumberOfComponents(3);
+    this->normals->SetNumberOfTuples(n_points);
+
+    this->texture_coordinates = vtkSmartPointer<vtkFloatArray>::New();
+    this->texture_coordinates->SetName("TextureCoordinates");
+    this->texture_coordinates->SetNumberOfComponents(2);
+    this->texture_coordinates->SetNumberOfTuples(n_points);
+    // (as vtkTextureMapToPlane did, with the plane from (0,0,0) to (X,0,0) and (0,Y,0))
+    float* st = static_cast<float*>(this->texture_coordinates->GetVoidPointer(0));
+    for(vtkIdType i=0;i<n_points;i++)
+    {
+        st[i*2+0] = xyz[i*3+0] / X;
+        st[i*2+1] = xyz[i*3+1] / Y;
+    }
+}
+
+// ---------------------------------------------------------------------
+
+int DisplacedSurfaceFilter::RequestData(vtkInformation* vtkNotUsed(request),vtkInformationVector** inputVector,
+                                        vtkInformationVector* outputVector)
+{
+    vtkImageData* input = vtkImageData::GetData(inputVector[0]);
+    vtkPolyData* output = vtkPolyData::GetData(outputVector);
+    vtkDataArray* values = input->GetPointData()->GetScalars();
+    if(!values)
+    {
+        vtkErrorMacro("Input has no scalars");
+        return 0;
+    }
+    if(values->GetNumberOfComponents() != 1)
+    {
+        vtkErrorMacro("Input must have one component");
+        return 0;
+    }
+    const int* dims = input->GetDimensions();
+    if(dims[2] != 1)
+    {
+        vtkErrorMacro("Input must be 2D");
+        return 0;
+    }
+    const int X = dims[0];
+    const int Y = dims[1];
+    const double* origin = input->GetOrigin();
+    const double* spacing = input->GetSpacing();
+
+    if(!this->points || X != this->dimensions[0] || Y != this->dimensions[1]
+        || !equal(origin, origin+3, this->origin) || !equal(spacing, spacing+3, this->spacing))
+        this->BuildTopology(X,Y,origin,spacing);
+
+    // (as vtkImageData::AllocateScalars does: if someone still holds our last output, e.g. through a shallow copy,
+    // leave it alone and write into new arrays - our own output lets go of them first, so that it doesn't count)
+    output->Initialize();
+    if(this->points->GetReferenceCount() > 1)
+    {
+        vtkSmartPointer<vtkPoints> new_points = vtkSmartPointer<vtkPoints>::New();
+        new_points->DeepCopy(this->points);
+        this->points = new_points;
+    }
+    if(this->normals->GetReferenceCount() > 1)
+    {
+        vtkSmartPointer<vtkFloatArray> new_normals = vtkSmartPointer<vtkFloatArray>::New();
+        new_normals->SetName("Normals");
+        new_normals->SetNumberOfComponents(3);
+        new_normals->SetNumberOfTuples(this->normals->GetNumberOfTuples());
+        this->normals = new_normals;
+    }
+
+    float* xyz = static_cast<float*>(this->points->GetVoidPointer(0));
+    float* n = static_cast<float*>(this->normals->GetVoidPointer(0));
+    switch(values->GetDataType())
+    {
+        case VTK_FLOAT:
+            Displace(static_cast<const float*>(values->GetVoidPointer(0)), X, Y, origin[2], this->ScaleFactor, spacing, xyz, n);
+            break;
+        case VTK_DOUBLE:
+            Displace(static_cast<const double*>(values->GetVoidPointer(0)), X, Y, origin[2], this->ScaleFactor, spacing, xyz, n);
+            break;
+        default:
+            vtkErrorMacro("Unsupported data type: " << values->GetDataTypeAsString());
+            return 0;
+    }
+    this->points->Modified();
+    this->normals->Modified();
+
+    // (these are the same objects each time unless the dimensions changed, so downstream the quads stay as they were)
+    output->SetPoints(this->points);
+    output->SetPolys(this->quads);
+    output->GetPointData()->SetScalars(values);
+    output->GetPointData()->SetNormals(this->normals);
+    if(this->GenerateTextureCoordinates)
+        output->GetPointData()->SetTCoords(this->texture_coordinates);
+    else
+        output->GetPointData()->SetTCoords(NULL);
+    return 1;
+}
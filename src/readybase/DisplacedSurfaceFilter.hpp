@@ -0,0 +1,76 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __DISPLACEDSURFACEFILTER__
+#define __DISPLACEDSURFACEFILTER__
+
+// VTK:
+#include <vtkPolyDataAlgorithm.h>
+#include <vtkSmartPointer.h>
+class vtkCellArray;
+class vtkFloatArray;
+class vtkPoints;
+
+/// Turns a 2D image into a height field: a grid of quads, one vertex per pixel, raised by the pixel's value times
+/// the scale factor. Does the same job as vtkImageDataGeometryFilter, vtkWarpScalar and vtkPolyDataNormals but keeps
+/// its points, quads and normals between updates, so that when the image changes only the heights and the normals
+/// are rewritten (on several threads). The quads are only rebuilt when the image dimensions change. The scalars of
+/// the output are the image's own array, not a copy.
+class DisplacedSurfaceFilter : public vtkPolyDataAlgorithm
+{
+    public:
+
+        vtkTypeMacro(DisplacedSurfaceFilter, vtkPolyDataAlgorithm);
+        static DisplacedSurfaceFilter* New();
+
+        vtkSetMacro(ScaleFactor, double);
+        vtkGetMacro(ScaleFactor, double);
+
+        /// Add texture coordinates that map an image-sized texture onto the surface, as vtkTextureMapToPlane did.
+        vtkSetMacro(GenerateTextureCoordinates, bool);
+        vtkGetMacro(GenerateTextureCoordinates, bool);
+
+    protected:
+
+        DisplacedSurfaceFilter();
+
+        int FillInputPortInformation(int port,vtkInformation* info) override;
+        int RequestData(vtkInformation* request,vtkInformationVector** inputVector,vtkInformationVector* outputVector) override;
+
+        /// Makes new points, quads and texture coordinates for a grid of this size.
+        void BuildTopology(int X,int Y,const double origin[3],const double spacing[3]);
+
+    protected:
+
+        double ScaleFactor;
+        bool GenerateTextureCoordinates;
+
+        int dimensions[2];
+        double origin[3];
+        double spacing[3];
+        vtkSmartPointer<vtkPoints> points;
+        vtkSmartPointer<vtkCellArray> quads;
+        vtkSmartPointer<vtkFloatArray> normals;
+        vtkSmartPointer<vtkFloatArray> texture_coordinates;
+
+    private: // deliberately not implemented, to prevent use
+
+        DisplacedSurfaceFilter(const DisplacedSurfaceFilter&);
+        DisplacedSurfaceFilter& operator=(const DisplacedSurfaceFilter&);
+};
+
+#endif
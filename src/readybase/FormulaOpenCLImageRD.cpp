@@ -18,16 +18,19 @@
 // local:
 #include "FormulaOpenCLImageRD.hpp"
 #include "stencils.hpp"
+#include "super_time_stepping.hpp"
 #include "utils.hpp"
 
 // STL:
 #include <algorithm>
 #include <cmath>
+#include <map>
 #include <set>
 #include <sstream>
 #include <string>
 
 // VTK:
+#include <vtkMath.h>
 #include <vtkXMLUtilities.h>
 
 using namespace std;
@@ -55,6 +58,8 @@ delta_b = D_b * laplacian_b + a*b*b - (F+K)*b;");
 struct InputsNeeded {
     vector<string> chemicals_needed;
     vector<AppliedStencil> stencils_needed;
+    vector<AppliedStencil> staged_stencils_needed; // factored stencils, applied in two passes through local memory
+    vector<AppliedStencil> looped_stencils_needed; // large stencils, summed in a loop over a table of weights
     set<InputPoint> cells_needed;
     map<string, int> gradient_mag_squared;
     bool using_x_pos;
@@ -67,11 +72,37 @@ struct InputsNeeded {
 
 // -------------------------------------------------------------------------
 
+void GetStencilRadii(const Stencil& stencil, const int block_size[3], int radii[3])
+{
+    // how far the stencil reads in each direction, in blocks (non-block-aligned inputs need the block beyond)
+    radii[0] = radii[1] = radii[2] = 0;
+    for (const StencilPoint& stencil_point : stencil.points)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            radii[i] = max(radii[i], (abs(stencil_point.point.xyz[i]) + block_size[i] - 1) / block_size[i]);
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+
+string GetStageName(const AppliedStencil& staged_stencil)
+{
+    // the name of the intermediate result of the first pass, e.g. "stage_bilaplacian_a"
+    return "stage_" + staged_stencil.stencil.factors[0].label + "_" + staged_stencil.chem;
+}
+
+// -------------------------------------------------------------------------
+
 InputsNeeded DetectInputsNeeded(const string& formula, int num_chemicals, int dimensionality, const int block_size[3],
-                                const AbstractRD::Accuracy& accuracy)
+                                const AbstractRD::Accuracy& accuracy, bool use_local_memory, bool loop_large_stencils)
 {
     InputsNeeded inputs_needed;
 
+    // stencils with more points than this are summed in a loop, since unrolling them makes huge kernels that compile slowly
+    const size_t MAX_UNROLLED_STENCIL_POINTS = 64;
+
     const vector<string> formula_tokens = tokenize_for_keywords(formula);
     const vector<Stencil> known_stencils = GetKnownStencils(dimensionality, accuracy);
     for (int i = 0; i < num_chemicals; i++)
@@ -107,26 +138,32 @@ InputsNeeded DetectInputsNeeded(const string& formula, int num_chemicals, int di
             if (UsingKeyword(formula_tokens, keyword) || dependent_stencils.find(keyword) != dependent_stencils.end())
             {
                 const AppliedStencil applied_stencil{ stencil, chem };
+                if (use_local_memory && stencil.factors.size() == 2)
+                {
+                    // the work-group applies the inner stencil over its tile, then each cell applies the outer one
+                    inputs_needed.staged_stencils_needed.push_back(applied_stencil);
+                    continue;
+                }
+                if (loop_large_stencils && stencil.points.size() > MAX_UNROLLED_STENCIL_POINTS)
+                {
+                    // the loop reads its inputs directly, so they are not added to cells_needed
+                    inputs_needed.looped_stencils_needed.push_back(applied_stencil);
+                    continue;
+                }
                 inputs_needed.stencils_needed.push_back(applied_stencil);
                 // add the cell inputs needed for this stencil
                 const set<InputPoint> input_points = applied_stencil.GetInputPoints();
                 inputs_needed.cells_needed.insert(input_points.begin(), input_points.end());
             }
         }
-        // search for direct access to neighbors, e.g. "a_nw"
-        const int MAX_RADIUS = 10; // surely if the user wants something this big they should use a kernel?
-        for (int x = -MAX_RADIUS; x <= MAX_RADIUS; x++)
+        // search for direct access to neighbors, e.g. "a_nw" or "a_e20"
+        const string prefix = chem + "_";
+        for (const string& token : formula_tokens)
         {
-            for (int y = -MAX_RADIUS; y <= MAX_RADIUS; y++)
+            Point point;
+            if (token.compare(0, prefix.size(), prefix) == 0 && Point::FromName(token.substr(prefix.size()), point))
             {
-                for (int z = -MAX_RADIUS; z <= MAX_RADIUS; z++)
-                {
-                    const InputPoint input_point{ { {x, y, z} }, chem };
-                    if (UsingKeyword(formula_tokens, input_point.GetName()))
-                    {
-                        inputs_needed.cells_needed.insert(input_point);
-                    }
-                }
+                inputs_needed.cells_needed.insert({ point, chem });
             }
         }
     }
@@ -159,6 +196,26 @@ InputsNeeded DetectInputsNeeded(const string& formula, int num_chemicals, int di
         inputs_needed.stencil_radii[1] = max(inputs_needed.stencil_radii[1], abs(input_point.point.y) / block_size[1]);
         inputs_needed.stencil_radii[2] = max(inputs_needed.stencil_radii[2], abs(input_point.point.z) / block_size[2]);
     }
+    for (const AppliedStencil& staged_stencil : inputs_needed.staged_stencils_needed)
+    {
+        // the first pass also covers the halo that the second pass reads
+        int inner_radii[3], outer_radii[3];
+        GetStencilRadii(staged_stencil.stencil.factors[0], block_size, inner_radii);
+        GetStencilRadii(staged_stencil.stencil.factors[1], block_size, outer_radii);
+        for (int i = 0; i < 3; i++)
+        {
+            inputs_needed.stencil_radii[i] = max(inputs_needed.stencil_radii[i], inner_radii[i] + outer_radii[i]);
+        }
+    }
+    for (const AppliedStencil& looped_stencil : inputs_needed.looped_stencils_needed)
+    {
+        int radii[3];
+        GetStencilRadii(looped_stencil.stencil, block_size, radii);
+        for (int i = 0; i < 3; i++)
+        {
+            inputs_needed.stencil_radii[i] = max(inputs_needed.stencil_radii[i], radii[i]);
+        }
+    }
 
     return inputs_needed;
 }
@@ -168,7 +225,8 @@ InputsNeeded DetectInputsNeeded(const string& formula, int num_chemicals, int di
 struct KernelOptions {
     KernelOptions(bool wrap, const string& indent, int data_type, const string& data_type_string,
                   const string& data_type_suffix, const int block_size[3],
-                  bool use_local_memory, const size_t local_work_size[3])
+                  bool use_local_memory, const size_t local_work_size[3], bool use_image_storage, bool image_3d,
+                  bool use_super_time_stepping, bool peel_boundary)
         : wrap(wrap)
         , indent(indent)
         , data_type(data_type)
@@ -177,6 +235,10 @@ struct KernelOptions {
         , block_size{ block_size[0], block_size[1], block_size[2] }
         , use_local_memory(use_local_memory)
         , local_work_size{ local_work_size[0], local_work_size[1], local_work_size[2] }
+        , use_image_storage(use_image_storage)
+        , image_3d(image_3d)
+        , use_super_time_stepping(use_super_time_stepping)
+        , peel_boundary(peel_boundary)
     {}
     bool wrap;
     string indent;
@@ -186,10 +248,98 @@ struct KernelOptions {
     const int block_size[3];
     bool use_local_memory;
     const size_t local_work_size[3];
+    bool use_image_storage;
+    bool image_3d;
+    bool use_super_time_stepping;
+    bool peel_boundary;
 };
 
 // -------------------------------------------------------------------------
 
+string GetInteriorCondition(const InputsNeeded& inputs_needed, const KernelOptions& options)
+{
+    // true where every input needed is inside the image, so no wrapping or clamping is needed
+    // (with local memory we test the whole work-group, so that all its work-items take the same branch)
+    // (empty if there is no test to make, and then every read wraps or clamps unless the boundary is peeled off)
+    if (!options.peel_boundary)
+    {
+        return "";
+    }
+    const char* coords[3] = { "x", "y", "z" };
+    const char* sizes[3] = { "X", "Y", "Z" };
+    const char* radii[3] = { "XR", "YR", "ZR" };
+    const char* local_sizes[3] = { "LX", "LY", "LZ" };
+    ostringstream oss;
+    for (int i = 0; i < 3; i++)
+    {
+        if (inputs_needed.stencil_radii[i] == 0)
+        {
+            continue;
+        }
+        if (!oss.str().empty())
+        {
+            oss << " && ";
+        }
+        const string index = string("index_") + coords[i];
+        if (options.use_local_memory)
+        {
+            const string start = index + " - local_" + coords[i];
+            oss << start << " >= " << radii[i] << " && " << start << " + " << local_sizes[i] << " + " << radii[i]
+                << " <= " << sizes[i];
+        }
+        else
+        {
+            oss << index << " >= " << inputs_needed.stencil_radii[i] << " && " << index << " < " << sizes[i]
+                << " - " << inputs_needed.stencil_radii[i];
+        }
+    }
+    return oss.str();
+}
+
+// -------------------------------------------------------------------------
+
+string GetImageReadCode(const InputPoint& input_point, const KernelOptions& options)
+{
+    // the sampler does the wrapping (which needs normalized coordinates) or the clamping
+    const int offset[3] = { input_point.point.x / options.block_size[0], input_point.point.y / options.block_size[1],
+                            input_point.point.z / options.block_size[2] };
+    const bool is_here = offset[0] == 0 && offset[1] == 0 && offset[2] == 0;
+    const int n_coords = options.image_3d ? 3 : 2;
+    ostringstream oss;
+    oss << "read_imagef(" << input_point.chem << "_in, sampler, ";
+    if (is_here)
+    {
+        oss << (options.wrap ? "pos" : "here");
+    }
+    else if (options.wrap)
+    {
+        oss << "pos + (float" << (options.image_3d ? "4" : "2") << ")(";
+        for (int i = 0; i < n_coords; i++)
+        {
+            oss << (i > 0 ? ", " : "") << offset[i] << ".0f";
+        }
+        oss << (options.image_3d ? ", 0.0f" : "") << ") * texel";
+    }
+    else
+    {
+        const char* coords[3] = { "x", "y", "z" };
+        oss << "(int" << (options.image_3d ? "4" : "2") << ")(";
+        for (int i = 0; i < n_coords; i++)
+        {
+            oss << (i > 0 ? ", " : "") << "index_" << coords[i];
+            if (offset[i] != 0)
+            {
+                oss << showpos << offset[i] << noshowpos;
+            }
+        }
+        oss << (options.image_3d ? ", 0" : "") << ")";
+    }
+    oss << ")" << (options.block_size[0] == 1 ? ".x" : "");
+    return oss.str();
+}
+
+// -------------------------------------------------------------------------
+
 void WriteHeader(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
 {
     if (options.data_type == VTK_DOUBLE)
@@ -203,6 +353,27 @@ void WriteHeader(ostringstream& kernel_source, const InputsNeeded& inputs_needed
     #error \"Double precision floating point not supported on this OpenCL device. Choose another or contact the Ready team.\"\n\
 #endif\n\n";
     }
+    if (options.use_image_storage)
+    {
+        if (options.image_3d)
+        {
+            kernel_source << "\
+#ifdef cl_khr_3d_image_writes\n\
+    #pragma OPENCL EXTENSION cl_khr_3d_image_writes : enable\n\
+#else\n\
+    #error \"Writing to 3D images not supported on this OpenCL device. Turn off image storage or choose another device.\"\n\
+#endif\n\n";
+        }
+        kernel_source << "// the chemicals are stored in images, read through a sampler that handles the boundaries:\n";
+        if (options.wrap)
+        {
+            kernel_source << "const sampler_t sampler = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_REPEAT | CLK_FILTER_NEAREST;\n\n";
+        }
+        else
+        {
+            kernel_source << "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;\n\n";
+        }
+    }
     if (options.use_local_memory)
     {
         kernel_source << "// work group size, in blocks:\n";
@@ -214,21 +385,68 @@ void WriteHeader(ostringstream& kernel_source, const InputsNeeded& inputs_needed
         kernel_source << "#define YR " << inputs_needed.stencil_radii[1] << "\n";
         kernel_source << "#define ZR " << inputs_needed.stencil_radii[2] << "\n\n";
     }
+    // output the tables for the stencils that are summed in a loop (once each, though several chemicals may use them)
+    set<string> looped_labels;
+    for (const AppliedStencil& looped_stencil : inputs_needed.looped_stencils_needed)
+    {
+        const Stencil& stencil = looped_stencil.stencil;
+        if (!looped_labels.insert(stencil.label).second)
+        {
+            continue;
+        }
+        const size_t n = stencil.points.size();
+        kernel_source << "constant int " << stencil.label << "_weights[" << n << "] = {";
+        for (size_t i = 0; i < n; i++)
+        {
+            kernel_source << (i % 16 == 0 ? "\n    " : " ") << stencil.points[i].weight << (i < n - 1 ? "," : "");
+        }
+        kernel_source << " };\n";
+        kernel_source << "constant int " << stencil.label << "_offsets[" << n << "][3] = {";
+        for (size_t i = 0; i < n; i++)
+        {
+            const Point& point = stencil.points[i].point;
+            kernel_source << (i % 8 == 0 ? "\n    " : " ") << "{" << point.x << "," << point.y << "," << point.z << "}"
+                << (i < n - 1 ? "," : "");
+        }
+        kernel_source << " };\n\n";
+    }
     // output the function declaration
+    const string image_type = options.image_3d ? "image3d_t" : "image2d_t";
     kernel_source << "kernel void rd_compute(";
     for (const string& chem : inputs_needed.chemicals_needed)
     {
-        kernel_source << "global " << options.data_type_string << " *" << chem << "_in";
+        if (options.use_image_storage)
+        {
+            kernel_source << "read_only " << image_type << " " << chem << "_in";
+        }
+        else
+        {
+            kernel_source << "global " << options.data_type_string << " *" << chem << "_in";
+        }
         kernel_source << ",";
     }
     for (size_t i = 0; i < inputs_needed.chemicals_needed.size(); i++)
     {
-        kernel_source << "global " << options.data_type_string << " *" << inputs_needed.chemicals_needed[i] << "_out";
+        if (options.use_image_storage)
+        {
+            kernel_source << "write_only " << image_type << " " << inputs_needed.chemicals_needed[i] << "_out";
+        }
+        else
+        {
+            kernel_source << "global " << options.data_type_string << " *" << inputs_needed.chemicals_needed[i] << "_out";
+        }
         if (i < inputs_needed.chemicals_needed.size() - 1)
         {
             kernel_source << ",";
         }
     }
+    if (options.use_super_time_stepping)
+    {
+        // the coefficients of the current stage
+        const string scalar_type = options.data_type == VTK_DOUBLE ? "double" : "float";
+        kernel_source << ",const " << scalar_type << " rkl_mu,const " << scalar_type << " rkl_nu,const " << scalar_type
+            << " rkl_mu_tilde";
+    }
     kernel_source << ")\n{\n";
 }
 
@@ -246,7 +464,9 @@ void WriteParameters(ostringstream& kernel_source, const vector<AbstractRD::Para
     // add a dx parameter for grid spacing if one is not already supplied
     const bool has_dx_parameter = find_if(parameters.begin(), parameters.end(),
         [](const AbstractRD::Parameter& param) { return param.name == "dx"; }) != parameters.end();
-    if (!inputs_needed.stencils_needed.empty() && !has_dx_parameter)
+    const bool using_stencils = !inputs_needed.stencils_needed.empty() || !inputs_needed.staged_stencils_needed.empty()
+        || !inputs_needed.looped_stencils_needed.empty();
+    if (using_stencils && !has_dx_parameter)
     {
         kernel_source << options.indent << "const " << options.data_type_string << " dx = 1.0" << options.data_type_suffix << "; // grid spacing\n";
         // TODO: only need this if using a stencil that uses dx
@@ -271,10 +491,46 @@ void WriteIndices(ostringstream& kernel_source, const InputsNeeded& inputs_neede
     kernel_source << options.indent << "const int X = get_global_size(0);\n";
     kernel_source << options.indent << "const int Y = get_global_size(1);\n";
     kernel_source << options.indent << "const int Z = get_global_size(2);\n";
-    kernel_source << options.indent << "const int index_here = X*(Y*index_z + index_y) + index_x;\n";
+    if (options.use_image_storage)
+    {
+        if (options.image_3d)
+        {
+            kernel_source << options.indent << "const int4 here = (int4)(index_x, index_y, index_z, 0);\n";
+        }
+        else
+        {
+            kernel_source << options.indent << "const int2 here = (int2)(index_x, index_y);\n";
+        }
+        if (options.wrap)
+        {
+            // (the repeating sampler takes coordinates in [0,1), so we step between texel centers)
+            if (options.image_3d)
+            {
+                kernel_source << options.indent << "const float4 texel = (float4)(1.0f / X, 1.0f / Y, 1.0f / Z, 0.0f);\n";
+                kernel_source << options.indent << "const float4 pos = ((float4)(index_x, index_y, index_z, 0.0f) + 0.5f) * texel;\n";
+            }
+            else
+            {
+                kernel_source << options.indent << "const float2 texel = (float2)(1.0f / X, 1.0f / Y);\n";
+                kernel_source << options.indent << "const float2 pos = ((float2)(index_x, index_y) + 0.5f) * texel;\n";
+            }
+        }
+    }
+    else
+    {
+        kernel_source << options.indent << "const int index_here = X*(Y*index_z + index_y) + index_x;\n";
+    }
     for (const string& chem : inputs_needed.chemicals_needed)
     {
-        kernel_source << options.indent << options.data_type_string << " " << chem << " = " << chem << "_in[index_here];\n";
+        kernel_source << options.indent << options.data_type_string << " " << chem << " = ";
+        if (options.use_image_storage)
+        {
+            kernel_source << GetImageReadCode({ { { 0, 0, 0 } }, chem }, options) << ";\n";
+        }
+        else
+        {
+            kernel_source << chem << "_in[index_here];\n";
+        }
         // (non-const to allow the user to assign directly to it if needed)
     }
     kernel_source << "\n";
@@ -282,7 +538,8 @@ void WriteIndices(ostringstream& kernel_source, const InputsNeeded& inputs_neede
 
 // -------------------------------------------------------------------------
 
-void WriteLocalMemoryCopyBlocksUnrolled(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
+void WriteLocalMemoryCopyBlocksUnrolled(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options,
+                                        bool interior)
 {
     // unroll the copy blocks, with if-statements to check if local index is for a cell that should be copied
     int copy_size[3];
@@ -362,7 +619,9 @@ void WriteLocalMemoryCopyBlocksUnrolled(ostringstream& kernel_source, const Inpu
                         kernel_source << cx << " * LX + ";
                     }
                     kernel_source << "local_x]";
-                    kernel_source << "= " << chem << "_in[" << GetIndexString(ix.str(), iy.str(), iz.str(), options.wrap) << "]; \n";
+                    const string index = interior ? GetUncheckedIndexString(ix.str(), iy.str(), iz.str())
+                                                  : GetIndexString(ix.str(), iy.str(), iz.str(), options.wrap);
+                    kernel_source << "= " << chem << "_in[" << index << "]; \n";
                 }
                 if (!first_block)
                 {
@@ -375,7 +634,8 @@ void WriteLocalMemoryCopyBlocksUnrolled(ostringstream& kernel_source, const Inpu
 
 // -------------------------------------------------------------------------
 
-void WriteLocalMemoryCopyBlocksWithLoops(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
+void WriteLocalMemoryCopyBlocksWithLoops(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options,
+                                         bool interior)
 {
     // include the for-loops in the kernel code
     kernel_source << options.indent << "const int x_start = index_x - local_x - XR;\n";
@@ -391,7 +651,7 @@ void WriteLocalMemoryCopyBlocksWithLoops(ostringstream& kernel_source, const Inp
     {
         kernel_source << options.indent << options.indent << options.indent << options.indent << "local_" << chem
             << "[z - z_start][y - y_start][x - x_start] = " << chem << "_in["
-            << GetIndexString("x", "y", "z", options.wrap) << "];\n";
+            << (interior ? GetUncheckedIndexString("x", "y", "z") : GetIndexString("x", "y", "z", options.wrap)) << "];\n";
     }
     kernel_source << options.indent << options.indent << options.indent << "}\n";
     kernel_source << options.indent << options.indent << "}\n";
@@ -400,6 +660,28 @@ void WriteLocalMemoryCopyBlocksWithLoops(ostringstream& kernel_source, const Inp
 
 // -------------------------------------------------------------------------
 
+void WriteLocalMemoryCopyBlocks(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options,
+                                bool interior)
+{
+    // unrolling is a bit faster, but for large neighborhoods it makes huge kernels, so beyond this we use loops
+    const int MAX_UNROLLED_COPY_BLOCKS = 27;
+    int num_copy_blocks = 1;
+    for (int i = 0; i < 3; i++)
+    {
+        num_copy_blocks *= (int)ceil((options.local_work_size[i] + inputs_needed.stencil_radii[i] * 2) / (float)options.local_work_size[i]);
+    }
+    if (num_copy_blocks > MAX_UNROLLED_COPY_BLOCKS)
+    {
+        WriteLocalMemoryCopyBlocksWithLoops(kernel_source, inputs_needed, options, interior);
+    }
+    else
+    {
+        WriteLocalMemoryCopyBlocksUnrolled(kernel_source, inputs_needed, options, interior);
+    }
+}
+
+// -------------------------------------------------------------------------
+
 void WriteLocalMemorySection(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
 {
     kernel_source << options.indent << "// copy into local memory:\n";
@@ -409,8 +691,22 @@ void WriteLocalMemorySection(ostringstream& kernel_source, const InputsNeeded& i
         kernel_source << options.indent << "local " << options.data_type_string << " local_" << chem
             << "[LZ + ZR * 2][LY + YR * 2][LX + XR * 2];\n";
     }
-    WriteLocalMemoryCopyBlocksUnrolled(kernel_source, inputs_needed, options);
-    //WriteLocalMemoryCopyBlocksWithLoops(kernel_source, inputs_needed, options); // possibly a bit slower, may depend on stencils
+    const string interior_condition = GetInteriorCondition(inputs_needed, options);
+    if (interior_condition.empty())
+    {
+        WriteLocalMemoryCopyBlocks(kernel_source, inputs_needed, options, options.peel_boundary);
+    }
+    else
+    {
+        // most work-groups are away from the boundary, so only the others need the wrapping or clamping arithmetic
+        KernelOptions nested_options(options);
+        nested_options.indent += options.indent;
+        kernel_source << options.indent << "if (" << interior_condition << ") {\n";
+        WriteLocalMemoryCopyBlocks(kernel_source, inputs_needed, nested_options, true);
+        kernel_source << options.indent << "} else {\n";
+        WriteLocalMemoryCopyBlocks(kernel_source, inputs_needed, nested_options, false);
+        kernel_source << options.indent << "}\n";
+    }
     kernel_source << options.indent << "barrier(CLK_LOCAL_MEM_FENCE);\n";
     kernel_source << options.indent << "const int lx = local_x + XR;\n";
     kernel_source << options.indent << "const int ly = local_y + YR;\n";
@@ -420,24 +716,218 @@ void WriteLocalMemorySection(ostringstream& kernel_source, const InputsNeeded& i
 
 // -------------------------------------------------------------------------
 
-void WriteCellsNeeded(ostringstream& kernel_source, const set<InputPoint>& cells_needed, const KernelOptions& options)
+void WriteLocalInputs(ostringstream& kernel_source, const set<InputPoint>& input_points, const KernelOptions& options)
+{
+    // retrieve the block-aligned inputs from local memory, then swizzle any others from them
+    set<InputPoint> aligned_points;
+    for (const InputPoint& input_point : input_points)
+    {
+        if (input_point.point.x % options.block_size[0] == 0)
+        {
+            aligned_points.insert(input_point);
+        }
+        else
+        {
+            const pair<InputPoint, InputPoint> blocks = input_point.GetAlignedBlocks_Block411();
+            aligned_points.insert(blocks.first);
+            aligned_points.insert(blocks.second);
+        }
+    }
+    for (const InputPoint& input_point : aligned_points)
+    {
+        kernel_source << options.indent << "const " << options.data_type_string << " "
+                      << input_point.GetDirectAccessCode(options.wrap, options.block_size, true) << ";\n";
+    }
+    for (const InputPoint& input_point : input_points)
+    {
+        if (input_point.point.x % options.block_size[0] != 0)
+        {
+            kernel_source << options.indent << "const " << options.data_type_string << " " << input_point.GetName()
+                << " = (" << options.data_type_string << ")(" << input_point.GetSwizzled_Block411() << ");\n";
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+
+void WriteStagedStencilsFirstPass(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
+{
+    // each work-group applies the inner stencil over its tile and the halo that the outer stencil will read, sharing the
+    // results through local memory, so each cell then only needs the outer stencil instead of the full convolution
+    kernel_source << options.indent << "// first pass of the staged stencils:\n";
+    const char* coords[3] = { "x", "y", "z" };
+    const char* radii[3] = { "XR", "YR", "ZR" };
+    const char* local_sizes[3] = { "LX", "LY", "LZ" };
+    for (const AppliedStencil& staged_stencil : inputs_needed.staged_stencils_needed)
+    {
+        const string stage_name = GetStageName(staged_stencil);
+        kernel_source << options.indent << "local " << options.data_type_string << " local_" << stage_name
+            << "[LZ + ZR * 2][LY + YR * 2][LX + XR * 2];\n";
+        int outer_radii[3];
+        GetStencilRadii(staged_stencil.stencil.factors[1], options.block_size, outer_radii);
+        string loop_indent = options.indent;
+        for (int i = 2; i >= 0; i--)
+        {
+            // (the loop variables shadow lx, ly, lz so that the local memory accesses are relative to them)
+            const string l = string("l") + coords[i];
+            ostringstream start, end;
+            start << radii[i];
+            end << radii[i] << " + " << local_sizes[i];
+            if (outer_radii[i] > 0)
+            {
+                start << " - " << outer_radii[i];
+                end << " + " << outer_radii[i];
+            }
+            kernel_source << loop_indent << "for (int " << l << " = " << start.str() << " + local_" << coords[i] << "; "
+                << l << " < " << end.str() << "; " << l << " += " << local_sizes[i] << ") {\n";
+            loop_indent += options.indent;
+        }
+        KernelOptions nested_options(options);
+        nested_options.indent = loop_indent;
+        const AppliedStencil inner{ staged_stencil.stencil.factors[0], staged_stencil.chem };
+        WriteLocalInputs(kernel_source, inner.GetInputPoints(), nested_options);
+        kernel_source << loop_indent << "local_" << stage_name << "[lz][ly][lx] = " << inner.GetExpression() << ";\n";
+        for (int i = 0; i < 3; i++)
+        {
+            loop_indent.erase(0, options.indent.size());
+            kernel_source << loop_indent << "}\n";
+        }
+    }
+    kernel_source << options.indent << "barrier(CLK_LOCAL_MEM_FENCE);\n";
+    kernel_source << "\n";
+}
+
+// -------------------------------------------------------------------------
+
+void WriteLoopedStencil(ostringstream& kernel_source, const AppliedStencil& looped_stencil, const InputsNeeded& inputs_needed,
+                        const KernelOptions& options)
+{
+    // sum over the table of weights, reading each input from local memory, or from global memory with or without the
+    // wrapping or clamping arithmetic depending on whether the cell is away from the boundary
+    const Stencil& stencil = looped_stencil.stencil;
+    const string& chem = looped_stencil.chem;
+    const string name = looped_stencil.GetName();
+    const string scalar_type = options.data_type == VTK_DOUBLE ? "double" : "float";
+    const bool is_block411 = options.block_size[0] == 4;
+    auto write_loop = [&](const string& indent, const string& access)
+    {
+        kernel_source << indent << "for (int i = 0; i < " << stencil.points.size() << "; i++) {\n";
+        kernel_source << indent << options.indent << "const int ox = " << stencil.label << "_offsets[i][0];\n";
+        kernel_source << indent << options.indent << "const int oy = " << stencil.label << "_offsets[i][1];\n";
+        kernel_source << indent << options.indent << "const int oz = " << stencil.label << "_offsets[i][2];\n";
+        kernel_source << indent << options.indent << name << " += " << stencil.label << "_weights[i] * " << access << ";\n";
+        kernel_source << indent << "}\n";
+    };
+    kernel_source << options.indent << options.data_type_string << " " << name << " = 0.0" << options.data_type_suffix << ";\n";
+    if (options.use_local_memory)
+    {
+        write_loop(options.indent, is_block411
+            ? "vload4(0, (local " + scalar_type + "*)&local_" + chem + "[lz + oz][ly + oy][lx] + ox)"
+            : "local_" + chem + "[lz + oz][ly + oy][lx + ox]");
+    }
+    else
+    {
+        string checked_access;
+        if (is_block411)
+        {
+            // assemble the four cells one at a time, since each may wrap or clamp separately
+            const string y = GetCoordString("index_y + oy", "Y", options.wrap);
+            const string z = GetCoordString("index_z + oz", "Z", options.wrap);
+            checked_access = "(" + options.data_type_string + ")(";
+            for (int i = 0; i < 4; i++)
+            {
+                const string x = GetCoordString("4*index_x + ox" + (i > 0 ? " + " + to_string(i) : ""), "(4*X)", options.wrap);
+                checked_access += string(i > 0 ? ", " : "") + "((global " + scalar_type + "*)" + chem + "_in)[4*X * (Y * "
+                    + z + " + " + y + ") + " + x + "]";
+            }
+            checked_access += ")";
+        }
+        else
+        {
+            checked_access = chem + "_in[" + GetIndexString("index_x + ox", "index_y + oy", "index_z + oz", options.wrap) + "]";
+        }
+        const string unchecked_access = is_block411
+            ? "vload4(0, (global " + scalar_type + "*)" + chem + "_in + 4 * (index_here + X * (Y * oz + oy)) + ox)"
+            : chem + "_in[index_here + X * (Y * oz + oy) + ox]";
+        const string interior_condition = GetInteriorCondition(inputs_needed, options);
+        if (interior_condition.empty())
+        {
+            write_loop(options.indent, checked_access);
+        }
+        else
+        {
+            kernel_source << options.indent << "if (" << interior_condition << ") {\n";
+            write_loop(options.indent + options.indent, unchecked_access);
+            kernel_source << options.indent << "} else {\n";
+            write_loop(options.indent + options.indent, checked_access);
+            kernel_source << options.indent << "}\n";
+        }
+    }
+    const string divisor_code = stencil.GetDivisorCode();
+    if (!divisor_code.empty())
+    {
+        kernel_source << options.indent << name << " = " << name << divisor_code << ";\n";
+    }
+}
+
+// -------------------------------------------------------------------------
+
+void WriteCellsNeeded(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
 {
     kernel_source << options.indent << "// cells needed:\n";
-    // write code to retrieve the block-aligned inputs from global memory
-    for (const InputPoint& input_point : cells_needed)
+    // the block-aligned inputs to retrieve (but not the central cell)
+    vector<InputPoint> aligned_points;
+    for (const InputPoint& input_point : inputs_needed.cells_needed)
     {
-        // block-aligned points (but not the central cell)
         if (!(input_point.point.x == 0 && input_point.point.y == 0 && input_point.point.z == 0)
             && input_point.point.x % options.block_size[0] == 0)
+        {
+            aligned_points.push_back(input_point);
+        }
+    }
+    const string interior_condition = options.use_local_memory ? "" : GetInteriorCondition(inputs_needed, options);
+    if (options.use_image_storage)
+    {
+        // the sampler wraps or clamps, so every input is a plain read
+        for (const InputPoint& input_point : aligned_points)
+        {
+            kernel_source << options.indent << "const " << options.data_type_string << " " << input_point.GetName()
+                          << " = " << GetImageReadCode(input_point, options) << ";\n";
+        }
+    }
+    else if (interior_condition.empty())
+    {
+        // write code to retrieve the block-aligned inputs from global or local memory
+        for (const InputPoint& input_point : aligned_points)
         {
             kernel_source << options.indent << "const " << options.data_type_string << " "
                           << input_point.GetDirectAccessCode(options.wrap, options.block_size, options.use_local_memory) << ";\n";
         }
     }
+    else
+    {
+        // most cells are away from the boundary, so only the others need the wrapping or clamping arithmetic
+        for (const InputPoint& input_point : aligned_points)
+        {
+            kernel_source << options.indent << options.data_type_string << " " << input_point.GetName() << ";\n";
+        }
+        kernel_source << options.indent << "if (" << interior_condition << ") {\n";
+        for (const InputPoint& input_point : aligned_points)
+        {
+            kernel_source << options.indent << options.indent << input_point.GetOffsetAccessCode(options.block_size) << ";\n";
+        }
+        kernel_source << options.indent << "} else {\n";
+        for (const InputPoint& input_point : aligned_points)
+        {
+            kernel_source << options.indent << options.indent
+                          << input_point.GetDirectAccessCode(options.wrap, options.block_size, false) << ";\n";
+        }
+        kernel_source << options.indent << "}\n";
+    }
     if (options.block_size[0] == 4)
     {
         // write code to compute the non-block-aligned float4's from the block-aligned ones we have retrieved
-        for (const InputPoint& input_point : cells_needed)
+        for (const InputPoint& input_point : inputs_needed.cells_needed)
         {
             if (input_point.point.x % options.block_size[0] != 0)
             {
@@ -460,6 +950,19 @@ void WriteKeywords(ostringstream& kernel_source, const InputsNeeded& inputs_need
     {
         kernel_source << options.indent << "const " << options.data_type_string << " " << applied_stencil.GetCode() << ";\n";
     }
+    // write the loops for the large stencils
+    for (const AppliedStencil& looped_stencil : inputs_needed.looped_stencils_needed)
+    {
+        WriteLoopedStencil(kernel_source, looped_stencil, inputs_needed, options);
+    }
+    // write the second pass of the staged stencils, reading the first pass from local memory
+    for (const AppliedStencil& staged_stencil : inputs_needed.staged_stencils_needed)
+    {
+        const AppliedStencil outer{ staged_stencil.stencil.factors[1], GetStageName(staged_stencil) };
+        WriteLocalInputs(kernel_source, outer.GetInputPoints(), options);
+        kernel_source << options.indent << "const " << options.data_type_string << " " << staged_stencil.GetName()
+            << " = " << outer.GetExpression() << ";\n";
+    }
     // write code for x_pos, y_pos, z_pos if needed
     if (inputs_needed.using_x_pos)
     {
@@ -509,6 +1012,29 @@ void WriteKeywords(ostringstream& kernel_source, const InputsNeeded& inputs_need
 
 // -------------------------------------------------------------------------
 
+void WriteSuperTimeSteppingStage(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
+{
+    // Y_j = mu * Y_{j-1} + nu * Y_{j-2} + mu_tilde * timestep * F(Y_{j-1}), where the output buffer still holds Y_{j-2}
+    // (nothing useful in the first stage, where nu is zero)
+    const string& indent = options.indent;
+    kernel_source << indent << "// Runge-Kutta-Legendre stage:\n";
+    kernel_source << indent << "if (rkl_nu == 0)\n" << indent << "{\n";
+    for (const string& chem : inputs_needed.chemicals_needed)
+    {
+        kernel_source << indent << indent << chem << "_out[index_here] = rkl_mu * " << chem
+            << " + rkl_mu_tilde * timestep * delta_" << chem << ";\n";
+    }
+    kernel_source << indent << "}\n" << indent << "else\n" << indent << "{\n";
+    for (const string& chem : inputs_needed.chemicals_needed)
+    {
+        kernel_source << indent << indent << chem << "_out[index_here] = rkl_mu * " << chem << " + rkl_nu * " << chem
+            << "_out[index_here] + rkl_mu_tilde * timestep * delta_" << chem << ";\n";
+    }
+    kernel_source << indent << "}\n";
+}
+
+// -------------------------------------------------------------------------
+
 string AssembleKernelSource(const InputsNeeded& inputs_needed,
     const vector<AbstractRD::Parameter>& parameters,
     const string& formula,
@@ -526,9 +1052,13 @@ string AssembleKernelSource(const InputsNeeded& inputs_needed,
     if (options.use_local_memory)
     {
         WriteLocalMemorySection(kernel_source, inputs_needed, options);
+        if (!inputs_needed.staged_stencils_needed.empty())
+        {
+            WriteStagedStencilsFirstPass(kernel_source, inputs_needed, options);
+        }
     }
     // add the cells we need
-    WriteCellsNeeded(kernel_source, inputs_needed.cells_needed, options);
+    WriteCellsNeeded(kernel_source, inputs_needed, options);
     // add the keywords we need
     WriteKeywords(kernel_source, inputs_needed, options);
     // add the formula
@@ -541,12 +1071,31 @@ string AssembleKernelSource(const InputsNeeded& inputs_needed,
         kernel_source << options.indent << s << "\n";
     }
     kernel_source << "\n";
+    if (options.use_super_time_stepping)
+    {
+        WriteSuperTimeSteppingStage(kernel_source, inputs_needed, options);
+        kernel_source << "}\n";
+        return kernel_source.str();
+    }
     // add the forward-Euler step
     // TODO: only add this when delta_<chem> appears in the formula
     kernel_source << options.indent << "// forward-Euler update step:\n";
     for (const string& chem : inputs_needed.chemicals_needed)
     {
-        kernel_source << options.indent << chem << "_out[index_here] = " << chem << " + timestep * delta_" << chem << ";\n";
+        if (options.use_image_storage && options.block_size[0] == 1)
+        {
+            kernel_source << options.indent << "write_imagef(" << chem << "_out, here, (float4)(" << chem
+                << " + timestep * delta_" << chem << ", 0.0f, 0.0f, 0.0f));\n";
+        }
+        else if (options.use_image_storage)
+        {
+            kernel_source << options.indent << "write_imagef(" << chem << "_out, here, " << chem << " + timestep * delta_"
+                << chem << ");\n";
+        }
+        else
+        {
+            kernel_source << options.indent << chem << "_out[index_here] = " << chem << " + timestep * delta_" << chem << ";\n";
+        }
     }
     // TODO: timestep only needed if it appears in the formula or if we are doing forward-Euler for at least one chemical
     // finish up
@@ -557,35 +1106,56 @@ string AssembleKernelSource(const InputsNeeded& inputs_needed,
 
 // -------------------------------------------------------------------------
 
-string FormulaOpenCLImageRD::AssembleKernelSourceFromFormula(const string& formula) const
+string AssembleFormulaKernelSource(const string& formula, int num_chemicals, int dimensionality,
+    const vector<AbstractRD::Parameter>& parameters, AbstractRD::Accuracy accuracy, bool wrap, int data_type,
+    const string& data_type_string, const string& data_type_suffix, const int block_size[3],
+    bool use_local_memory, const size_t local_work_size[3], int stencil_radii[3], bool loop_large_stencils,
+    bool use_image_storage, bool use_super_time_stepping, bool peel_boundary)
 {
-    string full_data_type_string = this->data_type_string;
-    if (this->block_size[0] == 4 && this->block_size[1] == 1 && this->block_size[2] == 1)
+    string full_data_type_string = data_type_string;
+    if (block_size[0] == 4 && block_size[1] == 1 && block_size[2] == 1)
     {
         full_data_type_string += "4";
     }
-    else if(this->block_size[0] == 1 && this->block_size[1] == 1 && this->block_size[2] == 1)
+    else if(block_size[0] == 1 && block_size[1] == 1 && block_size[2] == 1)
     {
     }
     else
     {
         throw runtime_error("unsupported block size in AssembleKernelSourceFromFormula");
     }
+    if (use_image_storage && data_type != VTK_FLOAT)
+    {
+        throw runtime_error("image storage needs float data in AssembleKernelSourceFromFormula");
+    }
+    if (use_image_storage && use_super_time_stepping)
+    {
+        // (a stage reads the output of the one before last, and images are either read or written by a kernel)
+        throw runtime_error("super-time-stepping needs buffers, not image storage, in AssembleKernelSourceFromFormula");
+    }
+    // (image reads go through the texture cache, so with images we read every input directly)
+    const bool read_through_local_memory = use_local_memory && !use_image_storage;
+    const bool read_in_loops = loop_large_stencils && !use_image_storage;
 
-    const InputsNeeded inputs_needed = DetectInputsNeeded(formula, this->GetNumberOfChemicals(),
-        this->GetArenaDimensionality(), this->block_size, this->GetAccuracy());
+    const InputsNeeded inputs_needed = DetectInputsNeeded(formula, num_chemicals, dimensionality, block_size, accuracy,
+        read_through_local_memory, read_in_loops);
+    if (stencil_radii)
+    {
+        copy(inputs_needed.stencil_radii, inputs_needed.stencil_radii + 3, stencil_radii);
+    }
 
     const string indent = "    ";
-    const KernelOptions options(this->wrap, indent, this->data_type, full_data_type_string, this->data_type_suffix, this->block_size,
-        this->use_local_memory, this->local_work_size);
+    const KernelOptions options(wrap, indent, data_type, full_data_type_string, data_type_suffix, block_size,
+        read_through_local_memory, local_work_size, use_image_storage, dimensionality == 3, use_super_time_stepping,
+        peel_boundary);
 
     string amended_formula = formula;
-    if (this->data_type == VTK_DOUBLE)
+    if (data_type == VTK_DOUBLE)
     {
         // float4 doesn't auto-convert to double4 or double
         amended_formula = ReplaceAllSubstrings(amended_formula, "float4", full_data_type_string);
     }
-    else if (this->data_type == VTK_FLOAT)
+    else if (data_type == VTK_FLOAT)
     {
         // float4 doesn't auto-convert to float
         amended_formula = ReplaceAllSubstrings(amended_formula, "float4", full_data_type_string);
@@ -595,9 +1165,127 @@ string FormulaOpenCLImageRD::AssembleKernelSourceFromFormula(const string& formu
         amended_formula = ReplaceAllSubstrings(amended_formula, "double", full_data_type_string);
     }
 
-    const string kernel_source = AssembleKernelSource(inputs_needed, this->parameters, amended_formula, options);
+    return AssembleKernelSource(inputs_needed, parameters, amended_formula, options);
+}
+
+// -------------------------------------------------------------------------
+
+void GetFormulaStencilRadii(const string& formula, int num_chemicals, int dimensionality,
+    AbstractRD::Accuracy accuracy, int stencil_radii[3])
+{
+    const int single_cells[3] = { 1, 1, 1 };
+    const InputsNeeded inputs_needed = DetectInputsNeeded(formula, num_chemicals, dimensionality, single_cells, accuracy,
+        false, false);
+    copy(inputs_needed.stencil_radii, inputs_needed.stencil_radii + 3, stencil_radii);
+}
+
+// -------------------------------------------------------------------------
+
+string FormulaOpenCLImageRD::AssembleKernelSourceFromFormula(const string& formula) const
+{
+    return AssembleFormulaKernelSource(formula, this->GetNumberOfChemicals(), this->GetArenaDimensionality(),
+        this->parameters, this->GetAccuracy(), this->wrap, this->data_type, this->data_type_string,
+        this->data_type_suffix, this->block_size, this->use_local_memory, this->local_work_size, nullptr, true,
+        this->StoresChemicalsInImages(), this->GetSuperTimeSteppingStagesNeeded() > 0);
+}
+
+// -------------------------------------------------------------------------
+
+bool FormulaOpenCLImageRD::StoresChemicalsInImages() const
+{
+    // (images hold floats, and are only 3D for 3D arenas; a super-time-stepping stage reads its output, so needs buffers)
+    return this->use_image_storage && !this->use_super_time_stepping && this->data_type == VTK_FLOAT && !this->images.empty()
+        && (this->GetArenaDimensionality() == 3 || vtkMath::Round(this->GetZ()) == 1);
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaOpenCLImageRD::SetUseImageStorage(bool val)
+{
+    AbstractRD::SetUseImageStorage(val);
+    this->RecreateStorage();
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaOpenCLImageRD::SetUseSuperTimeStepping(bool val)
+{
+    AbstractRD::SetUseSuperTimeStepping(val);
+    if (this->use_image_storage)
+    {
+        this->RecreateStorage(); // (switches between images and buffers)
+    }
+}
+
+// -------------------------------------------------------------------------
+
+int FormulaOpenCLImageRD::GetSuperTimeSteppingStagesNeeded() const
+{
+    if (!this->use_super_time_stepping)
+    {
+        return 0;
+    }
+    if (this->super_time_stepping_stages > 0)
+    {
+        return this->super_time_stepping_stages;
+    }
+    // the spectral radius of each point-symmetric stencil (e.g. laplacian_a) is at most the sum of its weights' sizes
+    // (the stencils with odd powers of dx have imaginary spectra, which no number of stages makes stable)
+    const double dx = this->IsParameter("dx") ? this->GetParameterValueByName("dx") : 1.0;
+    map<string, double> keyword_radii;
+    for (const Stencil& stencil : GetKnownStencils(this->GetArenaDimensionality(), this->GetAccuracy()))
+    {
+        if (stencil.dx_power % 2 != 0)
+        {
+            continue;
+        }
+        double sum = 0.0;
+        for (const StencilPoint& stencil_point : stencil.points)
+        {
+            sum += abs(stencil_point.weight);
+        }
+        const double radius = sum / stencil.divisor / pow(dx, stencil.dx_power);
+        for (int i = 0; i < this->GetNumberOfChemicals(); i++)
+        {
+            keyword_radii[stencil.label + "_" + GetChemicalName(i)] = radius;
+        }
+    }
+    if (!this->IsParameter("timestep"))
+    {
+        return 1; // (the kernel won't build, and its error will say why)
+    }
+    double spectral_radius;
+    if (!EstimateFormulaSpectralRadius(this->formula, this->parameters, keyword_radii, spectral_radius))
+    {
+        return 0; // (we can't tell how many stages would be stable, so take forward-Euler steps instead)
+    }
+    return GetNumberOfRKL1Stages(this->GetParameterValueByName("timestep"), spectral_radius);
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaOpenCLImageRD::SetBlockSize(int axis, int n)
+{
+    this->block_size[axis] = n;
+    this->need_reload_formula = true;
+    if (this->StoresChemicalsInImages())
+    {
+        this->RecreateStorage(); // (the images have one texel per block)
+    }
+}
+
+// -------------------------------------------------------------------------
 
-    return kernel_source;
+void FormulaOpenCLImageRD::RecreateStorage()
+{
+    if (this->images.empty()) return; // (nothing allocated yet)
+    // the kernel and the storage must match, so both are replaced (CreateOpenCLBuffers copies the chemicals back first)
+    this->need_reload_formula = true;
+    this->ReloadContextIfNeeded();
+    this->DiscardPendingProgram();
+    this->ReleaseKernel();
+    this->StartBuildingKernelIfNeeded();
+    this->CreateOpenCLBuffers();
 }
 
 // -------------------------------------------------------------------------
@@ -615,6 +1303,18 @@ void FormulaOpenCLImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_t
     read_optional_attribute(xml_formula, "block_size_x", this->block_size[0]);
     read_optional_attribute(xml_formula, "block_size_y", this->block_size[1]);
     read_optional_attribute(xml_formula, "block_size_z", this->block_size[2]);
+    read_optional_attribute(xml_formula, "super_time_stepping", this->use_super_time_stepping);
+    read_optional_attribute(xml_formula, "super_time_stepping_stages", this->super_time_stepping_stages);
+    if (this->super_time_stepping_stages < 0)
+    {
+        throw runtime_error("super_time_stepping_stages must not be negative");
+    }
+    bool use_image_storage = this->use_image_storage;
+    read_optional_attribute(xml_formula, "image_storage", use_image_storage);
+    if (use_image_storage != this->use_image_storage)
+    {
+        this->SetUseImageStorage(use_image_storage); // (recreates the storage, if there is any yet)
+    }
 
     // number_of_chemicals:
     read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
@@ -656,6 +1356,18 @@ vtkSmartPointer<vtkXMLDataElement> FormulaOpenCLImageRD::GetAsXML(bool generate_
     formula->SetIntAttribute("block_size_z", this->block_size[2]);
     const char* accuracy_labels[3] = { "low", "medium", "high" };
     formula->SetAttribute("accuracy", accuracy_labels[static_cast<int>(this->accuracy)]);
+    if (this->use_super_time_stepping)
+    {
+        formula->SetIntAttribute("super_time_stepping", 1);
+    }
+    if (this->super_time_stepping_stages > 0)
+    {
+        formula->SetIntAttribute("super_time_stepping_stages", this->super_time_stepping_stages);
+    }
+    if (this->use_image_storage)
+    {
+        formula->SetIntAttribute("image_storage", 1);
+    }
     string f = this->GetFormula();
     f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
     formula->SetCharacterData(f.c_str(), (int)f.length());
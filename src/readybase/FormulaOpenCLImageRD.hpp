@@ -38,9 +38,15 @@ class FormulaOpenCLImageRD : public OpenCLImageRD
         int GetBlockSizeX() const override { return this->block_size[0]; }
         int GetBlockSizeY() const override { return this->block_size[1]; }
         int GetBlockSizeZ() const override { return this->block_size[2]; }
-        void SetBlockSizeX(int n) override { this->block_size[0] = n; this->need_reload_formula = true; }
-        void SetBlockSizeY(int n) override { this->block_size[1] = n; this->need_reload_formula = true; }
-        void SetBlockSizeZ(int n) override { this->block_size[2] = n; this->need_reload_formula = true; }
+        void SetBlockSizeX(int n) override { this->SetBlockSize(0, n); }
+        void SetBlockSizeY(int n) override { this->SetBlockSize(1, n); }
+        void SetBlockSizeZ(int n) override { this->SetBlockSize(2, n); }
+
+        bool HasEditableImageStorage() const override { return true; }
+        void SetUseImageStorage(bool val) override;
+
+        bool HasEditableSuperTimeStepping() const override { return true; }
+        void SetUseSuperTimeStepping(bool val) override;
 
         bool HasEditableAccuracyOption() const override { return true; }
         void SetAccuracy(Accuracy acc) override { this->accuracy = acc; this->need_reload_formula = true; }
@@ -58,7 +64,41 @@ class FormulaOpenCLImageRD : public OpenCLImageRD
         void SetWrap(bool w) override;
         bool HasEditableDataType() const override { return true; }
 
+    protected:
+
+        /// Only float data can be stored in images.
+        bool StoresChemicalsInImages() const override;
+
+        /// Enough stages for the timestep, given the spectral radius estimated from the formula's stencils, unless the
+        /// rule sets super_time_stepping_stages. If there is no estimate then the kernel takes forward-Euler steps.
+        int GetSuperTimeSteppingStagesNeeded() const override;
+
     private:
 
         int block_size[3];
+
+        void SetBlockSize(int axis, int n);
+        /// Replace the storage and the kernel together, e.g. when switching between buffers and images.
+        void RecreateStorage();
 };
+
+/// Writes the kernel that applies a formula rule to an image, with the given options.
+/** If stencil_radii is not null it receives how far the formula reads in each direction, in blocks.
+    If loop_large_stencils is set then stencils with many points are summed in a loop over a table of weights,
+    which keeps the kernel small and quick to compile, instead of being unrolled.
+    If use_image_storage is set then the chemicals are read from image2d_t (or for 3D, image3d_t) arguments through
+    a sampler that wraps or clamps at the boundaries, instead of from buffers. Images need float data, and make
+    use_local_memory and loop_large_stencils have no effect.
+    If use_super_time_stepping is set then the kernel computes one Runge-Kutta-Legendre stage instead of a
+    forward-Euler step, taking the stage's coefficients as three arguments after the buffers. This needs buffers.
+    If peel_boundary is set then the cells (or with local memory, the work-groups) whose neighbors are all inside the
+    image read them at plain offsets, and only the others wrap or clamp each index. */
+std::string AssembleFormulaKernelSource(const std::string& formula, int num_chemicals, int dimensionality,
+    const std::vector<AbstractRD::Parameter>& parameters, AbstractRD::Accuracy accuracy, bool wrap, int data_type,
+    const std::string& data_type_string, const std::string& data_type_suffix, const int block_size[3],
+    bool use_local_memory, const size_t local_work_size[3], int stencil_radii[3], bool loop_large_stencils = true,
+    bool use_image_storage = false, bool use_super_time_stepping = false, bool peel_boundary = true);
+
+/// Scans a formula for the stencils it uses, to find how far it reads in each direction, in cells.
+void GetFormulaStencilRadii(const std::string& formula, int num_chemicals, int dimensionality,
+    AbstractRD::Accuracy accuracy, int stencil_radii[3]);
@@ -17,9 +17,11 @@
 
 // local:
 #include "FormulaOpenCLMeshRD.hpp"
+#include "super_time_stepping.hpp"
 #include "utils.hpp"
 
 // STL:
+#include <map>
 #include <string>
 #include <sstream>
 
@@ -51,6 +53,7 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
 {
     const string indent = "    ";
     const int NC = this->GetNumberOfChemicals();
+    const bool super_time_stepping = this->GetSuperTimeSteppingStagesNeeded() > 0;
 
     ostringstream kernel_source;
     kernel_source << fixed << setprecision(6);
@@ -66,30 +69,69 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
 #endif\n\n";
     }
     // output the function definition
+    // (with a few chemicals they are interleaved in one buffer, so that each neighbor is fetched in a single gather)
+    const int W = this->GetInterleavedWidth();
+    const string interleaved_type = this->data_type_string + to_string(W);
+    const char* components = "xyzw";
     kernel_source << "kernel void rd_compute(";
-    for(int i=0;i<NC;i++)
-        kernel_source << "global " << this->data_type_string << " *" << GetChemicalName(i) << "_in,";
-    for(int i=0;i<NC;i++)
-        kernel_source << "global " << this->data_type_string << " *" << GetChemicalName(i) << "_out,";
-    kernel_source << "global int* neighbor_indices,global float* neighbor_weights,const int max_neighbors)\n";
+    if(W > 1)
+        kernel_source << "global " << interleaved_type << " *chemicals_in,global " << interleaved_type << " *chemicals_out,";
+    else
+    {
+        for(int i=0;i<NC;i++)
+            kernel_source << "global " << this->data_type_string << " *" << GetChemicalName(i) << "_in,";
+        for(int i=0;i<NC;i++)
+            kernel_source << "global " << this->data_type_string << " *" << GetChemicalName(i) << "_out,";
+    }
+    kernel_source << "global int* neighbor_indices,global float* neighbor_weights,const int max_neighbors";
+    if(super_time_stepping)
+    {
+        // the coefficients of the current stage
+        const string scalar_type = this->data_type == VTK_DOUBLE ? "double" : "float";
+        kernel_source << ",const " << scalar_type << " rkl_mu,const " << scalar_type << " rkl_nu,const " << scalar_type
+                      << " rkl_mu_tilde";
+    }
+    kernel_source << ")\n";
     // output the body
     kernel_source << "{\n";
     kernel_source << indent << "const int index_x = get_global_id(0);\n";
-    for(int i=0;i<NC;i++)
-        kernel_source << indent << this->data_type_string << " " << GetChemicalName(i) << " = " << GetChemicalName(i) << "_in[index_x];\n";
+    if(W > 1)
+    {
+        kernel_source << indent << "const " << interleaved_type << " _here = chemicals_in[index_x];\n";
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << this->data_type_string << " " << GetChemicalName(i) << " = _here." << components[i] << ";\n";
+    }
+    else
+    {
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << this->data_type_string << " " << GetChemicalName(i) << " = " << GetChemicalName(i) << "_in[index_x];\n";
+    }
     kernel_source << "\n";
     // compute the laplacians
     kernel_source << indent << "// compute the Laplacians\n";
-    for(int i=0;i<NC;i++)
-        kernel_source << indent << this->data_type_string << " laplacian_" << GetChemicalName(i) << " = -" << GetChemicalName(i) << ";\n";
     kernel_source << indent << "int _offset = index_x * max_neighbors;\n";
-    kernel_source << indent << "for(int _i=0;_i<max_neighbors;_i++)\n" << indent << "{\n";
-    for(int i=0;i<NC;i++)
-        kernel_source << indent << indent << "laplacian_" << GetChemicalName(i) << " += " << GetChemicalName(i)
-                      << "_in[neighbor_indices[_offset+_i]] * neighbor_weights[_offset+_i];\n";
-    kernel_source << indent << "}\n";
-    for(int i=0;i<NC;i++)
-        kernel_source << indent << "laplacian_" << GetChemicalName(i) << " *= 4.0" << this->data_type_suffix << ";\n"; // TODO: not sure about 3D meshes
+    if(W > 1)
+    {
+        kernel_source << indent << interleaved_type << " _laplacian = -_here;\n";
+        kernel_source << indent << "for(int _i=0;_i<max_neighbors;_i++)\n" << indent << "{\n";
+        kernel_source << indent << indent << "_laplacian += chemicals_in[neighbor_indices[_offset+_i]] * neighbor_weights[_offset+_i];\n";
+        kernel_source << indent << "}\n";
+        kernel_source << indent << "_laplacian *= 4.0" << this->data_type_suffix << ";\n"; // TODO: not sure about 3D meshes
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << this->data_type_string << " laplacian_" << GetChemicalName(i) << " = _laplacian." << components[i] << ";\n";
+    }
+    else
+    {
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << this->data_type_string << " laplacian_" << GetChemicalName(i) << " = -" << GetChemicalName(i) << ";\n";
+        kernel_source << indent << "for(int _i=0;_i<max_neighbors;_i++)\n" << indent << "{\n";
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << indent << "laplacian_" << GetChemicalName(i) << " += " << GetChemicalName(i)
+                          << "_in[neighbor_indices[_offset+_i]] * neighbor_weights[_offset+_i];\n";
+        kernel_source << indent << "}\n";
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << "laplacian_" << GetChemicalName(i) << " *= 4.0" << this->data_type_suffix << ";\n"; // TODO: not sure about 3D meshes
+    }
     kernel_source << "\n";
     // the parameters (assume all float for now)
     kernel_source << indent << "// parameters:\n";
@@ -102,10 +144,33 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
         kernel_source << indent << this->data_type_string << " delta_" << GetChemicalName(i) << " = 0.0" << this->data_type_suffix << ";\n";
     kernel_source << "\n" << indent << "// the formula:\n";
     kernel_source << f << "\n";
+    if(super_time_stepping)
+    {
+        this->WriteSuperTimeSteppingStage(kernel_source);
+        kernel_source << "}\n";
+        return kernel_source.str();
+    }
     // the forward-Euler step
     kernel_source << indent << "// forward-Euler update step:\n";
-    for(int i=0;i<NC;i++)
-        kernel_source << indent << GetChemicalName(i) << "_out[index_x] = " << GetChemicalName(i) << " + timestep * delta_" << GetChemicalName(i) << ";\n";
+    if(W > 1)
+    {
+        kernel_source << indent << "chemicals_out[index_x] = (" << interleaved_type << ")(";
+        for(int i=0;i<W;i++)
+        {
+            if(i > 0)
+                kernel_source << ", ";
+            if(i < NC)
+                kernel_source << GetChemicalName(i) << " + timestep * delta_" << GetChemicalName(i);
+            else
+                kernel_source << "0.0" << this->data_type_suffix; // (padding)
+        }
+        kernel_source << ");\n";
+    }
+    else
+    {
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << GetChemicalName(i) << "_out[index_x] = " << GetChemicalName(i) << " + timestep * delta_" << GetChemicalName(i) << ";\n";
+    }
     // finish up
     kernel_source << "}\n";
 
@@ -114,6 +179,84 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
 
 // -------------------------------------------------------------------------
 
+void FormulaOpenCLMeshRD::WriteSuperTimeSteppingStage(ostringstream& kernel_source) const
+{
+    // Y_j = mu * Y_{j-1} + nu * Y_{j-2} + mu_tilde * timestep * F(Y_{j-1}), where the output buffer still holds Y_{j-2}
+    // (nothing useful in the first stage, where nu is zero)
+    const string indent = "    ";
+    const int NC = this->GetNumberOfChemicals();
+    const int W = this->GetInterleavedWidth();
+    kernel_source << indent << "// Runge-Kutta-Legendre stage:\n";
+    if(W > 1)
+    {
+        const string interleaved_type = this->data_type_string + to_string(W);
+        kernel_source << indent << interleaved_type << " _delta = (" << interleaved_type << ")(";
+        for(int i=0;i<W;i++)
+        {
+            if(i > 0)
+                kernel_source << ", ";
+            if(i < NC)
+                kernel_source << "delta_" << GetChemicalName(i);
+            else
+                kernel_source << "0.0" << this->data_type_suffix; // (padding)
+        }
+        kernel_source << ");\n";
+        kernel_source << indent << interleaved_type << " _next = rkl_mu * _here + rkl_mu_tilde * timestep * _delta;\n";
+        kernel_source << indent << "if(rkl_nu != 0)\n";
+        kernel_source << indent << indent << "_next += rkl_nu * chemicals_out[index_x];\n";
+        kernel_source << indent << "chemicals_out[index_x] = _next;\n";
+    }
+    else
+    {
+        kernel_source << indent << "if(rkl_nu == 0)\n" << indent << "{\n";
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << indent << GetChemicalName(i) << "_out[index_x] = rkl_mu * " << GetChemicalName(i)
+                          << " + rkl_mu_tilde * timestep * delta_" << GetChemicalName(i) << ";\n";
+        kernel_source << indent << "}\n" << indent << "else\n" << indent << "{\n";
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << indent << GetChemicalName(i) << "_out[index_x] = rkl_mu * " << GetChemicalName(i)
+                          << " + rkl_nu * " << GetChemicalName(i) << "_out[index_x] + rkl_mu_tilde * timestep * delta_"
+                          << GetChemicalName(i) << ";\n";
+        kernel_source << indent << "}\n";
+    }
+}
+
+// -------------------------------------------------------------------------
+
+int FormulaOpenCLMeshRD::GetSuperTimeSteppingStagesNeeded() const
+{
+    if(!this->use_super_time_stepping)
+        return 0;
+    if(this->super_time_stepping_stages > 0)
+        return this->super_time_stepping_stages;
+    if(!this->IsParameter("timestep"))
+        return 1; // (the kernel won't build, and its error will say why)
+    // laplacian_a is 4 times a weighted mean of the neighbors minus the cell, so its spectral radius is at most 8
+    map<string,double> keyword_radii;
+    for(int i=0;i<this->GetNumberOfChemicals();i++)
+        keyword_radii["laplacian_" + GetChemicalName(i)] = 8.0;
+    double spectral_radius;
+    if(!EstimateFormulaSpectralRadius(this->formula, this->parameters, keyword_radii, spectral_radius))
+        return 0; // (we can't tell how many stages would be stable, so take forward-Euler steps instead)
+    return GetNumberOfRKL1Stages(this->GetParameterValueByName("timestep"), spectral_radius);
+}
+
+// -------------------------------------------------------------------------
+
+double FormulaOpenCLMeshRD::EstimateMaximumStableTimestep() const
+{
+    const double laplacian_radius = this->EstimateLaplacianSpectralRadius();
+    map<string,double> keyword_radii;
+    for(int i=0;i<this->GetNumberOfChemicals();i++)
+        keyword_radii["laplacian_" + GetChemicalName(i)] = laplacian_radius;
+    double spectral_radius;
+    if(!EstimateFormulaSpectralRadius(this->formula, this->parameters, keyword_radii, spectral_radius))
+        return 0.0; // (can't tell)
+    return spectral_radius > 0.0 ? 2.0 / spectral_radius : 0.0;
+}
+
+// -------------------------------------------------------------------------
+
 void FormulaOpenCLMeshRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
 {
     OpenCLMeshRD::InitializeFromXML(rd,warn_to_update);
@@ -127,10 +270,16 @@ void FormulaOpenCLMeshRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to
 
     // number_of_chemicals:
     read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
+    read_optional_attribute(xml_formula,"super_time_stepping",this->use_super_time_stepping);
+    read_optional_attribute(xml_formula,"super_time_stepping_stages",this->super_time_stepping_stages);
+    if(this->super_time_stepping_stages < 0)
+        throw runtime_error("super_time_stepping_stages must not be negative");
 
     string formula = trim_multiline_string(xml_formula->GetCharacterData());
-    this->TestFormula(formula); // will throw on error
-    this->SetFormula(formula); // (won't throw yet)
+    this->SetFormula(formula);
+    // start building the kernel now, so that the build overlaps with reading the mesh (any error is reported when loading)
+    this->ReloadContextIfNeeded();
+    this->StartBuildingKernelIfNeeded();
 }
 
 // -------------------------------------------------------------------------
@@ -146,6 +295,10 @@ vtkSmartPointer<vtkXMLDataElement> FormulaOpenCLMeshRD::GetAsXML(bool generate_i
     vtkSmartPointer<vtkXMLDataElement> formula = vtkSmartPointer<vtkXMLDataElement>::New();
     formula->SetName("formula");
     formula->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    if(this->use_super_time_stepping)
+        formula->SetIntAttribute("super_time_stepping",1);
+    if(this->super_time_stepping_stages > 0)
+        formula->SetIntAttribute("super_time_stepping_stages",this->super_time_stepping_stages);
     string f = this->GetFormula();
     f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
     formula->SetCharacterData(f.c_str(), (int)f.length());
@@ -18,6 +18,9 @@
 // local:
 #include "OpenCLMeshRD.hpp"
 
+// STL:
+#include <sstream>
+
 /// An RD system that uses an OpenCL formula snippet.
 class FormulaOpenCLMeshRD : public OpenCLMeshRD
 {
@@ -40,4 +43,23 @@ class FormulaOpenCLMeshRD : public OpenCLMeshRD
         void SetParameterValue(int iParam,float val) override;
 
         bool HasEditableDataType() const override { return true; }
+
+        bool HasEditableSuperTimeStepping() const override { return true; }
+
+        /// From the formula's Laplacians and what they are multiplied by (see EstimateFormulaSpectralRadius), or 0 if
+        /// that can't be bounded.
+        double EstimateMaximumStableTimestep() const override;
+
+    protected:
+
+        bool CanInterleaveChemicals() const override { return true; }
+
+        /// Enough stages for the timestep, given the spectral radius estimated from the formula's Laplacians, unless
+        /// the rule sets super_time_stepping_stages. If there is no estimate then the kernel takes forward-Euler steps.
+        int GetSuperTimeSteppingStagesNeeded() const override;
+
+    private:
+
+        /// Write the end of a kernel that takes one Runge-Kutta-Legendre stage instead of a forward-Euler step.
+        void WriteSuperTimeSteppingStage(std::ostringstream& kernel_source) const;
 };
@@ -100,9 +100,8 @@ void FullKernelOpenCLImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &war
     // number_of_chemicals:
     read_required_attribute(xml_kernel,"number_of_chemicals",this->n_chemicals);
 
-    // do this last, because it requires everything else to be set up first
-    this->TestFormula(formula); // will throw on error but won't set
-    this->SetFormula(formula); // will set but won't throw
+    // the kernel gets built in the background once the images are allocated (any error is reported when loading)
+    this->SetFormula(formula);
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -81,8 +81,10 @@ void FullKernelOpenCLMeshRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn
     read_required_attribute(xml_kernel,"number_of_chemicals",this->n_chemicals);
 
     // do this last, because it requires everything else to be set up first
-    this->TestFormula(formula); // will throw on error but won't set
-    this->SetFormula(formula); // will set but won't throw
+    this->SetFormula(formula);
+    // start building the kernel now, so that the build overlaps with reading the mesh (any error is reported when loading)
+    this->ReloadContextIfNeeded();
+    this->StartBuildingKernelIfNeeded();
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -22,14 +22,43 @@
 // STL:
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
 
 // VTK:
 #include <vtkImageData.h>
+#include <vtkXMLDataElement.h>
 
 using namespace std;
 
+/// Names for the update orders, as used in the rule's update_order attribute.
+static const char* update_order_names[3] = { "double_buffered", "wavefront", "red_black" };
+
+/// The new values of a cell, given its old values and the sums of the old values of its 6 neighbors.
+static inline void ApplyGrayScott(float aval,float bval,float sum_a,float sum_b,
+    float timestep,float D_a,float D_b,float k,float F,float& new_a,float& new_b)
+{
+    // compute the Laplacians of a and b (7-point stencil)
+    float dda = sum_a - 6*aval;
+    float ddb = sum_b - 6*bval;
+
+    // compute the new rate of change of a and b
+    float da = D_a * dda - aval*bval*bval + F*(1-aval);
+    float db = D_b * ddb + aval*bval*bval - (F+k)*bval;
+
+    #if !defined( USE_SSE )
+        // avoid denormals manually
+        da += 1e-10f;
+        db += 1e-10f;
+    #endif
+
+    // apply the change
+    new_a = aval + timestep * da;
+    new_b = bval + timestep * db;
+}
+
 GrayScottImageRD::GrayScottImageRD()
     : InbuiltImageRD(VTK_FLOAT)
+    , update_order(UpdateOrder::DoubleBuffered)
 {
     this->rule_name = "Gray-Scott";
     this->n_chemicals = 2;
@@ -45,11 +74,63 @@ void GrayScottImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
     // N.B. this class is hardwired for Gray-Scott using floats, so data_type is ignored
     if(nc!=2) throw runtime_error("GrayScottImageRD::AllocateImages : this implementation is for 2 chemicals only");
     ImageRD::AllocateImages(x,y,z,2,VTK_FLOAT);
-    // also allocate our buffer images
+    // also allocate our buffer images, if we need them
     this->DeleteBuffers();
+    if(this->update_order == UpdateOrder::DoubleBuffered)
+        this->AllocateBuffers();
+}
+
+void GrayScottImageRD::InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update)
+{
+    InbuiltImageRD::InitializeFromXML(rd,warn_to_update);
+
+    // update_order (optional)
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    const char *s = rule->GetAttribute("update_order");
+    if(!s)
+        this->SetUpdateOrder(UpdateOrder::DoubleBuffered);
+    else
+    {
+        const char** it = find_if(update_order_names, update_order_names + 3, [s](const char* name) { return strcmp(name,s)==0; });
+        if(it == update_order_names + 3)
+            throw runtime_error(string("GrayScottImageRD::InitializeFromXML : unknown update_order: ")+s);
+        this->SetUpdateOrder(static_cast<UpdateOrder>(it - update_order_names));
+    }
+}
+
+vtkSmartPointer<vtkXMLDataElement> GrayScottImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = InbuiltImageRD::GetAsXML(generate_initial_pattern_when_loading);
+    if(this->update_order != UpdateOrder::DoubleBuffered) // (the default is left out, for older versions of Ready)
+        rd->FindNestedElementWithName("rule")->SetAttribute("update_order",update_order_names[static_cast<int>(this->update_order)]);
+    return rd;
+}
+
+void GrayScottImageRD::SetUpdateOrder(UpdateOrder order)
+{
+    this->update_order = order;
+    if(this->images.empty()) return; // (the buffers are allocated along with the images)
+    if(order == UpdateOrder::DoubleBuffered)
+    {
+        if(this->buffer_images.empty())
+            this->AllocateBuffers();
+    }
+    else
+        this->DeleteBuffers();
+    if(order != UpdateOrder::Wavefront)
+        vector<float>().swap(this->slice_copies);
+}
+
+size_t GrayScottImageRD::GetMemorySize() const
+{
+    return ImageRD::GetMemorySize() * (this->buffer_images.empty() ? 1 : 2) + this->slice_copies.size() * sizeof(float);
+}
+
+void GrayScottImageRD::AllocateBuffers()
+{
     this->buffer_images.resize(2);
     for(int i=0;i<2;i++)
-        this->buffer_images[i] = AllocateVTKImage(x,y,z,VTK_FLOAT);
+        this->buffer_images[i] = AllocateVTKImage(this->GetX(),this->GetY(),this->GetZ(),VTK_FLOAT);
 }
 
 GrayScottImageRD::~GrayScottImageRD()
@@ -64,6 +145,17 @@ void GrayScottImageRD::DeleteBuffers()
 
 void GrayScottImageRD::InternalUpdate(int n_steps)
 {
+    if(this->update_order == UpdateOrder::Wavefront)
+    {
+        this->UpdateInPlaceWavefront(n_steps);
+        return;
+    }
+    if(this->update_order == UpdateOrder::RedBlack)
+    {
+        this->UpdateInPlaceRedBlack(n_steps);
+        return;
+    }
+
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
@@ -133,34 +225,21 @@ void GrayScottImageRD::InternalUpdate(int n_steps)
                     float aval = *vtk_at(old_a,x,y,z,X,Y);
                     float bval = *vtk_at(old_b,x,y,z,X,Y);
 
-                    // compute the Laplacians of a and b
-                    // 7-point stencil:
-                    float dda = *vtk_at(old_a,x,y_prev,z,X,Y) +
-                                *vtk_at(old_a,x,y_next,z,X,Y) +
-                                *vtk_at(old_a,x_prev,y,z,X,Y) +
-                                *vtk_at(old_a,x_next,y,z,X,Y) +
-                                *vtk_at(old_a,x,y,z_prev,X,Y) +
-                                *vtk_at(old_a,x,y,z_next,X,Y) - 6*aval;
-                    float ddb = *vtk_at(old_b,x,y_prev,z,X,Y) +
-                                *vtk_at(old_b,x,y_next,z,X,Y) +
-                                *vtk_at(old_b,x_prev,y,z,X,Y) +
-                                *vtk_at(old_b,x_next,y,z,X,Y) +
-                                *vtk_at(old_b,x,y,z_prev,X,Y) +
-                                *vtk_at(old_b,x,y,z_next,X,Y) - 6*bval;
-
-                    // compute the new rate of change of a and b
-                    float da = D_a * dda - aval*bval*bval + F*(1-aval);
-                    float db = D_b * ddb + aval*bval*bval - (F+k)*bval;
-
-                    #if !defined( USE_SSE )
-                        // avoid denormals manually
-                        da += 1e-10f;
-                        db += 1e-10f;
-                    #endif
-
-                    // apply the change
-                    *vtk_at(new_a,x,y,z,X,Y) = aval + timestep * da;
-                    *vtk_at(new_b,x,y,z,X,Y) = bval + timestep * db;
+                    float sum_a = *vtk_at(old_a,x,y_prev,z,X,Y) +
+                                  *vtk_at(old_a,x,y_next,z,X,Y) +
+                                  *vtk_at(old_a,x_prev,y,z,X,Y) +
+                                  *vtk_at(old_a,x_next,y,z,X,Y) +
+                                  *vtk_at(old_a,x,y,z_prev,X,Y) +
+                                  *vtk_at(old_a,x,y,z_next,X,Y);
+                    float sum_b = *vtk_at(old_b,x,y_prev,z,X,Y) +
+                                  *vtk_at(old_b,x,y_next,z,X,Y) +
+                                  *vtk_at(old_b,x_prev,y,z,X,Y) +
+                                  *vtk_at(old_b,x_next,y,z,X,Y) +
+                                  *vtk_at(old_b,x,y,z_prev,X,Y) +
+                                  *vtk_at(old_b,x,y,z_next,X,Y);
+
+                    ApplyGrayScott(aval,bval,sum_a,sum_b,timestep,D_a,D_b,k,F,
+                        *vtk_at(new_a,x,y,z,X,Y),*vtk_at(new_b,x,y,z,X,Y));
                 }
             }
         }
@@ -172,3 +251,138 @@ void GrayScottImageRD::InternalUpdate(int n_steps)
         this->images[1]->DeepCopy(this->buffer_images[1]);
     }
 }
+
+void GrayScottImageRD::UpdateInPlaceWavefront(int n_steps)
+{
+    // The image is swept one slice at a time: a plane in 3D, a row in 1D and 2D. Each slice is overwritten as soon as
+    // it has been computed, so we keep copies of the old values of the current and previous slices, and of the first
+    // (which the last one needs when wrapping). The results are the same as for DoubleBuffered.
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+    const bool planes = Z > 1;
+    const int S = planes ? Z : Y; // the number of slices
+    const int R = planes ? Y : 1; // the number of rows in each slice
+    const size_t N = size_t(X) * R;
+
+    const float timestep = this->GetParameterValueByName("timestep");
+    const float D_a = this->GetParameterValueByName("D_a");
+    const float D_b = this->GetParameterValueByName("D_b");
+    const float k = this->GetParameterValueByName("k");
+    const float F = this->GetParameterValueByName("F");
+
+    float* data[2] = { static_cast<float*>(this->images[0]->GetScalarPointer()),
+                       static_cast<float*>(this->images[1]->GetScalarPointer()) };
+    this->slice_copies.resize(2 * 3 * N);
+    float* first[2] = { &this->slice_copies[0], &this->slice_copies[3 * N] };
+
+    for(int iStep=0;iStep<n_steps;iStep++)
+    {
+        float* previous[2] = { first[0] + N, first[1] + N };
+        float* current[2] = { first[0] + 2 * N, first[1] + 2 * N };
+        for(int c=0;c<2;c++)
+            memcpy(first[c], data[c], N * sizeof(float));
+        for(int s=0;s<S;s++)
+        {
+            for(int c=0;c<2;c++)
+                memcpy(current[c], data[c] + s * N, N * sizeof(float));
+            // where the old values of slice t are now
+            auto old_slice = [&](int c,int t) -> const float* {
+                if(t == s) return current[c];
+                if(t == s-1) return previous[c];
+                if(t > s) return data[c] + t * N; // (not overwritten yet)
+                return first[c]; // (t == 0, when wrapping around from the last slice)
+            };
+            const int s_prev = this->wrap ? (s-1+S)%S : max(0,s-1);
+            const int s_next = this->wrap ? (s+1)%S : min(S-1,s+1);
+            for(int r=0;r<R;r++)
+            {
+                const int r_prev = this->wrap ? (r-1+R)%R : max(0,r-1);
+                const int r_next = this->wrap ? (r+1)%R : min(R-1,r+1);
+                // the rows that hold the y and z neighbors of this row, for each chemical
+                const float *row[2],*y_prev[2],*y_next[2],*z_prev[2],*z_next[2];
+                for(int c=0;c<2;c++)
+                {
+                    row[c] = current[c] + r * X;
+                    if(planes)
+                    {
+                        y_prev[c] = current[c] + r_prev * X;
+                        y_next[c] = current[c] + r_next * X;
+                        z_prev[c] = old_slice(c,s_prev) + r * X;
+                        z_next[c] = old_slice(c,s_next) + r * X;
+                    }
+                    else
+                    {
+                        y_prev[c] = old_slice(c,s_prev);
+                        y_next[c] = old_slice(c,s_next);
+                        z_prev[c] = z_next[c] = row[c];
+                    }
+                }
+                float* new_a = data[0] + s * N + r * X;
+                float* new_b = data[1] + s * N + r * X;
+                for(int x=0;x<X;x++)
+                {
+                    const int x_prev = this->wrap ? (x-1+X)%X : max(0,x-1);
+                    const int x_next = this->wrap ? (x+1)%X : min(X-1,x+1);
+                    // (summed in the same order as in InternalUpdate, so that the results are identical)
+                    const float sum_a = y_prev[0][x] + y_next[0][x] + row[0][x_prev] + row[0][x_next] + z_prev[0][x] + z_next[0][x];
+                    const float sum_b = y_prev[1][x] + y_next[1][x] + row[1][x_prev] + row[1][x_next] + z_prev[1][x] + z_next[1][x];
+                    ApplyGrayScott(row[0][x],row[1][x],sum_a,sum_b,timestep,D_a,D_b,k,F,new_a[x],new_b[x]);
+                }
+            }
+            for(int c=0;c<2;c++)
+                swap(previous[c],current[c]);
+        }
+    }
+}
+
+void GrayScottImageRD::UpdateInPlaceRedBlack(int n_steps)
+{
+    // The cells are colored like a checkerboard, and all the red cells (x+y+z even) are updated before all the black
+    // ones, each reading the latest values of its neighbors. The black cells thus see their neighbors' new values, as in
+    // Gauss-Seidel, which suits rules where diffusion dominates. No extra memory is needed. (With wrapping, an odd size
+    // puts cells of the same color side by side across the edge, which is harmless.)
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+
+    const float timestep = this->GetParameterValueByName("timestep");
+    const float D_a = this->GetParameterValueByName("D_a");
+    const float D_b = this->GetParameterValueByName("D_b");
+    const float k = this->GetParameterValueByName("k");
+    const float F = this->GetParameterValueByName("F");
+
+    float *a = static_cast<float*>(this->images[0]->GetScalarPointer());
+    float *b = static_cast<float*>(this->images[1]->GetScalarPointer());
+
+    for(int iStep=0;iStep<n_steps;iStep++)
+    {
+        for(int color=0;color<2;color++)
+        {
+            for(int z=0;z<Z;z++)
+            {
+                const int z_prev = this->wrap ? (z-1+Z)%Z : max(0,z-1);
+                const int z_next = this->wrap ? (z+1)%Z : min(Z-1,z+1);
+                for(int y=0;y<Y;y++)
+                {
+                    const int y_prev = this->wrap ? (y-1+Y)%Y : max(0,y-1);
+                    const int y_next = this->wrap ? (y+1)%Y : min(Y-1,y+1);
+                    for(int x=(color+y+z)%2;x<X;x+=2)
+                    {
+                        const int x_prev = this->wrap ? (x-1+X)%X : max(0,x-1);
+                        const int x_next = this->wrap ? (x+1)%X : min(X-1,x+1);
+                        const float sum_a = *vtk_at(a,x,y_prev,z,X,Y) + *vtk_at(a,x,y_next,z,X,Y) +
+                                            *vtk_at(a,x_prev,y,z,X,Y) + *vtk_at(a,x_next,y,z,X,Y) +
+                                            *vtk_at(a,x,y,z_prev,X,Y) + *vtk_at(a,x,y,z_next,X,Y);
+                        const float sum_b = *vtk_at(b,x,y_prev,z,X,Y) + *vtk_at(b,x,y_next,z,X,Y) +
+                                            *vtk_at(b,x_prev,y,z,X,Y) + *vtk_at(b,x_next,y,z,X,Y) +
+                                            *vtk_at(b,x,y,z_prev,X,Y) + *vtk_at(b,x,y,z_next,X,Y);
+                        float* pa = vtk_at(a,x,y,z,X,Y);
+                        float* pb = vtk_at(b,x,y,z,X,Y);
+                        ApplyGrayScott(*pa,*pb,sum_a,sum_b,timestep,D_a,D_b,k,F,*pa,*pb);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -16,23 +16,7 @@
     along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
 
 // local:
-#include "ImageRD.hpp"
-
-/// Base class for all the inbuilt implementations.
-// (TODO: put in separate files when we have more than one derived class)
-class InbuiltImageRD : public ImageRD
-{
-    public:
-        InbuiltImageRD(int data_type) : ImageRD(data_type) {}
-
-        std::string GetRuleType() const override { return "inbuilt"; }
-
-        bool HasEditableFormula() const override { return false; }
-        bool HasEditableNumberOfChemicals() const override { return false; }
-
-        bool HasEditableWrapOption() const override { return true; }
-        bool HasEditableDataType() const override { return false; }
-};
+#include "InbuiltImageRD.hpp"
 
 /// An inbuilt implementation: n-dimensional Gray-Scott.
 class GrayScottImageRD : public InbuiltImageRD
@@ -42,15 +26,35 @@ class GrayScottImageRD : public InbuiltImageRD
         GrayScottImageRD();
         ~GrayScottImageRD();
 
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        /// The order in which the cells are updated, which decides how much memory is needed.
+        enum class UpdateOrder {
+            DoubleBuffered, ///< read from one copy of the chemicals and write to another (the default)
+            Wavefront,      ///< in place, keeping the old values of the last few rows (2D) or planes (3D): same results
+            RedBlack        ///< in place, updating alternate cells in two passes: Gauss-Seidel ordering, no extra memory
+        };
+        UpdateOrder GetUpdateOrder() const { return this->update_order; }
+        void SetUpdateOrder(UpdateOrder order);
+
+        size_t GetMemorySize() const override;
+
     protected:
 
-        std::vector<vtkSmartPointer<vtkImageData>> buffer_images; // one for each chemical
+        std::vector<vtkSmartPointer<vtkImageData>> buffer_images; // one for each chemical (DoubleBuffered only)
+
+        UpdateOrder update_order;
+        std::vector<float> slice_copies; // the rolling buffer of old values (Wavefront only)
 
     protected:
 
         void AllocateImages(int x,int y,int z,int nc,int data_type) override;
 
         void InternalUpdate(int n_steps) override;
+        void UpdateInPlaceWavefront(int n_steps);
+        void UpdateInPlaceRedBlack(int n_steps);
 
+        void AllocateBuffers();
         void DeleteBuffers();
 };
@@ -25,6 +25,9 @@
 #include <vtkCellData.h>
 #include <vtkMinimalStandardRandomSequence.h>
 
+// STL:
+#include <algorithm>
+
 // ---------------------------------------------------------------------
 
 GrayScottMeshRD::GrayScottMeshRD()
@@ -125,3 +128,13 @@ void GrayScottMeshRD::CopyFromMesh(vtkUnstructuredGrid *mesh2)
 }
 
 // ---------------------------------------------------------------------
+
+double GrayScottMeshRD::EstimateMaximumStableTimestep() const
+{
+    // (the reaction terms are mild next to the diffusion, so they are left out)
+    const double D = std::max(this->GetParameterValueByName("D_a"),this->GetParameterValueByName("D_b"));
+    const double radius = D * this->EstimateLaplacianSpectralRadius();
+    return radius > 0.0 ? 2.0 / radius : 0.0;
+}
+
+// ---------------------------------------------------------------------
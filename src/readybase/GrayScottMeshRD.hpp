@@ -43,6 +43,8 @@ class GrayScottMeshRD : public InbuiltMeshRD
         void SetNumberOfChemicals(int n, bool reallocate_storage = false) override;
         void CopyFromMesh(vtkUnstructuredGrid *mesh2) override;
 
+        double EstimateMaximumStableTimestep() const override;
+
     protected:
 
         void InternalUpdate(int n_steps) override;
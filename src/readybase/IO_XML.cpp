@@ -81,7 +81,7 @@ bool RD_XMLImageReader::ShouldGenerateInitialPatternWhenLoading()
 
 vtkXMLDataElement* RD_XMLImageReader::GetRDElement()
 {
-    this->Update();
+    this->UpdateInformation(); // (parses the XML but doesn't decode the arrays)
     vtkSmartPointer<vtkXMLDataElement> root = this->XMLParser->GetRootElement();
     if(!root) throw runtime_error("No XML found in file");
     vtkSmartPointer<vtkXMLDataElement> rd = root->FindNestedElementWithName("RD");
@@ -89,6 +89,36 @@ vtkXMLDataElement* RD_XMLImageReader::GetRDElement()
     return rd;
 }
 
+// --------------------------------------------------------------------------------
+
+void RD_XMLImageReader::GetPointDataLayout(int dimensions[3],int& n_chemicals,int& data_type)
+{
+    this->UpdateInformation();
+    vtkSmartPointer<vtkXMLDataElement> root = this->XMLParser->GetRootElement();
+    if(!root) throw runtime_error("No XML found in file");
+    vtkSmartPointer<vtkXMLDataElement> image_data = root->FindNestedElementWithName("ImageData");
+    if(!image_data) throw runtime_error("ImageData node not found in file");
+
+    int extent[6];
+    if(image_data->GetVectorAttribute("WholeExtent",6,extent) != 6)
+        throw runtime_error("ImageData has no WholeExtent.");
+    for(int xyz=0;xyz<3;xyz++)
+        dimensions[xyz] = extent[xyz*2+1] - extent[xyz*2] + 1;
+
+    vtkSmartPointer<vtkXMLDataElement> piece = image_data->FindNestedElementWithName("Piece");
+    if(!piece) throw runtime_error("Failed to read image.");
+    vtkSmartPointer<vtkXMLDataElement> point_data = piece->FindNestedElementWithName("PointData");
+    if(!point_data) throw runtime_error("Image has no point data.");
+    if(point_data->GetNumberOfNestedElements() == 0) throw runtime_error("No arrays in image point data.");
+
+    vtkXMLDataElement *first_array = point_data->GetNestedElement(0);
+    if(!first_array->GetWordTypeAttribute("type",data_type))
+        throw runtime_error("Unsupported data type in image point data.");
+    int n_components = 1;
+    first_array->GetScalarAttribute("NumberOfComponents",n_components); // (optional, defaults to 1)
+    n_chemicals = n_components * point_data->GetNumberOfNestedElements();
+}
+
 // ================================================================================
 
 string RD_XMLUnstructuredGridReader::GetType()
@@ -127,7 +157,7 @@ bool RD_XMLUnstructuredGridReader::ShouldGenerateInitialPatternWhenLoading()
 
 vtkXMLDataElement* RD_XMLUnstructuredGridReader::GetRDElement()
 {
-    this->Update();
+    this->UpdateInformation(); // (parses the XML but doesn't decode the arrays)
     vtkSmartPointer<vtkXMLDataElement> root = this->XMLParser->GetRootElement();
     if(!root) throw runtime_error("No XML found in file");
     vtkSmartPointer<vtkXMLDataElement> rd = root->FindNestedElementWithName("RD");
@@ -135,6 +165,27 @@ vtkXMLDataElement* RD_XMLUnstructuredGridReader::GetRDElement()
     return rd;
 }
 
+// --------------------------------------------------------------------------------
+
+int RD_XMLUnstructuredGridReader::GetCellDataType()
+{
+    this->UpdateInformation();
+    vtkSmartPointer<vtkXMLDataElement> root = this->XMLParser->GetRootElement();
+    if(!root) throw runtime_error("No XML found in file");
+    vtkSmartPointer<vtkXMLDataElement> ugrid = root->FindNestedElementWithName("UnstructuredGrid");
+    if(!ugrid) throw runtime_error("UnstructuredGrid node not found in file");
+    vtkSmartPointer<vtkXMLDataElement> piece = ugrid->FindNestedElementWithName("Piece");
+    if(!piece) throw runtime_error("Failed to read unstructured grid.");
+    vtkSmartPointer<vtkXMLDataElement> cell_data = piece->FindNestedElementWithName("CellData");
+    if(!cell_data) throw runtime_error("Unstructured grid has no cell data.");
+    if(cell_data->GetNumberOfNestedElements() == 0) throw runtime_error("No arrays in unstructured grid cell data.");
+
+    int data_type;
+    if(!cell_data->GetNestedElement(0)->GetWordTypeAttribute("type",data_type))
+        throw runtime_error("Unsupported data type in unstructured grid cell data.");
+    return data_type;
+}
+
 // ================================================================================
 
 void RD_XMLImageWriter::SetSystem(const ImageRD* rd_system)
@@ -43,6 +43,9 @@ class RD_XMLImageReader : public vtkXMLImageDataReader
         vtkXMLDataElement* GetRDElement();
         bool ShouldGenerateInitialPatternWhenLoading();
 
+        /// Read the image dimensions, number of chemicals and data type from the XML, without decoding the arrays.
+        void GetPointDataLayout(int dimensions[3],int& n_chemicals,int& data_type);
+
     protected:
 
         RD_XMLImageReader() {}
@@ -64,6 +67,9 @@ class RD_XMLUnstructuredGridReader : public vtkXMLUnstructuredGridReader
         vtkXMLDataElement* GetRDElement();
         bool ShouldGenerateInitialPatternWhenLoading();
 
+        /// Read the data type of the chemicals from the XML, without decoding the arrays.
+        int GetCellDataType();
+
     protected:
 
         RD_XMLUnstructuredGridReader() {}
@@ -17,15 +17,18 @@
 
 // local:
 #include "ImageRD.hpp"
+#include "DisplacedSurfaceFilter.hpp"
 #include "IO_XML.hpp"
 #include "overlays.hpp"
 #include "Properties.hpp"
+#include "resample.hpp"
 #include "scene_items.hpp"
 #include "utils.hpp"
 
 // STL:
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <stdexcept>
 
 // VTK:
@@ -84,7 +87,6 @@
 #include <vtkTextActor.h>
 #include <vtkTextProperty.h>
 #include <vtkTexture.h>
-#include <vtkTextureMapToPlane.h>
 #include <vtkThreshold.h>
 #include <vtkTransform.h>
 #include <vtkTransformFilter.h>
@@ -120,6 +122,7 @@ ImageRD::~ImageRD()
 
 void ImageRD::DeallocateImages()
 {
+    this->FinishReadingBack();
     this->images.clear();
     this->n_chemicals = 0;
 }
@@ -161,6 +164,7 @@ float ImageRD::GetZ() const
 
 vtkImageData* ImageRD::GetImage(int iChemical) const
 {
+    this->FinishReadingBack();
     return this->images[iChemical];
 }
 
@@ -168,6 +172,7 @@ vtkImageData* ImageRD::GetImage(int iChemical) const
 
 void ImageRD::GetImage(vtkImageData *im) const
 {
+    this->FinishReadingBack();
     vtkSmartPointer<vtkImageAppendComponents> iac = vtkSmartPointer<vtkImageAppendComponents>::New();
     for(int i=0;i<this->GetNumberOfChemicals();i++)
     {
@@ -181,6 +186,7 @@ void ImageRD::GetImage(vtkImageData *im) const
 
 void ImageRD::CopyFromImage(vtkImageData* im)
 {
+    this->FinishReadingBack();
     int n_arrays = im->GetPointData()->GetNumberOfArrays();
     int n_components = im->GetNumberOfScalarComponents();
 
@@ -231,6 +237,7 @@ void ImageRD::CopyFromMesh(
     const float value_inside,
     const float value_outside)
 {
+    this->FinishReadingBack();
     // decide the size of the image
     mesh->ComputeBounds();
     double bounds[6];
@@ -276,6 +283,7 @@ void ImageRD::CopyFromMesh(
 
 void ImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
 {
+    this->FinishReadingBack();
     this->DeallocateImages();
     this->n_chemicals = nc;
     this->images.resize(nc);
@@ -301,6 +309,7 @@ void ImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
 
 void ImageRD::GenerateInitialPattern()
 {
+    this->FinishReadingBack();
     if (this->initial_pattern_generator.ShouldZeroFirst()) {
         this->BlankImage();
     }
@@ -346,6 +355,7 @@ void ImageRD::GenerateInitialPattern()
 
 void ImageRD::BlankImage(float value)
 {
+    this->FinishReadingBack();
     for(int iImage=0;iImage<(int)this->images.size();iImage++)
     {
         this->images[iImage]->GetPointData()->GetScalars()->FillComponent(0, value);
@@ -360,10 +370,16 @@ void ImageRD::BlankImage(float value)
 void ImageRD::Update(int n_steps)
 {
     this->undo_stack.clear();
-    this->InternalUpdate(n_steps);
+    {
+        ScopedTimer timer(this->performance_counters.compute_seconds);
+        this->InternalUpdate(n_steps);
+    }
 
     this->timesteps_taken += n_steps;
+    this->performance_counters.steps += n_steps;
+    this->UpdateStatisticsIfDue(n_steps);
 
+    ScopedTimer timer(this->performance_counters.pipeline_seconds);
     for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
         this->images[ic]->Modified();
 
@@ -381,6 +397,8 @@ void ImageRD::Update(int n_steps)
 
 void ImageRD::InitializeRenderPipeline(vtkRenderer* pRenderer,const Properties& render_settings)
 {
+    this->FinishReadingBack();
+    ScopedTimer timer(this->performance_counters.pipeline_seconds);
     this->rearrange_fields_filter = NULL;
     this->assign_attribute_filter = NULL;
 
@@ -677,26 +695,13 @@ void ImageRD::InitializeVTKPipeline_2D(vtkRenderer* pRenderer,const Properties&
 
         if(show_displacement_mapped_surface)
         {
-            vtkSmartPointer<vtkImageDataGeometryFilter> plane = vtkSmartPointer<vtkImageDataGeometryFilter>::New();
-            plane->SetInputData(this->GetImage(iChem));
-            vtkSmartPointer<vtkWarpScalar> warp = vtkSmartPointer<vtkWarpScalar>::New();
-            warp->SetInputConnection(plane->GetOutputPort());
-            warp->SetScaleFactor(scaling);
-            vtkSmartPointer<vtkPolyDataNormals> normals = vtkSmartPointer<vtkPolyDataNormals>::New();
-            normals->SetInputConnection(warp->GetOutputPort());
-            normals->SplittingOff();
+            // (the surface keeps its quads between timesteps, only the heights and normals get rewritten)
+            vtkSmartPointer<DisplacedSurfaceFilter> surface = vtkSmartPointer<DisplacedSurfaceFilter>::New();
+            surface->SetInputData(this->GetImage(iChem));
+            surface->SetScaleFactor(scaling);
+            surface->SetGenerateTextureCoordinates(color_displacement_mapped_surface);
             vtkSmartPointer<vtkPolyDataMapper> mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
-            if(color_displacement_mapped_surface)
-            {
-                vtkSmartPointer<vtkTextureMapToPlane> tmap = vtkSmartPointer<vtkTextureMapToPlane>::New();
-                tmap->SetOrigin(0,0,0);
-                tmap->SetPoint1(this->GetX(),0,0);
-                tmap->SetPoint2(0,this->GetY(),0);
-                tmap->SetInputConnection(normals->GetOutputPort());
-                mapper->SetInputConnection(tmap->GetOutputPort());
-            }
-            else
-                mapper->SetInputConnection(normals->GetOutputPort());
+            mapper->SetInputConnection(surface->GetOutputPort());
             mapper->ScalarVisibilityOff();
             vtkSmartPointer<vtkActor> actor = vtkSmartPointer<vtkActor>::New();
             actor->SetMapper(mapper);
@@ -1248,6 +1253,7 @@ void ImageRD::AddPhasePlot(vtkRenderer* pRenderer,float scaling,float low,float
 
 void ImageRD::SaveStartingPattern()
 {
+    this->FinishReadingBack();
     this->GetImage(this->starting_pattern);
 }
 
@@ -1255,6 +1261,7 @@ void ImageRD::SaveStartingPattern()
 
 void ImageRD::RestoreStartingPattern()
 {
+    this->FinishReadingBack();
     this->CopyFromImage(this->starting_pattern);
     this->timesteps_taken = 0;
 }
@@ -1263,13 +1270,61 @@ void ImageRD::RestoreStartingPattern()
 
 void ImageRD::SetDimensions(int x, int y, int z)
 {
+    this->FinishReadingBack();
     this->AllocateImages(x,y,z,this->GetNumberOfChemicals(),this->data_type);
 }
 
 // ---------------------------------------------------------------------
 
+void ImageRD::Resample(int x, int y, int z)
+{
+    this->FinishReadingBack();
+    if(!this->HasEditableDimensions())
+        throw runtime_error("ImageRD::Resample : the dimensions of this system can't be changed");
+    if(this->data_type != VTK_FLOAT && this->data_type != VTK_DOUBLE)
+        throw runtime_error("ImageRD::Resample : unsupported data type");
+
+    // copy the current values, since changing the dimensions reallocates the images (and for some subclasses
+    // frees the memory their arrays point at, so holding a reference to the arrays is not enough)
+    const int old_dimensions[3] = { static_cast<int>(this->GetX()), static_cast<int>(this->GetY()), static_cast<int>(this->GetZ()) };
+    vector<vtkSmartPointer<vtkDataArray>> old_values;
+    for(int iChem=0;iChem<this->GetNumberOfChemicals();iChem++)
+    {
+        vtkSmartPointer<vtkDataArray> copy = vtkSmartPointer<vtkDataArray>::Take( vtkDataArray::CreateDataArray( this->data_type ) );
+        copy->DeepCopy(this->images[iChem]->GetPointData()->GetScalars());
+        old_values.push_back(copy);
+    }
+
+    this->SetDimensions(x,y,z);
+
+    const int new_dimensions[3] = { x, y, z };
+    vtkSmartPointer<vtkImageData> im = vtkSmartPointer<vtkImageData>::New();
+    im->SetDimensions(x,y,z);
+    for(int iChem=0;iChem<this->GetNumberOfChemicals();iChem++)
+    {
+        vtkSmartPointer<vtkDataArray> da = vtkSmartPointer<vtkDataArray>::Take( vtkDataArray::CreateDataArray( this->data_type ) );
+        da->SetNumberOfTuples(static_cast<vtkIdType>(x) * y * z);
+        da->SetName(GetChemicalName(iChem).c_str());
+        if(this->data_type == VTK_DOUBLE)
+            ResampleGrid(static_cast<const double*>(old_values[iChem]->GetVoidPointer(0)), old_dimensions,
+                static_cast<double*>(da->GetVoidPointer(0)), new_dimensions, this->wrap);
+        else
+            ResampleGrid(static_cast<const float*>(old_values[iChem]->GetVoidPointer(0)), old_dimensions,
+                static_cast<float*>(da->GetVoidPointer(0)), new_dimensions, this->wrap);
+        im->GetPointData()->AddArray(da);
+    }
+    this->CopyFromImage(im);
+
+    // (the old starting pattern is the wrong size now, so resetting returns to the resampled pattern instead)
+    this->SaveStartingPattern();
+    this->is_modified = true;
+}
+
+// ---------------------------------------------------------------------
+
 void ImageRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 {
+    this->FinishReadingBack();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
@@ -1312,6 +1367,7 @@ int ImageRD::GetNumberOfCells() const
 
 void ImageRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) const
 {
+    this->FinishReadingBack();
     bool use_image_interpolation = render_settings.GetProperty("use_image_interpolation").GetBool();
     int iActiveChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
     float contour_level = render_settings.GetProperty("contour_level").GetFloat();
@@ -1321,35 +1377,35 @@ void ImageRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) con
     float vertical_scale_1D = render_settings.GetProperty("vertical_scale_1D").GetFloat();
     float vertical_scale_2D = render_settings.GetProperty("vertical_scale_2D").GetFloat();
 
+    // the filters are kept between calls, so only the ones whose input or settings changed will run again
     switch(this->GetArenaDimensionality())
     {
         case 1:
             {
                 float scaling = vertical_scale_1D / (high-low); // vertical_scale gives the height of the graph in worldspace units
 
-                vtkSmartPointer<vtkImageDataGeometryFilter> plane = vtkSmartPointer<vtkImageDataGeometryFilter>::New();
-                plane->SetInputData(this->GetImage(iActiveChemical));
-                vtkSmartPointer<vtkWarpScalar> warp = vtkSmartPointer<vtkWarpScalar>::New();
-                warp->SetInputConnection(plane->GetOutputPort());
-                warp->SetScaleFactor(-scaling);
-                warp->Update();
-                out->DeepCopy(warp->GetOutput());
+                if(!this->mesh_warp_1D)
+                {
+                    this->mesh_plane_1D = vtkSmartPointer<vtkImageDataGeometryFilter>::New();
+                    this->mesh_warp_1D = vtkSmartPointer<vtkWarpScalar>::New();
+                    this->mesh_warp_1D->SetInputConnection(this->mesh_plane_1D->GetOutputPort());
+                }
+                this->mesh_plane_1D->SetInputData(this->GetImage(iActiveChemical));
+                this->mesh_warp_1D->SetScaleFactor(-scaling);
+                this->mesh_warp_1D->Update();
+                out->ShallowCopy(this->mesh_warp_1D->GetOutput());
             }
             break;
         case 2:
             {
                 float scaling = vertical_scale_2D / (high-low); // vertical_scale gives the height of the graph in worldspace units
 
-                vtkSmartPointer<vtkImageDataGeometryFilter> plane = vtkSmartPointer<vtkImageDataGeometryFilter>::New();
-                plane->SetInputData(this->GetImage(iActiveChemical));
-                vtkSmartPointer<vtkWarpScalar> warp = vtkSmartPointer<vtkWarpScalar>::New();
-                warp->SetInputConnection(plane->GetOutputPort());
-                warp->SetScaleFactor(scaling);
-                vtkSmartPointer<vtkPolyDataNormals> normals = vtkSmartPointer<vtkPolyDataNormals>::New();
-                normals->SetInputConnection(warp->GetOutputPort());
-                normals->SplittingOff();
-                normals->Update();
-                out->DeepCopy(normals->GetOutput());
+                if(!this->mesh_surface_2D)
+                    this->mesh_surface_2D = vtkSmartPointer<DisplacedSurfaceFilter>::New();
+                this->mesh_surface_2D->SetInputData(this->GetImage(iActiveChemical));
+                this->mesh_surface_2D->SetScaleFactor(scaling);
+                this->mesh_surface_2D->Update();
+                out->ShallowCopy(this->mesh_surface_2D->GetOutput());
             }
             break;
         case 3:
@@ -1357,42 +1413,46 @@ void ImageRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) con
             {
                 // turns the 3d grid of sampled values into a polygon mesh for rendering,
                 // by making a surface that contours the volume at a specified level
-                vtkSmartPointer<vtkContourFilter> surface = vtkSmartPointer<vtkContourFilter>::New();
-                surface->SetInputData(this->GetImage(iActiveChemical));
-                surface->SetValue(0, contour_level);
-                surface->Update();
-                out->DeepCopy(surface->GetOutput());
+                if(!this->mesh_contour_3D)
+                    this->mesh_contour_3D = vtkSmartPointer<vtkContourFilter>::New();
+                this->mesh_contour_3D->SetInputData(this->GetImage(iActiveChemical));
+                this->mesh_contour_3D->SetValue(0, contour_level);
+                this->mesh_contour_3D->Update();
+                out->ShallowCopy(this->mesh_contour_3D->GetOutput());
             }
             else
             {
                 // render as cubes, Minecraft-style
+                if(!this->mesh_geometry_3D)
+                {
+                    this->mesh_pad_3D = vtkSmartPointer<vtkImageWrapPad>::New();
+
+                    this->mesh_threshold_3D = vtkSmartPointer<vtkThreshold>::New();
+                    this->mesh_threshold_3D->SetInputConnection(this->mesh_pad_3D->GetOutputPort());
+                    this->mesh_threshold_3D->SetInputArrayToProcess(0, 0, 0,
+                        vtkDataObject::FIELD_ASSOCIATION_CELLS,
+                        vtkDataSetAttributes::SCALARS);
+
+                    vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
+                    transform->Translate (-.5, -.5, -.5);
+                    this->mesh_transform_3D = vtkSmartPointer<vtkTransformFilter>::New();
+                    this->mesh_transform_3D->SetTransform(transform);
+                    this->mesh_transform_3D->SetInputConnection(this->mesh_threshold_3D->GetOutputPort());
+
+                    this->mesh_geometry_3D = vtkSmartPointer<vtkGeometryFilter>::New();
+                    this->mesh_geometry_3D->SetInputConnection(this->mesh_transform_3D->GetOutputPort());
+                }
+
                 vtkImageData *image = this->GetImage(iActiveChemical);
                 int *extent = image->GetExtent();
-
-                vtkSmartPointer<vtkImageWrapPad> pad = vtkSmartPointer<vtkImageWrapPad>::New();
-                pad->SetInputData(image);
-                pad->SetOutputWholeExtent(extent[0],extent[1]+1,extent[2],extent[3]+1,extent[4],extent[5]+1);
-                pad->Update();
-                pad->GetOutput()->GetCellData()->SetScalars(image->GetPointData()->GetScalars()); // a non-pipelined operation
-
-                vtkSmartPointer<vtkThreshold> threshold = vtkSmartPointer<vtkThreshold>::New();
-                threshold->SetInputConnection(pad->GetOutputPort());
-                threshold->SetInputArrayToProcess(0, 0, 0,
-                    vtkDataObject::FIELD_ASSOCIATION_CELLS,
-                    vtkDataSetAttributes::SCALARS);
-                threshold->ThresholdByUpper(contour_level);
-
-                vtkSmartPointer<vtkTransform> transform = vtkSmartPointer<vtkTransform>::New();
-                transform->Translate (-.5, -.5, -.5);
-                vtkSmartPointer<vtkTransformFilter> transformModel = vtkSmartPointer<vtkTransformFilter>::New();
-                transformModel->SetTransform(transform);
-                transformModel->SetInputConnection(threshold->GetOutputPort());
-
-                vtkSmartPointer<vtkGeometryFilter> geometry = vtkSmartPointer<vtkGeometryFilter>::New();
-                geometry->SetInputConnection(transformModel->GetOutputPort());
-                geometry->Update();
-
-                out->DeepCopy(geometry->GetOutput());
+                this->mesh_pad_3D->SetInputData(image);
+                this->mesh_pad_3D->SetOutputWholeExtent(extent[0],extent[1]+1,extent[2],extent[3]+1,extent[4],extent[5]+1);
+                this->mesh_pad_3D->Update();
+                this->mesh_pad_3D->GetOutput()->GetCellData()->SetScalars(image->GetPointData()->GetScalars()); // a non-pipelined operation
+
+                this->mesh_threshold_3D->ThresholdByUpper(contour_level);
+                this->mesh_geometry_3D->Update();
+                out->ShallowCopy(this->mesh_geometry_3D->GetOutput());
             }
             break;
     }
@@ -1402,6 +1462,7 @@ void ImageRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) con
 
 void ImageRD::SaveFile(const char* filename,const Properties& render_settings,bool generate_initial_pattern_when_loading) const
 {
+    this->FinishReadingBack();
     // convert the image to named arrays
     vtkSmartPointer<vtkImageData> im = vtkSmartPointer<vtkImageData>::New();
     im->DeepCopy(this->images.front());
@@ -1429,20 +1490,24 @@ void ImageRD::SaveFile(const char* filename,const Properties& render_settings,bo
 
 void ImageRD::GetAs2DImage(vtkImageData *out,const Properties& render_settings) const
 {
+    this->FinishReadingBack();
     int iActiveChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
 
     // create a lookup table for mapping values to colors
     vtkSmartPointer<vtkScalarsToColors> lut = GetColorMap(render_settings);
 
-    // pass the image through the lookup table
-    vtkSmartPointer<vtkImageMapToColors> image_mapper = vtkSmartPointer<vtkImageMapToColors>::New();
-    image_mapper->SetLookupTable(lut);
-    image_mapper->SetOutputFormatToRGB(); // without this, vtkJPEGWriter writes JPEGs that some software struggles with
+    // pass the image through the lookup table (the filters are kept between calls, e.g. when recording every frame)
+    if(!this->image_mapper)
+    {
+        this->image_mapper = vtkSmartPointer<vtkImageMapToColors>::New();
+        this->image_mapper->SetOutputFormatToRGB(); // without this, vtkJPEGWriter writes JPEGs that some software struggles with
+    }
+    this->image_mapper->SetLookupTable(lut);
     switch(this->GetArenaDimensionality())
     {
         case 1:
         case 2:
-            image_mapper->SetInputData(this->GetImage(iActiveChemical));
+            this->image_mapper->SetInputData(this->GetImage(iActiveChemical));
             break;
         case 3:
             {
@@ -1482,22 +1547,27 @@ void ImageRD::GetAs2DImage(vtkImageData *out,const Properties& render_settings)
                 resliceAxes->SetElement(1, 3, slice_3D_position * this->GetY());
                 resliceAxes->SetElement(2, 3, slice_3D_position * this->GetZ());
 
-                vtkSmartPointer<vtkImageReslice> voi = vtkSmartPointer<vtkImageReslice>::New();
-                voi->SetInputData(this->GetImage(iActiveChemical));
-                voi->SetOutputDimensionality(2);
-                voi->SetResliceAxes(resliceAxes);
-                image_mapper->SetInputConnection(voi->GetOutputPort());
+                if(!this->image_reslice_3D)
+                {
+                    this->image_reslice_3D = vtkSmartPointer<vtkImageReslice>::New();
+                    this->image_reslice_3D->SetOutputDimensionality(2);
+                }
+                this->image_reslice_3D->SetInputData(this->GetImage(iActiveChemical));
+                this->image_reslice_3D->SetResliceAxes(resliceAxes);
+                this->image_mapper->SetInputConnection(this->image_reslice_3D->GetOutputPort());
             };
     }
-    image_mapper->Update();
+    this->image_mapper->Update();
 
-    out->DeepCopy(image_mapper->GetOutput());
+    // (the mapper gives its next output new scalars if we still hold these, so sharing them is safe)
+    out->ShallowCopy(this->image_mapper->GetOutput());
 }
 
 // --------------------------------------------------------------------------------
 
 void ImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 {
+    this->FinishReadingBack();
     if (this->images.front()->GetDimensions()[0] != im->GetDimensions()[0] ||
         this->images.front()->GetDimensions()[1] != im->GetDimensions()[1] ||
         this->images.front()->GetDimensions()[2] != im->GetDimensions()[2] ||
@@ -1515,34 +1585,14 @@ void ImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 
 float ImageRD::GetValue(float x,float y,float z,const Properties& render_settings)
 {
+    this->FinishReadingBack();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
 
     // which chemical was clicked-on?
-    float offset_x = 0.0f;
-    bool show_multiple_chemicals = render_settings.GetProperty("show_multiple_chemicals").GetBool();
-    int iChemical;
-    if(show_multiple_chemicals && this->GetArenaDimensionality()==1)
-    {
-        // detect which chemical was drawn on from the click position
-        const double image_height = X / this->image_ratio1D;
-        iChemical = int(floor((- y + this->image_top1D + image_height)/(image_height*2)));
-        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
-    }
-    else if(show_multiple_chemicals && this->GetArenaDimensionality()>=2)
-    {
-        // detect which chemical was drawn on from the click position
-        const float x_gap = this->x_spacing_proportion * this->GetX();
-        iChemical = int(floor((x + x_gap / 2) / (X + x_gap)));
-        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
-        offset_x = iChemical * (X + x_gap);
-    }
-    else
-    {
-        // only one chemical is shown, must be that one
-        iChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
-    }
+    float offset_x;
+    const int iChemical = this->GetChemicalUnderPoint(x,y,render_settings,offset_x);
 
     int ix,iy,iz;
     ix = int(floor(x-offset_x));
@@ -1559,34 +1609,14 @@ float ImageRD::GetValue(float x,float y,float z,const Properties& render_setting
 
 void ImageRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
 {
+    this->FinishReadingBack();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
 
     // which chemical was clicked-on?
-    float offset_x = 0.0f;
-    bool show_multiple_chemicals = render_settings.GetProperty("show_multiple_chemicals").GetBool();
-    int iChemical;
-    if(show_multiple_chemicals && this->GetArenaDimensionality()==1)
-    {
-        // detect which chemical was drawn on from the click position
-        const double image_height = X / this->image_ratio1D;
-        iChemical = int(floor((- y + this->image_top1D + image_height)/(image_height*2)));
-        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
-    }
-    else if(show_multiple_chemicals && this->GetArenaDimensionality()>=2)
-    {
-        // detect which chemical was drawn on from the click position
-        const float x_gap = this->x_spacing_proportion * this->GetX();
-        iChemical = int(floor((x + x_gap / 2) / (X + x_gap)));
-        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
-        offset_x = iChemical * (X + x_gap);
-    }
-    else
-    {
-        // only one chemical is shown, must be that one
-        iChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
-    }
+    float offset_x;
+    const int iChemical = this->GetChemicalUnderPoint(x,y,render_settings,offset_x);
 
     int ix,iy,iz;
     ix = int(floor(x-offset_x));
@@ -1609,34 +1639,14 @@ void ImageRD::SetValue(float x,float y,float z,float val,const Properties& rende
 
 void ImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
 {
+    this->FinishReadingBack();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
 
     // which chemical was clicked-on?
-    float offset_x = 0.0f;
-    bool show_multiple_chemicals = render_settings.GetProperty("show_multiple_chemicals").GetBool();
-    int iChemical;
-    if(show_multiple_chemicals && this->GetArenaDimensionality()==1)
-    {
-        // detect which chemical was drawn on from the click position
-        const double image_height = X / this->image_ratio1D;
-        iChemical = int(floor((- y + this->image_top1D + image_height)/(image_height*2)));
-        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
-    }
-    else if(show_multiple_chemicals && this->GetArenaDimensionality()>=2)
-    {
-        // detect which chemical was drawn on from the click position
-        const float x_gap = this->x_spacing_proportion * this->GetX();
-        iChemical = int(floor((x + x_gap  / 2) / (X + x_gap)));
-        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
-        offset_x = iChemical * (X + x_gap);
-    }
-    else
-    {
-        // only one chemical is shown, must be that one
-        iChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
-    }
+    float offset_x;
+    const int iChemical = this->GetChemicalUnderPoint(x,y,render_settings,offset_x);
 
     double *dataset_bbox = this->images.front()->GetBounds();
     r *= hypot3(dataset_bbox[1]-dataset_bbox[0],dataset_bbox[3]-dataset_bbox[2],dataset_bbox[5]-dataset_bbox[4]);
@@ -1672,8 +1682,151 @@ void ImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const
 
 // --------------------------------------------------------------------------------
 
+/// The distance from (x,y,z) to the line segment between cells a and b.
+static double DistanceToSegment(int x,int y,int z,const array<int,3>& a,const array<int,3>& b)
+{
+    const double ab[3] = { double(b[0]-a[0]), double(b[1]-a[1]), double(b[2]-a[2]) };
+    const double ap[3] = { double(x-a[0]), double(y-a[1]), double(z-a[2]) };
+    const double length2 = ab[0]*ab[0] + ab[1]*ab[1] + ab[2]*ab[2];
+    double t = 0.0;
+    if(length2 > 0.0)
+        t = max(0.0, min(1.0, (ap[0]*ab[0] + ap[1]*ab[1] + ap[2]*ab[2]) / length2));
+    return hypot3(ap[0]-t*ab[0], ap[1]-t*ab[1], ap[2]-t*ab[2]);
+}
+
+// --------------------------------------------------------------------------------
+
+void ImageRD::SetValuesAlongStroke(const vector<array<float,3>>& points,float r,float val,const Properties& render_settings)
+{
+    this->FinishReadingBack();
+    if(points.empty()) return;
+
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+
+    // the whole stroke is painted onto the chemical it started on
+    float offset_x;
+    const int iChemical = this->GetChemicalUnderPoint(points.front()[0],points.front()[1],render_settings,offset_x);
+    vtkImageData *image = this->GetImage(iChemical);
+
+    double *dataset_bbox = this->images.front()->GetBounds();
+    r *= hypot3(dataset_bbox[1]-dataset_bbox[0],dataset_bbox[3]-dataset_bbox[2],dataset_bbox[5]-dataset_bbox[4]);
+
+    vector<array<int,3>> cells(points.size());
+    for(size_t i=0;i<points.size();i++)
+    {
+        cells[i][0] = min(X-1,max(0,int(floor(points[i][0]-offset_x))));
+        cells[i][1] = min(Y-1,max(0,int(floor(points[i][1]))));
+        cells[i][2] = min(Z-1,max(0,int(floor(points[i][2]))));
+    }
+
+    // paint the capsule around each segment (or the ball around a single point), skipping cells already painted
+    for(size_t i=(cells.size()>1?1:0);i<cells.size();i++)
+    {
+        const array<int,3>& a = cells[i>0?i-1:0];
+        const array<int,3>& b = cells[i];
+        for(int tz=max(0,int(min(a[2],b[2])-r));tz<=min(Z-1,int(max(a[2],b[2])+r));tz++)
+        {
+            for(int ty=max(0,int(min(a[1],b[1])-r));ty<=min(Y-1,int(max(a[1],b[1])+r));ty++)
+            {
+                for(int tx=max(0,int(min(a[0],b[0])-r));tx<=min(X-1,int(max(a[0],b[0])+r));tx++)
+                {
+                    if(DistanceToSegment(tx,ty,tz,a,b)>=r)
+                        continue;
+                    float old_val = image->GetScalarComponentAsFloat(tx,ty,tz,0);
+                    if(old_val==val)
+                        continue;
+                    int ijk[3] = { tx, ty, tz };
+                    vtkIdType iCell = image->ComputeCellId(ijk);
+                    this->StorePaintAction(iChemical,iCell,old_val);
+                    image->SetScalarComponentFromFloat(tx,ty,tz,0,val);
+                }
+            }
+        }
+    }
+    image->Modified();
+    this->is_modified = true;
+}
+
+// --------------------------------------------------------------------------------
+
+bool ImageRD::CanPickAnalytically(const Properties& render_settings) const
+{
+    // 1D and 2D images are drawn as flat strips in the z=0 plane
+    return this->GetArenaDimensionality() <= 2;
+}
+
+// --------------------------------------------------------------------------------
+
+bool ImageRD::PickAnalytically(const double p1[3],const double p2[3],const Properties& render_settings,double p[3]) const
+{
+    if(p1[2]==p2[2]) return false; // (the ray is parallel to the plane)
+    const double t = p1[2] / (p1[2] - p2[2]);
+    if(t<0.0 || t>1.0) return false;
+    p[0] = p1[0] + t * (p2[0] - p1[0]);
+    p[1] = p1[1] + t * (p2[1] - p1[1]);
+    p[2] = 0.0;
+
+    const double X = this->GetX();
+    const double Y = this->GetY();
+    const bool show_multiple_chemicals = render_settings.GetProperty("show_multiple_chemicals").GetBool();
+    const int n_shown = show_multiple_chemicals ? this->GetNumberOfChemicals() : 1;
+    if(this->GetArenaDimensionality()==1)
+    {
+        // the chemicals are drawn as strips one below the other, with a gap between each
+        const double image_height = X / this->image_ratio1D;
+        const double below_top = this->image_top1D - p[1];
+        if(p[0]<0.0 || p[0]>X || below_top<0.0 || below_top>image_height * (2 * n_shown - 1))
+            return false;
+        return fmod(below_top, 2.0 * image_height) <= image_height;
+    }
+    else
+    {
+        // the chemicals are drawn side by side, with a gap between each
+        const double x_gap = this->x_spacing_proportion * X;
+        if(p[1]<0.0 || p[1]>Y || p[0]<0.0 || p[0]>n_shown * (X + x_gap) - x_gap)
+            return false;
+        return fmod(p[0], X + x_gap) <= X;
+    }
+}
+
+// --------------------------------------------------------------------------------
+
+int ImageRD::GetChemicalUnderPoint(float x,float y,const Properties& render_settings,float& offset_x) const
+{
+    const int X = this->GetX();
+    offset_x = 0.0f;
+    bool show_multiple_chemicals = render_settings.GetProperty("show_multiple_chemicals").GetBool();
+    int iChemical;
+    if(show_multiple_chemicals && this->GetArenaDimensionality()==1)
+    {
+        // detect which chemical was drawn on from the click position
+        const double image_height = X / this->image_ratio1D;
+        iChemical = int(floor((- y + this->image_top1D + image_height)/(image_height*2)));
+        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
+    }
+    else if(show_multiple_chemicals && this->GetArenaDimensionality()>=2)
+    {
+        // detect which chemical was drawn on from the click position
+        const float x_gap = this->x_spacing_proportion * this->GetX();
+        iChemical = int(floor((x + x_gap / 2) / (X + x_gap)));
+        iChemical = min(this->GetNumberOfChemicals()-1,max(0,iChemical)); // clamp to allowed range (just in case)
+        offset_x = iChemical * (X + x_gap);
+    }
+    else
+    {
+        // only one chemical is shown, must be that one
+        iChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
+    }
+    return iChemical;
+}
+
+// --------------------------------------------------------------------------------
+
 void ImageRD::FlipPaintAction(PaintAction& cca)
 {
+    this->FinishReadingBack();
     float *pCell = static_cast<float*>(this->GetImage(cca.iChemical)->GetScalarPointer()) + cca.iCell;
     float old_val = *pCell;
     *pCell = cca.val;
@@ -1693,6 +1846,7 @@ size_t ImageRD::GetMemorySize() const
 
 vector<float> ImageRD::GetData(int i_chemical) const
 {
+    this->FinishReadingBack();
     vector<float> values(this->GetX() * this->GetY() * this->GetZ());
     size_t i = 0;
     for(int z = 0; z < this->GetZ(); z++)
@@ -1709,3 +1863,18 @@ vector<float> ImageRD::GetData(int i_chemical) const
 }
 
 // --------------------------------------------------------------------------------
+
+vector<ChemicalStatistics> ImageRD::ComputeStatistics(int n_bins)
+{
+    this->FinishReadingBack();
+    vector<ChemicalStatistics> statistics;
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    {
+        vtkDataArray* scalars = this->images[ic]->GetPointData()->GetScalars();
+        statistics.push_back(ComputeChemicalStatistics(scalars->GetVoidPointer(0), scalars->GetNumberOfTuples(),
+            scalars->GetDataType(), n_bins));
+    }
+    return statistics;
+}
+
+// --------------------------------------------------------------------------------
@@ -26,6 +26,16 @@ class vtkImageData;
 class vtkAssignAttribute;
 class vtkRearrangeFields;
 class vtkUnstructuredGrid;
+class vtkContourFilter;
+class vtkGeometryFilter;
+class vtkImageDataGeometryFilter;
+class vtkImageMapToColors;
+class vtkImageReslice;
+class vtkImageWrapPad;
+class vtkThreshold;
+class vtkTransformFilter;
+class vtkWarpScalar;
+class DisplacedSurfaceFilter;
 
 /// Base class for image-based systems.
 class ImageRD : public AbstractRD
@@ -46,6 +56,7 @@ class ImageRD : public AbstractRD
         float GetY() const override;
         float GetZ() const override;
         void SetDimensions(int x,int y,int z) override;
+        void Resample(int x,int y,int z) override;
         void SetDimensionsAndNumberOfChemicals(int x,int y,int z,int nc);
 
         int GetNumberOfCells() const override;
@@ -79,6 +90,10 @@ class ImageRD : public AbstractRD
         float GetValue(float x,float y,float z,const Properties& render_settings) override;
         void SetValue(float x,float y,float z,float val,const Properties& render_settings) override;
         void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) override;
+        void SetValuesAlongStroke(const std::vector<std::array<float,3>>& points,float r,float val,const Properties& render_settings) override;
+
+        bool CanPickAnalytically(const Properties& render_settings) const override;
+        bool PickAnalytically(const double p1[3],const double p2[3],const Properties& render_settings,double p[3]) const override;
 
         size_t GetMemorySize() const override;
 
@@ -98,6 +113,11 @@ class ImageRD : public AbstractRD
 
         vtkImageData* GetImage(int iChemical) const;
 
+        /// Which chemical is drawn at (x,y), and how far along x its image has been moved to make room for the others.
+        int GetChemicalUnderPoint(float x,float y,const Properties& render_settings,float& offset_x) const;
+
+        std::vector<ChemicalStatistics> ComputeStatistics(int n_bins) override;
+
         void AddPhasePlot(vtkRenderer* pRenderer,float scaling,float low,float high,float posX,float posY,float posZ,
                             int iChemX,int iChemY,int iChemZ) override;
 
@@ -116,6 +136,21 @@ class ImageRD : public AbstractRD
         vtkAssignAttribute *assign_attribute_filter;
         vtkRearrangeFields *rearrange_fields_filter;
 
+    private:
+
+        // filter chains kept between calls to GetAsMesh() and GetAs2DImage() (e.g. when recording every frame),
+        // made when first needed
+        mutable vtkSmartPointer<vtkImageDataGeometryFilter> mesh_plane_1D;
+        mutable vtkSmartPointer<vtkWarpScalar> mesh_warp_1D;
+        mutable vtkSmartPointer<DisplacedSurfaceFilter> mesh_surface_2D;
+        mutable vtkSmartPointer<vtkContourFilter> mesh_contour_3D;
+        mutable vtkSmartPointer<vtkImageWrapPad> mesh_pad_3D;
+        mutable vtkSmartPointer<vtkThreshold> mesh_threshold_3D;
+        mutable vtkSmartPointer<vtkTransformFilter> mesh_transform_3D;
+        mutable vtkSmartPointer<vtkGeometryFilter> mesh_geometry_3D;
+        mutable vtkSmartPointer<vtkImageReslice> image_reslice_3D;
+        mutable vtkSmartPointer<vtkImageMapToColors> image_mapper;
+
     private:
 
         void InitializeVTKPipeline_1D(vtkRenderer* pRenderer,const Properties& render_settings);
@@ -0,0 +1,39 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __INBUILTIMAGERD__
+#define __INBUILTIMAGERD__
+
+// local:
+#include "ImageRD.hpp"
+
+/// Base class for all the inbuilt implementations.
+class InbuiltImageRD : public ImageRD
+{
+    public:
+        InbuiltImageRD(int data_type) : ImageRD(data_type) {}
+
+        std::string GetRuleType() const override { return "inbuilt"; }
+
+        bool HasEditableFormula() const override { return false; }
+        bool HasEditableNumberOfChemicals() const override { return false; }
+
+        bool HasEditableWrapOption() const override { return true; }
+        bool HasEditableDataType() const override { return false; }
+};
+
+#endif
@@ -543,24 +543,42 @@ void MeshGenerators::GetRandomDelaunay2D(int n_points,vtkUnstructuredGrid *mesh,
 
 // ---------------------------------------------------------------------
 
-void MeshGenerators::GetRandomVoronoi2D(int n_points,vtkUnstructuredGrid *mesh,int n_chems,int data_type)
+/// The centroid of a polygon in the z=0 plane.
+static void GetPolygonCentroid(vtkPoints *points,vtkIdList *pt_ids,double centroid[3])
 {
-    // make a 2D mesh of voronoi cells from a point cloud
+    const vtkIdType n = pt_ids->GetNumberOfIds();
+    double twice_area = 0.0, p1[3], p2[3];
+    centroid[0] = centroid[1] = centroid[2] = 0.0;
+    for(vtkIdType i=0;i<n;i++)
+    {
+        points->GetPoint(pt_ids->GetId(i),p1);
+        points->GetPoint(pt_ids->GetId((i+1)%n),p2);
+        const double cross = p1[0]*p2[1] - p2[0]*p1[1];
+        twice_area += cross;
+        centroid[0] += (p1[0]+p2[0]) * cross;
+        centroid[1] += (p1[1]+p2[1]) * cross;
+    }
+    centroid[0] /= 3.0 * twice_area;
+    centroid[1] /= 3.0 * twice_area;
+}
 
+// ---------------------------------------------------------------------
+
+/// Makes the Voronoi cells of a set of points in the square [0,side]x[0,side], leaving out the cells that reach beyond
+/// it: each cell joins the circumcenters of the Delaunay triangles around its point. site_of_cell gets the point
+/// that each cell belongs to.
+static void GetVoronoiCells(vtkPoints *sites,double side,vtkPolyData *voronoi,vector<vtkIdType>& site_of_cell)
+{
     vtkSmartPointer<vtkPolyData> old_poly = vtkSmartPointer<vtkPolyData>::New();
-    double side = sqrt((double)n_points); // spread enough for <pixel> access
     // first make a delaunay triangular mesh
     {
-        vtkSmartPointer<vtkPoints> pts = vtkSmartPointer<vtkPoints>::New();
-        pts->SetNumberOfPoints(n_points);
         vtkSmartPointer<vtkCellArray> cells = vtkSmartPointer<vtkCellArray>::New();
-        for(vtkIdType i=0;i<(vtkIdType)n_points;i++)
+        for(vtkIdType i=0;i<sites->GetNumberOfPoints();i++)
         {
-            pts->SetPoint(i,vtkMath::Random()*side,vtkMath::Random()*side,0);
             cells->InsertNextCell(1);
             cells->InsertCellPoint(i);
         }
-        old_poly->SetPoints(pts);
+        old_poly->SetPoints(sites);
         old_poly->SetPolys(cells);
         vtkSmartPointer<vtkDelaunay2D> del = vtkSmartPointer<vtkDelaunay2D>::New();
         del->SetInputData(old_poly);
@@ -591,6 +609,7 @@ void MeshGenerators::GetRandomVoronoi2D(int n_points,vtkUnstructuredGrid *mesh,i
     // polys: join the circumcenters of each neighboring tri of each point (if >2)
     vtkSmartPointer<vtkCellArray> new_cells = vtkSmartPointer<vtkCellArray>::New();
     vtkSmartPointer<vtkIdList> cell_ids = vtkSmartPointer<vtkIdList>::New();
+    site_of_cell.clear();
     for(vtkIdType i=0;i<old_poly->GetNumberOfPoints();i++)
     {
         old_poly->GetPointCells(i,cell_ids);
@@ -639,12 +658,44 @@ void MeshGenerators::GetRandomVoronoi2D(int n_points,vtkUnstructuredGrid *mesh,i
         if(!is_ok) continue;
         // add the cell to the mesh
         new_cells->InsertNextCell((vtkIdType)pt_ids.size(),&pt_ids[0]);
+        site_of_cell.push_back(i);
     }
+    voronoi->SetPoints(pts);
+    voronoi->SetPolys(new_cells);
+}
+
+// ---------------------------------------------------------------------
+
+void MeshGenerators::GetRandomVoronoi2D(int n_points,vtkUnstructuredGrid *mesh,int n_chems,int data_type,int n_lloyd_iterations)
+{
+    // make a 2D mesh of voronoi cells from a point cloud
+
+    double side = sqrt((double)n_points); // spread enough for <pixel> access
+    vtkSmartPointer<vtkPoints> sites = vtkSmartPointer<vtkPoints>::New();
+    sites->SetNumberOfPoints(n_points);
+    for(vtkIdType i=0;i<(vtkIdType)n_points;i++)
+        sites->SetPoint(i,vtkMath::Random()*side,vtkMath::Random()*side,0);
 
-    // remove unused points (they affect the bounding box)
     vtkSmartPointer<vtkPolyData> poly = vtkSmartPointer<vtkPolyData>::New();
-    poly->SetPoints(pts);
-    poly->SetPolys(new_cells);
+    vector<vtkIdType> site_of_cell;
+    GetVoronoiCells(sites,side,poly,site_of_cell);
+    // Lloyd's algorithm: move each point to the centroid of its cell and start again, so that the cells become more
+    // even in size and shape (the points whose cells reach beyond the square stay where they are)
+    for(int iteration=0;iteration<n_lloyd_iterations;iteration++)
+    {
+        vtkSmartPointer<vtkIdList> pt_ids = vtkSmartPointer<vtkIdList>::New();
+        for(vtkIdType iCell=0;iCell<poly->GetNumberOfPolys();iCell++)
+        {
+            poly->GetCellPoints(iCell,pt_ids);
+            double centroid[3];
+            GetPolygonCentroid(poly->GetPoints(),pt_ids,centroid);
+            sites->SetPoint(site_of_cell[iCell],centroid);
+        }
+        poly = vtkSmartPointer<vtkPolyData>::New();
+        GetVoronoiCells(sites,side,poly,site_of_cell);
+    }
+
+    // remove unused points (they affect the bounding box)
     vtkSmartPointer<vtkCleanPolyData> clean = vtkSmartPointer<vtkCleanPolyData>::New();
     clean->SetInputData(poly);
     clean->PointMergingOff();
@@ -43,8 +43,8 @@ namespace MeshGenerators
     /// Make a 2D Delaunay triangulation from a random set of points
     void GetRandomDelaunay2D(int n_points,vtkUnstructuredGrid *mesh,int n_chems,int data_type);
 
-    /// Make a 2D Voronoi mesh from a random set of points
-    void GetRandomVoronoi2D(int n_points,vtkUnstructuredGrid *mesh,int n_chems,int data_type);
+    /// Make a 2D Voronoi mesh from a random set of points, optionally evened out by some iterations of Lloyd's algorithm
+    void GetRandomVoronoi2D(int n_points,vtkUnstructuredGrid *mesh,int n_chems,int data_type,int n_lloyd_iterations=0);
 
     /// Applies the Delaunay algorithm to scattered points to get a mesh of tetrahedra.
     void GetRandomDelaunay3D(int n_points,vtkUnstructuredGrid* mesh,int n_chems,int data_type);
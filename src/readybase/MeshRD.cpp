@@ -67,6 +67,7 @@
 // STL:
 #include <stdexcept>
 #include <algorithm>
+#include <cmath>
 
 using namespace std;
 
@@ -74,6 +75,7 @@ using namespace std;
 
 MeshRD::MeshRD(int data_type)
     : AbstractRD(data_type)
+    , distance_weighted_neighbors(false)
 {
     this->starting_pattern = vtkSmartPointer<vtkUnstructuredGrid>::New();
     this->mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
@@ -84,9 +86,14 @@ MeshRD::MeshRD(int data_type)
 void MeshRD::Update(int n_steps)
 {
     this->undo_stack.clear();
-    this->InternalUpdate(n_steps);
+    {
+        ScopedTimer timer(this->performance_counters.compute_seconds);
+        this->InternalUpdate(n_steps);
+    }
 
     this->timesteps_taken += n_steps;
+    this->performance_counters.steps += n_steps;
+    this->UpdateStatisticsIfDue(n_steps);
 
     this->mesh->Modified();
 }
@@ -95,6 +102,7 @@ void MeshRD::Update(int n_steps)
 
 void MeshRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 {
+    this->FinishReadingBack();
     if (reallocate_storage)
     {
         this->mesh->GetCellData()->Initialize();
@@ -129,6 +137,7 @@ void MeshRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 
 void MeshRD::SaveFile(const char* filename,const Properties& render_settings,bool generate_initial_pattern_when_loading) const
 {
+    this->FinishReadingBack();
     vtkSmartPointer<RD_XMLUnstructuredGridWriter> iw = vtkSmartPointer<RD_XMLUnstructuredGridWriter>::New();
     iw->SetSystem(this);
     iw->SetRenderSettings(&render_settings);
@@ -144,6 +153,7 @@ void MeshRD::SaveFile(const char* filename,const Properties& render_settings,boo
 
 void MeshRD::GenerateInitialPattern()
 {
+    this->FinishReadingBack();
     if (this->initial_pattern_generator.ShouldZeroFirst()) {
         this->BlankImage();
     }
@@ -192,6 +202,7 @@ void MeshRD::GenerateInitialPattern()
 
 void MeshRD::BlankImage(float value)
 {
+    this->FinishReadingBack();
     for(int iChem=0;iChem<this->n_chemicals;iChem++)
     {
         this->mesh->GetCellData()->GetArray(GetChemicalName(iChem).c_str())->FillComponent(0, value);
@@ -224,8 +235,48 @@ float MeshRD::GetZ() const
 
 // ---------------------------------------------------------------------
 
+void MeshRD::InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update)
+{
+    AbstractRD::InitializeFromXML(rd,warn_to_update);
+
+    // neighbor_weights (optional, the mesh is read afterwards so the neighbors are weighted as it is loaded)
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    string neighbor_weights = "equal";
+    read_optional_attribute(rule,"neighbor_weights",neighbor_weights);
+    if(neighbor_weights != "equal" && neighbor_weights != "distance")
+        throw runtime_error("Unrecognized neighbor_weights");
+    this->distance_weighted_neighbors = (neighbor_weights == "distance");
+}
+
+// ---------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> MeshRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = AbstractRD::GetAsXML(generate_initial_pattern_when_loading);
+    if(this->distance_weighted_neighbors)
+        rd->FindNestedElementWithName("rule")->SetAttribute("neighbor_weights","distance");
+    return rd;
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRD::SetDistanceWeightedNeighbors(bool distance_weighted)
+{
+    this->FinishReadingBack();
+    if(distance_weighted == this->distance_weighted_neighbors) return;
+    this->distance_weighted_neighbors = distance_weighted;
+    if(this->mesh->GetNumberOfCells() == 0) return;
+    // (CopyFromMesh recomputes the neighbors and lets the subclasses know)
+    vtkSmartPointer<vtkUnstructuredGrid> copy = vtkSmartPointer<vtkUnstructuredGrid>::New();
+    copy->DeepCopy(this->mesh);
+    this->CopyFromMesh(copy);
+}
+
+// ---------------------------------------------------------------------
+
 void MeshRD::CopyFromMesh(vtkUnstructuredGrid* mesh2)
 {
+    this->FinishReadingBack();
     this->undo_stack.clear();
     this->mesh->DeepCopy(mesh2);
     this->is_modified = true;
@@ -240,6 +291,8 @@ void MeshRD::CopyFromMesh(vtkUnstructuredGrid* mesh2)
 
 void MeshRD::InitializeRenderPipeline(vtkRenderer* pRenderer,const Properties& render_settings)
 {
+    this->FinishReadingBack();
+    ScopedTimer timer(this->performance_counters.pipeline_seconds);
     float low = render_settings.GetProperty("low").GetFloat();
     float high = render_settings.GetProperty("high").GetFloat();
     bool use_image_interpolation = render_settings.GetProperty("use_image_interpolation").GetBool();
@@ -634,6 +687,7 @@ void MeshRD::AddPhasePlot(vtkRenderer* pRenderer,float scaling,float low,float h
 
 void MeshRD::SaveStartingPattern()
 {
+    this->FinishReadingBack();
     this->starting_pattern->DeepCopy(this->mesh);
 }
 
@@ -641,6 +695,7 @@ void MeshRD::SaveStartingPattern()
 
 void MeshRD::RestoreStartingPattern()
 {
+    this->FinishReadingBack();
     this->CopyFromMesh(this->starting_pattern);
     this->is_modified = true;
     this->timesteps_taken = 0;
@@ -658,6 +713,40 @@ void add_if_new(vector<TNeighbor>& neighbors,TNeighbor neighbor)
     neighbors.push_back(neighbor);
 }
 
+/// The mean of the vertices of each cell, as x,y,z for each.
+static vector<double> GetCellCentres(vtkUnstructuredGrid* grid)
+{
+    vector<double> centres(grid->GetNumberOfCells() * 3, 0.0);
+    vtkSmartPointer<vtkIdList> ptIds = vtkSmartPointer<vtkIdList>::New();
+    for(vtkIdType iCell=0;iCell<grid->GetNumberOfCells();iCell++)
+    {
+        grid->GetCellPoints(iCell,ptIds);
+        for(vtkIdType iPt=0;iPt<ptIds->GetNumberOfIds();iPt++)
+        {
+            const double* p = grid->GetPoint(ptIds->GetId(iPt));
+            for(int xyz=0;xyz<3;xyz++)
+                centres[iCell*3 + xyz] += p[xyz] / ptIds->GetNumberOfIds();
+        }
+    }
+    return centres;
+}
+
+/// Weight each neighbor of iCell by the inverse square of the distance between the cells' centres, as in a
+/// finite-difference Laplacian. (Before normalizing, so these weights are the same in both directions.)
+static void SetDistanceWeights(vtkIdType iCell,const vector<double>& centres,vector<TNeighbor>& neighbors)
+{
+    double max_distance2 = 0.0;
+    for(TNeighbor& neighbor : neighbors)
+    {
+        neighbor.weight = static_cast<float>(vtkMath::Distance2BetweenPoints(&centres[iCell*3], &centres[neighbor.iNeighbor*3]));
+        max_distance2 = max<double>(max_distance2, neighbor.weight);
+    }
+    // (coincident centres, e.g. from degenerate cells, are treated as being a millionth of the way to the furthest)
+    const double min_distance2 = max(1e-12 * max_distance2, 1e-30);
+    for(TNeighbor& neighbor : neighbors)
+        neighbor.weight = static_cast<float>(1.0 / max<double>(neighbor.weight, min_distance2));
+}
+
 bool IsEdgeNeighbor(vtkUnstructuredGrid *grid,vtkIdType iCell1,vtkIdType iCell2)
 {
     vtkSmartPointer<vtkIdList> cellIds = vtkSmartPointer<vtkIdList>::New();
@@ -685,6 +774,10 @@ void MeshRD::ComputeCellNeighbors(TNeighborhood neighborhood_type)
 
     vector<vector<TNeighbor> > cell_neighbors; // the connectivity between cells; for each cell, what cells are its neighbors?
     this->max_neighbors = 0;
+    this->cell_weight_sums.clear();
+    vector<double> centres;
+    if(this->distance_weighted_neighbors)
+        centres = GetCellCentres(this->mesh);
     for(vtkIdType iCell=0;iCell<this->mesh->GetNumberOfCells();iCell++)
     {
         vector<TNeighbor> neighbors;
@@ -761,6 +854,8 @@ void MeshRD::ComputeCellNeighbors(TNeighborhood neighborhood_type)
             break;
             default: throw runtime_error("MeshRD::ComputeCellNeighbors : unsupported neighborhood type");
         }
+        if(this->distance_weighted_neighbors)
+            SetDistanceWeights(iCell,centres,neighbors);
         // normalize the weights for this cell
         float weight_sum=0.0f;
         for(int iN=0;iN<(int)neighbors.size();iN++)
@@ -768,6 +863,7 @@ void MeshRD::ComputeCellNeighbors(TNeighborhood neighborhood_type)
         weight_sum = max(weight_sum,1e-5f); // avoid div0
         for(int iN=0;iN<(int)neighbors.size();iN++)
             neighbors[iN].weight /= weight_sum;
+        this->cell_weight_sums.push_back(weight_sum);
         // store this list of neighbors
         cell_neighbors.push_back(neighbors);
         if((int)neighbors.size()>this->max_neighbors)
@@ -807,43 +903,53 @@ int MeshRD::GetNumberOfCells() const
 
 void MeshRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) const
 {
+    this->FinishReadingBack();
     bool use_image_interpolation = render_settings.GetProperty("use_image_interpolation").GetBool();
     string activeChemical = render_settings.GetProperty("active_chemical").GetChemical();
     float contour_level = render_settings.GetProperty("contour_level").GetFloat();
 
+    // the filters are kept between calls, so only the ones whose input or settings changed will run again
     // 2D meshes will get returned unchanged, meshes with 3D cells will have their contour returned
     if(this->mesh->GetCellType(0)==VTK_POLYGON)
     {
-        vtkSmartPointer<vtkDataSetSurfaceFilter> geom = vtkSmartPointer<vtkDataSetSurfaceFilter>::New();
-        geom->SetInputData(this->mesh);
-        geom->Update();
-        out->DeepCopy(geom->GetOutput());
+        if(!this->mesh_surface)
+            this->mesh_surface = vtkSmartPointer<vtkDataSetSurfaceFilter>::New();
+        this->mesh_surface->SetInputData(this->mesh);
+        this->mesh_surface->Update();
+        out->ShallowCopy(this->mesh_surface->GetOutput());
+        return;
     }
-    else if(use_image_interpolation)
+
+    if(!this->mesh_assign_attribute)
+        this->mesh_assign_attribute = vtkSmartPointer<vtkAssignAttribute>::New();
+    this->mesh_assign_attribute->SetInputData(this->mesh);
+    this->mesh_assign_attribute->Assign(activeChemical.c_str(), vtkDataSetAttributes::SCALARS, vtkAssignAttribute::CELL_DATA);
+
+    if(use_image_interpolation)
     {
-        vtkSmartPointer<vtkAssignAttribute> assign_attribute = vtkSmartPointer<vtkAssignAttribute>::New();
-        assign_attribute->SetInputData(this->mesh);
-        assign_attribute->Assign(activeChemical.c_str(), vtkDataSetAttributes::SCALARS, vtkAssignAttribute::CELL_DATA);
-        vtkSmartPointer<vtkCellDataToPointData> to_point_data = vtkSmartPointer<vtkCellDataToPointData>::New();
-        to_point_data->SetInputConnection(assign_attribute->GetOutputPort());
-        vtkSmartPointer<vtkContourFilter> surface = vtkSmartPointer<vtkContourFilter>::New();
-        surface->SetInputConnection(to_point_data->GetOutputPort());
-        surface->SetValue(0,contour_level);
-        surface->Update();
-        out->DeepCopy(surface->GetOutput());
+        if(!this->mesh_contour)
+        {
+            this->mesh_to_point_data = vtkSmartPointer<vtkCellDataToPointData>::New();
+            this->mesh_to_point_data->SetInputConnection(this->mesh_assign_attribute->GetOutputPort());
+            this->mesh_contour = vtkSmartPointer<vtkContourFilter>::New();
+            this->mesh_contour->SetInputConnection(this->mesh_to_point_data->GetOutputPort());
+        }
+        this->mesh_contour->SetValue(0,contour_level);
+        this->mesh_contour->Update();
+        out->ShallowCopy(this->mesh_contour->GetOutput());
     }
     else
     {
-        vtkSmartPointer<vtkAssignAttribute> assign_attribute = vtkSmartPointer<vtkAssignAttribute>::New();
-        assign_attribute->SetInputData(this->mesh);
-        assign_attribute->Assign(activeChemical.c_str(), vtkDataSetAttributes::SCALARS, vtkAssignAttribute::CELL_DATA);
-        vtkSmartPointer<vtkThreshold> threshold = vtkSmartPointer<vtkThreshold>::New();
-        threshold->SetInputConnection(assign_attribute->GetOutputPort());
-        threshold->ThresholdByUpper(contour_level);
-        vtkSmartPointer<vtkDataSetSurfaceFilter> geom = vtkSmartPointer<vtkDataSetSurfaceFilter>::New();
-        geom->SetInputConnection(threshold->GetOutputPort());
-        geom->Update();
-        out->DeepCopy(geom->GetOutput());
+        if(!this->mesh_threshold_surface)
+        {
+            this->mesh_threshold = vtkSmartPointer<vtkThreshold>::New();
+            this->mesh_threshold->SetInputConnection(this->mesh_assign_attribute->GetOutputPort());
+            this->mesh_threshold_surface = vtkSmartPointer<vtkDataSetSurfaceFilter>::New();
+            this->mesh_threshold_surface->SetInputConnection(this->mesh_threshold->GetOutputPort());
+        }
+        this->mesh_threshold->ThresholdByUpper(contour_level);
+        this->mesh_threshold_surface->Update();
+        out->ShallowCopy(this->mesh_threshold_surface->GetOutput());
     }
 }
 
@@ -879,6 +985,7 @@ void MeshRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 
 float MeshRD::GetValue(float x, float y, float z, const Properties& render_settings)
 {
+    this->FinishReadingBack();
     const double X = this->GetX();
 
     this->CreateCellLocatorIfNeeded();
@@ -916,6 +1023,7 @@ float MeshRD::GetValue(float x, float y, float z, const Properties& render_setti
 
 void MeshRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
 {
+    this->FinishReadingBack();
     const double X = this->GetX();
 
     this->CreateCellLocatorIfNeeded();
@@ -957,6 +1065,7 @@ void MeshRD::SetValue(float x,float y,float z,float val,const Properties& render
 
 void MeshRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
 {
+    this->FinishReadingBack();
     const double X = this->GetX();
     const double Y = this->GetY();
     const double Z = this->GetZ();
@@ -1026,6 +1135,7 @@ void MeshRD::CreateCellLocatorIfNeeded()
 
 void MeshRD::FlipPaintAction(PaintAction& cca)
 {
+    this->FinishReadingBack();
     float old_val = this->mesh->GetCellData()->GetArray(GetChemicalName(cca.iChemical).c_str())->GetComponent( cca.iCell, 0 );
     this->mesh->GetCellData()->GetArray(GetChemicalName(cca.iChemical).c_str())->SetComponent( cca.iCell, 0, cca.val );
     cca.val = old_val;
@@ -1038,11 +1148,73 @@ void MeshRD::FlipPaintAction(PaintAction& cca)
 
 void MeshRD::GetMesh(vtkUnstructuredGrid* mesh) const
 {
+    this->FinishReadingBack();
     mesh->DeepCopy(this->mesh);
 }
 
 // --------------------------------------------------------------------------------
 
+void MeshRD::RelaxMesh(MeshRelaxation::Method method,int n_iterations)
+{
+    this->FinishReadingBack();
+    vtkSmartPointer<vtkUnstructuredGrid> relaxed = vtkSmartPointer<vtkUnstructuredGrid>::New();
+    relaxed->DeepCopy(this->mesh);
+    MeshRelaxation::Relax(relaxed,method,n_iterations);
+    this->CopyFromMesh(relaxed);
+    // (the cells are the same, so the starting pattern keeps its values in the new shapes)
+    if(this->starting_pattern->GetNumberOfPoints() == relaxed->GetNumberOfPoints())
+        this->starting_pattern->GetPoints()->DeepCopy(relaxed->GetPoints());
+}
+
+// --------------------------------------------------------------------------------
+
+double MeshRD::EstimateLaplacianSpectralRadius() const
+{
+    // laplacian_a is 4 times the weighted mean of the neighbors minus the cell. Weighting each cell by the sum of its
+    // weights before they were normalized (its number of neighbors, unless they are weighted by distance) makes this
+    // symmetric, so its eigenvalues are real (and in [-8,0]), and the Rayleigh quotient of power iteration converges
+    // quickly to the one of largest magnitude.
+    const int N_CELLS = this->GetNumberOfCells();
+    vector<double> x(N_CELLS), y(N_CELLS);
+    const vector<float>& cell_weights = this->cell_weight_sums;
+    for(int i=0;i<N_CELLS;i++)
+    {
+        x[i] = ((i * 2654435761u) % 1024) / 1024.0 - 0.5; // (any start with a bit of every mode will do)
+    }
+    double radius = 0.0;
+    const int MAX_ITERATIONS = 1000;
+    for(int iteration=0;iteration<MAX_ITERATIONS;iteration++)
+    {
+        double xy = 0.0, xx = 0.0, yy = 0.0;
+        for(int i=0;i<N_CELLS;i++)
+        {
+            double mean = 0.0;
+            for(int j=0;j<this->max_neighbors;j++)
+            {
+                const int k = i*this->max_neighbors + j;
+                mean += this->cell_neighbor_weights[k] * x[this->cell_neighbor_indices[k]];
+            }
+            y[i] = 4.0 * (mean - x[i]);
+            xy += cell_weights[i] * x[i] * y[i];
+            xx += cell_weights[i] * x[i] * x[i];
+            yy += cell_weights[i] * y[i] * y[i];
+        }
+        if(xx == 0.0 || yy == 0.0)
+            break;
+        const double new_radius = fabs(xy / xx);
+        const bool has_converged = fabs(new_radius - radius) <= 1e-6 * new_radius;
+        radius = new_radius;
+        if(has_converged)
+            break;
+        const double scale = 1.0 / sqrt(yy);
+        for(int i=0;i<N_CELLS;i++)
+            x[i] = y[i] * scale;
+    }
+    return radius;
+}
+
+// --------------------------------------------------------------------------------
+
 size_t MeshRD::GetMemorySize() const
 {
     const size_t DATA_SIZE = this->n_chemicals * this->data_type_size * this->mesh->GetNumberOfCells();
@@ -1055,6 +1227,7 @@ size_t MeshRD::GetMemorySize() const
 
 vector<float> MeshRD::GetData(int i_chemical) const
 {
+    this->FinishReadingBack();
     vtkDataArray* data = this->mesh->GetCellData()->GetArray(GetChemicalName(i_chemical).c_str());
     vector<float> values(this->mesh->GetNumberOfCells());
     for (int i = 0; i < this->mesh->GetNumberOfCells(); i++)
@@ -1065,3 +1238,18 @@ vector<float> MeshRD::GetData(int i_chemical) const
 }
 
 // --------------------------------------------------------------------------------
+
+vector<ChemicalStatistics> MeshRD::ComputeStatistics(int n_bins)
+{
+    this->FinishReadingBack();
+    vector<ChemicalStatistics> statistics;
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    {
+        vtkDataArray* data = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str());
+        statistics.push_back(ComputeChemicalStatistics(data->GetVoidPointer(0), data->GetNumberOfTuples(),
+            data->GetDataType(), n_bins));
+    }
+    return statistics;
+}
+
+// --------------------------------------------------------------------------------
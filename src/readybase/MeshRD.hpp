@@ -20,11 +20,17 @@
 
 // local:
 #include "AbstractRD.hpp"
+#include "MeshRelaxation.hpp"
 
 // VTK:
 #include <vtkType.h>
 class vtkUnstructuredGrid;
 class vtkCellLocator;
+class vtkAssignAttribute;
+class vtkCellDataToPointData;
+class vtkContourFilter;
+class vtkDataSetSurfaceFilter;
+class vtkThreshold;
 
 /// Base class for mesh-based systems.
 class MeshRD : public AbstractRD
@@ -33,6 +39,9 @@ class MeshRD : public AbstractRD
 
         MeshRD(int data_type);
 
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
         void SaveFile(const char* filename,
             const Properties& render_settings,
             bool generate_initial_pattern_when_loading) const override;
@@ -73,12 +82,32 @@ class MeshRD : public AbstractRD
 
         void GetMesh(vtkUnstructuredGrid* mesh) const;
 
+        /// Moves the vertices to even out the cells (see MeshRelaxation.hpp), keeping the chemicals and the neighbors.
+        void RelaxMesh(MeshRelaxation::Method method,int n_iterations);
+
+        /// Are the neighbors of each cell weighted by the inverse square of the distance between the cells' centres,
+        /// instead of equally? (The rule's neighbor_weights attribute, "equal" by default.) Either way the weights of
+        /// each cell are normalized to sum to 1, so neither laplacian_a nor the kernels need to know.
+        bool GetDistanceWeightedNeighbors() const { return this->distance_weighted_neighbors; }
+        void SetDistanceWeightedNeighbors(bool distance_weighted);
+
+        /// The largest magnitude of the eigenvalues of laplacian_a on this mesh, estimated by power iteration. With
+        /// equal weights this depends on how the cells are connected but not on their shapes; with distance weights
+        /// it depends on both.
+        double EstimateLaplacianSpectralRadius() const;
+
+        /// The largest timestep that forward Euler is stable for, from the diffusion rates and the Laplacian's spectral
+        /// radius, or 0 if the rule doesn't say (e.g. for kernel rules).
+        virtual double EstimateMaximumStableTimestep() const { return 0.0; }
+
         size_t GetMemorySize() const override;
 
         std::vector<float> GetData(int i_chemical) const override;
 
     protected: // functions
 
+        std::vector<ChemicalStatistics> ComputeStatistics(int n_bins) override;
+
         void AddPhasePlot(  vtkRenderer* pRenderer,float scaling,float low,float high,float posX,float posY,float posZ,
                             int iChemX,int iChemY,int iChemZ) override;
 
@@ -97,9 +126,21 @@ class MeshRD : public AbstractRD
         int max_neighbors;
         std::vector<int> cell_neighbor_indices;   ///< index of each neighbor of a cell
         std::vector<float> cell_neighbor_weights; ///< diffusion coefficient between each cell and a neighbor
+        std::vector<float> cell_weight_sums;      ///< the sum of each cell's weights before they were normalized
+        bool distance_weighted_neighbors;
 
         vtkSmartPointer<vtkCellLocator> cell_locator; ///< Returns a cell ID when given a 3D location
 
+    private: // variables
+
+        // filter chains kept between calls to GetAsMesh() (e.g. when recording every frame), made when first needed
+        mutable vtkSmartPointer<vtkDataSetSurfaceFilter> mesh_surface;
+        mutable vtkSmartPointer<vtkAssignAttribute> mesh_assign_attribute;
+        mutable vtkSmartPointer<vtkCellDataToPointData> mesh_to_point_data;
+        mutable vtkSmartPointer<vtkContourFilter> mesh_contour;
+        mutable vtkSmartPointer<vtkThreshold> mesh_threshold;
+        mutable vtkSmartPointer<vtkDataSetSurfaceFilter> mesh_threshold_surface;
+
     private: // deliberately not implemented, to prevent use
 
         MeshRD(MeshRD&);
@@ -0,0 +1,246 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "MeshRelaxation.hpp"
+
+// VTK:
+#include <vtkCell.h>
+#include <vtkGenericCell.h>
+#include <vtkIdList.h>
+#include <vtkPoints.h>
+#include <vtkSmartPointer.h>
+#include <vtkUnstructuredGrid.h>
+
+// STL:
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+typedef array<double,3> Vec3;
+
+// ---------------------------------------------------------------------
+
+/// Call task(first,last) for each chunk of [0,n), the chunks after the first on threads of their own.
+template <typename Task>
+static void RunChunks(size_t n,const Task& task)
+{
+    const size_t MIN_CHUNK_SIZE = 4096; // (small meshes aren't worth starting threads for)
+    const size_t n_chunks = max(size_t(1), min(size_t(thread::hardware_concurrency()), n / MIN_CHUNK_SIZE));
+    const size_t CHUNK_SIZE = (n + n_chunks - 1) / n_chunks;
+    vector<thread> threads;
+    for(size_t i=1;i<n_chunks;i++)
+        threads.emplace_back([&task,i,n,CHUNK_SIZE]() { task(min(n, i * CHUNK_SIZE), min(n, (i+1) * CHUNK_SIZE)); });
+    task(0, min(n, CHUNK_SIZE));
+    for(thread& t : threads)
+        t.join();
+}
+
+// ---------------------------------------------------------------------
+
+static Vec3 Subtract(const Vec3& a,const Vec3& b) { return { a[0]-b[0], a[1]-b[1], a[2]-b[2] }; }
+static Vec3 Cross(const Vec3& a,const Vec3& b) { return { a[1]*b[2]-a[2]*b[1], a[2]*b[0]-a[0]*b[2], a[0]*b[1]-a[1]*b[0] }; }
+static double Dot(const Vec3& a,const Vec3& b) { return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; }
+
+// ---------------------------------------------------------------------
+
+/// The area, centroid and normal (scaled by twice the area) of a polygon, from a fan of triangles around its mean vertex.
+static void GetPolygonProperties(const vector<Vec3>& points,const vector<vtkIdType>& cell,
+                                 double& area,Vec3& centroid,Vec3& normal)
+{
+    Vec3 middle = { 0, 0, 0 };
+    for(vtkIdType id : cell)
+        for(int i=0;i<3;i++)
+            middle[i] += points[id][i] / cell.size();
+    normal = { 0, 0, 0 };
+    for(size_t j=0;j<cell.size();j++)
+    {
+        const Vec3 n = Cross(Subtract(points[cell[j]],middle),Subtract(points[cell[(j+1)%cell.size()]],middle));
+        for(int i=0;i<3;i++)
+            normal[i] += n[i];
+    }
+    const double length = sqrt(Dot(normal,normal));
+    area = length / 2.0;
+    centroid = middle;
+    if(length == 0.0)
+        return;
+    // (each triangle's area is signed, so that polygons that aren't convex come out right)
+    Vec3 sum = { 0, 0, 0 };
+    double sum_of_areas = 0.0;
+    for(size_t j=0;j<cell.size();j++)
+    {
+        const Vec3& p1 = points[cell[j]];
+        const Vec3& p2 = points[cell[(j+1)%cell.size()]];
+        const double a = Dot(Cross(Subtract(p1,middle),Subtract(p2,middle)),normal) / length;
+        for(int i=0;i<3;i++)
+            sum[i] += a * (middle[i] + p1[i] + p2[i]) / 3.0;
+        sum_of_areas += a;
+    }
+    if(sum_of_areas != 0.0)
+        for(int i=0;i<3;i++)
+            centroid[i] = sum[i] / sum_of_areas;
+}
+
+// ---------------------------------------------------------------------
+
+/// Reads the points and the point ids of each cell, checking that the cells are all polygons.
+static void GetPolygons(vtkUnstructuredGrid* mesh,vector<Vec3>& points,vector<vector<vtkIdType>>& cells)
+{
+    points.resize(mesh->GetNumberOfPoints());
+    for(vtkIdType i=0;i<mesh->GetNumberOfPoints();i++)
+        mesh->GetPoint(i,points[i].data());
+    cells.resize(mesh->GetNumberOfCells());
+    vtkSmartPointer<vtkGenericCell> cell = vtkSmartPointer<vtkGenericCell>::New();
+    for(vtkIdType iCell=0;iCell<mesh->GetNumberOfCells();iCell++)
+    {
+        mesh->GetCell(iCell,cell);
+        if(cell->GetCellDimension() != 2 || cell->GetCellType() == VTK_PIXEL || cell->GetCellType() == VTK_TRIANGLE_STRIP)
+            throw runtime_error("MeshRelaxation : only meshes of polygons are supported");
+        vtkIdList* ids = cell->GetPointIds();
+        cells[iCell].assign(ids->GetPointer(0),ids->GetPointer(0) + ids->GetNumberOfIds());
+    }
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRelaxation::Relax(vtkUnstructuredGrid* mesh,Method method,int n_iterations)
+{
+    vector<Vec3> points;
+    vector<vector<vtkIdType>> cells;
+    GetPolygons(mesh,points,cells);
+    const size_t N_POINTS = points.size();
+
+    // find the cells of each vertex, the vertices it shares an edge with, and whether it is on the edge of the mesh
+    vector<vector<vtkIdType>> point_cells(N_POINTS), point_neighbors(N_POINTS);
+    vector<pair<vtkIdType,vtkIdType>> edges;
+    for(size_t iCell=0;iCell<cells.size();iCell++)
+    {
+        const vector<vtkIdType>& cell = cells[iCell];
+        for(size_t j=0;j<cell.size();j++)
+        {
+            const vtkIdType a = cell[j];
+            const vtkIdType b = cell[(j+1)%cell.size()];
+            point_cells[a].push_back(iCell);
+            point_neighbors[a].push_back(b);
+            point_neighbors[b].push_back(a);
+            edges.push_back({ min(a,b), max(a,b) });
+        }
+    }
+    for(vector<vtkIdType>& neighbors : point_neighbors)
+    {
+        sort(neighbors.begin(),neighbors.end());
+        neighbors.erase(unique(neighbors.begin(),neighbors.end()),neighbors.end());
+    }
+    // (an edge that only one cell uses is on the boundary)
+    vector<bool> is_fixed(N_POINTS,false);
+    for(size_t iPt=0;iPt<N_POINTS;iPt++)
+        is_fixed[iPt] = point_cells[iPt].empty();
+    sort(edges.begin(),edges.end());
+    for(size_t i=0;i<edges.size();)
+    {
+        size_t j = i + 1;
+        while(j < edges.size() && edges[j] == edges[i])
+            j++;
+        if(j - i == 1)
+            is_fixed[edges[i].first] = is_fixed[edges[i].second] = true;
+        i = j;
+    }
+
+    vector<double> areas(cells.size());
+    vector<Vec3> centroids(cells.size()), normals(cells.size());
+    vector<Vec3> new_points(N_POINTS);
+    for(int iteration=0;iteration<n_iterations;iteration++)
+    {
+        RunChunks(cells.size(),[&](size_t first,size_t last) {
+            for(size_t iCell=first;iCell<last;iCell++)
+                GetPolygonProperties(points,cells[iCell],areas[iCell],centroids[iCell],normals[iCell]);
+        });
+        RunChunks(N_POINTS,[&](size_t first,size_t last) {
+            for(size_t iPt=first;iPt<last;iPt++)
+            {
+                new_points[iPt] = points[iPt];
+                if(is_fixed[iPt])
+                    continue;
+                Vec3 target = { 0, 0, 0 };
+                Vec3 normal = { 0, 0, 0 };
+                double total_weight = 0.0;
+                for(vtkIdType iCell : point_cells[iPt])
+                {
+                    const double weight = method == Method::EqualizeCellSizes ? areas[iCell] : 1.0;
+                    for(int i=0;i<3;i++)
+                    {
+                        if(method != Method::Laplacian)
+                            target[i] += weight * centroids[iCell][i];
+                        normal[i] += normals[iCell][i];
+                    }
+                    total_weight += weight;
+                }
+                if(method == Method::Laplacian)
+                {
+                    for(vtkIdType iNeighbor : point_neighbors[iPt])
+                        for(int i=0;i<3;i++)
+                            target[i] += points[iNeighbor][i];
+                    total_weight = static_cast<double>(point_neighbors[iPt].size());
+                }
+                if(total_weight == 0.0)
+                    continue;
+                // take half a step, and only along the surface
+                Vec3 move;
+                for(int i=0;i<3;i++)
+                    move[i] = 0.5 * (target[i] / total_weight - points[iPt][i]);
+                const double normal_length_squared = Dot(normal,normal);
+                if(normal_length_squared > 0.0)
+                {
+                    const double along_normal = Dot(move,normal) / normal_length_squared;
+                    for(int i=0;i<3;i++)
+                        move[i] -= along_normal * normal[i];
+                }
+                for(int i=0;i<3;i++)
+                    new_points[iPt][i] += move[i];
+            }
+        });
+        points.swap(new_points);
+    }
+
+    for(size_t iPt=0;iPt<N_POINTS;iPt++)
+        mesh->GetPoints()->SetPoint(iPt,points[iPt].data());
+    mesh->GetPoints()->Modified();
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRelaxation::GetCellAreaRange(vtkUnstructuredGrid* mesh,double& smallest,double& largest)
+{
+    vector<Vec3> points;
+    vector<vector<vtkIdType>> cells;
+    GetPolygons(mesh,points,cells);
+    smallest = largest = 0.0;
+    for(size_t iCell=0;iCell<cells.size();iCell++)
+    {
+        double area;
+        Vec3 centroid, normal;
+        GetPolygonProperties(points,cells[iCell],area,centroid,normal);
+        smallest = iCell == 0 ? area : min(smallest,area);
+        largest = iCell == 0 ? area : max(largest,area);
+    }
+}
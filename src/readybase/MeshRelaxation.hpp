@@ -0,0 +1,43 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __MESHRELAXATION__
+#define __MESHRELAXATION__
+
+// VTK:
+class vtkUnstructuredGrid;
+
+/// Methods for improving the shape of the cells of an existing mesh of polygons (e.g. an imported surface), by moving
+/// its vertices. The cells and their neighbors stay the same. Vertices on the edge of an open mesh stay where they are,
+/// and the others move only along the surface, so that curved meshes don't shrink.
+namespace MeshRelaxation
+{
+    enum class Method
+    {
+        Laplacian,          ///< move each vertex towards the mean of the vertices it shares an edge with
+        Centroidal,         ///< move each vertex towards the mean of the centroids of its cells (a Lloyd-like step)
+        EqualizeCellSizes,  ///< as Centroidal but weighted by cell area, so that large cells give up area to small ones
+    };
+
+    /// Moves the vertices, in n_iterations half-steps towards their targets. Runs on several threads.
+    void Relax(vtkUnstructuredGrid* mesh,Method method,int n_iterations);
+
+    /// Finds the areas of the smallest and the largest cells.
+    void GetCellAreaRange(vtkUnstructuredGrid* mesh,double& smallest,double& largest);
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "NativeFormulaImageRD.hpp"
+#include "FormulaOpenCLImageRD.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <stdexcept>
+
+// VTK:
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+NativeFormulaImageRD::NativeFormulaImageRD(int data_type)
+    : ImageRD(data_type)
+{
+    this->block_size[0] = 1;
+    this->block_size[1] = 1;
+    this->block_size[2] = 1;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string NativeFormulaImageRD::AssembleKernel(const string& formula,const vector<Parameter>& parameters,
+                                            int halo[3]) const
+{
+    const int single_cells[3] = { 1, 1, 1 };
+    const size_t local_work_size[3] = { 1, 1, 1 };
+    // (large stencils stay unrolled: on the CPU the loops over weight tables run about three times slower, and the
+    // kernel is only compiled once)
+    return AssembleFormulaKernelSource(formula, this->GetNumberOfChemicals(), this->GetArenaDimensionality(),
+        parameters, this->GetAccuracy(), this->wrap, this->data_type, this->data_type_string,
+        this->data_type_suffix, single_cells, false, local_work_size, halo, false);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string NativeFormulaImageRD::GetKernel() const
+{
+    int halo[3];
+    return this->AssembleKernel(this->formula,this->parameters,halo);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeFormulaImageRD::TestFormula(std::string program_string)
+{
+    int halo[3];
+    NativeKernel test_kernel;
+    test_kernel.Build(this->AssembleKernel(program_string,this->parameters,halo));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeFormulaImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    ImageRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // formula:
+    vtkSmartPointer<vtkXMLDataElement> xml_formula = rule->FindNestedElementWithName("formula");
+    if(!xml_formula) throw runtime_error("formula node not found in file");
+    read_optional_attribute(xml_formula, "block_size_x", this->block_size[0]);
+    read_optional_attribute(xml_formula, "block_size_y", this->block_size[1]);
+    read_optional_attribute(xml_formula, "block_size_z", this->block_size[2]);
+
+    // number_of_chemicals:
+    read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
+
+    // accuracy
+    string accuracy_string;
+    read_optional_attribute(xml_formula, "accuracy", accuracy_string);
+    if (accuracy_string.size() > 0)
+    {
+        const char* accuracy_labels[3] = { "low", "medium", "high" };
+        auto it = find(accuracy_labels, accuracy_labels + 3, accuracy_string);
+        if (it == accuracy_labels + 3)
+        {
+            throw std::runtime_error("unknown accuracy attribute: " + accuracy_string);
+        }
+        this->SetAccuracy(static_cast<AbstractRD::Accuracy>(it - accuracy_labels));
+    }
+
+    string formula = trim_multiline_string(xml_formula->GetCharacterData());
+    this->SetFormula(formula); // (won't throw yet)
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> NativeFormulaImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = ImageRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    // formula
+    vtkSmartPointer<vtkXMLDataElement> formula = vtkSmartPointer<vtkXMLDataElement>::New();
+    formula->SetName("formula");
+    formula->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    formula->SetIntAttribute("block_size_x", this->block_size[0]);
+    formula->SetIntAttribute("block_size_y", this->block_size[1]);
+    formula->SetIntAttribute("block_size_z", this->block_size[2]);
+    const char* accuracy_labels[3] = { "low", "medium", "high" };
+    formula->SetAttribute("accuracy", accuracy_labels[static_cast<int>(this->accuracy)]);
+    string f = this->GetFormula();
+    f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
+    formula->SetCharacterData(f.c_str(), (int)f.length());
+    rule->AddNestedElement(formula);
+
+    return rd;
+}
+
+// ---------------------------------------------------------------------------------------------------------
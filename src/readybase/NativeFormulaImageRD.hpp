@@ -0,0 +1,58 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __NATIVEFORMULAIMAGERD__
+#define __NATIVEFORMULAIMAGERD__
+
+// local:
+#include "ImageRD.hpp"
+#include "NativeKernel.hpp"
+
+/// Base class for formula RD systems that run their kernel on the CPU, with their own storage.
+/** Reads and writes the same formula element as FormulaOpenCLImageRD. Subclasses generate the kernel with whatever
+  * parameters they need (e.g. a finer dx) and step their own storage with it. */
+class NativeFormulaImageRD : public ImageRD
+{
+    public:
+
+        NativeFormulaImageRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        std::string GetRuleType() const override { return "formula"; }
+
+        bool HasEditableFormula() const override { return true; }
+        bool HasEditableDataType() const override { return false; }
+        bool HasEditableWrapOption() const override { return true; }
+        bool HasEditableAccuracyOption() const override { return true; }
+        std::string GetKernel() const override;
+        void TestFormula(std::string program_string) override;
+
+    protected:
+
+        /// The kernel that applies the formula once, with these parameters, to every cell it is given (one cell per
+        /// work-item). Reports how many cells away it reads along each axis.
+        virtual std::string AssembleKernel(const std::string& formula,const std::vector<Parameter>& parameters,
+                                           int halo[3]) const;
+
+    protected:
+
+        int block_size[3]; ///< of the formula, kept for saving
+};
+
+#endif
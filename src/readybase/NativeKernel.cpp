@@ -0,0 +1,873 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "NativeKernel.hpp"
+
+// STL:
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+    #include <cerrno>
+    #include <dlfcn.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+
+namespace
+{
+    /// Compiled before the kernel: makes OpenCL C into valid C++.
+    const char* SHIM = R"SHIM(
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600 // (for ucontext)
+#define _DARWIN_C_SOURCE
+#endif
+#include <ucontext.h>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// address space qualifiers and other keywords
+#define __kernel
+#define kernel
+#define __global
+#define global
+#define __constant const
+#define constant const
+#define __private
+// (the work-items of a group take turns on one thread, so they share its copy; local memory has to be declared in
+// the kernel, it can't be passed in as an argument)
+#define __local static thread_local
+#define local static thread_local
+#define CLK_LOCAL_MEM_FENCE 1
+#define CLK_GLOBAL_MEM_FENCE 2
+#define cl_khr_fp64 1
+#define M_PI_F 3.14159265358979323846f
+#define MAXFLOAT 3.402823466e+38f
+typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef unsigned int uint;
+typedef unsigned long ulong;
+
+// work-item functions
+static thread_local size_t ready_global_id[3];
+static thread_local size_t ready_global_size[3];
+static thread_local size_t ready_local_id[3];
+static thread_local size_t ready_local_size[3];
+inline size_t get_global_id(uint d) { return d < 3 ? ready_global_id[d] : 0; }
+inline size_t get_global_size(uint d) { return d < 3 ? ready_global_size[d] : 1; }
+inline size_t get_local_id(uint d) { return d < 3 ? ready_local_id[d] : 0; }
+inline size_t get_local_size(uint d) { return d < 3 ? ready_local_size[d] : 1; }
+inline size_t get_group_id(uint d) { return get_global_id(d) / get_local_size(d); }
+inline size_t get_num_groups(uint d) { return get_global_size(d) / get_local_size(d); }
+inline size_t get_global_offset(uint) { return 0; }
+inline uint get_work_dim() { return 3; }
+
+// synchronization functions: at a barrier the work-item hands over to the next one in its group (see
+// ready_native_run_groups), and the memory is the same for all of them anyway
+typedef int cl_mem_fence_flags;
+static thread_local ucontext_t* ready_scheduler = nullptr;    ///< (only set while running work-groups)
+static thread_local ucontext_t* ready_current_work_item = nullptr;
+inline void barrier(cl_mem_fence_flags)
+{
+    if(ready_scheduler)
+        swapcontext(ready_current_work_item,ready_scheduler);
+}
+inline void mem_fence(cl_mem_fence_flags) {}
+inline void read_mem_fence(cl_mem_fence_flags) {}
+inline void write_mem_fence(cl_mem_fence_flags) {}
+
+// vector types
+template <typename T,int N> struct ready_vec_data;
+template <typename T> struct ready_vec_data<T,2> { union { struct { T x,y; }; struct { T s0,s1; }; T v[2]; }; };
+template <typename T> struct ready_vec_data<T,3> { union { struct { T x,y,z; }; struct { T s0,s1,s2; }; T v[4]; }; };
+template <typename T> struct ready_vec_data<T,4> { union { struct { T x,y,z,w; }; struct { T s0,s1,s2,s3; }; T v[4]; }; };
+template <typename T,int N> struct ready_vec : ready_vec_data<T,N>
+{
+    typedef T value_type;
+    static const int size = N;
+    ready_vec() = default;
+    ready_vec(T a) { for(int i=0;i<N;i++) this->v[i] = a; } // (scalars widen to vectors, as in OpenCL)
+};
+#define READY_VECTOR_TYPES(T) \
+    typedef ready_vec<T,2> T##2; typedef ready_vec<T,3> T##3; typedef ready_vec<T,4> T##4;
+READY_VECTOR_TYPES(float)
+READY_VECTOR_TYPES(double)
+READY_VECTOR_TYPES(int)
+READY_VECTOR_TYPES(uint)
+
+// (float4)(a,b,c,d) is rewritten as make_float4(a,b,c,d) before compiling
+template <typename V,typename... S> V ready_make(S... s)
+{
+    typedef typename V::value_type T;
+    const T values[] = { T(s)... };
+    const int n = sizeof...(S);
+    V r;
+    for(int i=0;i<V::size;i++) r.v[i] = values[n==1 ? 0 : i];
+    return r;
+}
+#define READY_MAKE_FUNCTIONS(T) \
+    template <typename... S> T##2 make_##T##2(S... s) { return ready_make<T##2>(s...); } \
+    template <typename... S> T##3 make_##T##3(S... s) { return ready_make<T##3>(s...); } \
+    template <typename... S> T##4 make_##T##4(S... s) { return ready_make<T##4>(s...); }
+READY_MAKE_FUNCTIONS(float)
+READY_MAKE_FUNCTIONS(double)
+READY_MAKE_FUNCTIONS(int)
+READY_MAKE_FUNCTIONS(uint)
+
+#define READY_ARITHMETIC(S) typename S,typename = typename std::enable_if<std::is_arithmetic<S>::value>::type
+#define READY_VECTOR_OPERATOR(op) \
+    template <typename T,int N> ready_vec<T,N> operator op(const ready_vec<T,N>& a,const ready_vec<T,N>& b) \
+        { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = a.v[i] op b.v[i]; return r; } \
+    template <typename T,int N,READY_ARITHMETIC(S)> ready_vec<T,N> operator op(const ready_vec<T,N>& a,S b) \
+        { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = a.v[i] op T(b); return r; } \
+    template <typename T,int N,READY_ARITHMETIC(S)> ready_vec<T,N> operator op(S a,const ready_vec<T,N>& b) \
+        { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = T(a) op b.v[i]; return r; } \
+    template <typename T,int N,typename B> ready_vec<T,N>& operator op##=(ready_vec<T,N>& a,const B& b) \
+        { a = a op b; return a; }
+READY_VECTOR_OPERATOR(+)
+READY_VECTOR_OPERATOR(-)
+READY_VECTOR_OPERATOR(*)
+READY_VECTOR_OPERATOR(/)
+template <typename T,int N> ready_vec<T,N> operator-(const ready_vec<T,N>& a) { return T(0) - a; }
+template <typename T,int N> ready_vec<T,N> operator+(const ready_vec<T,N>& a) { return a; }
+
+// built-in math functions
+#define READY_MATH_1(f) \
+    using std::f; \
+    template <typename T,int N> ready_vec<T,N> f(const ready_vec<T,N>& a) \
+        { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = std::f(a.v[i]); return r; }
+#define READY_MATH_2(f) \
+    using std::f; \
+    template <typename T,int N> ready_vec<T,N> f(const ready_vec<T,N>& a,const ready_vec<T,N>& b) \
+        { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = std::f(a.v[i],b.v[i]); return r; } \
+    template <typename T,int N,READY_ARITHMETIC(S)> ready_vec<T,N> f(const ready_vec<T,N>& a,S b) \
+        { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = std::f(a.v[i],T(b)); return r; }
+READY_MATH_1(exp) READY_MATH_1(exp2) READY_MATH_1(log) READY_MATH_1(log2) READY_MATH_1(log10)
+READY_MATH_1(sqrt) READY_MATH_1(cbrt) READY_MATH_1(fabs) READY_MATH_1(floor) READY_MATH_1(ceil)
+READY_MATH_1(round) READY_MATH_1(trunc) READY_MATH_1(sin) READY_MATH_1(cos) READY_MATH_1(tan)
+READY_MATH_1(asin) READY_MATH_1(acos) READY_MATH_1(atan) READY_MATH_1(sinh) READY_MATH_1(cosh)
+READY_MATH_1(tanh)
+READY_MATH_2(pow) READY_MATH_2(fmod) READY_MATH_2(hypot) READY_MATH_2(atan2) READY_MATH_2(fmin)
+READY_MATH_2(fmax)
+using std::abs;
+using std::fma;
+using std::isnan;
+using std::isinf;
+template <typename T> T rsqrt(const T& x) { return T(1) / sqrt(x); }
+template <typename T> T mad(const T& a,const T& b,const T& c) { return a * b + c; }
+#define native_exp exp
+#define native_exp2 exp2
+#define native_log log
+#define native_log2 log2
+#define native_sqrt sqrt
+#define native_rsqrt rsqrt
+#define native_sin sin
+#define native_cos cos
+#define native_tan tan
+#define native_powr pow
+#define half_exp exp
+#define half_log log
+#define half_sqrt sqrt
+#define half_rsqrt rsqrt
+#define half_sin sin
+#define half_cos cos
+#define powr pow
+#define pown pow
+template <typename A,typename B> A native_divide(const A& a,const B& b) { return a / b; }
+template <typename A> A native_recip(const A& a) { return 1 / a; }
+
+// built-in common functions
+template <typename A,typename B,typename = typename std::enable_if<std::is_arithmetic<A>::value && std::is_arithmetic<B>::value>::type>
+typename std::common_type<A,B>::type min(A a,B b) { return b < a ? b : a; }
+template <typename A,typename B,typename = typename std::enable_if<std::is_arithmetic<A>::value && std::is_arithmetic<B>::value>::type>
+typename std::common_type<A,B>::type max(A a,B b) { return a < b ? b : a; }
+template <typename T,int N> ready_vec<T,N> min(const ready_vec<T,N>& a,const ready_vec<T,N>& b)
+    { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = min(a.v[i],b.v[i]); return r; }
+template <typename T,int N> ready_vec<T,N> max(const ready_vec<T,N>& a,const ready_vec<T,N>& b)
+    { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = max(a.v[i],b.v[i]); return r; }
+template <typename T,int N,READY_ARITHMETIC(S)> ready_vec<T,N> min(const ready_vec<T,N>& a,S b) { return min(a,ready_vec<T,N>(T(b))); }
+template <typename T,int N,READY_ARITHMETIC(S)> ready_vec<T,N> max(const ready_vec<T,N>& a,S b) { return max(a,ready_vec<T,N>(T(b))); }
+template <typename X,typename L,typename H> X clamp(const X& x,const L& lo,const H& hi) { return min(max(x,lo),hi); }
+template <typename T> T ready_sign(T x) { return x > 0 ? T(1) : (x < 0 ? T(-1) : T(0)); }
+inline float sign(float x) { return ready_sign(x); }
+inline double sign(double x) { return ready_sign(x); }
+template <typename T,int N> ready_vec<T,N> sign(const ready_vec<T,N>& a)
+    { ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = ready_sign(a.v[i]); return r; }
+template <typename E,typename X> X step(const E& edge,const X& x) { return x < edge ? X(0) : X(1); }
+template <typename E,typename X> X smoothstep(const E& e0,const E& e1,const X& x)
+    { const X t = clamp((x - e0) / (e1 - e0),0,1); return t * t * (3 - 2 * t); }
+template <typename A,typename T> A mix(const A& a,const A& b,const T& t) { return a + (b - a) * t; }
+
+// built-in relational functions (on vectors, true is -1 in each component)
+#define READY_RELATION(f,op) \
+    template <typename A,typename B,typename = typename std::enable_if<std::is_arithmetic<A>::value && std::is_arithmetic<B>::value>::type> \
+    int f(A a,B b) { return a op b; } \
+    template <typename T,int N> ready_vec<int,N> f(const ready_vec<T,N>& a,const ready_vec<T,N>& b) \
+        { ready_vec<int,N> r; for(int i=0;i<N;i++) r.v[i] = a.v[i] op b.v[i] ? -1 : 0; return r; } \
+    template <typename T,int N,READY_ARITHMETIC(S)> ready_vec<int,N> f(const ready_vec<T,N>& a,S b) { return f(a,ready_vec<T,N>(T(b))); }
+READY_RELATION(isless,<)
+READY_RELATION(islessequal,<=)
+READY_RELATION(isgreater,>)
+READY_RELATION(isgreaterequal,>=)
+READY_RELATION(isequal,==)
+READY_RELATION(isnotequal,!=)
+template <typename A,typename B,typename C> A select(const A& a,const B& b,const C& c) { return c ? A(b) : a; }
+template <typename T,int N,typename B,typename C> ready_vec<T,N> select(const ready_vec<T,N>& a,const B& b,const ready_vec<C,N>& c)
+    { const ready_vec<T,N> bv(b); ready_vec<T,N> r; for(int i=0;i<N;i++) r.v[i] = c.v[i] < 0 ? bv.v[i] : a.v[i]; return r; }
+
+// built-in geometric functions
+template <typename T,int N> T dot(const ready_vec<T,N>& a,const ready_vec<T,N>& b)
+    { T s = 0; for(int i=0;i<N;i++) s += a.v[i] * b.v[i]; return s; }
+template <typename T,int N> T length(const ready_vec<T,N>& a) { return std::sqrt(dot(a,a)); }
+inline float length(float x) { return std::fabs(x); }
+inline double length(double x) { return std::fabs(x); }
+template <typename V> auto distance(const V& a,const V& b) -> decltype(length(a)) { return length(a - b); }
+template <typename V> V normalize(const V& a) { return a / length(a); }
+#define fast_length length
+#define fast_distance distance
+#define fast_normalize normalize
+
+// conversions
+template <typename T> int convert_int_sat_rtz(T x)
+{
+    if(isnan(x)) return 0;
+    return (int)std::fmax((double)INT_MIN,std::fmin((double)INT_MAX,std::trunc((double)x)));
+}
+#define convert_int_sat convert_int_sat_rtz
+#define convert_int_rtz(x) ((int)(x))
+#define convert_int(x) ((int)(x))
+#define convert_float(x) ((float)(x))
+#define convert_double(x) ((double)(x))
+inline int as_int(float x) { int i; std::memcpy(&i,&x,sizeof(i)); return i; }
+inline float as_float(int i) { float x; std::memcpy(&x,&i,sizeof(x)); return x; }
+
+// ------------------------------------- the kernel: ---------------------------------------
+#line 1 "kernel"
+)SHIM";
+
+    /// Compiled after the kernel: the entry points that run a range of work-items, or of work-groups.
+    const char* ENTRY_POINT = R"ENTRY(
+// -----------------------------------------------------------------------------------------
+
+template <typename A> A ready_arg(void* p)
+{
+    if constexpr (std::is_pointer<A>::value) return static_cast<A>(p); // a buffer
+    else return *static_cast<A*>(p);                                     // a scalar argument
+}
+
+template <typename... A,size_t... I> void ready_call(void (*f)(A...),void** args,std::index_sequence<I...>)
+{
+    f(ready_arg<A>(args[I])...);
+}
+
+template <typename... A> void ready_call(void (*f)(A...),void** args)
+{
+    ready_call(f,args,std::index_sequence_for<A...>());
+}
+
+extern "C"
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+void ready_native_run(void** args,const size_t* global_range,size_t first,size_t last)
+{
+    for(int d=0;d<3;d++)
+    {
+        ready_global_size[d] = global_range[d];
+        ready_local_size[d] = 1;
+        ready_local_id[d] = 0;
+    }
+    const size_t X = global_range[0];
+    const size_t Y = global_range[1];
+    size_t x = first % X;
+    size_t y = (first / X) % Y;
+    size_t z = first / (X * Y);
+    for(size_t i=first;i<last;i++)
+    {
+        ready_global_id[0] = x;
+        ready_global_id[1] = y;
+        ready_global_id[2] = z;
+        ready_call(rd_compute,args);
+        if(++x == X) { x = 0; if(++y == Y) { y = 0; ++z; } }
+    }
+}
+
+static thread_local void** ready_args;
+static thread_local bool ready_work_item_finished;
+
+static void ready_run_work_item()
+{
+    ready_call(rd_compute,ready_args);
+    ready_work_item_finished = true;
+} // (then back to the scheduler, through uc_link)
+
+extern "C"
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+void ready_native_run_groups(void** args,const size_t* global_range,const size_t* local_range,size_t first,size_t last)
+{
+    // each work-item gets a stack of its own, so that it can be left at a barrier while the others in its group
+    // catch up: they take turns, each running until it reaches the next barrier or finishes
+        const size_t N_ITEMS = local_range[0] * local_range[1] * local_range[2];
+    const size_t STACK_SIZE = 128 * 1024;
+    std::vector<ucontext_t> work_items(N_ITEMS);
+    std::vector<std::unique_ptr<char[]>> stacks(N_ITEMS);
+    std::vector<bool> finished(N_ITEMS);
+    ucontext_t scheduler;
+
+    for(int d=0;d<3;d++)
+    {
+        ready_global_size[d] = global_range[d];
+        ready_local_size[d] = local_range[d];
+    }
+    const size_t GX = global_range[0] / local_range[0];
+    const size_t GY = global_range[1] / local_range[1];
+    ready_args = args;
+    ready_scheduler = &scheduler;
+    for(size_t g=first;g<last;g++)
+    {
+        const size_t group[3] = { g % GX, (g / GX) % GY, g / (GX * GY) };
+        for(size_t i=0;i<N_ITEMS;i++)
+        {
+            if(!stacks[i])
+                stacks[i].reset(new char[STACK_SIZE]);
+            getcontext(&work_items[i]);
+            work_items[i].uc_stack.ss_sp = stacks[i].get();
+            work_items[i].uc_stack.ss_size = STACK_SIZE;
+            work_items[i].uc_link = &scheduler;
+            makecontext(&work_items[i],ready_run_work_item,0);
+            finished[i] = false;
+        }
+        size_t n_running = N_ITEMS;
+        while(n_running > 0)
+        {
+            for(size_t i=0;i<N_ITEMS;i++)
+            {
+                if(finished[i]) continue;
+                ready_local_id[0] = i % local_range[0];
+                ready_local_id[1] = (i / local_range[0]) % local_range[1];
+                ready_local_id[2] = i / (local_range[0] * local_range[1]);
+                for(int d=0;d<3;d++)
+                    ready_global_id[d] = group[d] * local_range[d] + ready_local_id[d];
+                ready_current_work_item = &work_items[i];
+                ready_work_item_finished = false;
+                swapcontext(&scheduler,&work_items[i]);
+                if(ready_work_item_finished)
+                {
+                    finished[i] = true;
+                    n_running--;
+                }
+            }
+        }
+    }
+    ready_scheduler = nullptr;
+}
+)ENTRY";
+}
+
+// ---------------------------------------------------------------------------
+
+static bool native_kernels_allowed = false; ///< see NativeKernel::SetAllowed()
+
+// ---------------------------------------------------------------------------
+
+static string GetCompiler()
+{
+    const char* compiler = getenv("READY_CXX");
+    return compiler ? compiler : "c++";
+}
+
+// ---------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+/// Runs a program directly (not through a shell), with its output going to a file. Returns its exit status, or -1.
+static int RunProgram(const vector<string>& args,const string& output_path)
+{
+    // (everything the child needs is made before forking, since only async-signal-safe calls are allowed after)
+    vector<char*> argv;
+    for(const string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(NULL);
+    const char* output = output_path.c_str();
+
+    const pid_t pid = fork();
+    if(pid < 0)
+        return -1;
+    if(pid == 0)
+    {
+        const int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(fd >= 0)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int status;
+    while(waitpid(pid, &status, 0) < 0)
+        if(errno != EINTR)
+            return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// ---------------------------------------------------------------------------
+
+/// The folder for the compiled kernels: $XDG_CACHE_HOME/ready, else ~/.cache/ready. Made if needed, and checked that
+/// only this user can get at it, since the libraries in it get loaded.
+static string GetCacheFolder()
+{
+    const char* cache_home = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    string parent;
+    if(cache_home && cache_home[0] == '/')
+        parent = cache_home;
+    else if(home && home[0] == '/')
+        parent = string(home) + "/.cache";
+    else
+        throw runtime_error("NativeKernel::Build : nowhere to keep the compiled kernels: set HOME or XDG_CACHE_HOME");
+    mkdir(parent.c_str(), 0700); // (fine if it exists already)
+    const string folder = parent + "/ready";
+    mkdir(folder.c_str(), 0700);
+
+    struct stat info;
+    if(lstat(folder.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 077) != 0)
+        throw runtime_error("NativeKernel::Build : " + folder + " must be a folder that only you can read and write");
+    return folder;
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+
+static string ReadFile(const string& path)
+{
+    ostringstream contents;
+    ifstream file(path, ios::binary);
+    if(file)
+        contents << file.rdbuf();
+    return contents.str();
+}
+
+// ---------------------------------------------------------------------------
+
+/// Throws if the kernel has a preprocessor directive other than the few that OpenCL kernels need: conditionals,
+/// #error, #pragma OPENCL EXTENSION, and #define of a number. (Anything else, like #include, could reach outside
+/// the kernel at compile time.)
+static void CheckDirectives(const string& source)
+{
+    // join continued lines and blank out the comments, so that what's left is what the preprocessor will see
+    string code;
+    code.reserve(source.size());
+    for(size_t i=0;i<source.size();i++)
+    {
+        if(source.compare(i, 2, "\\\n") == 0)
+            i++;
+        else if(source.compare(i, 2, "//") == 0)
+        {
+            while(i < source.size() && source[i] != '\n') i++;
+            code += '\n';
+        }
+        else if(source.compare(i, 2, "/*") == 0)
+        {
+            const size_t end = source.find("*/", i+2);
+            for(size_t j=i;j<min(end,source.size());j++)
+                if(source[j] == '\n') code += '\n';
+            code += ' ';
+            i = end == string::npos ? source.size() : end + 1;
+        }
+        else
+            code += source[i];
+    }
+    if(code.find("_Pragma") != string::npos)
+        throw runtime_error("NativeKernel::Build : _Pragma is not allowed in kernels that run without OpenCL");
+
+    static const regex directive("^\\s*(#|%:)\\s*(.*)$");
+    static const regex allowed("(if|ifdef|ifndef|elif|else|endif|error)(\\s.*)?"
+                               "|pragma\\s+OPENCL\\s+EXTENSION\\s+\\w+\\s*:\\s*(enable|disable)\\s*"
+                               "|define\\s+\\w+\\s+\\(?\\s*[-+]?[0-9][0-9.eE+-]*[fFlLuU]*\\s*\\)?\\s*"
+                               "|undef\\s+\\w+\\s*");
+    istringstream lines(code);
+    string line;
+    smatch match;
+    while(getline(lines, line))
+    {
+        if(!regex_match(line, match, directive))
+            continue;
+        const string body = match[2].str();
+        if(body.empty())
+            continue; // (a lone # does nothing)
+        if(!regex_match(body, allowed) || body.find("__has_include") != string::npos)
+            throw runtime_error("NativeKernel::Build : this preprocessor directive is not allowed in kernels that run "
+                                "without OpenCL:\n" + line);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+static string TranslateToCpp(const string& opencl_source)
+{
+    // vector literals like (float4)(a,b,c,d) would be a cast of a comma expression in C++
+    static const regex vector_literal("\\(\\s*(float|double|int|uint)([234])\\s*\\)\\s*\\(");
+    return regex_replace(opencl_source, vector_literal, "make_$1$2(");
+}
+
+// ---------------------------------------------------------------------------
+
+/// The local range as kept with a kernel: empty if its work-items run one at a time.
+static vector<size_t> ToLocalRange(const size_t local_range[3])
+{
+    return local_range ? vector<size_t>(local_range, local_range + 3) : vector<size_t>();
+}
+
+// ---------------------------------------------------------------------------
+
+NativeKernel::NativeKernel()
+    : library(NULL)
+    , entry_point(NULL)
+    , group_entry_point(NULL)
+    , counters(NULL)
+    , n_chunks(0)
+    , next_chunk(0)
+    , chunks_done(0)
+    , generation(0)
+    , stopping(false)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+NativeKernel::~NativeKernel()
+{
+    {
+        lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->work_available.notify_all();
+    for(thread& worker : this->workers)
+        worker.join();
+#ifndef _WIN32
+    if(this->library)
+        dlclose(this->library);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::SetAllowed(bool allowed)
+{
+    native_kernels_allowed = allowed;
+}
+
+// ---------------------------------------------------------------------------
+
+bool NativeKernel::IsAllowed()
+{
+    const char* env = getenv("READY_ALLOW_NATIVE_KERNELS");
+    return native_kernels_allowed || (env && string(env) == "1");
+}
+
+// ---------------------------------------------------------------------------
+
+bool NativeKernel::IsSupported()
+{
+#ifdef _WIN32
+    return false;
+#else
+    if(!IsAllowed())
+        return false;
+    static const bool has_compiler = RunProgram({ GetCompiler(), "--version" }, "/dev/null") == 0;
+    return has_compiler;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+string NativeKernel::GetSetupHints()
+{
+#ifdef _WIN32
+    return "Running rules without OpenCL is not supported on this platform.";
+#else
+    if(!IsAllowed())
+        return "Running rules without OpenCL compiles them as native code, which could harm your computer if the file "
+               "isn't from someone you trust, so it is turned off. To turn it on: in Ready tick the option in "
+               "Preferences > Edit, with rdy use --allow-native-kernels, or set READY_ALLOW_NATIVE_KERNELS=1.";
+    return "Running rules without OpenCL needs a C++ compiler: install one, or set READY_CXX.";
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::Build(const string& opencl_source,const size_t local_range[3])
+{
+    this->StartBuilding(opencl_source, local_range);
+    this->FinishBuilding();
+}
+
+// ---------------------------------------------------------------------------
+
+bool NativeKernel::IsBuiltFrom(const string& opencl_source,const size_t local_range[3]) const
+{
+    return this->entry_point && opencl_source == this->built_source
+        && ToLocalRange(local_range) == this->built_local_range;
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::StartBuilding(const string& opencl_source,const size_t local_range[3])
+{
+    const vector<size_t> range = ToLocalRange(local_range);
+    if(this->pending_build.valid())
+    {
+        if(opencl_source == this->pending_source && range == this->pending_local_range) return;
+        try
+        {
+            this->pending_build.get();
+        }
+        catch(...) {} // a failed build is of no interest if we don't want the result
+    }
+    if(this->IsBuiltFrom(opencl_source, local_range)) return;
+#ifdef _WIN32
+    throw runtime_error("NativeKernel::Build : running kernels without OpenCL is not supported on this platform");
+#else
+    if(!IsAllowed())
+        throw runtime_error("NativeKernel::Build : " + GetSetupHints());
+    CheckDirectives(opencl_source);
+
+    // the compiler runs on another thread, so the caller can carry on (e.g. running the old kernel) while it works
+    this->pending_build = async(launch::async, &NativeKernel::Compile, opencl_source);
+    this->pending_source = opencl_source;
+    this->pending_local_range = range;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+bool NativeKernel::IsBuilding() const
+{
+    return this->pending_build.valid();
+}
+
+// ---------------------------------------------------------------------------
+
+bool NativeKernel::IsBuildReady() const
+{
+    return this->pending_build.valid() && this->pending_build.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::FinishBuilding()
+{
+    if(!this->pending_build.valid()) return;
+#ifndef _WIN32
+    const CompiledKernel compiled = this->pending_build.get(); // rethrows any build error
+
+    void* new_library = dlopen(compiled.library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!new_library)
+        throw runtime_error(string("NativeKernel::Build : failed to load the kernel: ") + dlerror());
+    EntryPoint new_entry_point = reinterpret_cast<EntryPoint>(dlsym(new_library, "ready_native_run"));
+    GroupEntryPoint new_group_entry_point = reinterpret_cast<GroupEntryPoint>(dlsym(new_library, "ready_native_run_groups"));
+    if(!new_entry_point || !new_group_entry_point)
+    {
+        dlclose(new_library);
+        throw runtime_error("NativeKernel::Build : kernel entry point not found");
+    }
+    if(this->library)
+        dlclose(this->library);
+    this->library = new_library;
+    this->entry_point = new_entry_point;
+    this->group_entry_point = new_group_entry_point;
+    this->built_source = this->pending_source;
+    this->built_local_range = this->pending_local_range;
+    if(this->counters)
+        this->counters->build_seconds += compiled.build_seconds;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+NativeKernel::CompiledKernel NativeKernel::Compile(const string& opencl_source)
+{
+    CompiledKernel compiled = { "", 0.0 };
+#ifndef _WIN32
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // the compiled kernels are cached on disk, named by the hash of their source, with the source kept beside each
+    // one so that it can be checked before loading (in case two sources have the same hash)
+    const string source = string(SHIM) + TranslateToCpp(opencl_source) + ENTRY_POINT;
+    ostringstream name;
+    name << GetCacheFolder() << "/kernel_" << hex << hash<string>()(source);
+    compiled.library_path = name.str() + ".so";
+    const string source_path = name.str() + ".cpp";
+    if(!ifstream(compiled.library_path).good() || ReadFile(source_path) != source)
+    {
+        // (built under names of our own then renamed, since renaming is atomic, in case another build is making
+        // the same kernel)
+        static atomic<unsigned int> n_builds(0);
+        ostringstream temp;
+        temp << name.str() << "." << dec << getpid() << "." << n_builds++;
+        const string temp_source_path = temp.str() + ".cpp";
+        const string temp_library_path = temp.str() + ".so";
+        const string log_path = temp.str() + ".log";
+        if(!(ofstream(temp_source_path, ios::binary) << source))
+            throw runtime_error("NativeKernel::Build : failed to write " + temp_source_path);
+
+        vector<string> args = { GetCompiler(), "-std=c++17", "-shared", "-fPIC", "-w" };
+        const char* flags = getenv("READY_CXXFLAGS");
+        istringstream flag_list(flags ? flags : "-O3 -march=native");
+        string flag;
+        while(flag_list >> flag)
+            args.push_back(flag);
+        args.insert(args.end(), { "-o", temp_library_path, temp_source_path });
+        const int status = RunProgram(args, log_path);
+        const string log = ReadFile(log_path);
+        remove(log_path.c_str());
+        if(status != 0)
+        {
+            remove(temp_source_path.c_str());
+            remove(temp_library_path.c_str());
+            throw runtime_error("NativeKernel::Build : failed to compile the kernel:\n" + log);
+        }
+        if(rename(temp_library_path.c_str(), compiled.library_path.c_str()) != 0
+            || rename(temp_source_path.c_str(), source_path.c_str()) != 0)
+            throw runtime_error("NativeKernel::Build : failed to write " + compiled.library_path);
+    }
+    compiled.build_seconds = ScopedTimer::SecondsSince(start);
+#endif
+    return compiled;
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::Run(const vector<void*>& args,const size_t global_range[3])
+{
+    if(!this->entry_point)
+        throw runtime_error("NativeKernel::Run : no kernel has been built");
+    if(!this->CanRun(global_range))
+        throw runtime_error("NativeKernel::Run : the global range is not a multiple of the local range");
+
+    if(this->workers.empty())
+    {
+        // (the calling thread does its share too)
+        const unsigned int n_threads = max(1u, thread::hardware_concurrency());
+        for(unsigned int i=1;i<n_threads;i++)
+            this->workers.emplace_back(&NativeKernel::WorkerLoop, this);
+    }
+
+    // divide the work-items (or the work-groups, which each run on one thread) into a few chunks per thread, to
+    // balance the load
+    const bool in_groups = !this->built_local_range.empty();
+    const size_t* local_range = in_groups ? this->built_local_range.data() : NULL;
+    size_t N = 1;
+    for(int d=0;d<3;d++)
+        N *= in_groups ? global_range[d] / local_range[d] : global_range[d];
+    const size_t N_CHUNKS = min(N, (this->workers.size() + 1) * 4);
+    if(N_CHUNKS == 0) return;
+    const size_t CHUNK_SIZE = (N + N_CHUNKS - 1) / N_CHUNKS;
+    vector<void*> arguments(args);
+    const EntryPoint entry_point = this->entry_point;
+    const GroupEntryPoint group_entry_point = this->group_entry_point;
+
+    unique_lock<std::mutex> lock(this->mutex);
+    this->task = [&](size_t chunk) {
+        const size_t first = chunk * CHUNK_SIZE;
+        const size_t last = min(N, first + CHUNK_SIZE);
+        if(first < last && in_groups)
+            group_entry_point(arguments.data(), global_range, local_range, first, last);
+        else if(first < last)
+            entry_point(arguments.data(), global_range, first, last);
+    };
+    this->n_chunks = N_CHUNKS;
+    this->next_chunk = 0;
+    this->chunks_done = 0;
+    this->generation++;
+    this->work_available.notify_all();
+    this->ProcessChunks(lock);
+    this->work_done.wait(lock, [this]{ return this->chunks_done == this->n_chunks; });
+    this->task = nullptr;
+    if(this->counters)
+        this->counters->kernel_launches++;
+}
+
+// ---------------------------------------------------------------------------
+
+bool NativeKernel::CanRun(const size_t global_range[3]) const
+{
+    if(!this->entry_point) return false;
+    for(int d=0;d<3 && !this->built_local_range.empty();d++)
+        if(this->built_local_range[d] == 0 || global_range[d] % this->built_local_range[d] != 0)
+            return false;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::WorkerLoop()
+{
+    unsigned int generation_done = 0;
+    unique_lock<std::mutex> lock(this->mutex);
+    for(;;)
+    {
+        this->work_available.wait(lock, [&]{ return this->stopping || this->generation != generation_done; });
+        if(this->stopping) return;
+        generation_done = this->generation;
+        this->ProcessChunks(lock);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void NativeKernel::ProcessChunks(unique_lock<std::mutex>& lock)
+{
+    while(this->next_chunk < this->n_chunks)
+    {
+        const size_t chunk = this->next_chunk++;
+        lock.unlock();
+        this->task(chunk);
+        lock.lock();
+        if(++this->chunks_done == this->n_chunks)
+            this->work_done.notify_all();
+    }
+}
+
+// ---------------------------------------------------------------------------
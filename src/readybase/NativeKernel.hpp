@@ -0,0 +1,126 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __NATIVEKERNEL__
+#define __NATIVEKERNEL__
+
+// local:
+#include "PerformanceCounters.hpp"
+
+// STL:
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Runs an OpenCL kernel on the CPU, for when no OpenCL implementation is installed.
+/** The OpenCL C source is compiled as C++ by the system compiler, against a small shim that provides the vector
+  * types, the built-in functions and the work-item functions, and then loaded as a shared library. The work-items
+  * are shared out between a pool of threads. Kernels built with a local range run in work-groups, each on one
+  * thread, whose work-items take turns between barriers and share the local memory declared in the kernel. */
+class NativeKernel
+{
+    public:
+
+        NativeKernel();
+        ~NativeKernel();
+
+        /// Running a kernel without OpenCL compiles it as native code, which can do anything the user can, so it is off
+        /// until the user turns it on: in Preferences, with rdy --allow-native-kernels, or with
+        /// $READY_ALLOW_NATIVE_KERNELS=1. Only turn it on for files from people you trust.
+        static void SetAllowed(bool allowed);
+        static bool IsAllowed();
+
+        /// Can kernels be compiled and loaded here? (Must be allowed, and needs a C++ compiler at run time: $READY_CXX,
+        /// else c++.)
+        static bool IsSupported();
+
+        /// What the user would need to do for IsSupported() to be true.
+        static std::string GetSetupHints();
+
+        /// Compile and load the kernel, unless it is the one already loaded. Throws with the compiler output on error,
+        /// or if the kernel uses a preprocessor directive other than those that OpenCL kernels need (see
+        /// CheckDirectives() in NativeKernel.cpp). If local_range is given then the work-items run in work-groups of
+        /// that size, which can use local memory and barriers.
+        void Build(const std::string& opencl_source,const size_t local_range[3] = NULL);
+        bool IsBuiltFrom(const std::string& opencl_source,const size_t local_range[3] = NULL) const;
+
+        /// Start compiling the kernel on another thread, unless it is the one already loaded or being compiled. The
+        /// kernel that is loaded can still be run meanwhile.
+        void StartBuilding(const std::string& opencl_source,const size_t local_range[3] = NULL);
+        /// Has a kernel been started that hasn't been loaded yet?
+        bool IsBuilding() const;
+        /// Has the kernel being built finished compiling? (Then FinishBuilding() won't have to wait.)
+        bool IsBuildReady() const;
+        /// Wait for the kernel being built, if any, and load it. Throws as Build() does.
+        void FinishBuilding();
+
+        /// Run rd_compute over the global range. Each argument points to a buffer, or to the value of a scalar argument.
+        void Run(const std::vector<void*>& args,const size_t global_range[3]);
+        /// Is there a kernel loaded whose local range, if any, divides this global range?
+        bool CanRun(const size_t global_range[3]) const;
+
+        /// Add the builds and runs from now on to these counters (if not NULL), which must outlive this object.
+        void SetPerformanceCounters(PerformanceCounters* c) { this->counters = c; }
+
+    private:
+
+        typedef void (*EntryPoint)(void** args,const size_t* global_range,size_t first,size_t last);
+        typedef void (*GroupEntryPoint)(void** args,const size_t* global_range,const size_t* local_range,
+                                        size_t first_group,size_t last_group);
+
+        struct CompiledKernel
+        {
+            std::string library_path;
+            double build_seconds;
+        };
+        /// Compile the kernel into a library in the cache, unless it is there already. (Runs on another thread.)
+        static CompiledKernel Compile(const std::string& opencl_source);
+
+        void* library;
+        EntryPoint entry_point;
+        GroupEntryPoint group_entry_point;
+        std::string built_source;
+        std::vector<size_t> built_local_range; ///< empty if the work-items run one at a time
+        PerformanceCounters* counters;
+
+        // the build in progress:
+        std::future<CompiledKernel> pending_build;
+        std::string pending_source;
+        std::vector<size_t> pending_local_range;
+
+        // the thread pool:
+        void WorkerLoop();
+        void ProcessChunks(std::unique_lock<std::mutex>& lock);
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable work_available,work_done;
+        std::function<void(size_t)> task; ///< called with the index of each chunk of work-items
+        size_t n_chunks,next_chunk,chunks_done;
+        unsigned int generation;
+        bool stopping;
+
+    private: // deliberately not implemented, to prevent use
+
+        NativeKernel(NativeKernel&);
+        NativeKernel& operator=(NativeKernel&);
+};
+
+#endif
@@ -0,0 +1,226 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "NativeKernelImageRD.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+NativeKernelImageRD::NativeKernelImageRD(int data_type)
+    : ImageRD(data_type)
+{
+    this->SetRuleName("Full kernel example");
+    this->SetFormula("kernel void rd_compute() {}");
+    this->block_size[0]=1;
+    this->block_size[1]=1;
+    this->block_size[2]=1;
+    this->kernel.SetPerformanceCounters(&this->performance_counters);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::TestFormula(std::string program_string)
+{
+    NativeKernel test_kernel;
+    test_kernel.Build(program_string);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::AllocateBuffersIfNeeded()
+{
+    const int X = vtkMath::Round(this->GetX());
+    const int Y = vtkMath::Round(this->GetY());
+    const int Z = vtkMath::Round(this->GetZ());
+    const int NC = this->GetNumberOfChemicals();
+    if((int)this->buffer_images.size() == NC && NC > 0)
+    {
+        const int *dims = this->buffer_images.front()->GetDimensions();
+        if(dims[0] == X && dims[1] == Y && dims[2] == Z)
+            return;
+    }
+    this->buffer_images.resize(NC);
+    for(int i=0;i<NC;i++)
+        this->buffer_images[i] = AllocateVTKImage(X,Y,Z,this->data_type);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::GetGlobalRange(size_t global_range[3]) const
+{
+    global_range[0] = max(1, vtkMath::Round(this->GetX()) / this->block_size[0]);
+    global_range[1] = max(1, vtkMath::Round(this->GetY()) / this->block_size[1]);
+    global_range[2] = max(1, vtkMath::Round(this->GetZ()) / this->block_size[2]);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::GetLocalRange(const size_t global_range[3],size_t local_range[3]) const
+{
+    // (each work-item needs a stack of its own while they take turns, so the groups are kept to 64 work-items)
+    const bool is_3D = global_range[2] > 1;
+    for(int d=0;d<3;d++)
+    {
+        local_range[d] = is_3D ? 4 : (d < 2 ? 8 : 1);
+        while(global_range[d] % local_range[d] != 0)
+            local_range[d] /= 2;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::StartBuildingKernelIfNeeded()
+{
+    if(!this->use_local_memory)
+    {
+        this->kernel.StartBuilding(this->formula);
+        return;
+    }
+    // as for FullKernelOpenCLImageRD, the kernel is told the size of its work-groups
+    size_t global_range[3],local_range[3];
+    this->GetGlobalRange(global_range);
+    this->GetLocalRange(global_range,local_range);
+    ostringstream kernel_source;
+    kernel_source << "#define LX " << local_range[0] << "\n";
+    kernel_source << "#define LY " << local_range[1] << "\n";
+    kernel_source << "#define LZ " << local_range[2] << "\n";
+    kernel_source << this->formula;
+    this->kernel.StartBuilding(kernel_source.str(),local_range);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::StartCompilingKernelIfNeeded()
+{
+    this->StartBuildingKernelIfNeeded();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::FinishCompilingKernel()
+{
+    this->StartBuildingKernelIfNeeded();
+    if(this->kernel.IsBuilding())
+        this->kernel.FinishBuilding();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool NativeKernelImageRD::IsCompilingKernel() const
+{
+    return this->kernel.IsBuilding() && !this->kernel.IsBuildReady();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::InternalUpdate(int n_steps)
+{
+    size_t global_range[3];
+    this->GetGlobalRange(global_range);
+    // keep running the current kernel while a new one is being built, unless there isn't one that fits
+    this->StartBuildingKernelIfNeeded();
+    if(this->kernel.IsBuilding() && (!this->kernel.CanRun(global_range) || this->kernel.IsBuildReady()))
+        this->kernel.FinishBuilding();
+    this->AllocateBuffersIfNeeded();
+
+    const int NC = this->GetNumberOfChemicals();
+
+    // the kernel takes the chemicals to read from and then the chemicals to write to
+    vector<void*> args[2];
+    for(int i=0;i<NC;i++)
+    {
+        args[0].push_back(this->images[i]->GetScalarPointer());
+        args[1].push_back(this->buffer_images[i]->GetScalarPointer());
+    }
+    for(int i=0;i<NC;i++)
+    {
+        args[0].push_back(this->buffer_images[i]->GetScalarPointer());
+        args[1].push_back(this->images[i]->GetScalarPointer());
+    }
+
+    for(int it=0;it<n_steps;it++)
+        this->kernel.Run(args[it%2],global_range);
+
+    if(n_steps%2)
+    {
+        // output ended up in the buffer images
+        for(int i=0;i<NC;i++)
+            this->images[i]->DeepCopy(this->buffer_images[i]);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    ImageRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // kernel:
+    vtkSmartPointer<vtkXMLDataElement> xml_kernel = rule->FindNestedElementWithName("kernel");
+    if(!xml_kernel) throw runtime_error("kernel node not found in file");
+    string formula = trim_multiline_string(xml_kernel->GetCharacterData());
+    read_required_attribute(xml_kernel,"block_size_x",this->block_size[0]);
+    read_required_attribute(xml_kernel,"block_size_y",this->block_size[1]);
+    read_required_attribute(xml_kernel,"block_size_z",this->block_size[2]);
+
+    // number_of_chemicals:
+    read_required_attribute(xml_kernel,"number_of_chemicals",this->n_chemicals);
+
+    // the kernel gets compiled in the background (any error is reported when loading)
+    this->SetFormula(formula);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> NativeKernelImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = ImageRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    vtkSmartPointer<vtkXMLDataElement> kernel = vtkSmartPointer<vtkXMLDataElement>::New();
+    kernel->SetName("kernel");
+    kernel->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    kernel->SetIntAttribute("block_size_x",this->block_size[0]);
+    kernel->SetIntAttribute("block_size_y",this->block_size[1]);
+    kernel->SetIntAttribute("block_size_z",this->block_size[2]);
+    string f = this->GetFormula();
+    f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
+    kernel->SetCharacterData(f.c_str(), (int)f.length());
+    rule->AddNestedElement(kernel);
+
+    return rd;
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,77 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __NATIVEKERNELIMAGERD__
+#define __NATIVEKERNELIMAGERD__
+
+// local:
+#include "ImageRD.hpp"
+#include "NativeKernel.hpp"
+
+/// An RD system that runs a full OpenCL kernel on the CPU, for when OpenCL is not available.
+/** Reads and writes the same files as FullKernelOpenCLImageRD. */
+class NativeKernelImageRD : public ImageRD
+{
+    public:
+
+        NativeKernelImageRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        std::string GetRuleType() const override { return "kernel"; }
+
+        bool HasEditableFormula() const override { return true; }
+        bool HasEditableDataType() const override { return false; }
+        std::string GetKernel() const override { return this->formula; }
+        void TestFormula(std::string program_string) override;
+
+        bool HasEditableBlockSize() const override { return true; }
+        int GetBlockSizeX() const override { return this->block_size[0]; }
+        int GetBlockSizeY() const override { return this->block_size[1]; }
+        int GetBlockSizeZ() const override { return this->block_size[2]; }
+        void SetBlockSizeX(int n) override { this->block_size[0]=n; }
+        void SetBlockSizeY(int n) override { this->block_size[1]=n; }
+        void SetBlockSizeZ(int n) override { this->block_size[2]=n; }
+
+        void StartCompilingKernelIfNeeded() override;
+        void FinishCompilingKernel() override;
+        bool IsCompilingKernel() const override;
+
+    protected:
+
+        void InternalUpdate(int n_steps) override;
+
+        /// (Re)allocate the images the kernel writes into, if the chemicals or dimensions have changed.
+        void AllocateBuffersIfNeeded();
+
+        /// The number of work-items along each axis: one per block.
+        void GetGlobalRange(size_t global_range[3]) const;
+        /// With local memory: the largest work-groups (up to 8x8 in 2D, 4x4x4 in 3D) that fit the global range exactly.
+        void GetLocalRange(const size_t global_range[3],size_t local_range[3]) const;
+
+        /// Start compiling the kernel for the current settings, unless it is the one loaded or being compiled.
+        void StartBuildingKernelIfNeeded();
+
+    protected:
+
+        int block_size[3];
+        NativeKernel kernel;
+        std::vector<vtkSmartPointer<vtkImageData>> buffer_images; ///< one for each chemical
+};
+
+#endif
@@ -0,0 +1,185 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "NativeKernelMeshRD.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <stdexcept>
+
+// VTK:
+#include <vtkCellData.h>
+#include <vtkDataArray.h>
+#include <vtkUnstructuredGrid.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+NativeKernelMeshRD::NativeKernelMeshRD(int data_type)
+    : MeshRD(data_type)
+{
+    this->SetRuleName("Full kernel example");
+    this->SetFormula("kernel void rd_compute() {}");
+    this->kernel.SetPerformanceCounters(&this->performance_counters);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelMeshRD::TestFormula(std::string program_string)
+{
+    NativeKernel test_kernel;
+    test_kernel.Build(program_string);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelMeshRD::AllocateBuffersIfNeeded()
+{
+    const int NC = this->GetNumberOfChemicals();
+    const vtkIdType N_CELLS = this->mesh->GetNumberOfCells();
+    if((int)this->buffer_arrays.size() == NC && (NC == 0 || this->buffer_arrays.front()->GetNumberOfTuples() == N_CELLS))
+        return;
+    this->buffer_arrays.resize(NC);
+    for(int i=0;i<NC;i++)
+    {
+        vtkDataArray *array = this->mesh->GetCellData()->GetArray(GetChemicalName(i).c_str());
+        if(!array) throw runtime_error("NativeKernelMeshRD::AllocateBuffersIfNeeded : chemical array not found");
+        this->buffer_arrays[i] = vtkSmartPointer<vtkDataArray>::Take(array->NewInstance());
+        this->buffer_arrays[i]->SetNumberOfComponents(1);
+        this->buffer_arrays[i]->SetNumberOfTuples(N_CELLS);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelMeshRD::StartCompilingKernelIfNeeded()
+{
+    this->kernel.StartBuilding(this->formula);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelMeshRD::FinishCompilingKernel()
+{
+    this->kernel.StartBuilding(this->formula);
+    if(this->kernel.IsBuilding())
+        this->kernel.FinishBuilding();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool NativeKernelMeshRD::IsCompilingKernel() const
+{
+    return this->kernel.IsBuilding() && !this->kernel.IsBuildReady();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelMeshRD::InternalUpdate(int n_steps)
+{
+    const size_t global_range[3] = { (size_t)this->mesh->GetNumberOfCells(), 1, 1 };
+    // keep running the current kernel while a new one is being built, unless there isn't one
+    this->kernel.StartBuilding(this->formula);
+    if(this->kernel.IsBuilding() && (!this->kernel.CanRun(global_range) || this->kernel.IsBuildReady()))
+        this->kernel.FinishBuilding();
+    this->AllocateBuffersIfNeeded();
+
+    const int NC = this->GetNumberOfChemicals();
+
+    // the kernel takes the chemicals to read from, the chemicals to write to and then the neighborhood
+    vector<vtkDataArray*> arrays;
+    for(int i=0;i<NC;i++)
+        arrays.push_back(this->mesh->GetCellData()->GetArray(GetChemicalName(i).c_str()));
+    vector<void*> args[2];
+    for(int i=0;i<NC;i++)
+    {
+        args[0].push_back(arrays[i]->GetVoidPointer(0));
+        args[1].push_back(this->buffer_arrays[i]->GetVoidPointer(0));
+    }
+    for(int i=0;i<NC;i++)
+    {
+        args[0].push_back(this->buffer_arrays[i]->GetVoidPointer(0));
+        args[1].push_back(arrays[i]->GetVoidPointer(0));
+    }
+    for(int i=0;i<2;i++)
+    {
+        args[i].push_back(&this->cell_neighbor_indices[0]);
+        args[i].push_back(&this->cell_neighbor_weights[0]);
+        args[i].push_back(&this->max_neighbors);
+    }
+
+    for(int it=0;it<n_steps;it++)
+        this->kernel.Run(args[it%2],global_range);
+
+    if(n_steps%2)
+    {
+        // output ended up in the buffer arrays
+        for(int i=0;i<NC;i++)
+        {
+            arrays[i]->DeepCopy(this->buffer_arrays[i]);
+            arrays[i]->SetName(GetChemicalName(i).c_str());
+        }
+    }
+    for(int i=0;i<NC;i++)
+        arrays[i]->Modified();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernelMeshRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    MeshRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // kernel:
+    vtkSmartPointer<vtkXMLDataElement> xml_kernel = rule->FindNestedElementWithName("kernel");
+    if(!xml_kernel) throw runtime_error("kernel node not found in file");
+    string formula = trim_multiline_string(xml_kernel->GetCharacterData());
+
+    // number_of_chemicals:
+    read_required_attribute(xml_kernel,"number_of_chemicals",this->n_chemicals);
+
+    // the kernel gets compiled in the background (any error is reported when loading)
+    this->SetFormula(formula);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> NativeKernelMeshRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = MeshRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    vtkSmartPointer<vtkXMLDataElement> kernel = vtkSmartPointer<vtkXMLDataElement>::New();
+    kernel->SetName("kernel");
+    kernel->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    string f = this->GetFormula();
+    f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
+    kernel->SetCharacterData(f.c_str(), (int)f.length());
+    rule->AddNestedElement(kernel);
+
+    return rd;
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,62 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __NATIVEKERNELMESHRD__
+#define __NATIVEKERNELMESHRD__
+
+// local:
+#include "MeshRD.hpp"
+#include "NativeKernel.hpp"
+
+// VTK:
+class vtkDataArray;
+
+/// An RD system on a mesh that runs a full OpenCL kernel on the CPU, for when OpenCL is not available.
+/** Reads and writes the same files as FullKernelOpenCLMeshRD. */
+class NativeKernelMeshRD : public MeshRD
+{
+    public:
+
+        NativeKernelMeshRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        std::string GetRuleType() const override { return "kernel"; }
+
+        bool HasEditableDataType() const override { return false; }
+        std::string GetKernel() const override { return this->formula; }
+        void TestFormula(std::string program_string) override;
+
+        void StartCompilingKernelIfNeeded() override;
+        void FinishCompilingKernel() override;
+        bool IsCompilingKernel() const override;
+
+    protected:
+
+        void InternalUpdate(int n_steps) override;
+
+        /// (Re)allocate the arrays the kernel writes into, if the chemicals or cells have changed.
+        void AllocateBuffersIfNeeded();
+
+    protected:
+
+        NativeKernel kernel;
+        std::vector<vtkSmartPointer<vtkDataArray>> buffer_arrays; ///< one for each chemical
+};
+
+#endif
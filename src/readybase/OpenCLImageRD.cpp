@@ -25,14 +25,18 @@ using namespace OpenCL_utils;
 // STL:
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <stdexcept>
 #include <sstream>
 #include <utility>
 #include <vector>
 
 // VTK:
+#include <vtkDataArray.h>
 #include <vtkImageData.h>
 #include <vtkMath.h>
+#include <vtkPointData.h>
+#include <vtkSmartPointer.h>
 
 using namespace std;
 
@@ -40,102 +44,124 @@ using namespace std;
 
 OpenCLImageRD::OpenCLImageRD(int opencl_platform,int opencl_device,int data_type)
     : ImageRD(data_type)
-    , OpenCL_MixIn(opencl_platform,opencl_device)
+    , OpenCL_MixIn(opencl_platform,opencl_device,this->performance_counters)
+    , need_read_from_opencl_buffers(false)
+    , images_were_read(false)
 {
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLImageRD::BuildProgram()
+void OpenCLImageRD::StartBuildingKernelIfNeeded()
 {
-    // create the program
-    this->kernel_source = this->AssembleKernelSourceFromFormula(this->formula);
-    const char* source = this->kernel_source.c_str();
-    size_t source_size = this->kernel_source.length();
-    clReleaseProgram(this->program);
-    cl_int ret;
-    this->program = clCreateProgramWithSource(this->context, 1, &source, &source_size, &ret);
-    throwOnError(ret, "OpenCLImageRD::ReloadKernelIfNeeded : Failed to create program with source: ");
-
-    // build the program
-    ret = clBuildProgram(this->program, 1, &this->device_id, "-cl-denorms-are-zero", NULL, NULL);
-    if (ret != CL_SUCCESS)
-    {
-        size_t build_log_length = 0;
-        cl_int ret2 = clGetProgramBuildInfo(this->program, this->device_id, CL_PROGRAM_BUILD_LOG, 0, 0, &build_log_length);
-        throwOnError(ret2, "OpenCLImageRD::ReloadKernelIfNeeded : retrieving length of program build log failed: ");
-        vector<char> build_log(build_log_length);
-        cl_int ret3 = clGetProgramBuildInfo(this->program, this->device_id, CL_PROGRAM_BUILD_LOG, build_log_length, build_log.data(), 0);
-        throwOnError(ret3, "OpenCLImageRD::ReloadKernelIfNeeded : retrieving program build log failed: ");
-        { ofstream out("kernel.txt"); out << kernel_source; }
-        ostringstream oss;
-        oss << "OpenCLImageRD::ReloadKernelIfNeeded : build failed (kernel saved as kernel.txt):\n\n" << string(build_log.begin(), build_log.end());
-        throwOnError(ret, oss.str().c_str());
-    }
-}
-
-// ----------------------------------------------------------------------------------------------------------------
-
-void OpenCLImageRD::ReloadKernelIfNeeded()
-{
-    if(!this->need_reload_formula) return;
-
-    this->global_range[0] = max(1, vtkMath::Round(this->GetX()) / this->GetBlockSizeX());
-    this->global_range[1] = max(1, vtkMath::Round(this->GetY()) / this->GetBlockSizeY());
-    this->global_range[2] = max(1, vtkMath::Round(this->GetZ()) / this->GetBlockSizeZ());
-
-    if (this->use_local_memory)
+    if(!this->need_reload_formula || this->HasPendingProgram()) return;
+
+    const size_t global[3] = {
+        (size_t)max(1, vtkMath::Round(this->GetX()) / this->GetBlockSizeX()),
+        (size_t)max(1, vtkMath::Round(this->GetY()) / this->GetBlockSizeY()),
+        (size_t)max(1, vtkMath::Round(this->GetZ()) / this->GetBlockSizeZ()) };
+
+    // the kernel source depends on the local work size, so we assemble one candidate per size and let the
+    // background build keep the largest one that compiles
+    vector<KernelCandidate> candidates;
+    const int stages = this->GetSuperTimeSteppingStagesNeeded();
+    const size_t old_local_work_size[3] = { this->local_work_size[0], this->local_work_size[1], this->local_work_size[2] };
+    if (this->use_local_memory && !this->StoresChemicalsInImages()) // (image kernels read through the texture cache instead)
     {
         cl_ulong local_memory_size;
         clGetDeviceInfo(this->device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory_size), &local_memory_size, NULL);
         cl_ulong max_work_group_size;
         clGetDeviceInfo(this->device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
 
-        int n = 1;
-        while (n <= 1024)
+        for(int n = 1; n <= 1024; n *= 2)
         {
-            this->local_work_size[0] = min(this->global_range[0], (size_t)4 * n / this->GetBlockSizeX());
-            this->local_work_size[1] = min(this->global_range[1], (size_t)4 * n / this->GetBlockSizeY());
-            this->local_work_size[2] = min(this->global_range[2], (size_t)4 * n / this->GetBlockSizeZ());
-            try
+            this->local_work_size[0] = min(global[0], (size_t)4 * n / this->GetBlockSizeX());
+            this->local_work_size[1] = min(global[1], (size_t)4 * n / this->GetBlockSizeY());
+            this->local_work_size[2] = min(global[2], (size_t)4 * n / this->GetBlockSizeZ());
+            // ensure that we don't hit CL_DEVICE_MAX_WORK_GROUP_SIZE
+            size_t work_group_size = this->local_work_size[0] * this->local_work_size[1] * this->local_work_size[2];
+            if (work_group_size >= max_work_group_size)  // if allow to be equal, can get errors later
             {
-                // ensure that we don't hit CL_DEVICE_MAX_WORK_GROUP_SIZE
-                size_t work_group_size = this->local_work_size[0] * this->local_work_size[1] * this->local_work_size[2];
-                if (work_group_size >= max_work_group_size)  // if allow to be equal, can get errors later
-                {
-                    break;
-                }
-                // ensure that we don't hit CL_DEVICE_LOCAL_MEM_SIZE
-                int extra = 2;
-                size_t expected_mem = 4 * sizeof(float) * (this->local_work_size[0] + extra) * (this->local_work_size[1] + extra) * (this->local_work_size[2] + extra);
-                // TODO: allow for number of chemicals etc, as we allocate in the kernel
-                if (expected_mem > local_memory_size)
-                {
-                    break;
-                }
-                BuildProgram();
+                break;
             }
-            catch (...)
+            // ensure that we don't hit CL_DEVICE_LOCAL_MEM_SIZE
+            int extra = 2;
+            size_t expected_mem = 4 * sizeof(float) * (this->local_work_size[0] + extra) * (this->local_work_size[1] + extra) * (this->local_work_size[2] + extra);
+            // TODO: allow for number of chemicals etc, as we allocate in the kernel
+            if (expected_mem > local_memory_size)
             {
                 break;
             }
-            n *= 2;
+            candidates.push_back({ this->AssembleKernelSourceFromFormula(this->formula),
+                { this->local_work_size[0], this->local_work_size[1], this->local_work_size[2] }, true, stages });
         }
-        n /= 2; // return to last known good
-        this->local_work_size[0] = min(this->global_range[0], (size_t)4 * n / this->GetBlockSizeX());
-        this->local_work_size[1] = min(this->global_range[1], (size_t)4 * n / this->GetBlockSizeY());
-        this->local_work_size[2] = min(this->global_range[2], (size_t)4 * n / this->GetBlockSizeZ());
+        if(candidates.empty())
+            throw runtime_error("OpenCLImageRD::StartBuildingKernelIfNeeded : no local work size fits on this device");
     }
+    else
+    {
+        candidates.push_back({ this->AssembleKernelSourceFromFormula(this->formula),
+            { this->local_work_size[0], this->local_work_size[1], this->local_work_size[2] }, false, stages });
+    }
+    for(int i=0;i<3;i++)
+        this->local_work_size[i] = old_local_work_size[i]; // (the running kernel keeps its own until the new one arrives)
 
-    BuildProgram();
+    this->StartBuildingProgram(candidates);
+    this->need_reload_formula = false;
+}
 
-    // create the kernel
-    clReleaseKernel(this->kernel);
-    cl_int ret;
-    this->kernel = clCreateKernel(this->program, this->kernel_function_name.c_str(), &ret);
-    throwOnError(ret,"OpenCLImageRD::ReloadKernelIfNeeded : kernel creation failed: ");
+// ----------------------------------------------------------------------------------------------------------------
 
-    this->need_reload_formula = false;
+void OpenCLImageRD::CollectPendingKernel()
+{
+    try
+    {
+        this->CollectPendingProgram();
+    }
+    catch(...)
+    {
+        this->need_reload_formula = true; // try again next time, so that the error is reported again
+        throw;
+    }
+
+    this->global_range[0] = max(1, vtkMath::Round(this->GetX()) / this->GetBlockSizeX());
+    this->global_range[1] = max(1, vtkMath::Round(this->GetY()) / this->GetBlockSizeY());
+    this->global_range[2] = max(1, vtkMath::Round(this->GetZ()) / this->GetBlockSizeZ());
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::ReloadKernelIfNeeded()
+{
+    this->StartBuildingKernelIfNeeded();
+    if(this->HasPendingProgram())
+        this->CollectPendingKernel();
+    this->StartBuildingKernelIfNeeded(); // in case the formula was changed while the last build was pending
+    if(this->HasPendingProgram())
+        this->CollectPendingKernel();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::StartCompilingKernelIfNeeded()
+{
+    this->ReloadContextIfNeeded();
+    this->StartBuildingKernelIfNeeded();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::FinishCompilingKernel()
+{
+    this->ReloadContextIfNeeded();
+    this->ReloadKernelIfNeeded();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+bool OpenCLImageRD::IsCompilingKernel() const
+{
+    return this->HasPendingProgram() && !this->IsPendingProgramReady();
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -147,19 +173,21 @@ void OpenCLImageRD::CreateOpenCLBuffers()
     const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
     const int NC = this->GetNumberOfChemicals();
 
+    // (the images keep their values, once they have the latest ones)
+    this->ReadFromOpenCLBuffersIfNeeded();
+    this->FinishReadingCurrentBuffers();
     this->ReleaseOpenCLBuffers();
-
-    cl_int ret;
-
-    for(int io=0;io<2;io++) // we create two buffers for each chemical, and switch between them
+    if(this->StoresChemicalsInImages())
     {
-        this->buffers[io].resize(NC);
-        for(int ic=0;ic<NC;ic++)
-        {
-            this->buffers[io][ic] = clCreateBuffer(this->context, CL_MEM_READ_WRITE, MEM_SIZE, NULL, &ret);
-            throwOnError(ret,"OpenCLImageRD::CreateOpenCLBuffers : buffer creation failed: ");
-        }
+        // one texel per block, so float4 blocks are RGBA texels
+        const size_t region[3] = {
+            (size_t)max(1, vtkMath::Round(this->GetX()) / this->GetBlockSizeX()),
+            (size_t)max(1, vtkMath::Round(this->GetY()) / this->GetBlockSizeY()),
+            (size_t)max(1, vtkMath::Round(this->GetZ()) / this->GetBlockSizeZ()) };
+        this->CreateChemicalImages(NC, region, this->GetBlockSizeX() * this->GetBlockSizeY() * this->GetBlockSizeZ());
     }
+    else
+        this->CreateChemicalBuffers(NC, MEM_SIZE);
 
     this->need_write_to_opencl_buffers = true;
 }
@@ -168,6 +196,15 @@ void OpenCLImageRD::CreateOpenCLBuffers()
 
 void OpenCLImageRD::WriteToOpenCLBuffersIfNeeded()
 {
+    if(this->use_host_memory)
+    {
+        // the images are normally already in the current buffers, so we only need to hand them back to the device
+        this->AttachImagesToCurrentBuffers(true);
+        this->UnmapBuffers();
+        this->need_write_to_opencl_buffers = false;
+        return;
+    }
+
     if(!this->need_write_to_opencl_buffers) return;
 
     const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
@@ -176,8 +213,10 @@ void OpenCLImageRD::WriteToOpenCLBuffersIfNeeded()
     for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
     {
         void* data = this->images[ic]->GetScalarPointer();
-        cl_int ret = clEnqueueWriteBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLImageRD::WriteToOpenCLBuffers : buffer writing failed: ");
+        if(this->buffers_are_images)
+            this->EnqueueWriteImage(this->buffers[this->iCurrentBuffer][ic], data);
+        else
+            this->EnqueueWrite(this->buffers[this->iCurrentBuffer][ic], MEM_SIZE, data);
     }
 
     this->need_write_to_opencl_buffers = false;
@@ -211,6 +250,7 @@ void OpenCLImageRD::GenerateInitialPattern()
 
 void OpenCLImageRD::BlankImage(float value)
 {
+    this->need_read_from_opencl_buffers = false; // (they are about to be overwritten)
     ImageRD::BlankImage(value);
     this->need_write_to_opencl_buffers = true;
 }
@@ -219,10 +259,13 @@ void OpenCLImageRD::BlankImage(float value)
 
 void OpenCLImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
 {
+    this->need_read_from_opencl_buffers = false; // (the old values are discarded)
     ImageRD::AllocateImages(x,y,z,nc,data_type);
     this->need_reload_formula = true;
     this->ReloadContextIfNeeded();
-    this->ReloadKernelIfNeeded();
+    this->DiscardPendingProgram(); // (was for the old size)
+    this->ReleaseKernel(); // (doesn't match the new storage, so mustn't be run while the new one is built)
+    this->StartBuildingKernelIfNeeded(); // (meanwhile the caller can fill the images)
     this->CreateOpenCLBuffers();
 }
 
@@ -230,10 +273,14 @@ void OpenCLImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
 
 void OpenCLImageRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 {
+    if(reallocate_storage)
+        this->need_read_from_opencl_buffers = false; // (the old values are discarded)
     ImageRD::SetNumberOfChemicals(n, reallocate_storage);
     this->need_reload_formula = true;
     this->ReloadContextIfNeeded();
-    this->ReloadKernelIfNeeded();
+    this->DiscardPendingProgram(); // (was for the old number of chemicals)
+    this->ReleaseKernel(); // (doesn't match the new storage, so mustn't be run while the new one is built)
+    this->StartBuildingKernelIfNeeded();
     this->CreateOpenCLBuffers();
 }
 
@@ -242,52 +289,122 @@ void OpenCLImageRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 void OpenCLImageRD::InternalUpdate(int n_steps)
 {
     this->ReloadContextIfNeeded();
-    this->ReloadKernelIfNeeded();
+    // keep running the current kernel while a new one is being built, unless there isn't one that fits the storage
+    this->StartBuildingKernelIfNeeded();
+    if(this->HasPendingProgram() && (!this->kernel || this->IsPendingProgramReady()))
+        this->CollectPendingKernel();
     this->WriteToOpenCLBuffersIfNeeded();
 
     cl_int ret;
     int iBuffer;
     const int NC = this->GetNumberOfChemicals();
+    // (a super-time-stepping kernel takes each timestep in several stages, each reading the last stage and
+    //  overwriting the one before that, which it also reads, so the buffers swap after every stage)
+    const int n_stages = max(1, this->kernel_stages);
 
     for(int it=0;it<n_steps;it++)
     {
-        for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
+        for(int j=1;j<=n_stages;j++)
         {
-            iBuffer = (this->iCurrentBuffer+io)%2;
-            for(int ic=0;ic<NC;ic++)
+            for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
             {
-                // a_in, b_in, ... a_out, b_out ...
-                ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), (void *)&this->buffers[iBuffer][ic]);
-                throwOnError(ret,"OpenCLImageRD::InternalUpdate : clSetKernelArg failed: ");
+                iBuffer = (this->iCurrentBuffer+io)%2;
+                for(int ic=0;ic<NC;ic++)
+                {
+                    // a_in, b_in, ... a_out, b_out ...
+                    ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), (void *)&this->buffers[iBuffer][ic]);
+                    throwOnError(ret,"OpenCLImageRD::InternalUpdate : clSetKernelArg failed: ");
+                }
             }
+            if(this->kernel_stages > 0)
+                this->SetSuperTimeSteppingArgs(2*NC, j, this->data_type == VTK_DOUBLE);
+            ret = this->EnqueueKernel(1 - this->iCurrentBuffer, this->kernel_uses_local_memory ? this->local_work_size : NULL);
+            if (ret != CL_SUCCESS)
+            {
+                ostringstream oss;
+                oss << "OpenCLImageRD::InternalUpdate : clEnqueueNDRangeKernel failed.\n";
+                oss << "Local work size: " << this->local_work_size[0] << " x " << this->local_work_size[1] << " x " << this->local_work_size[2] << "\n";
+                throwOnError(ret, oss.str().c_str());
+            }
+            this->iCurrentBuffer = 1 - this->iCurrentBuffer;
         }
-        ret = clEnqueueNDRangeKernel(this->command_queue, this->kernel, 3, // dimensions
-            NULL, this->global_range, this->use_local_memory ? this->local_work_size : NULL,
-            0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-        {
-            ostringstream oss;
-            oss << "OpenCLImageRD::InternalUpdate : clEnqueueNDRangeKernel failed.\n";
-            oss << "Local work size: " << this->local_work_size[0] << " x " << this->local_work_size[1] << " x " << this->local_work_size[2] << "\n";
-            throwOnError(ret, oss.str().c_str());
-        }
-        this->iCurrentBuffer = 1 - this->iCurrentBuffer;
     }
+    this->performance_counters.kernel_launches += n_steps * n_stages;
+
+    // the images are only copied back when something waits for them, so that a run that only looks at the
+    // statistics (which are reduced on the device) doesn't pay for the copy; if they were waited for after the last
+    // update then they probably will be again, so the copy is started now, to overlap with the next update
+    this->need_read_from_opencl_buffers = true;
+    if(this->images_were_read)
+        this->ReadFromOpenCLBuffers();
+    this->images_were_read = false;
+}
 
-    this->ReadFromOpenCLBuffers();
+// ----------------------------------------------------------------------------------------------------------------
+
+vector<ChemicalStatistics> OpenCLImageRD::ComputeStatistics(int n_bins)
+{
+    // (if the buffers live in host memory, or are out of date because the images have been edited, then the
+    //  images are the place to look, as they are if the chemicals are in image objects that the reduction can't read)
+    if(this->use_host_memory || this->buffers_are_images || this->need_write_to_opencl_buffers
+        || this->buffers[this->iCurrentBuffer].empty())
+        return ImageRD::ComputeStatistics(n_bins);
+    return this->ComputeStatisticsOfCurrentBuffers(this->GetNumberOfCells(), this->data_type_string, n_bins);
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
 void OpenCLImageRD::ReadFromOpenCLBuffers()
 {
+    this->need_read_from_opencl_buffers = false;
+    if(this->use_host_memory)
+    {
+        this->AttachImagesToCurrentBuffers(false);
+        return;
+    }
+
     // read from opencl buffers into our image
     const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
+    vector<void*> destinations(this->GetNumberOfChemicals());
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+        destinations[ic] = this->images[ic]->GetScalarPointer();
+    this->StartReadingCurrentBuffers(destinations, MEM_SIZE);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::ReadFromOpenCLBuffersIfNeeded()
+{
+    if(this->need_read_from_opencl_buffers && !this->buffers[this->iCurrentBuffer].empty())
+        this->ReadFromOpenCLBuffers();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::FinishReadingBack() const
+{
+    // (copying the chemicals back doesn't change what the caller sees)
+    OpenCLImageRD* self = const_cast<OpenCLImageRD*>(this);
+    self->images_were_read = true;
+    self->ReadFromOpenCLBuffersIfNeeded();
+    self->FinishReadingCurrentBuffers();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::AttachImagesToCurrentBuffers(bool copy_image_data)
+{
+    const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
+    const vector<void*>& mapped = this->MapCurrentBuffers();
     for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
     {
-        void* data = this->images[ic]->GetScalarPointer();
-        cl_int ret = clEnqueueReadBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLImageRD::ReadFromOpenCLBuffers : buffer reading failed: ");
+        vtkDataArray* scalars = this->images[ic]->GetPointData()->GetScalars();
+        if(scalars->GetVoidPointer(0) == mapped[ic]) continue;
+        if(copy_image_data)
+            memcpy(mapped[ic], scalars->GetVoidPointer(0), MEM_SIZE);
+        // (we replace the array rather than changing it, since it may be shared, e.g. with the starting pattern)
+        this->images[ic]->GetPointData()->SetScalars(
+            this->MakeArrayOverHostMemory(scalars, mapped[ic], this->GetNumberOfCells()));
     }
 }
 
@@ -316,6 +433,14 @@ void OpenCLImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,
 
 // ----------------------------------------------------------------------------------------------------------------
 
+void OpenCLImageRD::SetValuesAlongStroke(const vector<array<float,3>>& points,float r,float val,const Properties& render_settings)
+{
+    ImageRD::SetValuesAlongStroke(points,r,val,render_settings);
+    this->need_write_to_opencl_buffers = true;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
 void OpenCLImageRD::Undo()
 {
     ImageRD::Undo();
@@ -37,15 +37,23 @@ class OpenCLImageRD : public ImageRD, public OpenCL_MixIn
         void TestFormula(std::string program_string) override;
 
         std::string GetKernel() const override { return this->AssembleKernelSourceFromFormula(this->formula); }
+        void StartCompilingKernelIfNeeded() override;
+        void FinishCompilingKernel() override;
+        bool IsCompilingKernel() const override;
 
         void SetFrom2DImage(int iChemical, vtkImageData *im) override;
 
         void SetValue(float x,float y,float z,float val,const Properties& render_settings) override;
         void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) override;
+        void SetValuesAlongStroke(const std::vector<std::array<float,3>>& points,float r,float val,const Properties& render_settings) override;
 
         void Undo() override;
         void Redo() override;
 
+        int GetNumberOfStagesPerTimestep() const override { return this->kernel_stages; }
+
+        void FinishReadingBack() const override;
+
     protected:
 
         void CopyFromImage(vtkImageData* im) override;
@@ -55,7 +63,18 @@ class OpenCLImageRD : public ImageRD, public OpenCL_MixIn
 
         void InternalUpdate(int n_steps) override;
 
+        std::vector<ChemicalStatistics> ComputeStatistics(int n_bins) override;
+
         void ReloadKernelIfNeeded() override;
+        /// Assemble the kernel and start building it in the background, if the formula has changed.
+        void StartBuildingKernelIfNeeded();
+        void CollectPendingKernel();
+
+        /// Should the chemicals be stored in OpenCL image objects rather than buffers? (the kernel must match)
+        virtual bool StoresChemicalsInImages() const { return false; }
+
+        /// How many super-time-stepping stages the kernel assembled now should take per timestep, or 0 for forward Euler.
+        virtual int GetSuperTimeSteppingStagesNeeded() const { return 0; }
 
         void CreateOpenCLBuffers() override;
         void WriteToOpenCLBuffersIfNeeded() override;
@@ -63,7 +82,15 @@ class OpenCLImageRD : public ImageRD, public OpenCL_MixIn
 
     private:
 
-        void BuildProgram();
+        /// When the buffers live in host memory, point the images at the current ones instead of copying, first
+        /// copying across any image data that isn't there already (if copy_image_data).
+        void AttachImagesToCurrentBuffers(bool copy_image_data);
+
+        /// Start copying the chemicals back into the images if they have changed since they were last copied.
+        void ReadFromOpenCLBuffersIfNeeded();
+
+        bool need_read_from_opencl_buffers; ///< are the buffers newer than the images?
+        mutable bool images_were_read; ///< has anything waited for the images since the last update?
 };
 
 #endif
@@ -22,6 +22,8 @@ using namespace OpenCL_utils;
 #include "utils.hpp"
 
 // STL:
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <sstream>
 
@@ -29,6 +31,8 @@ using namespace OpenCL_utils;
 #include <vtkMath.h>
 #include <vtkUnstructuredGrid.h>
 #include <vtkCellData.h>
+#include <vtkDataArray.h>
+#include <vtkSmartPointer.h>
 
 using namespace std;
 
@@ -36,7 +40,7 @@ using namespace std;
 
 OpenCLMeshRD::OpenCLMeshRD(int opencl_platform,int opencl_device,int data_type)
     : MeshRD(data_type)
-    , OpenCL_MixIn(opencl_platform,opencl_device)
+    , OpenCL_MixIn(opencl_platform,opencl_device,this->performance_counters)
 {
     this->clBuffer_cell_neighbor_indices = NULL;
     this->clBuffer_cell_neighbor_weights = NULL;
@@ -57,7 +61,9 @@ void OpenCLMeshRD::SetNumberOfChemicals(int n, bool reallocate_storage)
     MeshRD::SetNumberOfChemicals(n, reallocate_storage);
     this->need_reload_formula = true;
     this->ReloadContextIfNeeded();
-    this->ReloadKernelIfNeeded();
+    this->DiscardPendingProgram(); // (was for the old number of chemicals)
+    this->ReleaseKernel(); // (doesn't match the new storage, so mustn't be run while the new one is built)
+    this->StartBuildingKernelIfNeeded();
     this->CreateOpenCLBuffers();
 }
 
@@ -106,88 +112,121 @@ void OpenCLMeshRD::DeleteAllParameters()
 void OpenCLMeshRD::InternalUpdate(int n_steps)
 {
     this->ReloadContextIfNeeded();
-    this->ReloadKernelIfNeeded();
+    // keep running the current kernel while a new one is being built, unless there isn't one that fits the storage
+    this->StartBuildingKernelIfNeeded();
+    if(this->HasPendingProgram() && (!this->kernel || this->IsPendingProgramReady()))
+        this->CollectPendingKernel();
     this->WriteToOpenCLBuffersIfNeeded();
 
     cl_int ret;
     int iBuffer;
-    const int NC = this->GetNumberOfChemicals();
+    const int NB = (int)this->buffers[0].size(); // (one per chemical, or one if they are interleaved)
 
     // pass the neighbor indices and weights as parameters for the kernel
-    ret = clSetKernelArg(this->kernel, 2*NC + 0, sizeof(cl_mem), (void *)&this->clBuffer_cell_neighbor_indices);
+    ret = clSetKernelArg(this->kernel, 2*NB + 0, sizeof(cl_mem), (void *)&this->clBuffer_cell_neighbor_indices);
     throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on indices array: ");
-    ret = clSetKernelArg(this->kernel, 2*NC + 1, sizeof(cl_mem), (void *)&this->clBuffer_cell_neighbor_weights);
+    ret = clSetKernelArg(this->kernel, 2*NB + 1, sizeof(cl_mem), (void *)&this->clBuffer_cell_neighbor_weights);
     throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on weights array: ");
-    ret = clSetKernelArg(this->kernel, 2*NC + 2, sizeof(int), &this->max_neighbors);
+    ret = clSetKernelArg(this->kernel, 2*NB + 2, sizeof(int), &this->max_neighbors);
     throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on max_neighbors parameter: ");
 
+    // (a super-time-stepping kernel takes each timestep in several stages, swapping the buffers after each)
+    const int n_stages = max(1, this->kernel_stages);
+
     for(int it=0;it<n_steps;it++)
     {
-        for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
+        for(int j=1;j<=n_stages;j++)
         {
-            iBuffer = (this->iCurrentBuffer+io)%2;
-            for(int ic=0;ic<NC;ic++)
+            for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
             {
-                // a_in, b_in, ... a_out, b_out ...
-                ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), &this->buffers[iBuffer][ic]);
-                throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on buffer: ");
+                iBuffer = (this->iCurrentBuffer+io)%2;
+                for(int ib=0;ib<NB;ib++)
+                {
+                    // a_in, b_in, ... a_out, b_out ... (or chemicals_in, chemicals_out)
+                    ret = clSetKernelArg(this->kernel, io*NB+ib, sizeof(cl_mem), &this->buffers[iBuffer][ib]);
+                    throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on buffer: ");
+                }
             }
+            if(this->kernel_stages > 0)
+                this->SetSuperTimeSteppingArgs(2*NB + 3, j, this->data_type == VTK_DOUBLE);
+            ret = this->EnqueueKernel(1 - this->iCurrentBuffer, NULL);
+            throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clEnqueueNDRangeKernel failed: ");
+            this->iCurrentBuffer = 1 - this->iCurrentBuffer;
         }
-        ret = clEnqueueNDRangeKernel(this->command_queue,this->kernel, 3, NULL, this->global_range, NULL, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clEnqueueNDRangeKernel failed: ");
-        this->iCurrentBuffer = 1 - this->iCurrentBuffer;
     }
+    this->performance_counters.kernel_launches += n_steps * n_stages;
 
-    this->ReadFromOpenCLBuffers();
+    this->ReadFromOpenCLBuffers(); // (only starts the copy, so the next update can start while it finishes)
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLMeshRD::ReloadKernelIfNeeded()
+void OpenCLMeshRD::StartBuildingKernelIfNeeded()
 {
-    if(!this->need_reload_formula) return;
+    if(!this->need_reload_formula || this->HasPendingProgram()) return;
 
     if(this->n_chemicals==0)
-        throw runtime_error("OpenCLMeshRD::ReloadKernelIfNeeded : zero chemicals");
+        throw runtime_error("OpenCLMeshRD::StartBuildingKernelIfNeeded : zero chemicals");
 
-    cl_int ret;
+    // (we let the local work group size be automatically decided, seems to be faster and more flexible that way)
+    this->StartBuildingProgram({ { this->AssembleKernelSourceFromFormula(this->formula), { 1, 1, 1 }, false,
+        this->GetSuperTimeSteppingStagesNeeded() } });
+    this->need_reload_formula = false;
+}
 
-    // create the program
-    this->kernel_source = this->AssembleKernelSourceFromFormula(this->formula);
-    const char *source = this->kernel_source.c_str();
-    size_t source_size = this->kernel_source.length();
-    clReleaseProgram(this->program);
-    this->program = clCreateProgramWithSource(this->context,1,&source,&source_size,&ret);
-    throwOnError(ret,"OpenCLMeshRD::ReloadKernelIfNeeded : Failed to create program with source: ");
-
-    // build the program
-    ret = clBuildProgram(this->program,1,&this->device_id,"-cl-denorms-are-zero",NULL,NULL);
-    if(ret != CL_SUCCESS)
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::CollectPendingKernel()
+{
+    try
     {
-        size_t build_log_length = 0;
-        cl_int ret2 = clGetProgramBuildInfo(this->program,this->device_id,CL_PROGRAM_BUILD_LOG,0,0,&build_log_length);
-        throwOnError(ret2,"OpenCLMeshRD::ReloadKernelIfNeeded : retrieving length of program build log failed: ");
-        vector<char> build_log(build_log_length);
-        cl_int ret3 = clGetProgramBuildInfo(this->program,this->device_id,CL_PROGRAM_BUILD_LOG,build_log_length,build_log.data(),0);
-        throwOnError(ret3,"OpenCLMeshRD::ReloadKernelIfNeeded : retrieving program build log failed: ");
-        { ofstream out("kernel.txt"); out << kernel_source; }
-        ostringstream oss;
-        oss << "OpenCLMeshRD::ReloadKernelIfNeeded : build failed (kernel saved as kernel.txt):\n\n" << string( build_log.begin(), build_log.end() );
-        throwOnError(ret,oss.str().c_str());
+        this->CollectPendingProgram();
+    }
+    catch(...)
+    {
+        this->need_reload_formula = true; // try again next time, so that the error is reported again
+        throw;
     }
-
-    // create the kernel
-    clReleaseKernel(this->kernel);
-    this->kernel = clCreateKernel(this->program,this->kernel_function_name.c_str(),&ret);
-    throwOnError(ret,"OpenCLMeshRD::ReloadKernelIfNeeded : kernel creation failed: ");
 
     // TODO: round this up to an abundant number to enable many choices for division by local workgroup range?
     this->global_range[0] = this->mesh->GetNumberOfCells();
     this->global_range[1] = 1;
     this->global_range[2] = 1;
-    // (we let the local work group size be automatically decided, seems to be faster and more flexible that way)
+}
 
-    this->need_reload_formula = false;
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::ReloadKernelIfNeeded()
+{
+    this->StartBuildingKernelIfNeeded();
+    if(this->HasPendingProgram())
+        this->CollectPendingKernel();
+    this->StartBuildingKernelIfNeeded(); // in case the formula was changed while the last build was pending
+    if(this->HasPendingProgram())
+        this->CollectPendingKernel();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::StartCompilingKernelIfNeeded()
+{
+    this->ReloadContextIfNeeded();
+    this->StartBuildingKernelIfNeeded();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::FinishCompilingKernel()
+{
+    this->ReloadContextIfNeeded();
+    this->ReloadKernelIfNeeded();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+bool OpenCLMeshRD::IsCompilingKernel() const
+{
+    return this->HasPendingProgram() && !this->IsPendingProgramReady();
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -196,22 +235,17 @@ void OpenCLMeshRD::CreateOpenCLBuffers()
 {
     this->ReloadContextIfNeeded();
 
-    this->ReleaseOpenCLBuffers();
+    this->ReleaseOpenCLBuffers(); // (the chemical arrays keep their values)
 
     cl_int ret;
 
-    // create two buffers for each chemical (we will switch between them)
+    // create two buffers for each chemical (we will switch between them), or two for all of them if interleaved
     const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
-    const int NC = this->GetNumberOfChemicals();
-    for(int io=0;io<2;io++)
-    {
-        this->buffers[io].resize(NC);
-        for(int ic=0;ic<NC;ic++)
-        {
-            this->buffers[io][ic] = clCreateBuffer(this->context, CL_MEM_READ_WRITE, MEM_SIZE, NULL, &ret);
-            throwOnError(ret,"OpenCLMeshRD::CreateOpenCLBuffers : data buffer creation failed: ");
-        }
-    }
+    const int W = this->GetInterleavedWidth();
+    if(W > 1)
+        this->CreateChemicalBuffers(1, MEM_SIZE * W);
+    else
+        this->CreateChemicalBuffers(this->GetNumberOfChemicals(), MEM_SIZE);
 
     // create a buffer for the indices of the neighbors of each cell
     const size_t NBORS_INDICES_SIZE = sizeof(int) * this->mesh->GetNumberOfCells() * this->max_neighbors;
@@ -230,46 +264,54 @@ void OpenCLMeshRD::CreateOpenCLBuffers()
 
 void OpenCLMeshRD::WriteToOpenCLBuffersIfNeeded()
 {
-    if(!this->need_write_to_opencl_buffers) return;
-
     if(this->buffers[0].empty())
         this->CreateOpenCLBuffers();
 
-    cl_int ret;
-    const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
-    this->iCurrentBuffer = 0;
-    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    const int W = this->GetInterleavedWidth();
+    if(this->use_host_memory)
+    {
+        if(W > 1)
+        {
+            if(this->need_write_to_opencl_buffers)
+                this->InterleaveChemicals(this->MapCurrentBuffers().front());
+        }
+        else
+        {
+            // the chemicals are normally already in the current buffers, so we only need to hand them back to the device
+            this->AttachArraysToCurrentBuffers(true);
+        }
+        this->UnmapBuffers();
+    }
+
+    if(!this->need_write_to_opencl_buffers) return;
+
+    if(!this->use_host_memory)
     {
-        const void* data = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str())->WriteVoidPointer(0,0);
-        ret = clEnqueueWriteBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : data buffer writing failed: ");
+        const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
+        this->iCurrentBuffer = 0;
+        if(W > 1)
+        {
+            this->interleaved_data.resize(MEM_SIZE * W);
+            this->InterleaveChemicals(&this->interleaved_data[0]);
+            this->EnqueueWrite(this->buffers[this->iCurrentBuffer][0], MEM_SIZE * W, &this->interleaved_data[0]);
+        }
+        else
+        {
+            for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+            {
+                const void* data = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str())->WriteVoidPointer(0,0);
+                this->EnqueueWrite(this->buffers[this->iCurrentBuffer][ic], MEM_SIZE, data);
+            }
+        }
     }
 
     // fill indices buffer
     const size_t NBORS_INDICES_SIZE = sizeof(int) * this->mesh->GetNumberOfCells() * this->max_neighbors;
-    ret = clEnqueueWriteBuffer(
-        this->command_queue,
-        this->clBuffer_cell_neighbor_indices,
-        CL_TRUE,
-        0,
-        NBORS_INDICES_SIZE,
-        &this->cell_neighbor_indices[0],
-        0,
-        NULL,
-        NULL);
-    throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : indices buffer writing failed: ");
+    this->EnqueueWrite(this->clBuffer_cell_neighbor_indices, NBORS_INDICES_SIZE, &this->cell_neighbor_indices[0]);
 
     // fill weights buffer
     const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * this->mesh->GetNumberOfCells() * this->max_neighbors;
-    ret = clEnqueueWriteBuffer(
-        this->command_queue,
-        this->clBuffer_cell_neighbor_weights,
-        CL_TRUE, 0, NBORS_WEIGHTS_SIZE,
-        &this->cell_neighbor_weights[0],
-        0,
-        NULL,
-        NULL);
-    throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : weights buffer writing failed: ");
+    this->EnqueueWrite(this->clBuffer_cell_neighbor_weights, NBORS_WEIGHTS_SIZE, &this->cell_neighbor_weights[0]);
 
     this->need_write_to_opencl_buffers = false;
 }
@@ -278,15 +320,140 @@ void OpenCLMeshRD::WriteToOpenCLBuffersIfNeeded()
 
 void OpenCLMeshRD::ReadFromOpenCLBuffers()
 {
+    const int W = this->GetInterleavedWidth();
+    if(this->use_host_memory)
+    {
+        if(W > 1)
+            this->DeinterleaveChemicals(this->MapCurrentBuffers().front());
+        else
+            this->AttachArraysToCurrentBuffers(false);
+        return;
+    }
+
     // read from opencl buffers into our mesh data
     const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
+    if(W > 1)
+    {
+        this->interleaved_data.resize(MEM_SIZE * W);
+        this->StartReadingCurrentBuffers({ &this->interleaved_data[0] }, MEM_SIZE * W); // (FinishReadingBack deinterleaves)
+        return;
+    }
+    vector<void*> destinations(this->GetNumberOfChemicals());
     for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
     {
         vtkDataArray *array = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str());
         if( !array ) throw runtime_error( "OpenCLMeshRD::ReadFromOpenCLBuffers : named array not found" );
-        void* data = array->WriteVoidPointer(0,0);
-        cl_int ret = clEnqueueReadBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLMeshRD::ReadFromOpenCLBuffers : data buffer reading failed: ");
+        destinations[ic] = array->WriteVoidPointer(0,0);
+    }
+    this->StartReadingCurrentBuffers(destinations, MEM_SIZE);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::FinishReadingBack() const
+{
+    // (waiting for the copy doesn't change what the caller sees)
+    OpenCLMeshRD* self = const_cast<OpenCLMeshRD*>(this);
+    if(self->FinishReadingCurrentBuffers() && self->GetInterleavedWidth() > 1)
+        self->DeinterleaveChemicals(&self->interleaved_data[0]);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::AttachArraysToCurrentBuffers(bool copy_array_data)
+{
+    const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
+    const vector<void*>& mapped = this->MapCurrentBuffers();
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    {
+        vtkDataArray *array = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str());
+        if( !array ) throw runtime_error( "OpenCLMeshRD::AttachArraysToCurrentBuffers : named array not found" );
+        if(array->GetVoidPointer(0) == mapped[ic]) continue;
+        if(copy_array_data)
+            memcpy(mapped[ic], array->GetVoidPointer(0), MEM_SIZE);
+        // (we replace the array rather than changing it, since it may be shared with another mesh)
+        this->mesh->GetCellData()->AddArray( // (replaces the array with the same name)
+            this->MakeArrayOverHostMemory(array, mapped[ic], this->mesh->GetNumberOfCells()));
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+int OpenCLMeshRD::GetInterleavedWidth() const
+{
+    // with a few chemicals, one gather per neighbor can fetch all of them
+    const int NC = this->GetNumberOfChemicals();
+    if(!this->CanInterleaveChemicals() || NC < 2 || NC > 4)
+        return 1;
+    return (NC == 2) ? 2 : 4; // (a float3 takes the space of a float4 anyway)
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+template <typename T>
+void InterleaveArrays(const vector<const void*>& arrays, void* interleaved, vtkIdType n_cells, int width)
+{
+    T* out = static_cast<T*>(interleaved);
+    for(vtkIdType i=0;i<n_cells;i++)
+    {
+        for(size_t ic=0;ic<arrays.size();ic++)
+            out[i*width+ic] = static_cast<const T*>(arrays[ic])[i];
+        for(int ic=(int)arrays.size();ic<width;ic++)
+            out[i*width+ic] = 0; // (padding)
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+template <typename T>
+void DeinterleaveArrays(const void* interleaved, const vector<void*>& arrays, vtkIdType n_cells, int width)
+{
+    const T* in = static_cast<const T*>(interleaved);
+    for(size_t ic=0;ic<arrays.size();ic++)
+    {
+        T* out = static_cast<T*>(arrays[ic]);
+        for(vtkIdType i=0;i<n_cells;i++)
+            out[i] = in[i*width+ic];
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::InterleaveChemicals(void* interleaved) const
+{
+    vector<const void*> arrays(this->GetNumberOfChemicals());
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    {
+        vtkDataArray *array = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str());
+        if( !array ) throw runtime_error( "OpenCLMeshRD::InterleaveChemicals : named array not found" );
+        arrays[ic] = array->GetVoidPointer(0);
+    }
+    const vtkIdType n_cells = this->mesh->GetNumberOfCells();
+    switch(this->data_type)
+    {
+        case VTK_FLOAT: InterleaveArrays<float>(arrays, interleaved, n_cells, this->GetInterleavedWidth()); break;
+        case VTK_DOUBLE: InterleaveArrays<double>(arrays, interleaved, n_cells, this->GetInterleavedWidth()); break;
+        default: throw runtime_error("OpenCLMeshRD::InterleaveChemicals : unsupported data type");
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::DeinterleaveChemicals(const void* interleaved)
+{
+    vector<void*> arrays(this->GetNumberOfChemicals());
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    {
+        vtkDataArray *array = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str());
+        if( !array ) throw runtime_error( "OpenCLMeshRD::DeinterleaveChemicals : named array not found" );
+        arrays[ic] = array->WriteVoidPointer(0,0);
+    }
+    const vtkIdType n_cells = this->mesh->GetNumberOfCells();
+    switch(this->data_type)
+    {
+        case VTK_FLOAT: DeinterleaveArrays<float>(interleaved, arrays, n_cells, this->GetInterleavedWidth()); break;
+        case VTK_DOUBLE: DeinterleaveArrays<double>(interleaved, arrays, n_cells, this->GetInterleavedWidth()); break;
+        default: throw runtime_error("OpenCLMeshRD::DeinterleaveChemicals : unsupported data type");
     }
 }
 
@@ -294,7 +461,14 @@ void OpenCLMeshRD::ReadFromOpenCLBuffers()
 
 void OpenCLMeshRD::CopyFromMesh(vtkUnstructuredGrid* mesh2)
 {
+    const int old_n_chemicals = this->n_chemicals;
     MeshRD::CopyFromMesh(mesh2);
+    if(this->n_chemicals != old_n_chemicals)
+    {
+        this->DiscardPendingProgram(); // (was for the old number of chemicals)
+        this->ReleaseKernel();
+        this->need_reload_formula = true;
+    }
     this->need_write_to_opencl_buffers = true;
 }
 
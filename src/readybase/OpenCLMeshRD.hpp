@@ -48,6 +48,9 @@ class OpenCLMeshRD : public MeshRD, public OpenCL_MixIn
 
         void TestFormula(std::string program_string) override;
         std::string GetKernel() const override { return this->AssembleKernelSourceFromFormula(this->formula); }
+        void StartCompilingKernelIfNeeded() override;
+        void FinishCompilingKernel() override;
+        bool IsCompilingKernel() const override;
 
         void SetValue(float x,float y,float z,float val,const Properties& render_settings) override;
         void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) override;
@@ -55,21 +58,46 @@ class OpenCLMeshRD : public MeshRD, public OpenCL_MixIn
         void Undo() override;
         void Redo() override;
 
+        int GetNumberOfStagesPerTimestep() const override { return this->kernel_stages; }
+
+        void FinishReadingBack() const override;
+
     protected:
 
         void InternalUpdate(int n_steps) override;
 
         void ReloadKernelIfNeeded() override;
+        /// Assemble the kernel and start building it in the background, if the formula has changed.
+        void StartBuildingKernelIfNeeded();
+        void CollectPendingKernel();
 
         void CreateOpenCLBuffers() override;
         void WriteToOpenCLBuffersIfNeeded() override;
         void ReadFromOpenCLBuffers() override;
         void ReleaseOpenCLBuffers() override;
 
+        /// How many super-time-stepping stages the kernel assembled now should take per timestep, or 0 for forward Euler.
+        virtual int GetSuperTimeSteppingStagesNeeded() const { return 0; }
+
+        /// Can the kernel take the chemicals interleaved in one buffer? (only if we assemble it ourselves)
+        virtual bool CanInterleaveChemicals() const { return false; }
+        /// The number of chemicals stored per cell in each buffer: 2 or 4 if interleaved, else 1 (one buffer per chemical).
+        int GetInterleavedWidth() const;
+
     private:
 
+        /// Copy the chemical arrays into interleaved storage, or back out of it.
+        void InterleaveChemicals(void* interleaved) const;
+        void DeinterleaveChemicals(const void* interleaved);
+
+        /// When the buffers live in host memory, point the chemical arrays at the current ones instead of copying,
+        /// first copying across any data that isn't there already (if copy_array_data).
+        void AttachArraysToCurrentBuffers(bool copy_array_data);
+
         cl_mem clBuffer_cell_neighbor_indices;
         cl_mem clBuffer_cell_neighbor_weights;
+
+        std::vector<char> interleaved_data; ///< host copy of the interleaved buffer, when not using host memory
 };
 
 #endif
@@ -17,19 +17,54 @@
 
 // local:
 #include "OpenCL_MixIn.hpp"
+#include "OpenCL_Registry.hpp"
 #include "OpenCL_utils.hpp"
+#include "super_time_stepping.hpp"
 using namespace OpenCL_utils;
 
 // STL:
-#include <stdexcept>
-#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+    #include <malloc.h>
+#endif
 
 using namespace std;
 
 // ---------------------------------------------------------------------------
 
-OpenCL_MixIn::OpenCL_MixIn(int opencl_platform, int opencl_device)
+static void* AllocateAligned(size_t size,size_t alignment)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size,alignment);
+#else
+    void* memory = NULL;
+    if(posix_memalign(&memory,alignment,size) != 0)
+        return NULL;
+    return memory;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+static void FreeAligned(void* memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+OpenCL_MixIn::OpenCL_MixIn(int opencl_platform, int opencl_device, PerformanceCounters& performance_counters)
     : context(NULL)
     , device_id(NULL)
     , program(NULL)
@@ -37,10 +72,26 @@ OpenCL_MixIn::OpenCL_MixIn(int opencl_platform, int opencl_device)
     , kernel_function_name("rd_compute")
     , global_range{ 1, 1, 1 }
     , local_work_size{ 1, 1, 1 }
+    , kernel_uses_local_memory(false)
+    , kernel_stages(0)
     , command_queue(NULL)
+    , transfer_queue(NULL)
     , need_reload_context(true)
     , need_write_to_opencl_buffers(true)
     , iCurrentBuffer(0)
+    , use_host_memory(false)
+    , buffers_are_images(false)
+    , counters(performance_counters)
+    , last_kernel_event(NULL)
+    , i_read_buffer(0)
+    , reads_are_waited_for(false)
+    , i_mapped_buffer(0)
+    , buffer_size(0)
+    , image_region{ 1, 1, 1 }
+    , statistics_program(NULL)
+    , moments_kernel(NULL)
+    , histogram_kernel(NULL)
+    , statistics_group_size(1)
     , iPlatform(opencl_platform)
     , iDevice(opencl_device)
 {
@@ -52,15 +103,25 @@ OpenCL_MixIn::OpenCL_MixIn(int opencl_platform, int opencl_device)
 
 OpenCL_MixIn::~OpenCL_MixIn()
 {
+    this->DiscardPendingProgram();
     clFlush(this->command_queue);
     clFinish(this->command_queue);
+    clFinish(this->transfer_queue);
+    for(cl_event event : this->write_events)
+        clReleaseEvent(event);
+    for(cl_event event : this->writes_in_flight)
+        clReleaseEvent(event);
+    for(cl_event event : this->read_events)
+        clReleaseEvent(event);
+    if(this->last_kernel_event)
+        clReleaseEvent(this->last_kernel_event);
+    this->ReleaseStatisticsProgram();
     clReleaseKernel(this->kernel);
-    clReleaseProgram(this->program);
-    for(int i=0;i<2;i++)
-        for(vector<cl_mem>::const_iterator it = this->buffers[i].begin();it!=this->buffers[i].end();it++)
-            clReleaseMemObject(*it);
-    clReleaseCommandQueue(this->command_queue);
-    clReleaseContext(this->context);
+    if(this->program)
+        OpenCL_Registry::ReleaseProgram(this->program);
+    OpenCL_MixIn::ReleaseOpenCLBuffers();
+    if(this->context)
+        OpenCL_Registry::ReleaseContext(this->context); // (the command queue belongs to the shared context)
 }
 
 // ---------------------------------------------------------------------------
@@ -101,97 +162,660 @@ void OpenCL_MixIn::ReloadContextIfNeeded()
 {
     if(!this->need_reload_context) return;
 
-    cl_int ret;
+    // any build in progress is for the old context
+    this->DiscardPendingProgram();
+
+    // systems on the same device share a context and command queues
+    OpenCL_Registry::SharedContext shared = OpenCL_Registry::AcquireContext(this->iPlatform,this->iDevice);
+    this->UnmapBuffers();
+    this->FinishReadingCurrentBuffers();
+    if(this->last_kernel_event)
+        clReleaseEvent(this->last_kernel_event);
+    this->last_kernel_event = NULL;
+    this->ReleaseStatisticsProgram();
+    if(this->context)
+        OpenCL_Registry::ReleaseContext(this->context);
+    this->device_id = shared.device_id;
+    this->context = shared.context;
+    this->command_queue = shared.command_queue;
+    this->transfer_queue = shared.transfer_queue;
+
+    this->need_reload_context = false;
+}
+
+// -------------------------------------------------------------------------
+
+void OpenCL_MixIn::TestKernel(std::string kernel_source)
+{
+    // (building a program on the existing context doesn't disturb the running kernel or the buffers)
+    this->ReloadContextIfNeeded();
 
-    // retrieve our chosen platform
-    cl_platform_id platform_id;
+    // (the program stays in the pool, so if this formula is then applied it won't need building again)
+    ScopedTimer timer(this->counters.build_seconds);
+    cl_program temp_program = OpenCL_Registry::AcquireProgram(this->context,this->device_id,kernel_source);
+    OpenCL_Registry::ReleaseProgram(temp_program);
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::StartBuildingProgram(const vector<KernelCandidate>& candidates)
+{
+    if(candidates.empty())
+        throw runtime_error("OpenCL_MixIn::StartBuildingProgram : no kernel to build");
+
+    this->DiscardPendingProgram();
+
+    // OpenCL allows programs to be built on another thread, so the caller can carry on (e.g. reading the data, or
+    // running the old kernel) while the compiler works
+    cl_context build_context = this->context;
+    cl_device_id build_device_id = this->device_id;
+    this->pending_program = async(launch::async, [build_context,build_device_id,candidates]()
     {
-        cl_uint num_platforms = 0;
-        ret = clGetPlatformIDs( 0, 0, &num_platforms );
-        if(ret != CL_SUCCESS || num_platforms==0)
+        BuiltProgram built = { NULL, candidates.front(), 0.0 };
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(const KernelCandidate& candidate : candidates)
         {
-            throw runtime_error("No OpenCL platforms available");
-            // currently only likely to see this when running in a virtualized OS, where an opencl.dll is found but doesn't work
+            cl_program program;
+            try
+            {
+                program = OpenCL_Registry::AcquireProgram(build_context,build_device_id,candidate.source);
+            }
+            catch(...)
+            {
+                if(!built.program) throw; // nothing built, report the error
+                break; // else keep the last one that built
+            }
+            if(built.program) OpenCL_Registry::ReleaseProgram(built.program);
+            built.program = program;
+            built.candidate = candidate;
         }
-        if(this->iPlatform >= (int)num_platforms)
-            throw runtime_error("OpenCL_MixIn::ReloadContextIfNeeded : too few platforms available");
-        vector<cl_platform_id> platforms_available( num_platforms );
-        ret = clGetPlatformIDs( num_platforms, platforms_available.data(), 0 );
-        if(ret != CL_SUCCESS)
-        {
-            throw runtime_error("Failed to retrieve OpenCL platforms");
-            // currently only likely to see this when running in a virtualized OS, where an opencl.dll is found but doesn't work
-        }
-        platform_id = platforms_available[this->iPlatform];
+        built.build_seconds = ScopedTimer::SecondsSince(start);
+        return built;
+    });
+}
+
+// -----------------------------------------------------------------------
+
+bool OpenCL_MixIn::HasPendingProgram() const
+{
+    return this->pending_program.valid();
+}
+
+// -----------------------------------------------------------------------
+
+bool OpenCL_MixIn::IsPendingProgramReady() const
+{
+    return this->pending_program.valid() && this->pending_program.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::CollectPendingProgram()
+{
+    if(!this->pending_program.valid()) return;
+
+    BuiltProgram built = this->pending_program.get(); // rethrows any build error
+    this->counters.build_seconds += built.build_seconds;
+
+    cl_int ret;
+    cl_kernel new_kernel = clCreateKernel(built.program,this->kernel_function_name.c_str(),&ret);
+    if(ret != CL_SUCCESS)
+    {
+        OpenCL_Registry::ReleaseProgram(built.program);
+        throwOnError(ret,"OpenCL_MixIn::CollectPendingProgram : kernel creation failed: ");
     }
 
-    // retrieve our chosen device
+    clReleaseKernel(this->kernel);
+    if(this->program)
+        OpenCL_Registry::ReleaseProgram(this->program);
+    this->kernel = new_kernel;
+    this->program = built.program;
+    this->kernel_source = built.candidate.source;
+    for(int i=0;i<3;i++)
+        this->local_work_size[i] = built.candidate.local_work_size[i];
+    this->kernel_uses_local_memory = built.candidate.uses_local_memory;
+    this->kernel_stages = built.candidate.super_time_stepping_stages;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::DiscardPendingProgram()
+{
+    if(!this->pending_program.valid()) return;
+
+    try
     {
-        cl_uint num_devices = 0;
-        ret = clGetDeviceIDs(platform_id,CL_DEVICE_TYPE_ALL,0,0,&num_devices);
-        throwOnError(ret,"OpenCL_MixIn::ReloadContextIfNeeded : Failed to retrieve number of device IDs: ");
-        if(this->iDevice >= (int)num_devices)
-            throw runtime_error("OpenCL_MixIn::ReloadContextIfNeeded : too few devices available");
+        OpenCL_Registry::ReleaseProgram(this->pending_program.get().program);
+    }
+    catch(...) {} // a failed build is of no interest if we don't want the result
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::ReleaseKernel()
+{
+    clReleaseKernel(this->kernel);
+    this->kernel = NULL;
+}
+
+// -----------------------------------------------------------------------
 
-        vector<cl_device_id> devices_available(num_devices);
-        ret = clGetDeviceIDs(platform_id,CL_DEVICE_TYPE_ALL,num_devices,devices_available.data(),0);
-        throwOnError(ret,"OpenCL_MixIn::ReloadContextIfNeeded : Failed to retrieve device IDs: ");
-        this->device_id = devices_available[this->iDevice];
+void OpenCL_MixIn::SetSuperTimeSteppingArgs(int first_arg,int j,bool double_precision)
+{
+    const RKL1Stage stage = GetRKL1Stage(j,this->kernel_stages);
+    const double coefficients[3] = { stage.mu, stage.nu, stage.mu_tilde };
+    for(int i=0;i<3;i++)
+    {
+        cl_int ret;
+        if(double_precision)
+            ret = clSetKernelArg(this->kernel,first_arg+i,sizeof(cl_double),&coefficients[i]);
+        else
+        {
+            const cl_float value = (cl_float)coefficients[i];
+            ret = clSetKernelArg(this->kernel,first_arg+i,sizeof(cl_float),&value);
+        }
+        throwOnError(ret,"OpenCL_MixIn::SetSuperTimeSteppingArgs : clSetKernelArg failed: ");
     }
+}
 
-    // create the context
-    clReleaseContext(this->context);
-    this->context = clCreateContext(NULL,1,&this->device_id,NULL,NULL,&ret);
-    throwOnError(ret,"OpenCL_MixIn::ReloadContextIfNeeded : Failed to create context: ");
+// -----------------------------------------------------------------------
 
-    // create the command queue
-    clReleaseCommandQueue(this->command_queue);
-    this->command_queue = clCreateCommandQueue(this->context,this->device_id,0,&ret);
-    throwOnError(ret,"OpenCL_MixIn::ReloadContextIfNeeded : Failed to create command queue: ");
+void OpenCL_MixIn::EnqueueWrite(cl_mem buffer,size_t size,const void* data)
+{
+    cl_event event;
+    cl_int ret = clEnqueueWriteBuffer(this->transfer_queue,buffer,CL_FALSE,0,size,data,0,NULL,&event);
+    throwOnError(ret,"OpenCL_MixIn::EnqueueWrite : buffer writing failed: ");
+    this->counters.bytes_uploaded += size;
+    this->write_events.push_back(event);
+}
 
-    this->need_reload_context = false;
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::EnqueueWriteImage(cl_mem image,const void* data)
+{
+    const size_t origin[3] = { 0, 0, 0 };
+    cl_event event;
+    cl_int ret = clEnqueueWriteImage(this->transfer_queue,image,CL_FALSE,origin,this->image_region,0,0,data,0,NULL,&event);
+    throwOnError(ret,"OpenCL_MixIn::EnqueueWriteImage : image writing failed: ");
+    this->counters.bytes_uploaded += this->buffer_size;
+    this->write_events.push_back(event);
 }
 
-// -------------------------------------------------------------------------
+// -----------------------------------------------------------------------
 
-void OpenCL_MixIn::TestKernel(std::string kernel_source)
+vector<cl_event> OpenCL_MixIn::TakeWritesToWaitFor()
 {
-    this->need_reload_context = true;
-    this->ReloadContextIfNeeded();
+    if(this->write_events.empty()) return vector<cl_event>();
+
+    clFlush(this->transfer_queue);
+    vector<cl_event> wait_list;
+    wait_list.swap(this->write_events);
+    // (the host may still be being read from, so we keep the events until WaitForWritesToFinish)
+    this->writes_in_flight.insert(this->writes_in_flight.end(),wait_list.begin(),wait_list.end());
+    return wait_list;
+}
 
-    cl_int ret;
+// -----------------------------------------------------------------------
 
-    // create the program
-    const char *source = kernel_source.c_str();
-    size_t source_size = kernel_source.length();
-    cl_program temp_program = clCreateProgramWithSource(this->context,1,&source,&source_size,&ret);
-    throwOnError(ret,"OpenCL_MixIn::TestKernel : Failed to create program with source: ");
+void OpenCL_MixIn::WaitForWritesToFinish()
+{
+    this->writes_in_flight.insert(this->writes_in_flight.end(),this->write_events.begin(),this->write_events.end());
+    this->write_events.clear();
+    if(this->writes_in_flight.empty()) return;
+
+    clFlush(this->transfer_queue);
+    cl_int ret = clWaitForEvents((cl_uint)this->writes_in_flight.size(),this->writes_in_flight.data());
+    for(cl_event event : this->writes_in_flight)
+        clReleaseEvent(event);
+    this->writes_in_flight.clear();
+    throwOnError(ret,"OpenCL_MixIn::WaitForWritesToFinish : failed: ");
+}
 
-    // build the program
-    ret = clBuildProgram(temp_program,1,&this->device_id,"-cl-denorms-are-zero",NULL,NULL);
-    if(ret != CL_SUCCESS)
+// -----------------------------------------------------------------------
+
+cl_int OpenCL_MixIn::EnqueueKernel(int i_output,const size_t* local)
+{
+    vector<cl_event> wait_list = this->TakeWritesToWaitFor();
+    // (the kernels before this one only read the buffers that are being copied back, so they overlap the copy)
+    if(!this->read_events.empty() && !this->reads_are_waited_for && i_output == this->i_read_buffer)
     {
-        size_t build_log_length = 0;
-        cl_int ret2 = clGetProgramBuildInfo(temp_program,this->device_id,CL_PROGRAM_BUILD_LOG,0,0,&build_log_length);
-        throwOnError(ret2,"OpenCL_MixIn::TestKernel : retrieving length of program build log failed: ");
-        vector<char> build_log(build_log_length);
-        cl_int ret3 = clGetProgramBuildInfo(temp_program,this->device_id,CL_PROGRAM_BUILD_LOG,build_log_length,build_log.data(),0);
-        throwOnError(ret3,"OpenCL_MixIn::TestKernel : retrieving program build log failed: ");
-        { ofstream out("kernel.txt"); out << kernel_source; }
-        ostringstream oss;
-        oss << "OpenCL_MixIn::TestKernel : build failed (kernel saved as kernel.txt):\n\n" << string( build_log.begin(), build_log.end() );
-        throwOnError(ret,oss.str().c_str());
+        wait_list.insert(wait_list.end(),this->read_events.begin(),this->read_events.end());
+        this->reads_are_waited_for = true;
     }
-    clReleaseProgram(temp_program);
+    if(this->last_kernel_event)
+        clReleaseEvent(this->last_kernel_event);
+    this->last_kernel_event = NULL;
+    return clEnqueueNDRangeKernel(this->command_queue,this->kernel,3,NULL,this->global_range,local,
+        (cl_uint)wait_list.size(),wait_list.empty() ? NULL : wait_list.data(),&this->last_kernel_event);
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::StartReadingCurrentBuffers(const vector<void*>& destinations,size_t size)
+{
+    // (the transfer queue is in order, so any earlier reads have finished before these, but they might be of the
+    //  other buffers and so not yet waited for by the kernels, so we make sure of them here)
+    this->FinishReadingCurrentBuffers();
+
+    // the reads wait for the last kernel, and for the writes too in case there were writes but no kernels
+    vector<cl_event> wait_list = this->TakeWritesToWaitFor();
+    if(this->last_kernel_event)
+    {
+        clFlush(this->command_queue);
+        wait_list.push_back(this->last_kernel_event);
+    }
+
+    cl_int ret = CL_SUCCESS;
+    for(size_t i=0;i<destinations.size() && ret==CL_SUCCESS;i++)
+    {
+        cl_event event;
+        if(this->buffers_are_images)
+        {
+            const size_t origin[3] = { 0, 0, 0 };
+            ret = clEnqueueReadImage(this->transfer_queue,this->buffers[this->iCurrentBuffer][i],CL_FALSE,origin,
+                this->image_region,0,0,destinations[i],(cl_uint)wait_list.size(),
+                wait_list.empty() ? NULL : wait_list.data(),&event);
+        }
+        else
+            ret = clEnqueueReadBuffer(this->transfer_queue,this->buffers[this->iCurrentBuffer][i],CL_FALSE,0,size,
+                destinations[i],(cl_uint)wait_list.size(),wait_list.empty() ? NULL : wait_list.data(),&event);
+        if(ret == CL_SUCCESS)
+            this->read_events.push_back(event);
+    }
+    clFlush(this->transfer_queue);
+    if(this->last_kernel_event)
+        clReleaseEvent(this->last_kernel_event);
+    this->last_kernel_event = NULL;
+    this->i_read_buffer = this->iCurrentBuffer;
+    this->reads_are_waited_for = false;
+    if(ret != CL_SUCCESS)
+        this->FinishReadingCurrentBuffers(); // (wait for the ones that were enqueued, since we are about to throw)
+    throwOnError(ret,"OpenCL_MixIn::StartReadingCurrentBuffers : buffer reading failed: ");
+    this->counters.readbacks++;
+    this->counters.bytes_downloaded += size * destinations.size();
+}
+
+// -----------------------------------------------------------------------
+
+bool OpenCL_MixIn::FinishReadingCurrentBuffers()
+{
+    if(this->read_events.empty()) return false;
+
+    cl_int ret = clWaitForEvents((cl_uint)this->read_events.size(),this->read_events.data());
+    for(cl_event event : this->read_events)
+        clReleaseEvent(event);
+    this->read_events.clear();
+    throwOnError(ret,"OpenCL_MixIn::FinishReadingCurrentBuffers : waiting for buffer reading failed: ");
+    this->WaitForWritesToFinish(); // (they were done before the reads began, so this only releases them)
+    return true;
 }
 
 // -----------------------------------------------------------------------
 
 void OpenCL_MixIn::ReleaseOpenCLBuffers()
 {
+    this->FinishReadingCurrentBuffers(); // (the host memory they write to may be about to be freed)
+    this->WaitForWritesToFinish(); // (the host memory they read from may be about to be freed)
+    if(!this->host_memory_arrays.empty())
+    {
+        clFinish(this->command_queue); // (the kernels may still be writing the values)
+        this->DetachArraysFromHostMemory();
+    }
+    this->UnmapBuffers();
     for(int i=0;i<2;i++)
+    {
+        if(!this->host_memory[i].empty())
+            clFinish(this->command_queue); // (the device may still be using the host memory)
         for(vector<cl_mem>::const_iterator it = this->buffers[i].begin();it!=this->buffers[i].end();it++)
             clReleaseMemObject(*it);
+        for(void* memory : this->host_memory[i])
+            FreeAligned(memory);
+        this->buffers[i].clear();
+        this->host_memory[i].clear();
+    }
 }
 
 // -----------------------------------------------------------------------
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_MixIn::CreateChemicalBuffers(int n_chemicals,size_t size)
+{
+    // on CPUs and integrated GPUs the buffers can live in host memory, avoiding all copies
+    cl_bool host_unified_memory = CL_FALSE;
+    cl_int ret = clGetDeviceInfo(this->device_id,CL_DEVICE_HOST_UNIFIED_MEMORY,sizeof(host_unified_memory),&host_unified_memory,NULL);
+    this->use_host_memory = (ret == CL_SUCCESS && host_unified_memory == CL_TRUE);
+    this->buffers_are_images = false;
+
+    // (zero-copy needs page-aligned memory and a size that is a multiple of the cache line)
+    const size_t ALLOCATED_SIZE = (size + 63) & ~size_t(63);
+    for(int io=0;io<2;io++) // we create two buffers for each chemical, and switch between them
+    {
+        this->buffers[io].resize(n_chemicals);
+        for(int ic=0;ic<n_chemicals;ic++)
+        {
+            if(this->use_host_memory)
+            {
+                void* memory = AllocateAligned(ALLOCATED_SIZE,4096);
+                if(!memory)
+                    throw runtime_error("OpenCL_MixIn::CreateChemicalBuffers : failed to allocate host memory");
+                this->host_memory[io].push_back(memory);
+                this->buffers[io][ic] = clCreateBuffer(this->context,CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,ALLOCATED_SIZE,memory,&ret);
+            }
+            else
+                this->buffers[io][ic] = clCreateBuffer(this->context,CL_MEM_READ_WRITE,size,NULL,&ret);
+            throwOnError(ret,"OpenCL_MixIn::CreateChemicalBuffers : buffer creation failed: ");
+        }
+    }
+    this->buffer_size = size;
+}
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_MixIn::CreateChemicalImages(int n_chemicals,const size_t region[3],int channels)
+{
+    // (images are opaque, so even on unified memory devices we copy rather than map)
+    this->use_host_memory = false;
+    this->buffers_are_images = true;
+
+    const cl_image_format format = { cl_channel_order(channels == 4 ? CL_RGBA : CL_R), CL_FLOAT };
+    cl_int ret;
+    for(int io=0;io<2;io++) // we create two images for each chemical, and switch between them
+    {
+        this->buffers[io].resize(n_chemicals);
+        for(int ic=0;ic<n_chemicals;ic++)
+        {
+            if(region[2] > 1)
+                this->buffers[io][ic] = clCreateImage3D(this->context,CL_MEM_READ_WRITE,&format,
+                    region[0],region[1],region[2],0,0,NULL,&ret);
+            else
+                this->buffers[io][ic] = clCreateImage2D(this->context,CL_MEM_READ_WRITE,&format,
+                    region[0],region[1],0,NULL,&ret);
+            throwOnError(ret,"OpenCL_MixIn::CreateChemicalImages : image creation failed: ");
+        }
+    }
+    for(int i=0;i<3;i++)
+        this->image_region[i] = region[i];
+    this->buffer_size = region[0] * region[1] * region[2] * channels * sizeof(float);
+}
+
+// ---------------------------------------------------------------------------
+
+const vector<void*>& OpenCL_MixIn::MapCurrentBuffers()
+{
+    if(!this->mapped_pointers.empty() && this->i_mapped_buffer == this->iCurrentBuffer)
+        return this->mapped_pointers;
+
+    this->UnmapBuffers();
+    const vector<cl_event> wait_list = this->TakeWritesToWaitFor();
+    this->i_mapped_buffer = this->iCurrentBuffer;
+    cl_int ret;
+    for(cl_mem buffer : this->buffers[this->iCurrentBuffer])
+    {
+        // (the command queue is in order, so this waits for the kernels)
+        void* pointer = clEnqueueMapBuffer(this->command_queue,buffer,CL_TRUE,CL_MAP_READ | CL_MAP_WRITE,0,this->buffer_size,
+            (cl_uint)wait_list.size(),wait_list.empty() ? NULL : wait_list.data(),NULL,&ret);
+        throwOnError(ret,"OpenCL_MixIn::MapCurrentBuffers : buffer mapping failed: ");
+        this->mapped_pointers.push_back(pointer);
+    }
+    this->WaitForWritesToFinish(); // (before the host can change what they were reading)
+    this->counters.readbacks++; // (but no bytes are copied)
+    return this->mapped_pointers;
+}
+
+// ---------------------------------------------------------------------------
+
+vtkSmartPointer<vtkDataArray> OpenCL_MixIn::MakeArrayOverHostMemory(vtkDataArray* like,void* memory,vtkIdType n_values)
+{
+    vtkSmartPointer<vtkDataArray> array = vtkSmartPointer<vtkDataArray>::Take(like->NewInstance());
+    array->SetName(like->GetName());
+    array->SetVoidArray(memory, n_values, 1); // (1: the buffer owns the memory, until DetachArraysFromHostMemory)
+    // (forget the arrays that have since been deleted)
+    this->host_memory_arrays.erase(remove_if(this->host_memory_arrays.begin(), this->host_memory_arrays.end(),
+        [](const vtkWeakPointer<vtkDataArray>& a) { return a.GetPointer() == NULL; }), this->host_memory_arrays.end());
+    this->host_memory_arrays.push_back(array.GetPointer());
+    return array;
+}
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_MixIn::DetachArraysFromHostMemory()
+{
+    // (the arrays may be shared with anything - a starting pattern, a filter's output - so rather than replacing
+    //  them we change them in place, so that every reference sees the copy)
+    for(const vtkWeakPointer<vtkDataArray>& weak : this->host_memory_arrays)
+    {
+        vtkDataArray* array = weak.GetPointer();
+        if(!array) continue;
+        vtkSmartPointer<vtkDataArray> own = vtkSmartPointer<vtkDataArray>::Take(array->NewInstance());
+        own->DeepCopy(array);
+        array->ShallowCopy(own); // (shares the copy's storage, letting go of the host memory)
+    }
+    this->host_memory_arrays.clear();
+}
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_MixIn::UnmapBuffers()
+{
+    for(size_t i=0;i<this->mapped_pointers.size();i++)
+        clEnqueueUnmapMemObject(this->command_queue,this->buffers[this->i_mapped_buffer][i],this->mapped_pointers[i],0,NULL,NULL);
+    this->mapped_pointers.clear();
+}
+
+// ---------------------------------------------------------------------------
+
+/// Kernels that reduce a buffer of n values to sums for each work-group: first the minimum, maximum and the sums of
+/// (value - shift) and its square, then (given the range) the counts in each histogram bin.
+static string GetStatisticsKernelSource(const string& data_type_string,size_t group_size,int n_bins)
+{
+    ostringstream kernel_source;
+    if(data_type_string == "double")
+    {
+        kernel_source << "\
+#ifdef cl_khr_fp64\n\
+    #pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\
+#elif defined(cl_amd_fp64)\n\
+    #pragma OPENCL EXTENSION cl_amd_fp64 : enable\n\
+#endif\n\n";
+    }
+    kernel_source << "#define T " << data_type_string << "\n";
+    kernel_source << "#define GROUP_SIZE " << group_size << "\n";
+    kernel_source << "#define N_BINS " << n_bins << "\n\n";
+    kernel_source << "\
+kernel void partial_moments(global const T* values,const ulong n,const T shift,global T* partials)\n\
+{\n\
+    local T s_min[GROUP_SIZE], s_max[GROUP_SIZE], s_sum[GROUP_SIZE], s_sum2[GROUP_SIZE];\n\
+    const size_t lid = get_local_id(0);\n\
+    T lo = INFINITY, hi = -INFINITY, sum = 0, sum2 = 0;\n\
+    for(ulong i = get_global_id(0); i < n; i += get_global_size(0))\n\
+    {\n\
+        const T value = values[i];\n\
+        lo = fmin(lo, value);\n\
+        hi = fmax(hi, value);\n\
+        const T d = value - shift;\n\
+        sum += d;\n\
+        sum2 += d * d;\n\
+    }\n\
+    s_min[lid] = lo; s_max[lid] = hi; s_sum[lid] = sum; s_sum2[lid] = sum2;\n\
+    barrier(CLK_LOCAL_MEM_FENCE);\n\
+    for(size_t s = GROUP_SIZE / 2; s > 0; s >>= 1)\n\
+    {\n\
+        if(lid < s)\n\
+        {\n\
+            s_min[lid] = fmin(s_min[lid], s_min[lid + s]);\n\
+            s_max[lid] = fmax(s_max[lid], s_max[lid + s]);\n\
+            s_sum[lid] += s_sum[lid + s];\n\
+            s_sum2[lid] += s_sum2[lid + s];\n\
+        }\n\
+        barrier(CLK_LOCAL_MEM_FENCE);\n\
+    }\n\
+    if(lid == 0)\n\
+    {\n\
+        global T* p = partials + 4 * get_group_id(0);\n\
+        p[0] = s_min[0]; p[1] = s_max[0]; p[2] = s_sum[0]; p[3] = s_sum2[0];\n\
+    }\n\
+}\n\
+\n\
+kernel void partial_histogram(global const T* values,const ulong n,const T low,const T scale,global uint* partials)\n\
+{\n\
+    local uint counts[N_BINS];\n\
+    for(size_t b = get_local_id(0); b < N_BINS; b += GROUP_SIZE)\n\
+        counts[b] = 0;\n\
+    barrier(CLK_LOCAL_MEM_FENCE);\n\
+    for(ulong i = get_global_id(0); i < n; i += get_global_size(0))\n\
+    {\n\
+        const T x = (values[i] - low) * scale;\n\
+        atomic_inc(&counts[x >= N_BINS ? N_BINS - 1 : (x > 0 ? (int)x : 0)]);\n\
+    }\n\
+    barrier(CLK_LOCAL_MEM_FENCE);\n\
+    for(size_t b = get_local_id(0); b < N_BINS; b += GROUP_SIZE)\n\
+        partials[N_BINS * get_group_id(0) + b] = counts[b];\n\
+}\n";
+    return kernel_source.str();
+}
+
+// ---------------------------------------------------------------------------
+
+/// Set a kernel argument of the reduction's value type, from a double.
+static cl_int SetValueArg(cl_kernel kernel,cl_uint index,bool is_double,double value)
+{
+    if(is_double)
+        return clSetKernelArg(kernel,index,sizeof(cl_double),&value);
+    const cl_float float_value = static_cast<cl_float>(value);
+    return clSetKernelArg(kernel,index,sizeof(cl_float),&float_value);
+}
+
+// ---------------------------------------------------------------------------
+
+vector<ChemicalStatistics> OpenCL_MixIn::ComputeStatisticsOfCurrentBuffers(size_t n,const string& data_type_string,
+    int n_bins)
+{
+    cl_int ret;
+    if(!this->statistics_program)
+    {
+        // (the work-group size must be a power of 2 for the tree reduction)
+        size_t max_group_size = 1;
+        clGetDeviceInfo(this->device_id,CL_DEVICE_MAX_WORK_GROUP_SIZE,sizeof(max_group_size),&max_group_size,NULL);
+        this->statistics_group_size = 1;
+        while(this->statistics_group_size * 2 <= min(max_group_size, size_t(64)))
+            this->statistics_group_size *= 2;
+    }
+    const string source = GetStatisticsKernelSource(data_type_string,this->statistics_group_size,n_bins);
+    if(source != this->statistics_source)
+    {
+        this->ReleaseStatisticsProgram();
+        this->statistics_program = OpenCL_Registry::AcquireProgram(this->context,this->device_id,source);
+        this->statistics_source = source;
+        this->moments_kernel = clCreateKernel(this->statistics_program,"partial_moments",&ret);
+        throwOnError(ret,"OpenCL_MixIn::ComputeStatisticsOfCurrentBuffers : kernel creation failed: ");
+        this->histogram_kernel = clCreateKernel(this->statistics_program,"partial_histogram",&ret);
+        throwOnError(ret,"OpenCL_MixIn::ComputeStatisticsOfCurrentBuffers : kernel creation failed: ");
+    }
+
+    // a few work-groups per compute unit is enough to keep the device busy, and keeps the read-back small
+    cl_uint n_compute_units = 1;
+    clGetDeviceInfo(this->device_id,CL_DEVICE_MAX_COMPUTE_UNITS,sizeof(n_compute_units),&n_compute_units,NULL);
+    const size_t GROUP_SIZE = this->statistics_group_size;
+    const size_t N_GROUPS = max(size_t(1), min(size_t(4 * n_compute_units), (n + GROUP_SIZE - 1) / GROUP_SIZE));
+    const size_t GLOBAL_SIZE = N_GROUPS * GROUP_SIZE;
+    const bool IS_DOUBLE = data_type_string == "double";
+    const size_t VALUE_SIZE = IS_DOUBLE ? sizeof(cl_double) : sizeof(cl_float);
+    const cl_ulong N = n;
+
+    // how many values each work-group sees (each work-item takes every GLOBAL_SIZE'th value from its global id)
+    vector<PartialStatistics> partials(N_GROUPS);
+    for(size_t g=0;g<N_GROUPS;g++)
+    {
+        partials[g].count = 0;
+        for(size_t id=g*GROUP_SIZE;id<(g+1)*GROUP_SIZE && id<n;id++)
+            partials[g].count += (n - 1 - id) / GLOBAL_SIZE + 1;
+    }
+
+    cl_mem partials_buffer = clCreateBuffer(this->context,CL_MEM_WRITE_ONLY,
+        N_GROUPS * max(4 * VALUE_SIZE, n_bins * sizeof(cl_uint)),NULL,&ret);
+    throwOnError(ret,"OpenCL_MixIn::ComputeStatisticsOfCurrentBuffers : buffer creation failed: ");
+    vector<unsigned char> moments(N_GROUPS * 4 * VALUE_SIZE);
+    vector<cl_uint> counts(N_GROUPS * n_bins);
+
+    vector<cl_event> wait_list = this->TakeWritesToWaitFor(); // (for the first command, the others are after it)
+    vector<ChemicalStatistics> statistics;
+    for(cl_mem values : this->buffers[this->iCurrentBuffer])
+    {
+        // the sums are taken relative to the first value, since the values may be far from zero
+        double shift = 0.0;
+        if(n > 0)
+        {
+            unsigned char first[sizeof(cl_double)];
+            ret = clEnqueueReadBuffer(this->command_queue,values,CL_TRUE,0,VALUE_SIZE,first,
+                (cl_uint)wait_list.size(),wait_list.empty() ? NULL : wait_list.data(),NULL);
+            wait_list.clear();
+            if(ret != CL_SUCCESS) break;
+            shift = IS_DOUBLE ? *reinterpret_cast<cl_double*>(first) : *reinterpret_cast<cl_float*>(first);
+        }
+
+        ret = clSetKernelArg(this->moments_kernel,0,sizeof(cl_mem),&values);
+        ret |= clSetKernelArg(this->moments_kernel,1,sizeof(cl_ulong),&N);
+        ret |= SetValueArg(this->moments_kernel,2,IS_DOUBLE,shift);
+        ret |= clSetKernelArg(this->moments_kernel,3,sizeof(cl_mem),&partials_buffer);
+        if(ret != CL_SUCCESS) break;
+        ret = clEnqueueNDRangeKernel(this->command_queue,this->moments_kernel,1,NULL,&GLOBAL_SIZE,&GROUP_SIZE,0,NULL,NULL);
+        if(ret != CL_SUCCESS) break;
+        ret = clEnqueueReadBuffer(this->command_queue,partials_buffer,CL_TRUE,0,moments.size(),moments.data(),0,NULL,NULL);
+        if(ret != CL_SUCCESS) break;
+        this->counters.kernel_launches++;
+        this->counters.bytes_downloaded += VALUE_SIZE + moments.size();
+        for(size_t g=0;g<N_GROUPS;g++)
+        {
+            double m[4];
+            for(int i=0;i<4;i++)
+            {
+                const unsigned char* p = &moments[(4 * g + i) * VALUE_SIZE];
+                m[i] = IS_DOUBLE ? *reinterpret_cast<const cl_double*>(p) : *reinterpret_cast<const cl_float*>(p);
+            }
+            partials[g].minimum = m[0];
+            partials[g].maximum = m[1];
+            partials[g].sum = m[2];
+            partials[g].sum_of_squares = m[3];
+        }
+        ChemicalStatistics chemical_statistics = CombinePartialStatistics(partials,shift);
+
+        // with the range known, count the values in each bin
+        ret = clSetKernelArg(this->histogram_kernel,0,sizeof(cl_mem),&values);
+        ret |= clSetKernelArg(this->histogram_kernel,1,sizeof(cl_ulong),&N);
+        ret |= SetValueArg(this->histogram_kernel,2,IS_DOUBLE,chemical_statistics.minimum);
+        ret |= SetValueArg(this->histogram_kernel,3,IS_DOUBLE,
+            GetHistogramScale(chemical_statistics.minimum,chemical_statistics.maximum,n_bins));
+        ret |= clSetKernelArg(this->histogram_kernel,4,sizeof(cl_mem),&partials_buffer);
+        if(ret != CL_SUCCESS) break;
+        ret = clEnqueueNDRangeKernel(this->command_queue,this->histogram_kernel,1,NULL,&GLOBAL_SIZE,&GROUP_SIZE,0,NULL,NULL);
+        if(ret != CL_SUCCESS) break;
+        ret = clEnqueueReadBuffer(this->command_queue,partials_buffer,CL_TRUE,0,counts.size() * sizeof(cl_uint),counts.data(),
+            0,NULL,NULL);
+        if(ret != CL_SUCCESS) break;
+        this->counters.kernel_launches++;
+        this->counters.bytes_downloaded += counts.size() * sizeof(cl_uint);
+        chemical_statistics.histogram.assign(n_bins,0);
+        for(size_t g=0;g<N_GROUPS;g++)
+            for(int b=0;b<n_bins;b++)
+                chemical_statistics.histogram[b] += counts[g * n_bins + b];
+
+        statistics.push_back(chemical_statistics);
+    }
+    clReleaseMemObject(partials_buffer);
+    throwOnError(ret,"OpenCL_MixIn::ComputeStatisticsOfCurrentBuffers : reduction failed: ");
+    return statistics;
+}
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_MixIn::ReleaseStatisticsProgram()
+{
+    clReleaseKernel(this->moments_kernel);
+    clReleaseKernel(this->histogram_kernel);
+    if(this->statistics_program)
+        OpenCL_Registry::ReleaseProgram(this->statistics_program);
+    this->moments_kernel = this->histogram_kernel = NULL;
+    this->statistics_program = NULL;
+    this->statistics_source.clear();
+}
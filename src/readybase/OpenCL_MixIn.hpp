@@ -27,16 +27,27 @@
     #include "OpenCL_Dyn_Load.h"
 #endif
 
+// local:
+#include "PerformanceCounters.hpp"
+#include "Statistics.hpp"
+
 // STL:
+#include <future>
 #include <vector>
 #include <string>
 
+// VTK:
+#include <vtkDataArray.h>
+#include <vtkSmartPointer.h>
+#include <vtkWeakPointer.h>
+
 /// OpenCL functionality, for adding to those implementations that use it.
 class OpenCL_MixIn
 {
     public:
 
-        OpenCL_MixIn(int opencl_platform,int opencl_device);
+        /// The builds, transfers and kernel launches are added to counters, which must outlive this object.
+        OpenCL_MixIn(int opencl_platform,int opencl_device,PerformanceCounters& counters);
         virtual ~OpenCL_MixIn();
     
         void SetPlatform(int i);
@@ -59,6 +70,71 @@ class OpenCL_MixIn
         /// Test a kernel string for errors on the current device.
         void TestKernel(std::string s);
 
+        /// A kernel source, together with the local work size it was assembled for.
+        struct KernelCandidate
+        {
+            std::string source;
+            size_t local_work_size[3];
+            bool uses_local_memory;
+            int super_time_stepping_stages; ///< stages per timestep, or 0 for a forward-Euler kernel
+        };
+
+        /// Start building the candidates in order on a background thread, keeping the last one that builds.
+        void StartBuildingProgram(const std::vector<KernelCandidate>& candidates);
+        /// Has a background build been started whose result hasn't been collected yet?
+        bool HasPendingProgram() const;
+        /// Has the background build finished (successfully or not)?
+        bool IsPendingProgramReady() const;
+        /// Wait for the background build and swap in its program and kernel. Throws if the build failed.
+        void CollectPendingProgram();
+        /// Wait for the background build (if any) and throw away the result.
+        void DiscardPendingProgram();
+        /// Release the kernel, e.g. when it no longer matches the buffers.
+        void ReleaseKernel();
+        /// Pass the coefficients of stage j (from 1 to kernel_stages) to a super-time-stepping kernel, as the three
+        /// arguments from first_arg on.
+        void SetSuperTimeSteppingArgs(int first_arg,int j,bool double_precision);
+
+        /// Enqueue a non-blocking write on the transfer queue. The data must stay valid and unchanged until
+        /// WaitForWritesToFinish, which FinishReadingCurrentBuffers and MapCurrentBuffers call before returning.
+        void EnqueueWrite(cl_mem buffer,size_t size,const void* data);
+        /// Enqueue a non-blocking write of a whole chemical image, as for EnqueueWrite. (buffers_are_images only)
+        void EnqueueWriteImage(cl_mem image,const void* data);
+        /// Return the writes that the next command on the command queue must wait for, as its event wait list. (The
+        /// queue is in order, so the commands after it wait for them too.)
+        std::vector<cl_event> TakeWritesToWaitFor();
+        /// Block until all the writes have been made, so that the host can change the data they were reading.
+        void WaitForWritesToFinish();
+        /// Enqueue the kernel over global_range, writing to buffers[i_output]. It waits for any writes, and for any
+        /// reads of the buffers that it overwrites.
+        cl_int EnqueueKernel(int i_output,const size_t* local);
+        /// Start copying the current buffers to the destinations once the kernels have finished, without waiting. The
+        /// destinations must not be touched until FinishReadingCurrentBuffers; meanwhile more kernels can run.
+        void StartReadingCurrentBuffers(const std::vector<void*>& destinations,size_t size);
+        /// Block until the reads started by StartReadingCurrentBuffers have finished. Returns false if there were none.
+        bool FinishReadingCurrentBuffers();
+
+        /// Create the two buffers for each chemical. If the device shares memory with the host then they are created
+        /// over aligned host memory, so that mapping them costs nothing and the host can work on that memory directly.
+        void CreateChemicalBuffers(int n_chemicals,size_t size);
+        /// Map the current buffers for the host to read and write, returning their host addresses. (use_host_memory only)
+        const std::vector<void*>& MapCurrentBuffers();
+        /// Make an array of the same type and name as like over n_values at memory, one of the mapped buffers. Arrays
+        /// made this way are given their own copy of the values before the buffers are released, so they stay valid
+        /// wherever they have been shallow-copied to. (use_host_memory only)
+        vtkSmartPointer<vtkDataArray> MakeArrayOverHostMemory(vtkDataArray* like,void* memory,vtkIdType n_values);
+        /// Create two image objects for each chemical instead of buffers, of region texels of channels floats
+        /// (1 or 4) each, so that kernels can read them through the texture cache with hardware boundary addressing.
+        /// They are 3D if region[2] > 1. Transfers are always copies, never host memory.
+        void CreateChemicalImages(int n_chemicals,const size_t region[3],int channels);
+        /// Hand the mapped buffers back to the device, before the kernels use them.
+        void UnmapBuffers();
+
+        /// Summarise the current buffer of each chemical (n values of data_type_string) on the device, into n_bins
+        /// histogram bins. Only the sums from each work-group are read back, not the values.
+        std::vector<ChemicalStatistics> ComputeStatisticsOfCurrentBuffers(size_t n,const std::string& data_type_string,
+            int n_bins);
+
     protected:
 
         cl_context context;
@@ -68,18 +144,56 @@ class OpenCL_MixIn
         std::string kernel_function_name;
         size_t global_range[3];
         size_t local_work_size[3];
+        bool kernel_uses_local_memory; ///< was the running kernel built to use local memory? (the setting may have changed since)
+        int kernel_stages; ///< how many stages the running kernel takes per timestep, or 0 if it takes a forward-Euler step
 
         cl_command_queue command_queue;
+        cl_command_queue transfer_queue; ///< (both queues belong to the shared context)
 
         bool need_reload_context,need_write_to_opencl_buffers;
 
         std::vector<cl_mem> buffers[2];
         int iCurrentBuffer;
+        bool use_host_memory; ///< do the buffers live in host memory? (when the device reports unified memory)
+        bool buffers_are_images; ///< were the chemicals created by CreateChemicalImages?
 
         std::string kernel_source;
 
+        PerformanceCounters& counters;
+
     private:
 
+        struct BuiltProgram
+        {
+            cl_program program;
+            KernelCandidate candidate;
+            double build_seconds;
+        };
+        std::future<BuiltProgram> pending_program;
+
+        void ReleaseStatisticsProgram();
+
+        std::vector<cl_event> write_events;   ///< writes that the next kernel must wait for
+        std::vector<cl_event> writes_in_flight; ///< writes that the kernels wait for but the host hasn't yet
+        cl_event last_kernel_event;           ///< the kernel that the next reads must wait for, if any
+        std::vector<cl_event> read_events;    ///< reads started by StartReadingCurrentBuffers
+        int i_read_buffer;                    ///< which buffers they are reading
+        bool reads_are_waited_for;            ///< has a kernel that overwrites those buffers been made to wait for them?
+
+        std::vector<void*> host_memory[2];    ///< the aligned storage behind buffers[2], when use_host_memory
+        std::vector<vtkWeakPointer<vtkDataArray>> host_memory_arrays; ///< made by MakeArrayOverHostMemory
+        /// Give each array over host memory that is still in use its own copy of the values.
+        void DetachArraysFromHostMemory();
+        std::vector<void*> mapped_pointers;   ///< where buffers[i_mapped_buffer] are mapped, if they are
+        int i_mapped_buffer;
+        size_t buffer_size;
+        size_t image_region[3];               ///< the size of each image in texels, when buffers_are_images
+
+        cl_program statistics_program;          ///< the reduction kernels used by ComputeStatisticsOfCurrentBuffers
+        cl_kernel moments_kernel,histogram_kernel;
+        std::string statistics_source;          ///< what statistics_program was built from
+        size_t statistics_group_size;
+
         int iPlatform,iDevice;
 };
 
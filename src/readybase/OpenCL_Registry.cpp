@@ -0,0 +1,290 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "OpenCL_Registry.hpp"
+using namespace OpenCL_utils;
+
+// STL:
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+
+namespace
+{
+    struct ContextEntry
+    {
+        int iPlatform,iDevice;
+        OpenCL_Registry::SharedContext shared;
+        int n_users;
+    };
+
+    struct ProgramEntry
+    {
+        cl_context context;
+        size_t source_hash;
+        string source;
+        cl_program program; ///< the pool holds one reference, and each user another
+        int n_users;
+        unsigned long last_used;
+    };
+
+    const int MAX_UNUSED_PROGRAMS = 16; ///< how many programs to keep around after the last user has released them
+
+    mutex registry_mutex; // (programs can be acquired from worker threads)
+    vector<ContextEntry> contexts;
+    vector<ProgramEntry> programs;
+    unsigned long use_count = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+static cl_program BuildProgramFromSource(cl_context context, cl_device_id device_id, const string& kernel_source)
+{
+    cl_int ret;
+
+    // create the program
+    const char *source = kernel_source.c_str();
+    size_t source_size = kernel_source.length();
+    cl_program program = clCreateProgramWithSource(context,1,&source,&source_size,&ret);
+    throwOnError(ret,"OpenCL_Registry::AcquireProgram : Failed to create program with source: ");
+
+    // build the program
+    ret = clBuildProgram(program,1,&device_id,"-cl-denorms-are-zero",NULL,NULL);
+    if(ret != CL_SUCCESS)
+    {
+        size_t build_log_length = 0;
+        cl_int ret2 = clGetProgramBuildInfo(program,device_id,CL_PROGRAM_BUILD_LOG,0,0,&build_log_length);
+        vector<char> build_log(build_log_length);
+        cl_int ret3 = clGetProgramBuildInfo(program,device_id,CL_PROGRAM_BUILD_LOG,build_log_length,build_log.data(),0);
+        clReleaseProgram(program);
+        throwOnError(ret2,"OpenCL_Registry::AcquireProgram : retrieving length of program build log failed: ");
+        throwOnError(ret3,"OpenCL_Registry::AcquireProgram : retrieving program build log failed: ");
+        { ofstream out("kernel.txt"); out << kernel_source; }
+        ostringstream oss;
+        oss << "OpenCL_Registry::AcquireProgram : build failed (kernel saved as kernel.txt):\n\n" << string( build_log.begin(), build_log.end() );
+        throwOnError(ret,oss.str().c_str());
+    }
+    return program;
+}
+
+// ---------------------------------------------------------------------------
+
+static cl_device_id GetDeviceID(int iPlatform,int iDevice)
+{
+    cl_int ret;
+
+    // retrieve our chosen platform
+    cl_platform_id platform_id;
+    {
+        cl_uint num_platforms = 0;
+        ret = clGetPlatformIDs( 0, 0, &num_platforms );
+        if(ret != CL_SUCCESS || num_platforms==0)
+        {
+            throw runtime_error("No OpenCL platforms available");
+            // currently only likely to see this when running in a virtualized OS, where an opencl.dll is found but doesn't work
+        }
+        if(iPlatform >= (int)num_platforms)
+            throw runtime_error("OpenCL_Registry::AcquireContext : too few platforms available");
+        vector<cl_platform_id> platforms_available( num_platforms );
+        ret = clGetPlatformIDs( num_platforms, platforms_available.data(), 0 );
+        if(ret != CL_SUCCESS)
+        {
+            throw runtime_error("Failed to retrieve OpenCL platforms");
+            // currently only likely to see this when running in a virtualized OS, where an opencl.dll is found but doesn't work
+        }
+        platform_id = platforms_available[iPlatform];
+    }
+
+    // retrieve our chosen device
+    cl_uint num_devices = 0;
+    ret = clGetDeviceIDs(platform_id,CL_DEVICE_TYPE_ALL,0,0,&num_devices);
+    throwOnError(ret,"OpenCL_Registry::AcquireContext : Failed to retrieve number of device IDs: ");
+    if(iDevice >= (int)num_devices)
+        throw runtime_error("OpenCL_Registry::AcquireContext : too few devices available");
+
+    vector<cl_device_id> devices_available(num_devices);
+    ret = clGetDeviceIDs(platform_id,CL_DEVICE_TYPE_ALL,num_devices,devices_available.data(),0);
+    throwOnError(ret,"OpenCL_Registry::AcquireContext : Failed to retrieve device IDs: ");
+    return devices_available[iDevice];
+}
+
+// ---------------------------------------------------------------------------
+
+static void ReleaseUnusedPrograms(size_t n_to_keep)
+{
+    // (registry_mutex must be held)
+    for(;;)
+    {
+        vector<ProgramEntry>::iterator oldest = programs.end();
+        size_t n_unused = 0;
+        for(vector<ProgramEntry>::iterator it = programs.begin(); it != programs.end(); it++)
+        {
+            if(it->n_users > 0) continue;
+            n_unused++;
+            if(oldest == programs.end() || it->last_used < oldest->last_used)
+                oldest = it;
+        }
+        if(n_unused <= n_to_keep) break;
+        clReleaseProgram(oldest->program);
+        programs.erase(oldest);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+OpenCL_Registry::SharedContext OpenCL_Registry::AcquireContext(int iPlatform,int iDevice)
+{
+    lock_guard<mutex> lock(registry_mutex);
+
+    for(ContextEntry& entry : contexts)
+    {
+        if(entry.iPlatform == iPlatform && entry.iDevice == iDevice)
+        {
+            entry.n_users++;
+            return entry.shared;
+        }
+    }
+
+    ContextEntry entry;
+    entry.iPlatform = iPlatform;
+    entry.iDevice = iDevice;
+    entry.n_users = 1;
+    entry.shared.device_id = GetDeviceID(iPlatform,iDevice);
+
+    // create the context
+    cl_int ret;
+    entry.shared.context = clCreateContext(NULL,1,&entry.shared.device_id,NULL,NULL,&ret);
+    throwOnError(ret,"OpenCL_Registry::AcquireContext : Failed to create context: ");
+
+    // create the command queues
+    entry.shared.command_queue = clCreateCommandQueue(entry.shared.context,entry.shared.device_id,0,&ret);
+    if(ret != CL_SUCCESS)
+    {
+        clReleaseContext(entry.shared.context);
+        throwOnError(ret,"OpenCL_Registry::AcquireContext : Failed to create command queue: ");
+    }
+    entry.shared.transfer_queue = clCreateCommandQueue(entry.shared.context,entry.shared.device_id,0,&ret);
+    if(ret != CL_SUCCESS)
+    {
+        clReleaseCommandQueue(entry.shared.command_queue);
+        clReleaseContext(entry.shared.context);
+        throwOnError(ret,"OpenCL_Registry::AcquireContext : Failed to create transfer queue: ");
+    }
+
+    contexts.push_back(entry);
+    return entry.shared;
+}
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_Registry::ReleaseContext(cl_context context)
+{
+    lock_guard<mutex> lock(registry_mutex);
+
+    vector<ContextEntry>::iterator it = find_if(contexts.begin(), contexts.end(),
+        [context](const ContextEntry& entry) { return entry.shared.context == context; });
+    if(it == contexts.end()) return;
+    if(--it->n_users > 0) return;
+
+    // the pool's programs for this context are no use to anyone now (users still hold their own references)
+    for(vector<ProgramEntry>::iterator prog = programs.begin(); prog != programs.end(); )
+    {
+        if(prog->context == context)
+        {
+            clReleaseProgram(prog->program);
+            prog = programs.erase(prog);
+        }
+        else prog++;
+    }
+
+    clReleaseCommandQueue(it->shared.command_queue);
+    clReleaseCommandQueue(it->shared.transfer_queue);
+    clReleaseContext(it->shared.context);
+    contexts.erase(it);
+}
+
+// ---------------------------------------------------------------------------
+
+cl_program OpenCL_Registry::AcquireProgram(cl_context context,cl_device_id device_id,const string& source)
+{
+    const size_t source_hash = hash<string>()(source);
+    auto find_in_pool = [&]() {
+        return find_if(programs.begin(), programs.end(), [&](const ProgramEntry& entry) {
+            return entry.context == context && entry.source_hash == source_hash && entry.source == source; });
+    };
+
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        vector<ProgramEntry>::iterator it = find_in_pool();
+        if(it != programs.end())
+        {
+            it->n_users++;
+            it->last_used = ++use_count;
+            clRetainProgram(it->program);
+            return it->program;
+        }
+    }
+
+    // build without holding the lock, so that other threads can carry on using the pool
+    cl_program program = BuildProgramFromSource(context,device_id,source);
+
+    lock_guard<mutex> lock(registry_mutex);
+    vector<ProgramEntry>::iterator it = find_in_pool();
+    if(it != programs.end())
+    {
+        // another thread built the same source meanwhile, use theirs
+        clReleaseProgram(program);
+        it->n_users++;
+        it->last_used = ++use_count;
+        clRetainProgram(it->program);
+        return it->program;
+    }
+    if(find_if(contexts.begin(), contexts.end(), [context](const ContextEntry& entry) { return entry.shared.context == context; }) == contexts.end())
+        return program; // (not one of our contexts, so don't pool it)
+    programs.push_back({ context, source_hash, source, program, 1, ++use_count });
+    clRetainProgram(program);
+    return program;
+}
+
+// ---------------------------------------------------------------------------
+
+void OpenCL_Registry::ReleaseProgram(cl_program program)
+{
+    lock_guard<mutex> lock(registry_mutex);
+
+    for(ProgramEntry& entry : programs)
+    {
+        if(entry.program == program && entry.n_users > 0)
+        {
+            entry.n_users--;
+            break;
+        }
+    }
+    clReleaseProgram(program);
+    ReleaseUnusedPrograms(MAX_UNUSED_PROGRAMS);
+}
+
+// ---------------------------------------------------------------------------
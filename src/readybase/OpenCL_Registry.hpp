@@ -0,0 +1,55 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __OPENCLREGISTRY__
+#define __OPENCLREGISTRY__
+
+// local:
+#include "OpenCL_utils.hpp"
+
+// STL:
+#include <string>
+
+/// Process-wide cache of OpenCL contexts and built programs, so that systems on the same device share them.
+namespace OpenCL_Registry
+{
+    /// A context with its command queues, shared by all the systems that use the same device. Since the queues are
+    /// shared, a clFinish on one of them waits for the work of every system on that device, not only the caller's;
+    /// wait on events instead where only one's own work matters.
+    struct SharedContext
+    {
+        cl_device_id device_id;
+        cl_context context;
+        cl_command_queue command_queue;  ///< for running kernels
+        cl_command_queue transfer_queue; ///< for copying data to and from the device, linked to command_queue by events
+    };
+
+    /// Returns the shared context for this device, creating it if needed. Every call must be matched by ReleaseContext.
+    SharedContext AcquireContext(int iPlatform,int iDevice);
+
+    /// Releases a context from AcquireContext. The context and its programs are freed when no longer in use.
+    void ReleaseContext(cl_context context);
+
+    /// Returns a program built from this source, from the pool if it has been built before. Every call must be matched
+    /// by ReleaseProgram. Throws with the build log on error. Can be called from any thread.
+    cl_program AcquireProgram(cl_context context,cl_device_id device_id,const std::string& source);
+
+    /// Releases a program from AcquireProgram. It stays in the pool for a while, in case the same source is needed again.
+    void ReleaseProgram(cl_program program);
+}
+
+#endif
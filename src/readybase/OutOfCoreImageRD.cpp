@@ -0,0 +1,694 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "OutOfCoreImageRD.hpp"
+#include "overlays.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+/// Along one axis: where a tile starts, how wide it is, and the part that is written back.
+struct TileSpan
+{
+    int origin,size,core_origin,core_size;
+};
+
+// ---------------------------------------------------------------------------------------------------------
+
+static vector<TileSpan> GetTileSpans(int n,int tile_size,int halo,bool wrap)
+{
+    vector<TileSpan> spans;
+    if(n <= tile_size)
+    {
+        // the whole axis fits in a tile, so the kernel handles the boundary itself
+        spans.push_back({0,n,0,n});
+        return spans;
+    }
+    const int core_size = tile_size - 2 * halo;
+    if(core_size < 1)
+        throw runtime_error("OutOfCoreImageRD::GetTiles : tile_size is too small for the halo of steps_per_pass * stencil_radius");
+    for(int core_origin=0;core_origin<n;core_origin+=core_size)
+    {
+        const int size = min(core_size,n - core_origin);
+        if(wrap)
+            spans.push_back({core_origin - halo,tile_size,core_origin,size}); // (the halo wraps around)
+        else
+        {
+            // stop at the edges, where the kernel applies the boundary
+            const int origin = max(0,core_origin - halo);
+            spans.push_back({origin,min(n,core_origin + size + halo) - origin,core_origin,size});
+        }
+    }
+    return spans;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+/// The start of the temporary volume names; BrickedVolume::Open makes each one unique.
+static string GetTemporaryVolumePrefix()
+{
+    const char* folder = getenv("TMPDIR");
+    return string(folder && folder[0] ? folder : "/tmp") + "/ready_volume";
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+/// The path from the root, so that a saved file can refer to its volume files from wherever it is loaded.
+static string GetAbsolutePath(const string& path)
+{
+#ifndef _WIN32
+    if(!path.empty() && path[0] != '/')
+    {
+        char folder[PATH_MAX];
+        if(getcwd(folder,sizeof(folder)))
+            return string(folder) + "/" + path;
+    }
+#endif
+    return path;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+OutOfCoreImageRD::OutOfCoreImageRD(int data_type)
+    : NativeKernelImageRD(data_type)
+    , brick_size(32)
+    , tile_size(128)
+    , steps_per_pass(4)
+    , stencil_radius(1)
+    , i_current_volume(0)
+    , volume_was_reopened(false)
+{
+    for(int i=0;i<3;i++)
+    {
+        this->volume_dimensions[i] = 0;
+        this->preview_stride[i] = 1;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
+{
+    // the images are the preview; the grid itself goes in the volume files
+    NativeKernelImageRD::AllocateImages(x,y,z,nc,data_type);
+    const int preview_dimensions[3] = { x, y, z };
+    for(int i=0;i<3;i++)
+    {
+        if(this->volume_dimensions[i] < preview_dimensions[i])
+            this->volume_dimensions[i] = preview_dimensions[i];
+        this->preview_stride[i] = (this->volume_dimensions[i] + preview_dimensions[i] - 1) / preview_dimensions[i];
+    }
+
+    const string base_name = this->storage.empty() ? GetTemporaryVolumePrefix() : this->storage;
+    bool was_reopened = false;
+    for(int i=0;i<2;i++)
+    {
+        ostringstream filename;
+        filename << base_name << "." << i;
+        const bool reopened = this->volumes[i].Open(filename.str(),this->volume_dimensions,nc,(int)this->data_type_size,
+            this->brick_size,this->storage.empty());
+        if(i == this->i_current_volume)
+            was_reopened = reopened; // (the other volume is written before it is read, so it needn't have values)
+    }
+    this->volume_was_reopened = was_reopened;
+    if(!was_reopened)
+        this->i_current_volume = 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vector<OutOfCoreImageRD::Tile> OutOfCoreImageRD::GetTiles() const
+{
+    const int block_size[3] = { this->GetBlockSizeX(), this->GetBlockSizeY(), this->GetBlockSizeZ() };
+    vector<TileSpan> spans[3];
+    for(int i=0;i<3;i++)
+    {
+        // (tiles must be made of whole blocks)
+        if(this->tile_size % block_size[i] != 0 || this->volume_dimensions[i] % block_size[i] != 0)
+            throw runtime_error("OutOfCoreImageRD::GetTiles : tile_size and the dimensions must be multiples of the block size");
+        const int halo = (this->steps_per_pass * this->stencil_radius + block_size[i] - 1) / block_size[i] * block_size[i];
+        spans[i] = GetTileSpans(this->volume_dimensions[i],this->tile_size,halo,this->wrap);
+    }
+    // (in the order of the bricks in the volume files, so that they are read through from start to end)
+    vector<Tile> tiles;
+    for(const TileSpan& z : spans[2])
+    {
+        for(const TileSpan& y : spans[1])
+        {
+            for(const TileSpan& x : spans[0])
+            {
+                Tile tile = { { x.origin, y.origin, z.origin }, { x.size, y.size, z.size },
+                              { x.core_origin, y.core_origin, z.core_origin }, { x.core_size, y.core_size, z.core_size } };
+                tiles.push_back(tile);
+            }
+        }
+    }
+    return tiles;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+int OutOfCoreImageRD::MeasureStencilRadius()
+{
+    const int NC = this->GetNumberOfChemicals();
+    const size_t VALUE_SIZE = this->data_type_size;
+    const int block_size[3] = { this->GetBlockSizeX(), this->GetBlockSizeY(), this->GetBlockSizeZ() };
+
+    // a patch that is wider than the stencil that stencil_radius allows, so that a wider one shows
+    int size[3];
+    size_t global_range[3];
+    for(int i=0;i<3;i++)
+    {
+        size[i] = 1;
+        if(this->volume_dimensions[i] > 1)
+        {
+            size[i] = 16; // (a power of 2, for kernels that wrap with a mask)
+            while(size[i] < 4 * (this->stencil_radius + 1) || size[i] % block_size[i] != 0)
+                size[i] *= 2;
+        }
+        global_range[i] = max(1, size[i] / block_size[i]);
+    }
+    const size_t N = size_t(size[0]) * size[1] * size[2];
+    const int centre[3] = { size[0] / 2, size[1] / 2, size[2] / 2 };
+    const size_t i_centre = (size_t(centre[2]) * size[1] + centre[1]) * size[0] + centre[0];
+
+    vector<vector<char>> values(NC),spoilt_values(NC),results[2];
+    results[0].resize(NC);
+    results[1].resize(NC);
+    auto set_value = [this](vector<char>& v,size_t i,double value) {
+        if(this->data_type == VTK_DOUBLE) reinterpret_cast<double*>(v.data())[i] = value;
+        else reinterpret_cast<float*>(v.data())[i] = float(value);
+    };
+    mt19937 generator(1);
+    uniform_real_distribution<double> random_value(0.0,1.0);
+    int radius = 0;
+    for(int trial=0;trial<4;trial++)
+    {
+        // random values, and on alternate trials random 0s and 1s (for kernels that compare with particular values,
+        // like cellular automata), then the same with the centre spoilt by a NaN, which spreads to every cell
+        // that reads it (unless the kernel only compares with it)
+        for(int ic=0;ic<NC;ic++)
+        {
+            values[ic].resize(N * VALUE_SIZE);
+            for(size_t i=0;i<N;i++)
+                set_value(values[ic],i,trial%2 ? floor(random_value(generator) + 0.5) : random_value(generator));
+            spoilt_values[ic] = values[ic];
+            set_value(spoilt_values[ic],i_centre,numeric_limits<double>::quiet_NaN());
+        }
+        for(int is_spoilt=0;is_spoilt<2;is_spoilt++)
+        {
+            vector<void*> args;
+            for(int ic=0;ic<NC;ic++)
+                args.push_back(is_spoilt ? spoilt_values[ic].data() : values[ic].data());
+            for(int ic=0;ic<NC;ic++)
+            {
+                results[is_spoilt][ic].assign(N * VALUE_SIZE,0);
+                args.push_back(results[is_spoilt][ic].data());
+            }
+            this->kernel.Run(args,global_range);
+        }
+        // how far from the centre the results changed (across the wrap, if nearer)
+        for(int ic=0;ic<NC;ic++)
+        {
+            for(size_t i=0;i<N;i++)
+            {
+                if(memcmp(&results[0][ic][i * VALUE_SIZE],&results[1][ic][i * VALUE_SIZE],VALUE_SIZE) == 0)
+                    continue;
+                const int p[3] = { int(i % size[0]), int((i / size[0]) % size[1]), int(i / (size_t(size[0]) * size[1])) };
+                for(int d=0;d<3;d++)
+                {
+                    const int offset = abs(p[d] - centre[d]);
+                    radius = max(radius,min(offset,size[d] - offset));
+                }
+            }
+        }
+    }
+    return radius;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::InternalUpdate(int n_steps)
+{
+    this->kernel.Build(this->formula);
+
+    const int NC = this->GetNumberOfChemicals();
+    const size_t VALUE_SIZE = this->data_type_size;
+    const vector<Tile> tiles = this->GetTiles();
+
+    if(tiles.size() > 1 && this->stencil_checked_for != this->formula)
+    {
+        // the halos are only as wide as stencil_radius says, so if the kernel reads further then the values near
+        // the edges of each core would quietly go wrong
+        const int radius = this->MeasureStencilRadius();
+        if(radius > this->stencil_radius)
+        {
+            ostringstream oss;
+            oss << "OutOfCoreImageRD::InternalUpdate : the kernel reads cells " << radius << " away but stencil_radius"
+                " is " << this->stencil_radius << ". Set stencil_radius to at least " << radius
+                << " in the out_of_core element.";
+            throw runtime_error(oss.str());
+        }
+        this->stencil_checked_for = this->formula;
+    }
+
+    // for each chemical, the tile before and after each step, and the next tile (being read in on another thread)
+    vector<vector<char>> tile_values[2],next_tile_values(NC),core_values(NC);
+    tile_values[0].resize(NC);
+    tile_values[1].resize(NC);
+
+    for(int steps_done=0;steps_done<n_steps;)
+    {
+        const int STEPS = min(this->steps_per_pass,n_steps - steps_done);
+        const bool is_last_pass = steps_done + STEPS == n_steps;
+        const BrickedVolume& source = this->volumes[this->i_current_volume];
+        BrickedVolume& target = this->volumes[1 - this->i_current_volume];
+
+        auto read_tile = [&source,NC,VALUE_SIZE](const Tile& tile,vector<vector<char>>& values) {
+            for(int ic=0;ic<NC;ic++)
+            {
+                values[ic].resize(VALUE_SIZE * tile.size[0] * tile.size[1] * tile.size[2]);
+                source.ReadBox(ic,tile.origin,tile.size,values[ic].data());
+            }
+        };
+        future<void> reading = async(launch::async,read_tile,cref(tiles.front()),ref(next_tile_values));
+
+        for(size_t it=0;it<tiles.size();it++)
+        {
+            const Tile& tile = tiles[it];
+            reading.get();
+            swap(tile_values[0],next_tile_values);
+            if(it + 1 < tiles.size())
+            {
+                if(it + 2 < tiles.size())
+                    source.Prefetch(tiles[it+2].origin,tiles[it+2].size);
+                reading = async(launch::async,read_tile,cref(tiles[it+1]),ref(next_tile_values));
+            }
+
+            // advance the tile, the halo shrinking by stencil_radius each step
+            vector<void*> args[2];
+            for(int ic=0;ic<NC;ic++)
+            {
+                tile_values[1][ic].resize(tile_values[0][ic].size());
+                args[0].push_back(tile_values[0][ic].data());
+                args[1].push_back(tile_values[1][ic].data());
+            }
+            for(int ic=0;ic<NC;ic++)
+            {
+                args[0].push_back(tile_values[1][ic].data());
+                args[1].push_back(tile_values[0][ic].data());
+            }
+            const size_t global_range[3] = { size_t(tile.size[0] / this->GetBlockSizeX()),
+                                             size_t(tile.size[1] / this->GetBlockSizeY()),
+                                             size_t(tile.size[2] / this->GetBlockSizeZ()) };
+            for(int step=0;step<STEPS;step++)
+                this->kernel.Run(args[step%2],global_range);
+
+            // write out the core, which is now valid
+            const vector<vector<char>>& result = tile_values[STEPS%2];
+            const int offset[3] = { tile.core_origin[0] - tile.origin[0], tile.core_origin[1] - tile.origin[1],
+                                    tile.core_origin[2] - tile.origin[2] };
+            const size_t ROW_BYTES = VALUE_SIZE * tile.core_size[0];
+            for(int ic=0;ic<NC;ic++)
+            {
+                core_values[ic].resize(ROW_BYTES * tile.core_size[1] * tile.core_size[2]);
+                char* row = core_values[ic].data();
+                for(int z=0;z<tile.core_size[2];z++)
+                {
+                    for(int y=0;y<tile.core_size[1];y++)
+                    {
+                        const size_t i = (size_t(z + offset[2]) * tile.size[1] + y + offset[1]) * tile.size[0] + offset[0];
+                        memcpy(row,result[ic].data() + i * VALUE_SIZE,ROW_BYTES);
+                        row += ROW_BYTES;
+                    }
+                }
+                target.WriteBox(ic,tile.core_origin,tile.core_size,core_values[ic].data());
+                if(is_last_pass)
+                    this->SamplePreview(ic,tile.core_origin,tile.core_size,core_values[ic].data());
+            }
+        }
+        target.Flush();
+        this->i_current_volume = 1 - this->i_current_volume;
+        steps_done += STEPS;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::SamplePreview(int i_chemical,const int origin[3],const int size[3],const char* values)
+{
+    const size_t VALUE_SIZE = this->data_type_size;
+    const int* preview_dimensions = this->images[i_chemical]->GetDimensions();
+    char* preview = static_cast<char*>(this->images[i_chemical]->GetScalarPointer());
+    int first[3],last[3];
+    for(int i=0;i<3;i++)
+    {
+        // the preview cells whose grid cell is in the box
+        first[i] = (origin[i] + this->preview_stride[i] - 1) / this->preview_stride[i];
+        last[i] = min(preview_dimensions[i],(origin[i] + size[i] + this->preview_stride[i] - 1) / this->preview_stride[i]);
+    }
+    for(int pz=first[2];pz<last[2];pz++)
+    {
+        for(int py=first[1];py<last[1];py++)
+        {
+            for(int px=first[0];px<last[0];px++)
+            {
+                const size_t i_box = (size_t(pz * this->preview_stride[2] - origin[2]) * size[1]
+                    + py * this->preview_stride[1] - origin[1]) * size[0] + px * this->preview_stride[0] - origin[0];
+                const size_t i_preview = (size_t(pz) * preview_dimensions[1] + py) * preview_dimensions[0] + px;
+                memcpy(preview + i_preview * VALUE_SIZE,values + i_box * VALUE_SIZE,VALUE_SIZE);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::WriteThroughPreviewCell(int i_chemical,vtkIdType i_cell)
+{
+    const size_t VALUE_SIZE = this->data_type_size;
+    const int* preview_dimensions = this->images[i_chemical]->GetDimensions();
+    const int p[3] = { int(i_cell % preview_dimensions[0]),
+                       int((i_cell / preview_dimensions[0]) % preview_dimensions[1]),
+                       int(i_cell / (vtkIdType(preview_dimensions[0]) * preview_dimensions[1])) };
+    int origin[3],size[3];
+    for(int i=0;i<3;i++)
+    {
+        origin[i] = p[i] * this->preview_stride[i];
+        size[i] = min(this->preview_stride[i],this->volume_dimensions[i] - origin[i]);
+    }
+    const char* value = static_cast<const char*>(this->images[i_chemical]->GetScalarPointer()) + i_cell * VALUE_SIZE;
+    const size_t N = size_t(size[0]) * size[1] * size[2];
+    vector<char> values(N * VALUE_SIZE);
+    for(size_t i=0;i<N;i++)
+        memcpy(&values[i * VALUE_SIZE],value,VALUE_SIZE);
+    this->volumes[this->i_current_volume].WriteBox(i_chemical,origin,size,values.data());
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::CopyFromImage(vtkImageData* im)
+{
+    NativeKernelImageRD::CopyFromImage(im);
+    if(this->volume_was_reopened)
+    {
+        // the volume files have the full-resolution values
+        this->volume_was_reopened = false;
+        return;
+    }
+    // else fill the grid from the preview
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    {
+        const vtkIdType N_CELLS = this->images[ic]->GetNumberOfPoints();
+        for(vtkIdType i=0;i<N_CELLS;i++)
+            this->WriteThroughPreviewCell(ic,i);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::GenerateInitialPattern()
+{
+    const int NC = this->GetNumberOfChemicals();
+    const int B = this->brick_size;
+    const int* V = this->volume_dimensions;
+    BrickedVolume& volume = this->volumes[this->i_current_volume];
+
+    for(size_t iOverlay = 0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+        this->initial_pattern_generator.GetOverlay(iOverlay).Reseed();
+
+    // a brick at a time, applying the overlays at the position of each cell in the preview
+    vector<vector<double>> brick_values(NC);
+    vector<vector<char>> raw_values(NC);
+    vector<double> vals(NC);
+    for(int bz=0;bz<V[2];bz+=B)
+    {
+        for(int by=0;by<V[1];by+=B)
+        {
+            for(int bx=0;bx<V[0];bx+=B)
+            {
+                const int origin[3] = { bx, by, bz };
+                const int size[3] = { min(B,V[0]-bx), min(B,V[1]-by), min(B,V[2]-bz) };
+                const size_t N = size_t(size[0]) * size[1] * size[2];
+                for(int ic=0;ic<NC;ic++)
+                {
+                    raw_values[ic].resize(N * this->data_type_size);
+                    brick_values[ic].assign(N,0.0);
+                    if(!this->initial_pattern_generator.ShouldZeroFirst())
+                    {
+                        volume.ReadBox(ic,origin,size,raw_values[ic].data());
+                        for(size_t i=0;i<N;i++)
+                        {
+                            if(this->data_type == VTK_DOUBLE) brick_values[ic][i] = reinterpret_cast<double*>(raw_values[ic].data())[i];
+                            else brick_values[ic][i] = reinterpret_cast<float*>(raw_values[ic].data())[i];
+                        }
+                    }
+                }
+                size_t i = 0;
+                for(int z=bz;z<bz+size[2];z++)
+                {
+                    for(int y=by;y<by+size[1];y++)
+                    {
+                        for(int x=bx;x<bx+size[0];x++,i++)
+                        {
+                            for(size_t iOverlay=0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+                            {
+                                const Overlay& overlay = this->initial_pattern_generator.GetOverlay(iOverlay);
+                                int iC = overlay.GetTargetChemical();
+                                if(iC<0 || iC>=NC)
+                                    continue; // (as in ImageRD)
+                                for(int ic=0;ic<NC;ic++)
+                                    vals[ic] = brick_values[ic][i];
+                                brick_values[iC][i] = overlay.Apply(vals, *this, float(x) / this->preview_stride[0],
+                                    float(y) / this->preview_stride[1], float(z) / this->preview_stride[2]);
+                            }
+                        }
+                    }
+                }
+                for(int ic=0;ic<NC;ic++)
+                {
+                    for(size_t j=0;j<N;j++)
+                    {
+                        if(this->data_type == VTK_DOUBLE) reinterpret_cast<double*>(raw_values[ic].data())[j] = brick_values[ic][j];
+                        else reinterpret_cast<float*>(raw_values[ic].data())[j] = float(brick_values[ic][j]);
+                    }
+                    volume.WriteBox(ic,origin,size,raw_values[ic].data());
+                    this->SamplePreview(ic,origin,size,raw_values[ic].data());
+                }
+            }
+        }
+    }
+    for(int i=0;i<(int)this->images.size();i++)
+        this->images[i]->Modified();
+    this->timesteps_taken = 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::BlankImage(float value)
+{
+    NativeKernelImageRD::BlankImage(value);
+    const int B = this->brick_size;
+    const int* V = this->volume_dimensions;
+    vector<char> values(size_t(B) * B * B * this->data_type_size);
+    for(size_t i=0;i<size_t(B)*B*B;i++)
+    {
+        if(this->data_type == VTK_DOUBLE) reinterpret_cast<double*>(values.data())[i] = value;
+        else reinterpret_cast<float*>(values.data())[i] = value;
+    }
+    for(int bz=0;bz<V[2];bz+=B)
+    {
+        for(int by=0;by<V[1];by+=B)
+        {
+            for(int bx=0;bx<V[0];bx+=B)
+            {
+                const int origin[3] = { bx, by, bz };
+                const int size[3] = { min(B,V[0]-bx), min(B,V[1]-by), min(B,V[2]-bz) };
+                for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+                    this->volumes[this->i_current_volume].WriteBox(ic,origin,size,values.data());
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
+{
+    // forget the undone actions first, so that the new actions are the ones after the current end
+    while(!this->undo_stack.empty() && !this->undo_stack.back().done)
+        this->undo_stack.pop_back();
+    const size_t n_actions = this->undo_stack.size();
+    NativeKernelImageRD::SetValue(x,y,z,val,render_settings);
+    for(size_t i=n_actions;i<this->undo_stack.size();i++)
+        this->WriteThroughPreviewCell(this->undo_stack[i].iChemical,this->undo_stack[i].iCell);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
+{
+    while(!this->undo_stack.empty() && !this->undo_stack.back().done)
+        this->undo_stack.pop_back();
+    const size_t n_actions = this->undo_stack.size();
+    NativeKernelImageRD::SetValuesInRadius(x,y,z,r,val,render_settings);
+    for(size_t i=n_actions;i<this->undo_stack.size();i++)
+        this->WriteThroughPreviewCell(this->undo_stack[i].iChemical,this->undo_stack[i].iCell);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::SetValuesAlongStroke(const vector<array<float,3>>& points,float r,float val,const Properties& render_settings)
+{
+    while(!this->undo_stack.empty() && !this->undo_stack.back().done)
+        this->undo_stack.pop_back();
+    const size_t n_actions = this->undo_stack.size();
+    NativeKernelImageRD::SetValuesAlongStroke(points,r,val,render_settings);
+    for(size_t i=n_actions;i<this->undo_stack.size();i++)
+        this->WriteThroughPreviewCell(this->undo_stack[i].iChemical,this->undo_stack[i].iCell);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::FlipPaintAction(PaintAction& cca)
+{
+    NativeKernelImageRD::FlipPaintAction(cca);
+    this->WriteThroughPreviewCell(cca.iChemical,cca.iCell);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t OutOfCoreImageRD::GetMemorySize() const
+{
+    // the preview, and the three copies of a tile held while updating
+    const size_t TILE_CELLS = size_t(min(this->tile_size,this->volume_dimensions[0])) * min(this->tile_size,this->volume_dimensions[1])
+        * min(this->tile_size,this->volume_dimensions[2]);
+    return NativeKernelImageRD::GetMemorySize() + 3 * TILE_CELLS * this->n_chemicals * this->data_type_size;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::SaveFile(const char* filename,const Properties& render_settings,
+                                bool generate_initial_pattern_when_loading) const
+{
+    // only the preview goes in the file, which refers to the volume files for the grid
+    this->volumes[this->i_current_volume].Flush();
+    if(!this->storage.empty() || generate_initial_pattern_when_loading)
+    {
+        NativeKernelImageRD::SaveFile(filename,render_settings,generate_initial_pattern_when_loading);
+        return;
+    }
+    // temporary volume files go when we do, so the grid is copied into a volume file beside the saved file
+    this->saved_storage = GetAbsolutePath(filename) + ".bricks";
+    try
+    {
+        this->volumes[this->i_current_volume].SaveCopy(this->saved_storage + ".0");
+        NativeKernelImageRD::SaveFile(filename,render_settings,generate_initial_pattern_when_loading);
+    }
+    catch(...)
+    {
+        this->saved_storage.clear();
+        throw;
+    }
+    this->saved_storage.clear();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OutOfCoreImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    NativeKernelImageRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // out_of_core:
+    vtkSmartPointer<vtkXMLDataElement> xml_out_of_core = rule->FindNestedElementWithName("out_of_core");
+    if(!xml_out_of_core) throw runtime_error("out_of_core node not found in file");
+    read_required_attribute(xml_out_of_core,"dimension_x",this->volume_dimensions[0]);
+    read_required_attribute(xml_out_of_core,"dimension_y",this->volume_dimensions[1]);
+    read_required_attribute(xml_out_of_core,"dimension_z",this->volume_dimensions[2]);
+    read_optional_attribute(xml_out_of_core,"brick_size",this->brick_size);
+    read_optional_attribute(xml_out_of_core,"tile_size",this->tile_size);
+    read_optional_attribute(xml_out_of_core,"steps_per_pass",this->steps_per_pass);
+    read_optional_attribute(xml_out_of_core,"stencil_radius",this->stencil_radius);
+    read_optional_attribute(xml_out_of_core,"current_volume",this->i_current_volume);
+    const char *s = xml_out_of_core->GetAttribute("storage");
+    if(s) this->storage = s;
+    if(this->brick_size < 1 || this->tile_size < 1 || this->steps_per_pass < 1 || this->stencil_radius < 0
+        || this->i_current_volume < 0 || this->i_current_volume > 1)
+        throw runtime_error("OutOfCoreImageRD::InitializeFromXML : invalid out_of_core attributes");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> OutOfCoreImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = NativeKernelImageRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    vtkSmartPointer<vtkXMLDataElement> out_of_core = vtkSmartPointer<vtkXMLDataElement>::New();
+    out_of_core->SetName("out_of_core");
+    out_of_core->SetIntAttribute("dimension_x",this->volume_dimensions[0]);
+    out_of_core->SetIntAttribute("dimension_y",this->volume_dimensions[1]);
+    out_of_core->SetIntAttribute("dimension_z",this->volume_dimensions[2]);
+    out_of_core->SetIntAttribute("brick_size",this->brick_size);
+    out_of_core->SetIntAttribute("tile_size",this->tile_size);
+    out_of_core->SetIntAttribute("steps_per_pass",this->steps_per_pass);
+    out_of_core->SetIntAttribute("stencil_radius",this->stencil_radius);
+    if(!this->storage.empty())
+    {
+        out_of_core->SetAttribute("storage",this->storage.c_str());
+        out_of_core->SetIntAttribute("current_volume",this->i_current_volume);
+    }
+    else if(!this->saved_storage.empty())
+    {
+        out_of_core->SetAttribute("storage",this->saved_storage.c_str());
+        out_of_core->SetIntAttribute("current_volume",0);
+    }
+    rule->AddNestedElement(out_of_core);
+
+    return rd;
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,108 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __OUTOFCOREIMAGERD__
+#define __OUTOFCOREIMAGERD__
+
+// local:
+#include "BrickedVolume.hpp"
+#include "NativeKernelImageRD.hpp"
+
+/// A full-kernel RD system whose grid is kept on disk, for grids larger than RAM.
+/** The chemicals live in a pair of bricked, memory-mapped files. Each update streams through the grid in tiles:
+  * a tile and a halo around it is read in, advanced several timesteps on the CPU, and its core written out to the
+  * other file, while the next tile is read in on another thread. The halo must be wide enough for the kernel's
+  * stencil over those timesteps: steps_per_pass * stencil_radius cells, which is checked against the kernel before
+  * the first update. The images hold a downsampled preview, used for rendering and painting. A saved file holds the
+  * preview and refers to the volume files for the grid: those named by storage, or else a copy of the grid saved
+  * beside it. Specified by an out_of_core element in the rule. */
+class OutOfCoreImageRD : public NativeKernelImageRD
+{
+    public:
+
+        OutOfCoreImageRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        void SaveFile(const char* filename,
+            const Properties& render_settings,
+            bool generate_initial_pattern_when_loading) const override;
+
+        bool HasEditableDimensions() const override { return false; }
+        bool HasEditableNumberOfChemicals() const override { return false; }
+
+        void CopyFromImage(vtkImageData* im) override;
+        void GenerateInitialPattern() override;
+        void BlankImage(float value = 0.0f) override;
+
+        void SetValue(float x,float y,float z,float val,const Properties& render_settings) override;
+        void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) override;
+        void SetValuesAlongStroke(const std::vector<std::array<float,3>>& points,float r,float val,const Properties& render_settings) override;
+
+        size_t GetMemorySize() const override;
+
+        const int* GetVolumeDimensions() const { return this->volume_dimensions; }
+
+    protected:
+
+        void AllocateImages(int x,int y,int z,int nc,int data_type) override;
+
+        void InternalUpdate(int n_steps) override;
+
+        void FlipPaintAction(PaintAction& cca) override;
+
+    private:
+
+        /// A box of the grid that is advanced in one go, and the part of it (the core) that comes out valid.
+        struct Tile
+        {
+            int origin[3],size[3];
+            int core_origin[3],core_size[3];
+        };
+
+        std::vector<Tile> GetTiles() const;
+
+        /// Copy the values of a preview cell to the box of grid cells it stands for.
+        void WriteThroughPreviewCell(int i_chemical,vtkIdType i_cell);
+
+        /// Set the preview from the grid values in a box, sampling every preview_stride cells.
+        void SamplePreview(int i_chemical,const int origin[3],const int size[3],const char* values);
+
+        /// How far from a cell the kernel reads in one timestep, as seen by running it on a small patch of random
+        /// values with and without the centre cell spoilt. (Can only find a lower bound, but that catches a
+        /// stencil_radius that is too small.)
+        int MeasureStencilRadius();
+
+    protected:
+
+        int volume_dimensions[3];
+        int brick_size;
+        int tile_size;       ///< the width of a tile, including the halo (a power of 2 suits kernels that wrap with a mask)
+        int steps_per_pass;  ///< the number of timesteps taken on each tile while it is in memory
+        int stencil_radius;  ///< how far the kernel reads from each cell in one timestep
+        std::string storage; ///< the volume files are storage.0 and storage.1; if empty they are temporary
+        mutable std::string saved_storage; ///< while saving with temporary volume files: where the grid was copied
+        std::string stencil_checked_for;   ///< the kernel whose stencil has been checked against stencil_radius
+
+        BrickedVolume volumes[2];
+        int i_current_volume;
+        bool volume_was_reopened; ///< the volume files held values from before, so don't overwrite them on loading
+        int preview_stride[3];
+};
+
+#endif
@@ -0,0 +1,59 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "PerformanceCounters.hpp"
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+
+PerformanceCounters::PerformanceCounters()
+    : steps(0)
+    , kernel_launches(0)
+    , readbacks(0)
+    , bytes_uploaded(0)
+    , bytes_downloaded(0)
+    , compute_seconds(0.0)
+    , build_seconds(0.0)
+    , pipeline_seconds(0.0)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+ScopedTimer::ScopedTimer(double& s)
+    : seconds(s)
+    , start(chrono::steady_clock::now())
+{
+}
+
+// ---------------------------------------------------------------------------
+
+ScopedTimer::~ScopedTimer()
+{
+    this->seconds += ScopedTimer::SecondsSince(this->start);
+}
+
+// ---------------------------------------------------------------------------
+
+double ScopedTimer::SecondsSince(chrono::steady_clock::time_point t)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - t).count();
+}
+
+// ---------------------------------------------------------------------------
@@ -0,0 +1,56 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __PERFORMANCECOUNTERS__
+#define __PERFORMANCECOUNTERS__
+
+// STL:
+#include <chrono>
+
+/// Running totals of the work a system has done, to show where the time goes.
+struct PerformanceCounters
+{
+    PerformanceCounters();
+
+    long long steps;              ///< timesteps taken
+    long long kernel_launches;    ///< on the device, or on the CPU
+    long long readbacks;          ///< times the values were brought back from the device
+    long long bytes_uploaded;     ///< from the host to the device
+    long long bytes_downloaded;   ///< from the device to the host
+    double compute_seconds;       ///< advancing the system, including the transfers
+    double build_seconds;         ///< compiling kernels (for OpenCL this happens on another thread)
+    double pipeline_seconds;      ///< building and updating the render pipeline
+};
+
+/// Adds the time between its construction and its destruction onto a counter.
+class ScopedTimer
+{
+    public:
+
+        explicit ScopedTimer(double& seconds);
+        ~ScopedTimer();
+
+        /// The seconds elapsed since t.
+        static double SecondsSince(std::chrono::steady_clock::time_point t);
+
+    private:
+
+        double& seconds;
+        std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,191 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "SparseImageRD.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <stdexcept>
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+SparseImageRD::SparseImageRD(int data_type)
+    : NativeFormulaImageRD(data_type)
+    , sparse_brick_size(8)
+    , tolerance(1e-5f)
+    , need_read_images(true)
+{
+    if(data_type != VTK_FLOAT)
+        throw runtime_error("SparseImageRD : only float data is supported");
+    this->volume.SetPerformanceCounters(&this->performance_counters);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::InternalUpdate(int n_steps)
+{
+    const int NC = this->GetNumberOfChemicals();
+    const int dimensions[3] = { vtkMath::Round(this->GetX()), vtkMath::Round(this->GetY()), vtkMath::Round(this->GetZ()) };
+    vector<float*> values;
+    for(int ic=0;ic<NC;ic++)
+        values.push_back(static_cast<float*>(this->images[ic]->GetScalarPointer()));
+
+    if(!this->volume.IsReset(dimensions,NC,this->sparse_brick_size,this->wrap,this->tolerance))
+    {
+        this->volume.Reset(dimensions,NC,this->sparse_brick_size,this->wrap,this->tolerance);
+        this->need_read_images = true;
+    }
+    int halo[3];
+    if(this->volume.SetKernel(this->AssembleKernel(this->formula,this->parameters,halo),halo))
+        this->need_read_images = true; // (regions that were steady may not be any more)
+    if(this->need_read_images)
+    {
+        this->volume.SetDenseValues(vector<const float*>(values.begin(),values.end()));
+        this->need_read_images = false;
+    }
+
+    for(int it=0;it<n_steps;it++)
+        this->volume.Step();
+
+    this->volume.GetChangedDenseValues(values);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t SparseImageRD::GetMemorySize() const
+{
+    return ImageRD::GetMemorySize() + this->volume.GetMemorySize();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::GenerateInitialPattern()
+{
+    NativeFormulaImageRD::GenerateInitialPattern();
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::BlankImage(float value)
+{
+    NativeFormulaImageRD::BlankImage(value);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::CopyFromImage(vtkImageData* im)
+{
+    NativeFormulaImageRD::CopyFromImage(im);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::CopyFromMesh(vtkUnstructuredGrid* mesh,const int num_chemicals,const size_t target_chemical,
+    const size_t largest_dimension,const float value_inside,const float value_outside)
+{
+    NativeFormulaImageRD::CopyFromMesh(mesh,num_chemicals,target_chemical,largest_dimension,value_inside,value_outside);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
+{
+    NativeFormulaImageRD::SetFrom2DImage(iChemical,im);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
+{
+    NativeFormulaImageRD::SetValue(x,y,z,val,render_settings);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
+{
+    NativeFormulaImageRD::SetValuesInRadius(x,y,z,r,val,render_settings);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::SetValuesAlongStroke(const vector<array<float,3>>& points,float r,float val,const Properties& render_settings)
+{
+    NativeFormulaImageRD::SetValuesAlongStroke(points,r,val,render_settings);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::FlipPaintAction(PaintAction& cca)
+{
+    NativeFormulaImageRD::FlipPaintAction(cca);
+    this->need_read_images = true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    NativeFormulaImageRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // sparse:
+    vtkSmartPointer<vtkXMLDataElement> xml_sparse = rule->FindNestedElementWithName("sparse");
+    if(!xml_sparse) throw runtime_error("sparse node not found in file");
+    read_optional_attribute(xml_sparse,"brick_size",this->sparse_brick_size);
+    read_optional_attribute(xml_sparse,"tolerance",this->tolerance);
+    if(this->sparse_brick_size < 1 || this->tolerance < 0.0f)
+        throw runtime_error("SparseImageRD::InitializeFromXML : invalid sparse attributes");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> SparseImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = NativeFormulaImageRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    vtkSmartPointer<vtkXMLDataElement> sparse = vtkSmartPointer<vtkXMLDataElement>::New();
+    sparse->SetName("sparse");
+    sparse->SetIntAttribute("brick_size",this->sparse_brick_size);
+    sparse->SetFloatAttribute("tolerance",this->tolerance);
+    rule->AddNestedElement(sparse);
+
+    return rd;
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,68 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __SPARSEIMAGERD__
+#define __SPARSEIMAGERD__
+
+// local:
+#include "NativeFormulaImageRD.hpp"
+#include "SparseVolume.hpp"
+
+/// A formula RD system that only computes where the values are changing, for patterns dominated by a moving front.
+/** Uses a SparseVolume. The images are kept as a dense copy for rendering and saving: only the bricks that changed are
+  * copied back into them after each update. Any other change to the images (painting, a new pattern, ...) is read
+  * back into the sparse storage on the next update. Specified by a sparse element in the rule. Only float data is
+  * supported. */
+class SparseImageRD : public NativeFormulaImageRD
+{
+    public:
+
+        SparseImageRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        size_t GetMemorySize() const override;
+        /// How many of the bricks are being stepped, as of the last update.
+        size_t GetNumberOfActiveBricks() const { return this->volume.GetNumberOfActiveBricks(); }
+
+        // we override the functions that change the images, so that the sparse storage gets updated
+        void GenerateInitialPattern() override;
+        void BlankImage(float value = 0.0f) override;
+        void CopyFromImage(vtkImageData* im) override;
+        void CopyFromMesh(vtkUnstructuredGrid* mesh,const int num_chemicals,const size_t target_chemical,
+            const size_t largest_dimension,const float value_inside,const float value_outside) override;
+        void SetFrom2DImage(int iChemical, vtkImageData *im) override;
+        void SetValue(float x,float y,float z,float val,const Properties& render_settings) override;
+        void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) override;
+        void SetValuesAlongStroke(const std::vector<std::array<float,3>>& points,float r,float val,const Properties& render_settings) override;
+
+    protected:
+
+        void InternalUpdate(int n_steps) override;
+        void FlipPaintAction(PaintAction& cca) override;
+
+    protected:
+
+        int sparse_brick_size;
+        float tolerance;
+
+        SparseVolume volume;
+        bool need_read_images;
+};
+
+#endif
@@ -0,0 +1,469 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "SparseVolume.hpp"
+
+// STL:
+#include <cfloat>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------------------------------------
+
+SparseVolume::SparseVolume()
+    : n_chemicals(0)
+    , brick_size(0)
+    , wrap(true)
+    , tolerance(0.0f)
+{
+    for(int i=0;i<3;i++)
+    {
+        this->dimensions[i] = 0;
+        this->brick_extent[i] = 1;
+        this->n_bricks[i] = 0;
+        this->halo[i] = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool SparseVolume::IsReset(const int dimensions[3],int n_chemicals,int brick_size,bool wrap,float tolerance) const
+{
+    return equal(dimensions,dimensions+3,this->dimensions) && n_chemicals == this->n_chemicals
+        && brick_size == this->brick_size && wrap == this->wrap && tolerance == this->tolerance;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::Reset(const int dimensions[3],int n_chemicals,int brick_size,bool wrap,float tolerance)
+{
+    if(brick_size < 1 || tolerance < 0.0f)
+        throw runtime_error("SparseVolume::Reset : invalid brick size or tolerance");
+
+    for(int i=0;i<3;i++)
+    {
+        this->dimensions[i] = dimensions[i];
+        this->brick_extent[i] = (dimensions[i] > 1) ? brick_size : 1;
+        this->n_bricks[i] = (dimensions[i] + this->brick_extent[i] - 1) / this->brick_extent[i];
+    }
+    this->n_chemicals = n_chemicals;
+    this->brick_size = brick_size;
+    this->wrap = wrap;
+    this->tolerance = tolerance;
+
+    this->active_bricks.clear();
+    this->changed_bricks.clear();
+    this->tile_values.assign((size_t)this->n_bricks[0] * this->n_bricks[1] * this->n_bricks[2] * n_chemicals, 0.0f);
+    this->fixed_points.clear();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool SparseVolume::SetKernel(const string& source,const int halo[3])
+{
+    for(int i=0;i<3;i++)
+    {
+        if(this->dimensions[i] > 1 && halo[i] > this->brick_extent[i])
+            throw runtime_error("SparseVolume::SetKernel : the formula reads further than the brick size");
+        this->halo[i] = (this->dimensions[i] > 1) ? halo[i] : 0;
+    }
+    if(this->kernel.IsBuiltFrom(source))
+        return false;
+    this->kernel.Build(source);
+    this->fixed_points.clear();
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t SparseVolume::GetBrickKey(const int brick[3]) const
+{
+    return ((size_t)brick[2] * this->n_bricks[1] + brick[1]) * this->n_bricks[0] + brick[0];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::GetBrickOrigin(size_t key,int origin[3]) const
+{
+    origin[0] = (int)(key % this->n_bricks[0]) * this->brick_extent[0];
+    key /= this->n_bricks[0];
+    origin[1] = (int)(key % this->n_bricks[1]) * this->brick_extent[1];
+    origin[2] = (int)(key / this->n_bricks[1]) * this->brick_extent[2];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::GetHaloLayout(size_t key,HaloLayout& layout) const
+{
+    int origin[3];
+    this->GetBrickOrigin(key,origin);
+    const int *E = this->brick_extent;
+    const int *H = this->halo;
+    vector<int> bricks[3];
+    for(int i=0;i<3;i++)
+    {
+        const int n = this->dimensions[i];
+        const int P = E[i] + 2*H[i];
+        layout.slots[i].resize(P);
+        layout.offsets[i].resize(P);
+        for(int k=0;k<P;k++)
+        {
+            int p = origin[i] - H[i] + k;
+            p = this->wrap ? ((p % n) + n) % n : min(max(p,0),n-1);
+            const auto found = find(bricks[i].begin(),bricks[i].end(),p / E[i]);
+            layout.slots[i][k] = (int)(found - bricks[i].begin());
+            if(found == bricks[i].end())
+                bricks[i].push_back(p / E[i]);
+            layout.offsets[i][k] = p % E[i];
+        }
+        layout.n_slots[i] = bricks[i].size();
+    }
+    layout.keys.clear();
+    layout.values.clear();
+    for(int bz : bricks[2])
+    {
+        for(int by : bricks[1])
+        {
+            for(int bx : bricks[0])
+            {
+                const int brick[3] = { bx, by, bz };
+                const size_t neighbor = this->GetBrickKey(brick);
+                const auto found = this->active_bricks.find(neighbor);
+                layout.keys.push_back(neighbor);
+                layout.values.push_back(found == this->active_bricks.end() ? NULL : &found->second);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool SparseVolume::DoesHaloMatch(size_t key,const float* values) const
+{
+    HaloLayout layout;
+    this->GetHaloLayout(key,layout);
+
+    // an inactive neighbor matches everywhere or nowhere, so check those first
+    for(size_t i=0;i<layout.keys.size();i++)
+        if(!layout.values[i] && layout.keys[i] != key)
+            for(int ic=0;ic<this->n_chemicals;ic++)
+                if(fabs(this->tile_values[layout.keys[i] * this->n_chemicals + ic] - values[ic]) > this->tolerance)
+                    return false;
+
+    const int *E = this->brick_extent;
+    const int *H = this->halo;
+    for(int z=0;z<E[2]+2*H[2];z++)
+    {
+        for(int y=0;y<E[1]+2*H[1];y++)
+        {
+            for(int x=0;x<E[0]+2*H[0];x++)
+            {
+                if(x >= H[0] && x < E[0]+H[0] && y >= H[1] && y < E[1]+H[1] && z >= H[2] && z < E[2]+H[2])
+                    continue;
+                const size_t i = (layout.slots[2][z] * layout.n_slots[1] + layout.slots[1][y]) * layout.n_slots[0]
+                    + layout.slots[0][x];
+                const BrickValues *neighbor = layout.values[i];
+                if(!neighbor)
+                    continue; // (checked above, unless it is this brick, whose own values are the ones given)
+                const size_t cell = ((size_t)layout.offsets[2][z] * E[1] + layout.offsets[1][y]) * E[0]
+                    + layout.offsets[0][x];
+                for(int ic=0;ic<this->n_chemicals;ic++)
+                    if(fabs((*neighbor)[ic][cell] - values[ic]) > this->tolerance)
+                        return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool SparseVolume::IsFixedPoint(const float* values)
+{
+    vector<float> in(values,values+this->n_chemicals);
+    const auto found = this->fixed_points.find(in);
+    if(found != this->fixed_points.end())
+        return found->second;
+
+    // step a single cell: its neighbors are all itself
+    vector<float> out(this->n_chemicals);
+    vector<void*> args;
+    for(int ic=0;ic<this->n_chemicals;ic++)
+        args.push_back(&in[ic]);
+    for(int ic=0;ic<this->n_chemicals;ic++)
+        args.push_back(&out[ic]);
+    const size_t global_range[3] = { 1, 1, 1 };
+    this->kernel.Run(args,global_range);
+
+    bool is_fixed_point = true;
+    for(int ic=0;ic<this->n_chemicals;ic++)
+        if(fabs(out[ic] - values[ic]) > 16.0f * FLT_EPSILON * max(1.0f,fabs(values[ic]))) // (allow for rounding)
+            is_fixed_point = false;
+    this->fixed_points[vector<float>(values,values+this->n_chemicals)] = is_fixed_point;
+    return is_fixed_point;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::Activate(size_t key)
+{
+    BrickValues& values = this->active_bricks[key];
+    values.resize(this->n_chemicals);
+    for(int ic=0;ic<this->n_chemicals;ic++)
+        values[ic].assign(this->GetCellsPerBrick(),this->tile_values[key * this->n_chemicals + ic]);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::SetDenseValues(const vector<const float*>& values)
+{
+    this->active_bricks.clear();
+    this->changed_bricks.clear();
+
+    const int *E = this->brick_extent;
+    const int *D = this->dimensions;
+    const size_t n_bricks = this->GetNumberOfBricks();
+    vector<float> low(this->n_chemicals), high(this->n_chemicals);
+    for(size_t key=0;key<n_bricks;key++)
+    {
+        int origin[3];
+        this->GetBrickOrigin(key,origin);
+        BrickValues brick(this->n_chemicals,vector<float>(this->GetCellsPerBrick(),0.0f));
+        bool is_uniform = true;
+        for(int ic=0;ic<this->n_chemicals;ic++)
+        {
+            low[ic] = high[ic] = values[ic][((size_t)origin[2]*D[1] + origin[1])*D[0] + origin[0]];
+            for(int z=0;z<E[2] && origin[2]+z<D[2];z++)
+            {
+                for(int y=0;y<E[1] && origin[1]+y<D[1];y++)
+                {
+                    for(int x=0;x<E[0] && origin[0]+x<D[0];x++)
+                    {
+                        const float v = values[ic][((size_t)(origin[2]+z)*D[1] + origin[1]+y)*D[0] + origin[0]+x];
+                        brick[ic][(z*E[1]+y)*E[0]+x] = v;
+                        low[ic] = min(low[ic],v);
+                        high[ic] = max(high[ic],v);
+                    }
+                }
+            }
+            this->tile_values[key * this->n_chemicals + ic] = (low[ic] + high[ic]) / 2.0f;
+            is_uniform = is_uniform && high[ic] - low[ic] <= this->tolerance;
+        }
+        if(!is_uniform || !this->IsFixedPoint(&this->tile_values[key * this->n_chemicals]))
+            this->active_bricks[key].swap(brick);
+    }
+
+    // wake any inactive bricks that border different values
+    vector<size_t> to_wake;
+    for(size_t key=0;key<n_bricks;key++)
+        if(!this->active_bricks.count(key) && !this->DoesHaloMatch(key,&this->tile_values[key * this->n_chemicals]))
+            to_wake.push_back(key);
+    for(size_t key : to_wake)
+        this->Activate(key);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::GetChangedDenseValues(const vector<float*>& values)
+{
+    const int *E = this->brick_extent;
+    const int *D = this->dimensions;
+    for(size_t key : this->changed_bricks)
+    {
+        int origin[3];
+        this->GetBrickOrigin(key,origin);
+        const auto found = this->active_bricks.find(key);
+        for(int ic=0;ic<this->n_chemicals;ic++)
+        {
+            const float tile_value = this->tile_values[key * this->n_chemicals + ic];
+            for(int z=0;z<E[2] && origin[2]+z<D[2];z++)
+                for(int y=0;y<E[1] && origin[1]+y<D[1];y++)
+                    for(int x=0;x<E[0] && origin[0]+x<D[0];x++)
+                        values[ic][((size_t)(origin[2]+z)*D[1] + origin[1]+y)*D[0] + origin[0]+x] =
+                            (found == this->active_bricks.end()) ? tile_value : found->second[ic][(z*E[1]+y)*E[0]+x];
+        }
+    }
+    this->changed_bricks.clear();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::WakeNeighbors()
+{
+    const int *E = this->brick_extent;
+    unordered_set<size_t> candidates;
+    for(const auto& key_brick : this->active_bricks)
+    {
+        int origin[3];
+        this->GetBrickOrigin(key_brick.first,origin);
+        for(int dz=-(E[2]>1);dz<=(E[2]>1);dz++)
+        {
+            for(int dy=-(E[1]>1);dy<=(E[1]>1);dy++)
+            {
+                for(int dx=-(E[0]>1);dx<=(E[0]>1);dx++)
+                {
+                    int brick[3] = { origin[0]/E[0]+dx, origin[1]/E[1]+dy, origin[2]/E[2]+dz };
+                    bool is_inside = true;
+                    for(int i=0;i<3;i++)
+                    {
+                        const int n = this->n_bricks[i];
+                        if(this->wrap)
+                            brick[i] = ((brick[i] % n) + n) % n;
+                        else if(brick[i] < 0 || brick[i] >= n)
+                            is_inside = false;
+                    }
+                    if(is_inside && !this->active_bricks.count(this->GetBrickKey(brick)))
+                        candidates.insert(this->GetBrickKey(brick));
+                }
+            }
+        }
+    }
+    vector<size_t> to_wake;
+    for(size_t key : candidates)
+        if(!this->DoesHaloMatch(key,&this->tile_values[key * this->n_chemicals]))
+            to_wake.push_back(key);
+    for(size_t key : to_wake)
+        this->Activate(key);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::SleepUniformBricks()
+{
+    const int *E = this->brick_extent;
+    const int *D = this->dimensions;
+    vector<pair<size_t,vector<float>>> to_sleep;
+    vector<float> low(this->n_chemicals), high(this->n_chemicals);
+    for(const auto& key_brick : this->active_bricks)
+    {
+        int origin[3];
+        this->GetBrickOrigin(key_brick.first,origin);
+        bool is_uniform = true;
+        for(int ic=0;ic<this->n_chemicals && is_uniform;ic++)
+        {
+            const vector<float>& values = key_brick.second[ic];
+            low[ic] = high[ic] = values[0];
+            for(int z=0;z<E[2] && origin[2]+z<D[2];z++)
+            {
+                for(int y=0;y<E[1] && origin[1]+y<D[1];y++)
+                {
+                    for(int x=0;x<E[0] && origin[0]+x<D[0];x++)
+                    {
+                        low[ic] = min(low[ic],values[(z*E[1]+y)*E[0]+x]);
+                        high[ic] = max(high[ic],values[(z*E[1]+y)*E[0]+x]);
+                    }
+                }
+            }
+            is_uniform = high[ic] - low[ic] <= this->tolerance;
+        }
+        if(!is_uniform)
+            continue;
+        vector<float> mean(this->n_chemicals);
+        for(int ic=0;ic<this->n_chemicals;ic++)
+            mean[ic] = (low[ic] + high[ic]) / 2.0f;
+        if(this->DoesHaloMatch(key_brick.first,&mean[0]) && this->IsFixedPoint(&mean[0]))
+            to_sleep.push_back(make_pair(key_brick.first,mean));
+    }
+    for(const auto& key_mean : to_sleep)
+    {
+        copy(key_mean.second.begin(),key_mean.second.end(),&this->tile_values[key_mean.first * this->n_chemicals]);
+        this->active_bricks.erase(key_mean.first);
+        this->changed_bricks.insert(key_mean.first);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void SparseVolume::Step()
+{
+    this->WakeNeighbors();
+    if(this->active_bricks.empty())
+        return;
+
+    // copy each active brick and its halo into a patch, with the patches stacked along z
+    const int *E = this->brick_extent;
+    const int *H = this->halo;
+    const int P[3] = { E[0] + 2*H[0], E[1] + 2*H[1], E[2] + 2*H[2] };
+    const size_t patch_cells = (size_t)P[0] * P[1] * P[2];
+    const size_t n_patches = this->active_bricks.size();
+    vector<vector<float>> in(this->n_chemicals,vector<float>(patch_cells * n_patches));
+    vector<vector<float>> out(this->n_chemicals,vector<float>(patch_cells * n_patches));
+    size_t iPatch = 0;
+    HaloLayout layout;
+    for(const auto& key_brick : this->active_bricks)
+    {
+        this->GetHaloLayout(key_brick.first,layout);
+        size_t i_patch = iPatch * patch_cells;
+        for(int z=0;z<P[2];z++)
+        {
+            for(int y=0;y<P[1];y++)
+            {
+                for(int x=0;x<P[0];x++,i_patch++)
+                {
+                    const size_t i = (layout.slots[2][z] * layout.n_slots[1] + layout.slots[1][y]) * layout.n_slots[0]
+                        + layout.slots[0][x];
+                    const BrickValues *values = layout.values[i];
+                    const size_t cell = ((size_t)layout.offsets[2][z] * E[1] + layout.offsets[1][y]) * E[0]
+                        + layout.offsets[0][x];
+                    for(int ic=0;ic<this->n_chemicals;ic++)
+                        in[ic][i_patch] = values ? (*values)[ic][cell]
+                            : this->tile_values[layout.keys[i] * this->n_chemicals + ic];
+                }
+            }
+        }
+        iPatch++;
+    }
+
+    vector<void*> args;
+    for(int ic=0;ic<this->n_chemicals;ic++)
+        args.push_back(&in[ic][0]);
+    for(int ic=0;ic<this->n_chemicals;ic++)
+        args.push_back(&out[ic][0]);
+    const size_t global_range[3] = { (size_t)P[0], (size_t)P[1], (size_t)P[2] * n_patches };
+    this->kernel.Run(args,global_range);
+
+    iPatch = 0;
+    for(auto& key_brick : this->active_bricks)
+    {
+        for(int ic=0;ic<this->n_chemicals;ic++)
+        {
+            vector<float>& values = key_brick.second[ic];
+            const float *patch = &out[ic][iPatch * patch_cells];
+            for(int z=0;z<E[2];z++)
+                for(int y=0;y<E[1];y++)
+                    for(int x=0;x<E[0];x++)
+                        values[(z*E[1]+y)*E[0]+x] = patch[((size_t)(z+H[2])*P[1] + y+H[1])*P[0] + x+H[0]];
+        }
+        this->changed_bricks.insert(key_brick.first);
+        iPatch++;
+    }
+
+    this->SleepUniformBricks();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t SparseVolume::GetMemorySize() const
+{
+    return (this->active_bricks.size() * this->n_chemicals * this->GetCellsPerBrick() + this->tile_values.size())
+        * sizeof(float);
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,117 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __SPARSEVOLUME__
+#define __SPARSEVOLUME__
+
+// local:
+#include "NativeKernel.hpp"
+
+// STL:
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// Values of each chemical on a grid, stored only where they vary.
+/** The grid is divided into cubic bricks. A brick whose cells all have the same values (to within a tolerance), and
+  * which a step would leave unchanged, is inactive: only one value per chemical is kept for it. The others are active,
+  * kept in a hash table, and are the only ones stepped. Before each step, inactive bricks next to active ones that no
+  * longer match them are woken; after each step, active bricks that have become uniform are put to sleep. So for a
+  * pattern with a moving front, memory and compute scale with the area of the front rather than the volume. */
+class SparseVolume
+{
+    public:
+
+        SparseVolume();
+
+        /// Discard everything, leaving every brick inactive with value zero.
+        void Reset(const int dimensions[3],int n_chemicals,int brick_size,bool wrap,float tolerance);
+        bool IsReset(const int dimensions[3],int n_chemicals,int brick_size,bool wrap,float tolerance) const;
+
+        /// Compile the kernel, which steps all the cells it is given, reading up to halo[i] cells away along each
+        /// axis. Returns true if the kernel has changed, in which case the values should be set again.
+        bool SetKernel(const std::string& source,const int halo[3]);
+        /// Add the kernel builds and runs to these counters (if not NULL).
+        void SetPerformanceCounters(PerformanceCounters* c) { this->kernel.SetPerformanceCounters(c); }
+
+        /// Replace all the values with those of dense images (x fastest), one for each chemical.
+        void SetDenseValues(const std::vector<const float*>& values);
+        /// Copy the bricks that have changed since the last call into dense images (x fastest).
+        void GetChangedDenseValues(const std::vector<float*>& values);
+
+        void Step();
+
+        size_t GetNumberOfBricks() const { return this->tile_values.size() / std::max(1,this->n_chemicals); }
+        size_t GetNumberOfActiveBricks() const { return this->active_bricks.size(); }
+        size_t GetMemorySize() const;
+
+    private:
+
+        typedef std::vector<std::vector<float>> BrickValues; ///< one for each chemical
+
+        /// Where each cell of a brick and its halo comes from, wrapping around or clamping at the edges.
+        struct HaloLayout
+        {
+            std::vector<int> slots[3];   ///< for each position along each axis, the index of its brick along that axis
+            std::vector<int> offsets[3]; ///< for each position along each axis, the offset in that brick
+            size_t n_slots[3];
+            std::vector<size_t> keys;    ///< of each combination of the bricks along each axis, x fastest
+            std::vector<const BrickValues*> values; ///< NULL where the brick is inactive
+        };
+
+    private:
+
+        /// Look up the bricks that a brick and its halo cover, once each.
+        void GetHaloLayout(size_t key,HaloLayout& layout) const;
+
+        /// Whether every cell within the halo of a brick (but outside it) matches these values.
+        bool DoesHaloMatch(size_t key,const float* values) const;
+
+        /// Whether a step leaves a region of these uniform values unchanged.
+        bool IsFixedPoint(const float* values);
+
+        void Activate(size_t key);
+        void WakeNeighbors();
+        void SleepUniformBricks();
+
+        void GetBrickOrigin(size_t key,int origin[3]) const;
+        size_t GetBrickKey(const int brick[3]) const;
+        size_t GetCellsPerBrick() const { return (size_t)this->brick_extent[0]*this->brick_extent[1]*this->brick_extent[2]; }
+
+    private:
+
+        int dimensions[3];
+        int n_chemicals;
+        int brick_size;
+        bool wrap;
+        float tolerance;
+        int brick_extent[3]; ///< brick_size along the non-flat axes, 1 along the others
+        int n_bricks[3];
+        int halo[3];
+
+        std::unordered_map<size_t,BrickValues> active_bricks;
+        std::vector<float> tile_values; ///< for each brick, the value of each chemical while it is inactive
+        std::unordered_set<size_t> changed_bricks;
+
+        NativeKernel kernel;
+        std::map<std::vector<float>,bool> fixed_points; ///< cached results of IsFixedPoint
+};
+
+#endif
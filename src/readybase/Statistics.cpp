@@ -0,0 +1,146 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "Statistics.hpp"
+
+// VTK:
+#include <vtkType.h>
+
+// STL:
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+
+/// How many threads to share n values between. (Small arrays aren't worth starting threads for.)
+static size_t GetNumberOfChunks(size_t n)
+{
+    const size_t MIN_CHUNK_SIZE = 1 << 16;
+    return max(size_t(1), min(size_t(thread::hardware_concurrency()), n / MIN_CHUNK_SIZE));
+}
+
+// ---------------------------------------------------------------------------
+
+/// Call task(i_chunk,first,last) for each chunk of [0,n), the chunks after the first on threads of their own.
+template <typename Task>
+static void RunChunks(size_t n,size_t n_chunks,const Task& task)
+{
+    const size_t CHUNK_SIZE = (n + n_chunks - 1) / n_chunks;
+    vector<thread> threads;
+    for(size_t i=1;i<n_chunks;i++)
+        threads.emplace_back([&task,i,n,CHUNK_SIZE]() { task(i, min(n, i * CHUNK_SIZE), min(n, (i+1) * CHUNK_SIZE)); });
+    task(0, 0, min(n, CHUNK_SIZE));
+    for(thread& t : threads)
+        t.join();
+}
+
+// ---------------------------------------------------------------------------
+
+template <typename T>
+static ChemicalStatistics Summarise(const T* values,size_t n,int n_bins)
+{
+    const double shift = n > 0 ? values[0] : 0.0;
+    const size_t N_CHUNKS = GetNumberOfChunks(n);
+
+    // first pass: the moments, and so the range for the histogram
+    vector<PartialStatistics> partials(N_CHUNKS);
+    RunChunks(n, N_CHUNKS, [&](size_t i_chunk,size_t first,size_t last)
+    {
+        PartialStatistics p = { last - first, numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), 0.0, 0.0 };
+        for(size_t i=first;i<last;i++)
+        {
+            const double value = values[i];
+            p.minimum = min(p.minimum, value);
+            p.maximum = max(p.maximum, value);
+            const double d = value - shift;
+            p.sum += d;
+            p.sum_of_squares += d * d;
+        }
+        partials[i_chunk] = p;
+    });
+    ChemicalStatistics statistics = CombinePartialStatistics(partials, shift);
+
+    // second pass: the histogram
+    const double LOW = statistics.minimum;
+    const double SCALE = GetHistogramScale(statistics.minimum, statistics.maximum, n_bins);
+    vector<vector<size_t>> counts(N_CHUNKS, vector<size_t>(n_bins, 0));
+    RunChunks(n, N_CHUNKS, [&](size_t i_chunk,size_t first,size_t last)
+    {
+        size_t* count = counts[i_chunk].data();
+        for(size_t i=first;i<last;i++)
+        {
+            const double x = (values[i] - LOW) * SCALE;
+            count[x >= n_bins ? n_bins - 1 : (x > 0.0 ? int(x) : 0)]++; // (NaNs go in the first bin)
+        }
+    });
+    statistics.histogram.assign(n_bins, 0);
+    for(const vector<size_t>& count : counts)
+        for(int i=0;i<n_bins;i++)
+            statistics.histogram[i] += count[i];
+    return statistics;
+}
+
+// ---------------------------------------------------------------------------
+
+ChemicalStatistics ComputeChemicalStatistics(const void* values,size_t n,int data_type,int n_bins)
+{
+    switch(data_type)
+    {
+        case VTK_FLOAT: return Summarise(static_cast<const float*>(values), n, n_bins);
+        case VTK_DOUBLE: return Summarise(static_cast<const double*>(values), n, n_bins);
+        default: throw runtime_error("ComputeChemicalStatistics : unsupported data type");
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+ChemicalStatistics CombinePartialStatistics(const vector<PartialStatistics>& partials,double shift)
+{
+    size_t count = 0;
+    double minimum = numeric_limits<double>::infinity();
+    double maximum = -numeric_limits<double>::infinity();
+    double sum = 0.0, sum_of_squares = 0.0;
+    for(const PartialStatistics& p : partials)
+    {
+        if(p.count == 0) continue;
+        count += p.count;
+        minimum = min(minimum, p.minimum);
+        maximum = max(maximum, p.maximum);
+        sum += p.sum;
+        sum_of_squares += p.sum_of_squares;
+    }
+
+    ChemicalStatistics statistics;
+    if(count == 0 || minimum > maximum)
+    {
+        statistics.minimum = statistics.maximum = statistics.mean = statistics.variance = 0.0;
+        return statistics;
+    }
+    const double MEAN_OFFSET = sum / count;
+    statistics.minimum = minimum;
+    statistics.maximum = maximum;
+    statistics.mean = shift + MEAN_OFFSET;
+    statistics.variance = max(0.0, sum_of_squares / count - MEAN_OFFSET * MEAN_OFFSET);
+    return statistics;
+}
+
+// ---------------------------------------------------------------------------
@@ -0,0 +1,56 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __STATISTICS__
+#define __STATISTICS__
+
+// STL:
+#include <cstddef>
+#include <vector>
+
+/// A summary of the values of one chemical, for monitoring a run or for fitting the colormap to it.
+struct ChemicalStatistics
+{
+    double minimum,maximum;
+    double mean,variance;
+    std::vector<size_t> histogram; ///< counts in equal-width bins spanning [minimum,maximum]
+};
+
+/// Sums over part of the values. The sums are of (value - shift), for some shift close to the values, so that the
+/// variance doesn't suffer from cancellation.
+struct PartialStatistics
+{
+    size_t count;
+    double minimum,maximum;
+    double sum,sum_of_squares;
+};
+
+/// Summarise n values of data_type (VTK_FLOAT or VTK_DOUBLE) into n_bins histogram bins, splitting the work
+/// between several threads.
+ChemicalStatistics ComputeChemicalStatistics(const void* values,size_t n,int data_type,int n_bins);
+
+/// Combine partial sums (e.g. one from each thread or work-group) into the minimum, maximum, mean and variance of the
+/// whole. The histogram is left empty.
+ChemicalStatistics CombinePartialStatistics(const std::vector<PartialStatistics>& partials,double shift);
+
+/// The scale that maps (value - minimum) to a histogram bin. Values beyond the last bin go in the last bin.
+inline double GetHistogramScale(double minimum,double maximum,int n_bins)
+{
+    return maximum > minimum ? n_bins / (maximum - minimum) : 0.0;
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "StochasticGrayScottImageRD.hpp"
+#include "philox.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+/// What the random numbers of a cell in a timestep are used for. (The second word of the generator's counter.)
+enum RandomPurpose : uint32_t { REACTIONS = 0, JUMPS_OF_A = 1, JUMPS_OF_B = 2 };
+
+// -------------------------------------------------------------------------
+
+/// A Poisson-distributed number of events with the given mean. (Knuth's method for small means, otherwise Hörmann's
+/// transformed rejection with squeeze, PTRS.)
+static int32_t SamplePoisson(double mean, PhiloxStream& stream)
+{
+    if(mean <= 0.0)
+        return 0;
+    if(mean < 10.0)
+    {
+        const double threshold = exp(-mean);
+        int32_t k = 0;
+        double product = stream.NextUniform();
+        while(product > threshold)
+        {
+            k++;
+            product *= stream.NextUniform();
+        }
+        return k;
+    }
+    const double sqrt_mean = sqrt(mean), log_mean = log(mean);
+    const double b = 0.931 + 2.53 * sqrt_mean;
+    const double a = -0.059 + 0.02483 * b;
+    const double inv_alpha = 1.1239 + 1.1328 / (b - 3.4);
+    const double v_r = 0.9277 - 3.6224 / (b - 2.0);
+    for(;;)
+    {
+        const double U = stream.NextUniform() - 0.5;
+        const double V = stream.NextUniform();
+        const double us = 0.5 - fabs(U);
+        const double k = floor((2.0 * a / us + b) * U + mean + 0.43);
+        if(us >= 0.07 && V <= v_r)
+            return static_cast<int32_t>(k);
+        if(k < 0.0 || (us < 0.013 && V > us))
+            continue;
+        if(log(V) + log(inv_alpha) - log(a / (us * us) + b) <= -mean + k * log_mean - lgamma(k + 1.0))
+            return static_cast<int32_t>(k);
+    }
+}
+
+// -------------------------------------------------------------------------
+
+/// A binomially-distributed number of successes in n trials of probability p. (Exact by inversion when n*p is small,
+/// otherwise the normal approximation, whose error is small there compared with the tau-leaping's own.)
+static int32_t SampleBinomial(int32_t n, double p, PhiloxStream& stream)
+{
+    if(n <= 0 || p <= 0.0)
+        return 0;
+    if(p >= 1.0)
+        return n;
+    if(p > 0.5)
+        return n - SampleBinomial(n, 1.0 - p, stream);
+    if(n * p < 30.0)
+    {
+        const double q = 1.0 - p, s = p / q, a = (n + 1) * s;
+        double r = pow(q, n); // the probability of x successes, starting with none
+        double u = stream.NextUniform();
+        int32_t x = 0;
+        while(u > r && x < n)
+        {
+            u -= r;
+            x++;
+            r *= a / x - s;
+        }
+        return x;
+    }
+    const double mean = n * p, sd = sqrt(n * p * (1.0 - p));
+    const double normal = sqrt(-2.0 * log(stream.NextUniform())) * cos(2.0 * vtkMath::Pi() * stream.NextUniform());
+    return static_cast<int32_t>(min(double(n), max(0.0, floor(mean + sd * normal + 0.5))));
+}
+
+// -------------------------------------------------------------------------
+
+/// Call task(first,last) for chunks of [0,n), the chunks after the first on threads of their own.
+template <typename Task>
+static void RunChunks(size_t n, const Task& task)
+{
+    const size_t MIN_CHUNK_SIZE = 1 << 12; // (small grids aren't worth starting threads for)
+    const size_t n_chunks = max(size_t(1), min(size_t(thread::hardware_concurrency()), n / MIN_CHUNK_SIZE));
+    const size_t CHUNK_SIZE = (n + n_chunks - 1) / n_chunks;
+    vector<thread> threads;
+    for(size_t i=1;i<n_chunks;i++)
+        threads.emplace_back([&task, i, n, CHUNK_SIZE]() { task(min(n, i * CHUNK_SIZE), min(n, (i + 1) * CHUNK_SIZE)); });
+    task(0, min(n, CHUNK_SIZE));
+    for(thread& t : threads)
+        t.join();
+}
+
+// -------------------------------------------------------------------------
+
+StochasticGrayScottImageRD::StochasticGrayScottImageRD()
+    : InbuiltImageRD(VTK_FLOAT)
+    , seed(1)
+{
+    this->rule_name = "Gray-Scott stochastic";
+    this->n_chemicals = 2;
+    this->AddParameter("timestep",1.0f);
+    this->AddParameter("D_a",0.082f);
+    this->AddParameter("D_b",0.041f);
+    this->AddParameter("k",0.06f);
+    this->AddParameter("F",0.035f);
+    this->AddParameter("molecules_per_unit",100.0f);
+}
+
+// -------------------------------------------------------------------------
+
+void StochasticGrayScottImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
+{
+    // N.B. this class is hardwired for Gray-Scott using floats, so data_type is ignored
+    if(nc!=2) throw runtime_error("StochasticGrayScottImageRD::AllocateImages : this implementation is for 2 chemicals only");
+    ImageRD::AllocateImages(x,y,z,2,VTK_FLOAT);
+    for(int ic=0;ic<2;ic++)
+    {
+        vector<int32_t>().swap(this->counts[ic]); // (reallocated by the next update)
+        vector<int32_t>().swap(this->next_counts[ic]);
+        vector<int32_t>().swap(this->jumps[ic]);
+    }
+}
+
+// -------------------------------------------------------------------------
+
+void StochasticGrayScottImageRD::InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update)
+{
+    InbuiltImageRD::InitializeFromXML(rd,warn_to_update);
+
+    // seed (optional)
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    this->seed = 1;
+    read_optional_attribute(rule,"seed",this->seed);
+}
+
+// -------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> StochasticGrayScottImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = InbuiltImageRD::GetAsXML(generate_initial_pattern_when_loading);
+    rd->FindNestedElementWithName("rule")->SetAttribute("seed",to_string(this->seed).c_str());
+    return rd;
+}
+
+// -------------------------------------------------------------------------
+
+size_t StochasticGrayScottImageRD::GetMemorySize() const
+{
+    size_t n = 0;
+    for(int ic=0;ic<2;ic++)
+        n += this->counts[ic].size() + this->next_counts[ic].size() + this->jumps[ic].size();
+    return ImageRD::GetMemorySize() + n * sizeof(int32_t);
+}
+
+// -------------------------------------------------------------------------
+
+void StochasticGrayScottImageRD::InternalUpdate(int n_steps)
+{
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+    const size_t N = size_t(X) * Y * Z;
+
+    const double timestep = this->GetParameterValueByName("timestep");
+    const double D[2] = { this->GetParameterValueByName("D_a"), this->GetParameterValueByName("D_b") };
+    const double k = this->GetParameterValueByName("k");
+    const double F = this->GetParameterValueByName("F");
+    const double omega = this->GetParameterValueByName("molecules_per_unit");
+    if(omega <= 0.0)
+        throw runtime_error("StochasticGrayScottImageRD::InternalUpdate : molecules_per_unit must be positive");
+
+    // molecules jump along the axes that have more than one cell, at rate D to each neighbor (as for the inbuilt
+    // Laplacian), so each one leaves its cell in a timestep with this probability (which makes the expected change
+    // the same as the forward-Euler step that GrayScottImageRD takes)
+    const int dims[3] = { X, Y, Z };
+    vector<array<int,3>> directions;
+    for(int axis=0;axis<3;axis++)
+    {
+        if(dims[axis] < 2) continue;
+        for(int sign : { 1, -1 })
+        {
+            array<int,3> direction = { 0, 0, 0 };
+            direction[axis] = sign;
+            directions.push_back(direction);
+        }
+    }
+    const int n_directions = (int)directions.size();
+    const int bits_per_choice = n_directions == 2 ? 1 : n_directions == 4 ? 2 : 0; // (0 if not a power of two)
+    const double p_leave[2] = { min(1.0, n_directions * D[0] * timestep), min(1.0, n_directions * D[1] * timestep) };
+    const bool wrap = this->wrap;
+    // the cell at (x,y,z) + direction, or -1 if that is outside and we're not wrapping around
+    auto get_neighbor = [X,Y,Z,wrap](int x,int y,int z,const array<int,3>& direction) -> int64_t
+    {
+        int nx = x + direction[0], ny = y + direction[1], nz = z + direction[2];
+        if(wrap)
+        {
+            nx = (nx + X) % X;
+            ny = (ny + Y) % Y;
+            nz = (nz + Z) % Z;
+        }
+        else if(nx < 0 || nx >= X || ny < 0 || ny >= Y || nz < 0 || nz >= Z)
+            return -1;
+        return (int64_t(nz) * Y + ny) * X + nx;
+    };
+
+    // round the concentrations to whole molecules
+    float* concentrations[2];
+    for(int ic=0;ic<2;ic++)
+    {
+        concentrations[ic] = static_cast<float*>(this->images[ic]->GetScalarPointer());
+        this->counts[ic].resize(N);
+        this->next_counts[ic].resize(N);
+        this->jumps[ic].resize(N * n_directions);
+        for(size_t i=0;i<N;i++)
+            this->counts[ic][i] = static_cast<int32_t>(max(0.0, floor(concentrations[ic][i] * omega + 0.5)));
+    }
+
+    for(int iStep=0;iStep<n_steps;iStep++)
+    {
+        const uint32_t step = static_cast<uint32_t>(this->timesteps_taken + iStep);
+
+        // first the reactions in each cell, then how many of the molecules leave it in each direction
+        RunChunks(N, [&](size_t first, size_t last)
+        {
+            for(size_t i=first;i<last;i++)
+            {
+                int32_t a = this->counts[0][i];
+                int32_t b = this->counts[1][i];
+
+                // each term of the formula times omega gives the expected number of firings per unit time
+                PhiloxStream reactions(this->seed, static_cast<uint32_t>(i), step, REACTIONS, 0);
+                const int32_t feed = SamplePoisson(F * omega * timestep, reactions);
+                int32_t a_decay = SamplePoisson(F * a * timestep, reactions);
+                int32_t b_decay = SamplePoisson((F + k) * b * timestep, reactions);
+                int32_t autocatalysis = SamplePoisson(double(a) * b * (b - 1) / (omega * omega) * timestep, reactions);
+                // (tau-leaping can fire a reaction more often than there are molecules for, so we stop at zero)
+                autocatalysis = min(autocatalysis, a);
+                a_decay = min(a_decay, a - autocatalysis);
+                b_decay = min(b_decay, b);
+                a += feed - a_decay - autocatalysis;
+                b += autocatalysis - b_decay;
+
+                const int x = int(i % X), y = int((i / X) % Y), z = int(i / (size_t(X) * Y));
+                const int32_t after_reactions[2] = { a, b };
+                for(int ic=0;ic<2;ic++)
+                {
+                    PhiloxStream jumps_rng(this->seed, static_cast<uint32_t>(i), step, JUMPS_OF_A + ic, 0);
+                    int32_t leaving = SampleBinomial(after_reactions[ic], p_leave[ic], jumps_rng);
+                    int32_t staying = after_reactions[ic] - leaving;
+                    // share the leavers equally between the directions: one by one if there are only a few, which
+                    // is quicker than a binomial for each direction (in 1D and 2D a random word makes 32 or 16 choices)
+                    int32_t n_jumping[6] = { 0, 0, 0, 0, 0, 0 };
+                    if(leaving <= 8 * n_directions)
+                    {
+                        uint32_t word = 0;
+                        int bits_left = 0;
+                        for(int32_t m=0;m<leaving;m++)
+                        {
+                            if(bits_per_choice == 0)
+                            {
+                                n_jumping[(uint64_t(jumps_rng.NextUInt32()) * n_directions) >> 32]++;
+                                continue;
+                            }
+                            if(bits_left < bits_per_choice)
+                            {
+                                word = jumps_rng.NextUInt32();
+                                bits_left = 32;
+                            }
+                            n_jumping[word & (n_directions - 1)]++;
+                            word >>= bits_per_choice;
+                            bits_left -= bits_per_choice;
+                        }
+                    }
+                    else
+                    {
+                        for(int d=0;d<n_directions;d++)
+                        {
+                            n_jumping[d] = SampleBinomial(leaving, 1.0 / (n_directions - d), jumps_rng);
+                            leaving -= n_jumping[d];
+                        }
+                    }
+                    for(int d=0;d<n_directions;d++)
+                    {
+                        if(!wrap && get_neighbor(x, y, z, directions[d]) < 0)
+                        {
+                            staying += n_jumping[d]; // (bounce off the edge)
+                            n_jumping[d] = 0;
+                        }
+                        this->jumps[ic][i * n_directions + d] = n_jumping[d];
+                    }
+                    this->next_counts[ic][i] = staying;
+                }
+            }
+        });
+
+        // then each cell gathers the molecules that jumped into it (so the result doesn't depend on the chunks)
+        RunChunks(N, [&](size_t first, size_t last)
+        {
+            for(size_t i=first;i<last;i++)
+            {
+                const int x = int(i % X), y = int((i / X) % Y), z = int(i / (size_t(X) * Y));
+                for(int d=0;d<n_directions;d++)
+                {
+                    const array<int,3> back = { -directions[d][0], -directions[d][1], -directions[d][2] };
+                    const int64_t source = get_neighbor(x, y, z, back);
+                    if(source < 0) continue;
+                    for(int ic=0;ic<2;ic++)
+                        this->next_counts[ic][i] += this->jumps[ic][source * n_directions + d];
+                }
+            }
+        });
+
+        for(int ic=0;ic<2;ic++)
+            this->counts[ic].swap(this->next_counts[ic]);
+    }
+
+    for(int ic=0;ic<2;ic++)
+        for(size_t i=0;i<N;i++)
+            concentrations[ic][i] = static_cast<float>(this->counts[ic][i] / omega);
+}
+
+// -------------------------------------------------------------------------
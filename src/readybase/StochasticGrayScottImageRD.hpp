@@ -0,0 +1,66 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __STOCHASTICGRAYSCOTTIMAGERD__
+#define __STOCHASTICGRAYSCOTTIMAGERD__
+
+// local:
+#include "InbuiltImageRD.hpp"
+
+// STL:
+#include <cstdint>
+#include <vector>
+
+/// An inbuilt implementation: n-dimensional Gray-Scott with discrete molecules, to compare with the differential equations.
+/** Each cell holds whole numbers of molecules of a and b, and concentration 1 is molecules_per_unit molecules. Each
+ *  timestep the reactions (feed, A + 2B -> 3B, and the decay of a and b) fire a Poisson number of times, and each
+ *  molecule jumps to a neighboring cell with the probability that diffusion gives it (binomial tau-leaping). As
+ *  molecules_per_unit grows the results approach those of GrayScottImageRD with the same parameters.
+ *
+ *  The random numbers come from a counter-based generator keyed on the seed, the cell and the timestep, so a run
+ *  can be repeated exactly however many threads share the work. The images hold the concentrations, which are rounded
+ *  to whole molecules when an update starts, so patterns and painting work as for the other systems. */
+class StochasticGrayScottImageRD : public InbuiltImageRD
+{
+    public:
+
+        StochasticGrayScottImageRD();
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        uint32_t GetSeed() const { return this->seed; }
+        void SetSeed(uint32_t s) { this->seed = s; }
+
+        size_t GetMemorySize() const override;
+
+    protected:
+
+        void AllocateImages(int x,int y,int z,int nc,int data_type) override;
+
+        void InternalUpdate(int n_steps) override;
+
+    private:
+
+        uint32_t seed;
+
+        std::vector<int32_t> counts[2];   ///< the molecules of a and b in each cell
+        std::vector<int32_t> next_counts[2];
+        std::vector<int32_t> jumps[2];    ///< the molecules of a and b leaving each cell in each direction this timestep
+};
+
+#endif
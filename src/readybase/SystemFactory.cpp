@@ -25,11 +25,18 @@
 #include <GrayScottMeshRD.hpp>
 #include <FormulaOpenCLMeshRD.hpp>
 #include <FullKernelOpenCLMeshRD.hpp>
+#include <NativeKernelImageRD.hpp>
+#include <NativeKernelMeshRD.hpp>
+#include <OutOfCoreImageRD.hpp>
+#include <AMRImageRD.hpp>
+#include <SparseImageRD.hpp>
+#include <StochasticGrayScottImageRD.hpp>
 #include <Properties.hpp>
 #include <OpenCL_utils.hpp>
 
 // VTK:
 #include <vtkCellData.h>
+#include <vtkCommand.h>
 #include <vtkImageData.h>
 #include <vtkPointData.h>
 #include <vtkUnstructuredGrid.h>
@@ -48,7 +55,8 @@ unique_ptr<AbstractRD> CreateFromImageDataFile(
     int opencl_platform,
     int opencl_device,
     Properties &render_settings,
-    bool &warn_to_update);
+    bool &warn_to_update,
+    const SystemFactory::ProgressCallback& progress);
 
 unique_ptr<AbstractRD> CreateFromUnstructuredGridFile(
     const char *filename,
@@ -56,7 +64,8 @@ unique_ptr<AbstractRD> CreateFromUnstructuredGridFile(
     int opencl_platform,
     int opencl_device,
     Properties &render_settings,
-    bool &warn_to_update);
+    bool &warn_to_update,
+    const SystemFactory::ProgressCallback& progress);
 
 // -------------------------------------------------------------------------------------------------------------
 
@@ -66,7 +75,8 @@ unique_ptr<AbstractRD> SystemFactory::CreateFromFile(
     int opencl_platform,
     int opencl_device,
     Properties &render_settings,
-    bool &warn_to_update)
+    bool &warn_to_update,
+    const ProgressCallback& progress)
 {
     // temporarily turn off internationalisation, to avoid string-to-float conversion issues
     char *old_locale = setlocale(LC_NUMERIC,"C");
@@ -79,11 +89,11 @@ unique_ptr<AbstractRD> SystemFactory::CreateFromFile(
     {
         case VTK_IMAGE_DATA:
             system = CreateFromImageDataFile(filename,is_opencl_available,opencl_platform,opencl_device,
-                render_settings,warn_to_update);
+                render_settings,warn_to_update,progress);
             break;
         case VTK_UNSTRUCTURED_GRID:
             system = CreateFromUnstructuredGridFile(filename,is_opencl_available,opencl_platform,opencl_device,
-                render_settings,warn_to_update);
+                render_settings,warn_to_update,progress);
             break;
         default:
             throw runtime_error("Unsupported data type or file read error");
@@ -92,6 +102,9 @@ unique_ptr<AbstractRD> SystemFactory::CreateFromFile(
     // restore the old locale
     setlocale(LC_NUMERIC,old_locale);
 
+    // wait for the kernel that was started while the data was read, so that any error in it is reported here
+    system->FinishCompilingKernel();
+
     system->SetFilename(filename);
     system->SetModified(false);
     return system;
@@ -99,27 +112,52 @@ unique_ptr<AbstractRD> SystemFactory::CreateFromFile(
 
 // -------------------------------------------------------------------------------------------------------------
 
+namespace
+{
+    /// Passes on a reader's progress events, scaled into the range [start,end].
+    class ReaderProgressObserver : public vtkCommand
+    {
+    public:
+        static ReaderProgressObserver* New()
+        {
+            return new ReaderProgressObserver;
+        }
+        virtual void Execute(vtkObject* vtkNotUsed(caller), unsigned long event, void* calldata)
+        {
+            if (event == vtkCommand::ProgressEvent && this->progress)
+                this->progress(this->start + (this->end - this->start) * *static_cast<double*>(calldata));
+        }
+        SystemFactory::ProgressCallback progress;
+        double start, end;
+    };
+
+    // -------------------------------------------------------------------------------------------------------------
+
+    void ReportProgress(const SystemFactory::ProgressCallback& progress, double fraction)
+    {
+        if (progress)
+            progress(fraction);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
 unique_ptr<AbstractRD> CreateFromImageDataFile(
     const char *filename,
     bool is_opencl_available,
     int opencl_platform,
     int opencl_device,
     Properties &render_settings,
-    bool &warn_to_update)
+    bool &warn_to_update,
+    const SystemFactory::ProgressCallback& progress)
 {
     vtkSmartPointer<RD_XMLImageReader> reader = vtkSmartPointer<RD_XMLImageReader>::New();
     reader->SetFileName(filename);
-    reader->Update();
-    vtkImageData *image = reader->GetOutput();
-
-    if( image == NULL )
-        throw runtime_error("Failed to read image.");
-    if (image->GetPointData() == NULL)
-        throw runtime_error("Image has no point data.");
-    if (image->GetPointData()->GetArray(0) == NULL)
-        throw runtime_error("No arrays in image point data.");
 
-    int data_type = image->GetPointData()->GetArray(0)->GetDataType();
+    // first read just the XML header, so that the system can be created and its kernel build started before
+    // the (possibly very large) arrays are decoded
+    int dim[3], nc, data_type;
+    reader->GetPointDataLayout(dim,nc,data_type);
     string type = reader->GetType();
     string name = reader->GetName();
 
@@ -128,20 +166,49 @@ unique_ptr<AbstractRD> CreateFromImageDataFile(
     {
         if(name=="Gray-Scott")
             image_system = make_unique<GrayScottImageRD>();
+        else if(name=="Gray-Scott stochastic")
+            image_system = make_unique<StochasticGrayScottImageRD>();
         else
             throw runtime_error("Unsupported inbuilt implementation: "+name);
     }
     else if(type=="formula")
     {
-        if(!is_opencl_available)
+        vtkXMLDataElement *rule = reader->GetRDElement()->FindNestedElementWithName("rule");
+        if(rule && rule->FindNestedElementWithName("amr"))
+        {
+            // (each level of refinement runs its own copy of the formula, on the CPU)
+            if(!NativeKernel::IsSupported())
+                throw runtime_error("AMR systems run their formula as native code, on the CPU. " + NativeKernel::GetSetupHints());
+            image_system = make_unique<AMRImageRD>(data_type);
+        }
+        else if(rule && rule->FindNestedElementWithName("sparse"))
+        {
+            // (only the bricks near a front are stored and stepped, on the CPU)
+            if(!NativeKernel::IsSupported())
+                throw runtime_error("Sparse systems run their formula as native code, on the CPU. " + NativeKernel::GetSetupHints());
+            image_system = make_unique<SparseImageRD>(data_type);
+        }
+        else if(!is_opencl_available)
             throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints());
-        image_system = make_unique<FormulaOpenCLImageRD>(opencl_platform,opencl_device,data_type);
+        else
+            image_system = make_unique<FormulaOpenCLImageRD>(opencl_platform,opencl_device,data_type);
     }
     else if(type=="kernel")
     {
-        if(!is_opencl_available)
-            throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints());
-        image_system = make_unique<FullKernelOpenCLImageRD>(opencl_platform,opencl_device,data_type);
+        vtkXMLDataElement *rule = reader->GetRDElement()->FindNestedElementWithName("rule");
+        if(rule && rule->FindNestedElementWithName("out_of_core"))
+        {
+            // (the grid is too big for the GPU, so the kernel runs on the CPU a tile at a time)
+            if(!NativeKernel::IsSupported())
+                throw runtime_error("Out-of-core systems run their kernel as native code, on the CPU. " + NativeKernel::GetSetupHints());
+            image_system = make_unique<OutOfCoreImageRD>(data_type);
+        }
+        else if(is_opencl_available)
+            image_system = make_unique<FullKernelOpenCLImageRD>(opencl_platform,opencl_device,data_type);
+        else if(NativeKernel::IsSupported())
+            image_system = make_unique<NativeKernelImageRD>(data_type); // (run the kernel on the CPU instead)
+        else
+            throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints() + "\n\n" + NativeKernel::GetSetupHints());
     }
     else throw runtime_error("Unsupported rule type: "+type);
     image_system->InitializeFromXML(reader->GetRDElement(),warn_to_update);
@@ -152,16 +219,32 @@ unique_ptr<AbstractRD> CreateFromImageDataFile(
     if(xml_render_settings) // optional
         render_settings.OverwriteFromXML(xml_render_settings);
 
-    int dim[3];
-    image->GetDimensions(dim);
-    int nc = image->GetNumberOfScalarComponents() * image->GetPointData()->GetNumberOfArrays();
-    image_system->SetDimensions(dim[0],dim[1],dim[2]);
-    image_system->SetNumberOfChemicals(nc);
+    // (for OpenCL systems this starts building the kernel on another thread)
+    image_system->SetDimensionsAndNumberOfChemicals(dim[0],dim[1],dim[2],nc);
+    ReportProgress(progress,0.1);
+
+    // now decode the arrays
+    vtkSmartPointer<ReaderProgressObserver> observer = vtkSmartPointer<ReaderProgressObserver>::New();
+    observer->progress = progress;
+    observer->start = 0.1;
+    observer->end = 0.9;
+    reader->AddObserver(vtkCommand::ProgressEvent,observer);
+    reader->Update();
+    vtkImageData *image = reader->GetOutput();
+
+    if( image == NULL )
+        throw runtime_error("Failed to read image.");
+    if (image->GetPointData() == NULL)
+        throw runtime_error("Image has no point data.");
+    if (image->GetPointData()->GetArray(0) == NULL)
+        throw runtime_error("No arrays in image point data.");
+
     image_system->CopyFromImage(image);
     if (reader->ShouldGenerateInitialPatternWhenLoading())
     {
         image_system->GenerateInitialPattern();
     }
+    ReportProgress(progress,1.0);
 
     return image_system;
 }
@@ -174,21 +257,15 @@ unique_ptr<AbstractRD> CreateFromUnstructuredGridFile(
     int opencl_platform,
     int opencl_device,
     Properties &render_settings,
-    bool &warn_to_update)
+    bool &warn_to_update,
+    const SystemFactory::ProgressCallback& progress)
 {
     vtkSmartPointer<RD_XMLUnstructuredGridReader> reader = vtkSmartPointer<RD_XMLUnstructuredGridReader>::New();
     reader->SetFileName(filename);
-    reader->Update();
-    vtkUnstructuredGrid *ugrid = reader->GetOutput();
 
-    if (ugrid == NULL)
-        throw runtime_error("Failed to read unstructured grid.");
-    if (ugrid->GetCellData() == NULL)
-        throw runtime_error("Unstructured grid has no cell data.");
-    if (ugrid->GetCellData()->GetArray(0) == NULL)
-        throw runtime_error("No arrays in unstructured grid cell data.");
-
-    int data_type = ugrid->GetCellData()->GetArray(0)->GetDataType();
+    // first read just the XML header, so that the system can be created and its kernel build started before
+    // the mesh is decoded
+    int data_type = reader->GetCellDataType();
     string type = reader->GetType();
     string name = reader->GetName();
 
@@ -208,13 +285,34 @@ unique_ptr<AbstractRD> CreateFromUnstructuredGridFile(
     }
     else if(type=="kernel")
     {
-        if(!is_opencl_available)
-            throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints());
-        mesh_system = make_unique<FullKernelOpenCLMeshRD>(opencl_platform,opencl_device,data_type);
+        if(is_opencl_available)
+            mesh_system = make_unique<FullKernelOpenCLMeshRD>(opencl_platform,opencl_device,data_type);
+        else if(NativeKernel::IsSupported())
+            mesh_system = make_unique<NativeKernelMeshRD>(data_type); // (run the kernel on the CPU instead)
+        else
+            throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints() + "\n\n" + NativeKernel::GetSetupHints());
     }
     else throw runtime_error("Unsupported rule type: "+type);
 
+    // (for OpenCL systems this starts building the kernel on another thread)
     mesh_system->InitializeFromXML(reader->GetRDElement(),warn_to_update);
+    ReportProgress(progress,0.1);
+
+    // now decode the mesh
+    vtkSmartPointer<ReaderProgressObserver> observer = vtkSmartPointer<ReaderProgressObserver>::New();
+    observer->progress = progress;
+    observer->start = 0.1;
+    observer->end = 0.9;
+    reader->AddObserver(vtkCommand::ProgressEvent,observer);
+    reader->Update();
+    vtkUnstructuredGrid *ugrid = reader->GetOutput();
+
+    if (ugrid == NULL)
+        throw runtime_error("Failed to read unstructured grid.");
+    if (ugrid->GetCellData() == NULL)
+        throw runtime_error("Unstructured grid has no cell data.");
+    if (ugrid->GetCellData()->GetArray(0) == NULL)
+        throw runtime_error("No arrays in unstructured grid cell data.");
 
     mesh_system->CopyFromMesh(ugrid);
     // render settings
@@ -225,6 +323,7 @@ unique_ptr<AbstractRD> CreateFromUnstructuredGridFile(
 
     if(reader->ShouldGenerateInitialPatternWhenLoading())
         mesh_system->GenerateInitialPattern();
+    ReportProgress(progress,1.0);
 
     return mesh_system;
 }
@@ -20,6 +20,7 @@ class AbstractRD;
 class Properties;
 
 // STL:
+#include <functional>
 #include <memory>
 
 // -------------------------------------------------------------------------------------------------------------
@@ -27,12 +28,18 @@ class Properties;
 /// Methods for creating RD systems when we don't know their type.
 namespace SystemFactory {
 
+    /// Called with the fraction (0 to 1) of the file that has been loaded so far.
+    typedef std::function<void(double)> ProgressCallback;
+
     /// Load an RD system from file and create the appropriate AbstractRD-derived instance. (User is responsible for deletion.)
+    /// The kernel is compiled in the background while the data is read, and is loaded before this returns, so that a
+    /// kernel that doesn't build is reported here rather than on the first update.
     std::unique_ptr<AbstractRD> CreateFromFile(
         const char *filename,
         bool is_opencl_available,
         int opencl_platform,
         int opencl_device,
         Properties &render_settings,
-        bool &warn_to_update);
+        bool &warn_to_update,
+        const ProgressCallback& progress = nullptr);
 };
@@ -0,0 +1,88 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __PHILOX__
+#define __PHILOX__
+
+// STL:
+#include <cstdint>
+
+/// The Philox4x32-10 counter-based random number generator (Salmon et al. 2011, "Parallel random numbers: as easy as
+/// 1, 2, 3"). Each (counter, key) pair gives four random 32-bit values with no state in between, so every cell and
+/// timestep can have its own stream, and the results don't depend on how the work is divided between threads or
+/// work-items. It uses only 32-bit multiplies, so the same code runs in OpenCL C.
+inline void Philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for(int round=0;round<10;round++)
+    {
+        const uint64_t p0 = uint64_t(0xD2511F53u) * c0;
+        const uint64_t p1 = uint64_t(0xCD9E8D57u) * c2;
+        const uint32_t hi0 = uint32_t(p0 >> 32), lo0 = uint32_t(p0);
+        const uint32_t hi1 = uint32_t(p1 >> 32), lo1 = uint32_t(p1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/// A stream of random numbers from Philox4x32, identified by a key (e.g. the seed and the cell index) and the first
+/// three words of the counter (e.g. the timestep and what the numbers are for). The last word counts the blocks.
+class PhiloxStream
+{
+    public:
+
+        PhiloxStream(uint32_t key0, uint32_t key1, uint32_t counter0, uint32_t counter1, uint32_t counter2)
+            : key{ key0, key1 }
+            , counter{ counter0, counter1, counter2, 0 }
+            , i_next(4)
+        {}
+
+        uint32_t NextUInt32()
+        {
+            if(this->i_next == 4)
+            {
+                Philox4x32(this->counter, this->key, this->block);
+                this->counter[3]++;
+                this->i_next = 0;
+            }
+            return this->block[this->i_next++];
+        }
+
+        /// A uniform random number in (0,1), never exactly 0 or 1.
+        double NextUniform()
+        {
+            return (this->NextUInt32() + 0.5) * (1.0 / 4294967296.0);
+        }
+
+    private:
+
+        uint32_t key[2];
+        uint32_t counter[4];
+        uint32_t block[4];
+        int i_next;
+};
+
+#endif
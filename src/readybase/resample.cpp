@@ -0,0 +1,183 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "resample.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+/// The Lanczos kernel with three lobes: a sinc windowed by a wider sinc.
+static double Lanczos3(double x)
+{
+    x = fabs(x);
+    if (x < 1e-8)
+        return 1.0;
+    if (x >= 3.0)
+        return 0.0;
+    const double px = M_PI * x;
+    return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+// ---------------------------------------------------------------------
+
+/// Where index i of a line of n values reads from, wrapping around or mirroring about the edges.
+static int GetSourceIndex(int i, int n, bool wrap)
+{
+    if (wrap)
+        return ((i % n) + n) % n;
+    const int m = ((i % (2 * n)) + 2 * n) % (2 * n);
+    return m < n ? m : 2 * n - 1 - m;
+}
+
+// ---------------------------------------------------------------------
+
+/// The inputs and weights that make each output of a line of n_in values resampled to n_out.
+struct Taps
+{
+    vector<size_t> first; ///< where each output's taps start, with a last entry for the end
+    vector<int> index;
+    vector<double> weight;
+};
+
+// ---------------------------------------------------------------------
+
+static Taps GetTaps(int n_in, int n_out, bool wrap)
+{
+    // (the cell centers are aligned, so the grid covers the same space)
+    const double scale = n_in / static_cast<double>(n_out);
+    const double width = max(1.0, scale);
+    const double support = 3.0 * width;
+    Taps taps;
+    for (int i = 0; i < n_out; i++)
+    {
+        taps.first.push_back(taps.index.size());
+        const double center = (i + 0.5) * scale - 0.5;
+        double sum = 0.0;
+        for (int j = static_cast<int>(ceil(center - support)); j <= static_cast<int>(floor(center + support)); j++)
+        {
+            const double w = Lanczos3((j - center) / width);
+            if (w == 0.0)
+                continue;
+            taps.index.push_back(GetSourceIndex(j, n_in, wrap));
+            taps.weight.push_back(w);
+            sum += w;
+        }
+        for (size_t k = taps.first.back(); k < taps.weight.size(); k++)
+            taps.weight[k] /= sum;
+    }
+    taps.first.push_back(taps.index.size());
+    return taps;
+}
+
+// ---------------------------------------------------------------------
+
+/// Call task(first,last) for each chunk of [0,n), the chunks after the first on threads of their own.
+template <typename Task>
+static void RunChunks(size_t n, size_t n_values_each, const Task& task)
+{
+    const size_t MIN_CHUNK_VALUES = 1 << 16; // (small grids aren't worth starting threads for)
+    const size_t n_chunks = max(size_t(1), min(size_t(thread::hardware_concurrency()),
+        n * n_values_each / MIN_CHUNK_VALUES));
+    const size_t CHUNK_SIZE = (n + n_chunks - 1) / n_chunks;
+    vector<thread> threads;
+    for (size_t i = 1; i < n_chunks; i++)
+        threads.emplace_back([&task, i, n, CHUNK_SIZE]() { task(min(n, i * CHUNK_SIZE), min(n, (i + 1) * CHUNK_SIZE)); });
+    task(0, min(n, CHUNK_SIZE));
+    for (thread& t : threads)
+        t.join();
+}
+
+// ---------------------------------------------------------------------
+
+/// Resamples each line of values along one axis.
+template <typename T>
+static void ResampleAxis(const T* in, const int in_dimensions[3], int axis, int n_out, bool wrap, T* out)
+{
+    const int n_in = in_dimensions[axis];
+    const Taps taps = GetTaps(n_in, n_out, wrap);
+    // the lines run along the axis, with the values before it (inner) varying fastest
+    size_t inner = 1, outer = 1;
+    for (int i = 0; i < axis; i++)
+        inner *= in_dimensions[i];
+    for (int i = axis + 1; i < 3; i++)
+        outer *= in_dimensions[i];
+    RunChunks(inner * outer, n_out, [&](size_t first, size_t last) {
+        for (size_t line = first; line < last; line++)
+        {
+            const size_t p = line % inner;
+            const size_t o = line / inner;
+            const T* line_in = in + p + inner * n_in * o;
+            T* line_out = out + p + inner * n_out * o;
+            for (int i = 0; i < n_out; i++)
+            {
+                double sum = 0.0;
+                double lowest = line_in[inner * taps.index[taps.first[i]]];
+                double highest = lowest;
+                for (size_t k = taps.first[i]; k < taps.first[i + 1]; k++)
+                {
+                    const double value = line_in[inner * taps.index[k]];
+                    sum += taps.weight[k] * value;
+                    lowest = min(lowest, value);
+                    highest = max(highest, value);
+                }
+                line_out[inner * i] = static_cast<T>(min(highest, max(lowest, sum)));
+            }
+        }
+    });
+}
+
+// ---------------------------------------------------------------------
+
+template <typename T>
+void ResampleGrid(const T* in, const int in_dimensions[3], T* out, const int out_dimensions[3], bool wrap)
+{
+    // shrink first and grow last, so the passes in between have the fewest values to work on
+    vector<int> axes;
+    for (int axis = 0; axis < 3; axis++)
+        if (in_dimensions[axis] != out_dimensions[axis])
+            axes.push_back(axis);
+    sort(axes.begin(), axes.end(), [&](int a, int b) {
+        return out_dimensions[a] * static_cast<double>(in_dimensions[b])
+            < out_dimensions[b] * static_cast<double>(in_dimensions[a]); });
+
+    int dimensions[3] = { in_dimensions[0], in_dimensions[1], in_dimensions[2] };
+    vector<T> current(in, in + size_t(dimensions[0]) * dimensions[1] * dimensions[2]);
+    vector<T> next;
+    for (int axis : axes)
+    {
+        int next_dimensions[3] = { dimensions[0], dimensions[1], dimensions[2] };
+        next_dimensions[axis] = out_dimensions[axis];
+        next.resize(size_t(next_dimensions[0]) * next_dimensions[1] * next_dimensions[2]);
+        ResampleAxis(current.data(), dimensions, axis, out_dimensions[axis], wrap, next.data());
+        current.swap(next);
+        copy(next_dimensions, next_dimensions + 3, dimensions);
+    }
+    copy(current.begin(), current.end(), out);
+}
+
+// ---------------------------------------------------------------------
+
+template void ResampleGrid<float>(const float*, const int[3], float*, const int[3], bool);
+template void ResampleGrid<double>(const double*, const int[3], double*, const int[3], bool);
@@ -0,0 +1,29 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __RESAMPLE__
+#define __RESAMPLE__
+
+/// Resamples a grid of values (x varying fastest) to new dimensions, one axis at a time. Each output value is a
+/// Lanczos-3 weighted sum of the inputs around it; where an axis shrinks the filter is widened to span the cells being
+/// merged, so that they are averaged rather than sampled. Beyond the edges the values are taken from the opposite side
+/// if wrap is true, else mirrored. Each output is clamped to the range of the inputs it was made from, so the filter's
+/// ringing can't make values that weren't there before (e.g. negative concentrations). Runs on several threads.
+template <typename T>
+void ResampleGrid(const T* in, const int in_dimensions[3], T* out, const int out_dimensions[3], bool wrap);
+
+#endif
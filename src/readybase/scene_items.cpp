@@ -163,6 +163,7 @@ void SetDefaultRenderSettings(Properties& render_settings)
     render_settings.AddProperty(Property("active_chemical", "chemical", "a"));
     render_settings.AddProperty(Property("low", 0.0f));
     render_settings.AddProperty(Property("high", 1.0f));
+    render_settings.AddProperty(Property("auto_range", false)); // fit low and high to the active chemical as it runs
     render_settings.AddProperty(Property("vertical_scale_1D", 30.0f));
     render_settings.AddProperty(Property("vertical_scale_2D", 15.0f));
     render_settings.AddProperty(Property("contour_level", 0.25f));
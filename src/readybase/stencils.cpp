@@ -19,6 +19,7 @@
 
 // Stdlib:
 #include <array>
+#include <cctype>
 #include <cmath>
 #include <exception>
 #include <map>
@@ -60,6 +61,40 @@ string Point::GetName() const
 
 // ---------------------------------------------------------------------
 
+bool Point::FromName(const string& name, Point& point)
+{
+    const string dirs = "ewnsud"; // pairs of directions along x, y, z
+    point = Point{ { 0, 0, 0 } };
+    size_t i = 0;
+    while (i < name.size())
+    {
+        const size_t dir = dirs.find(name[i++]);
+        if (dir == string::npos)
+        {
+            return false;
+        }
+        int distance = 0;
+        const size_t digits_start = i;
+        while (i < name.size() && isdigit(name[i]))
+        {
+            if (i - digits_start >= 6)
+            {
+                return false;
+            }
+            distance = distance * 10 + (name[i++] - '0');
+        }
+        if (i == digits_start)
+        {
+            distance = 1;
+        }
+        point.xyz[dir / 2] = dir % 2 == 0 ? distance : -distance;
+    }
+    // only accept the names that GetName() produces, so e.g. "e1", "ee" and "nu" are not neighbors
+    return !name.empty() && point.GetName() == name;
+}
+
+// ---------------------------------------------------------------------
+
 string InputPoint::GetName() const
 {
     ostringstream oss;
@@ -138,6 +173,16 @@ string GetIndexString(const string& x, const string& y, const string& z, bool wr
 
 // -------------------------------------------------------------------------
 
+string GetUncheckedIndexString(const string& x, const string& y, const string& z)
+{
+    // for coordinates known to be inside the image, so no wrapping or clamping is needed
+    ostringstream oss;
+    oss << "X* (Y * (" << z << ") + (" << y << ")) + (" << x << ")";
+    return oss.str();
+}
+
+// -------------------------------------------------------------------------
+
 string GetIndexString(int x, int y, int z, bool wrap)
 {
     ostringstream oss;
@@ -211,6 +256,36 @@ string InputPoint::GetDirectAccessCode(bool wrap, const int block_size[3], bool
 
 // -------------------------------------------------------------------------
 
+string InputPoint::GetOffsetAccessCode(const int block_size[3]) const
+{
+    if (block_size[0] == 4 && point.x % 4 != 0)
+    {
+        throw runtime_error("internal error in GetOffsetAccessCode: point.x not divisible by 4");
+    }
+    // a plain offset from the central cell, which is only valid if the neighbor is inside the image
+    const int x = point.x / block_size[0];
+    const int y = point.y / block_size[1];
+    const int z = point.z / block_size[2];
+    ostringstream oss;
+    oss << GetName() << " = " << chem << "_in[index_here";
+    if (z != 0)
+    {
+        oss << (z < 0 ? " - " : " + ") << (abs(z) == 1 ? "" : to_string(abs(z)) + "*") << "X*Y";
+    }
+    if (y != 0)
+    {
+        oss << (y < 0 ? " - " : " + ") << (abs(y) == 1 ? "" : to_string(abs(y)) + "*") << "X";
+    }
+    if (x != 0)
+    {
+        oss << (x < 0 ? " - " : " + ") << abs(x);
+    }
+    oss << "]";
+    return oss.str();
+}
+
+// -------------------------------------------------------------------------
+
 string Stencil::GetDivisorCode() const
 {
     ostringstream oss;
@@ -249,9 +324,15 @@ set<InputPoint> AppliedStencil::GetInputPoints() const
 // ---------------------------------------------------------------------
 
 string AppliedStencil::GetCode() const
+{
+    return GetName() + " = " + GetExpression();
+}
+
+// ---------------------------------------------------------------------
+
+string AppliedStencil::GetExpression() const
 {
     ostringstream oss;
-    oss << GetName() << " = ";
     const string divisor_code = stencil.GetDivisorCode();
     if (!divisor_code.empty())
     {
@@ -413,6 +494,33 @@ Stencil StencilFrom3DArray(const string& label, int const (&arr)[L][M][N], int d
 
 // ---------------------------------------------------------------------
 
+Stencil ComposeStencils(const string& label, const Stencil& outer, const Stencil& inner)
+{
+    // convolve the two stencils, remembering the factors so that the code generator can apply them one after the other
+    map<Point, int> weights;
+    for (const StencilPoint& outer_point : outer.points)
+    {
+        for (const StencilPoint& inner_point : inner.points)
+        {
+            const Point point{ { outer_point.point.x + inner_point.point.x,
+                                 outer_point.point.y + inner_point.point.y,
+                                 outer_point.point.z + inner_point.point.z } };
+            weights[point] += outer_point.weight * inner_point.weight;
+        }
+    }
+    Stencil stencil{ label, {}, outer.divisor * inner.divisor, outer.dx_power + inner.dx_power, { inner, outer } };
+    for (const auto& weight : weights)
+    {
+        if (weight.second != 0)
+        {
+            stencil.points.push_back({ weight.first, weight.second });
+        }
+    }
+    return stencil;
+}
+
+// ---------------------------------------------------------------------
+
 using Arr3x3 = array<array<int, 3>, 3>;
 using Arr3x3x3 = array<array<array<int, 3>, 3>, 3>;
 using Arr5x5 = array<array<int, 5>, 5>;
@@ -542,28 +650,13 @@ Stencil GetTriLaplacianStencil(int dimensionality)
     case 1:
         return StencilFrom1DArray("trilaplacian", {1,-6,15,-20,15,-6,1}, 1, 6, 0);
     case 2:
-        // obtained by convolving a 2D Laplacian stencil with a 2D bi-Laplacian stencil - see Scripts/Python/convolve.py
-        return StencilFrom2DArray("trilaplacian", { {0,1,5,6,5,1,0},
-                                                    {1,6,-33,-56,-33,6,1},
-                                                    {5,-33,6,314,6,-33,5},
-                                                    {6,-56,314,-888,314,-56,6},
-                                                    {5,-33,6,314,6,-33,5},
-                                                    {1,6,-33,-56,-33,6,1},
-                                                    {0,1,5,6,5,1,0} }, 18, 6, 0, 1);
+        // a 2D Laplacian stencil convolved with a 2D bi-Laplacian stencil: 45 points, or 9 + 21 when applied in two passes
+        return ComposeStencils("trilaplacian",
+            StencilFrom2DArray<3,3>("laplacian", RotationallySymmetric3x3(1, 4, -20), 6, 2, 0, 1), GetBiLaplacianStencil(2));
     case 3:
-        // obtained by convolving a 3D Laplacian stencil with a 3D bi-Laplacian stencil - see Scripts/Python/convolve.py
-        return StencilFrom3DArray("trilaplacian", { {{-1,-3,-1,0,-1,-3,-1},{-3,-4,27,20,27,-4,-3},{-1,27,139,60,139,27,-1},
-               {0,20,60,40,60,20,0},{-1,27,139,60,139,27,-1},{-3,-4,27,20,27,-4,-3},{-1,-3,-1,0,-1,-3,-1}},{{-3,-4,27,20,27,-4,-3},
-            {-4,198,180,-28,180,198,-4},{27,180,-1719,-396,-1719,180,27},{20,-28,-396,-392,-396,-28,20},{27,180,-1719,-396,-1719,180,27},
-            {-4,198,180,-28,180,198,-4},{-3,-4,27,20,27,-4,-3}},{{-1,27,139,60,139,27,-1},{27,180,-1719,-396,-1719,180,27},
-            {139,-1719,1827,4816,1827,-1719,139},{60,-396,4816,2680,4816,-396,60},{139,-1719,1827,4816,1827,-1719,139},
-            {27,180,-1719,-396,-1719,180,27},{-1,27,139,60,139,27,-1}},{{0,20,60,40,60,20,0},{20,-28,-396,-392,-396,-28,20},
-            {60,-396,4816,2680,4816,-396,60},{40,-392,2680,-47536,2680,-392,40},{60,-396,4816,2680,4816,-396,60},{20,-28,-396,-392,-396,-28,20},
-            {0,20,60,40,60,20,0}},{{-1,27,139,60,139,27,-1},{27,180,-1719,-396,-1719,180,27},{139,-1719,1827,4816,1827,-1719,139},
-            {60,-396,4816,2680,4816,-396,60},{139,-1719,1827,4816,1827,-1719,139},{27,180,-1719,-396,-1719,180,27},{-1,27,139,60,139,27,-1}},
-            {{-3,-4,27,20,27,-4,-3},{-4,198,180,-28,180,198,-4},{27,180,-1719,-396,-1719,180,27},{20,-28,-396,-392,-396,-28,20},
-            {27,180,-1719,-396,-1719,180,27},{-4,198,180,-28,180,198,-4},{-3,-4,27,20,27,-4,-3}},{{-1,-3,-1,0,-1,-3,-1},{-3,-4,27,20,27,-4,-3},
-            {-1,27,139,60,139,27,-1},{0,20,60,40,60,20,0},{-1,27,139,60,139,27,-1},{-3,-4,27,20,27,-4,-3},{-1,-3,-1,0,-1,-3,-1}} }, 1080, 6, 0, 1, 2);
+        // a 3D Laplacian stencil convolved with a 3D bi-Laplacian stencil: 331 points, or 27 + 53 when applied in two passes
+        return ComposeStencils("trilaplacian",
+            StencilFrom3DArray<3,3,3>("laplacian", RotationallySymmetric3x3x3(1, 3, 14, -128), 30, 2, 0, 1, 2), GetBiLaplacianStencil(3));
     default:
         throw runtime_error("Internal error: unsupported dimensionality in GetTriLaplacianStencil");
     }
@@ -31,6 +31,7 @@ union Point
     int xyz[3];
 
     std::string GetName() const;
+    static bool FromName(const std::string& name, Point& point); // the inverse of GetName(), e.g. "ne" or "usw2"
 
     friend bool operator<(const Point& a, const Point& b)
     {
@@ -60,6 +61,7 @@ struct Stencil
     std::vector<StencilPoint> points;
     int divisor;
     int dx_power;
+    std::vector<Stencil> factors; // if not empty, the stencil is the inner one (first) followed by the outer one (second)
 
     std::string GetDivisorCode() const;
 };
@@ -73,6 +75,7 @@ struct InputPoint
 
     std::string GetName() const;
     std::string GetDirectAccessCode(bool wrap, const int block_size[3], bool use_local_memory) const;
+    std::string GetOffsetAccessCode(const int block_size[3]) const; // for cells away from the boundary
     std::string GetSwizzled_Block411() const;
     std::pair<InputPoint, InputPoint> GetAlignedBlocks_Block411() const;
 
@@ -93,6 +96,7 @@ struct AppliedStencil
 
     std::string GetName() const { return stencil.label + "_" + chem; }
     std::string GetCode() const;
+    std::string GetExpression() const; // the right-hand side of GetCode()
     std::set<InputPoint> GetInputPoints() const;
 };
 
@@ -101,6 +105,7 @@ struct AppliedStencil
 std::vector<Stencil> GetKnownStencils(int dimensionality, const AbstractRD::Accuracy& accuracy);
 std::string GetIndexString(int x, int y, int z, bool wrap);
 std::string GetIndexString(const std::string& x, const std::string& y, const std::string& z, bool wrap);
+std::string GetUncheckedIndexString(const std::string& x, const std::string& y, const std::string& z);
 std::string GetCoordString(int val, const std::string& coord, const std::string& coord_capital, bool wrap);
 std::string GetCoordString(const std::string& val, const std::string& coord_capital, bool wrap);
 
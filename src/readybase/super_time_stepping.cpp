@@ -0,0 +1,257 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "super_time_stepping.hpp"
+
+// STL:
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+RKL1Stage GetRKL1Stage(int j, int s)
+{
+    const double w1 = 2.0 / (s * s + s);
+    if (j == 1)
+    {
+        return { 1.0, 0.0, w1 };
+    }
+    const double mu = (2.0 * j - 1.0) / j;
+    return { mu, -(j - 1.0) / j, mu * w1 };
+}
+
+// ---------------------------------------------------------------------
+
+int GetNumberOfRKL1Stages(double dt, double spectral_radius)
+{
+    const double needed = dt * spectral_radius; // (forward Euler is stable up to 2)
+    int s = 1;
+    while (s * s + s < needed)
+    {
+        s++;
+    }
+    return s;
+}
+
+// ---------------------------------------------------------------------
+
+/// Splits a statement into identifiers, numbers and single-character operators.
+static vector<string> TokenizeStatement(const string& statement)
+{
+    vector<string> tokens;
+    size_t i = 0;
+    while (i < statement.size())
+    {
+        const char c = statement[i];
+        size_t end = i + 1;
+        if (isspace(static_cast<unsigned char>(c)))
+        {
+            i++;
+            continue;
+        }
+        if (isalpha(static_cast<unsigned char>(c)) || c == '_')
+        {
+            while (end < statement.size() && (isalnum(static_cast<unsigned char>(statement[end])) || statement[end] == '_'))
+                end++;
+        }
+        else if (isdigit(static_cast<unsigned char>(c)) || c == '.')
+        {
+            // (including exponents and suffixes, which strtod stops at, and member names, e.g. ".x")
+            const bool is_number = isdigit(static_cast<unsigned char>(c));
+            while (end < statement.size())
+            {
+                const char d = statement[end];
+                const bool is_exponent_sign = is_number && (d == '+' || d == '-')
+                    && (statement[end - 1] == 'e' || statement[end - 1] == 'E');
+                if (!isalnum(static_cast<unsigned char>(d)) && d != '.' && d != '_' && !is_exponent_sign)
+                {
+                    break;
+                }
+                end++;
+            }
+        }
+        tokens.push_back(statement.substr(i, end - i));
+        i = end;
+    }
+    return tokens;
+}
+
+// ---------------------------------------------------------------------
+
+/// Removes the // and /* */ comments.
+static string RemoveComments(const string& formula)
+{
+    string code;
+    size_t i = 0;
+    while (i < formula.size())
+    {
+        if (formula.compare(i, 2, "//") == 0)
+        {
+            i = formula.find('\n', i);
+        }
+        else if (formula.compare(i, 2, "/*") == 0)
+        {
+            i = formula.find("*/", i);
+            if (i != string::npos)
+            {
+                i += 2;
+            }
+        }
+        else
+        {
+            code += formula[i++];
+            continue;
+        }
+        if (i == string::npos)
+        {
+            break;
+        }
+        code += ' ';
+    }
+    return code;
+}
+
+// ---------------------------------------------------------------------
+
+bool EstimateFormulaSpectralRadius(const string& formula, const vector<AbstractRD::Parameter>& parameters,
+    const map<string, double>& keyword_radii, double& spectral_radius)
+{
+    // the value of a token, if it is a parameter or a number
+    auto get_value = [&parameters](const string& token, double& value) {
+        for (const AbstractRD::Parameter& parameter : parameters)
+        {
+            if (parameter.name == token)
+            {
+                value = parameter.value;
+                return true;
+            }
+        }
+        if (!token.empty() && (isdigit(static_cast<unsigned char>(token[0]))
+            || (token[0] == '.' && token.size() > 1 && isdigit(static_cast<unsigned char>(token[1])))))
+        {
+            value = strtod(token.c_str(), nullptr);
+            return true;
+        }
+        return false;
+    };
+    // can this token end an operand, so that a + or - after it adds rather than negates?
+    auto ends_operand = [](const string& token) {
+        const unsigned char c = token.back();
+        return isalnum(c) || c == '_' || c == '.' || c == ')';
+    };
+
+    // the operators in the statements that add to each delta_ are summed
+    map<string, double> delta_radii;
+    const string code = RemoveComments(formula);
+    size_t start = 0;
+    while (start < code.size())
+    {
+        size_t end = code.find(';', start);
+        if (end == string::npos)
+        {
+            end = code.size();
+        }
+        const vector<string> tokens = TokenizeStatement(code.substr(start, end - start));
+        start = end + 1;
+        // the statement must be "delta_a = ...", "delta_a += ..." or "delta_a -= ...", and mustn't read a delta_, else
+        // we can't tell how the operators end up in the rate of change (e.g. "float lap = laplacian_a;")
+        const size_t equals = find(tokens.begin(), tokens.end(), "=") - tokens.begin();
+        const bool sets_delta = !tokens.empty() && tokens[0].compare(0, 6, "delta_") == 0;
+        for (size_t i = equals + 1; i < tokens.size(); i++)
+        {
+            if (tokens[i].compare(0, 6, "delta_") == 0)
+            {
+                return false;
+            }
+        }
+        if (sets_delta && (equals == tokens.size()
+            || !(equals == 1 || (equals == 2 && (tokens[1] == "+" || tokens[1] == "-" || tokens[1][0] == '.')))))
+        {
+            return false;
+        }
+        vector<size_t> keywords;
+        for (size_t i = 0; i < tokens.size(); i++)
+        {
+            if (keyword_radii.count(tokens[i]))
+            {
+                keywords.push_back(i);
+            }
+        }
+        if (keywords.empty())
+        {
+            continue;
+        }
+        if (!sets_delta)
+        {
+            return false;
+        }
+        // each operator must be a term of the sum, multiplied or divided only by parameters or numbers, e.g.
+        // "- D_a * laplacian_a / 2", else we can't bound its contribution (e.g. "a * laplacian_a" or "(laplacian_a)")
+        double& radius = delta_radii[tokens[0]];
+        for (const size_t i : keywords)
+        {
+            if (i < equals || count(tokens.begin() + equals, tokens.begin() + i, "(")
+                != count(tokens.begin() + equals, tokens.begin() + i, ")"))
+            {
+                return false;
+            }
+            double coefficient = 1.0, value;
+            size_t first = i;
+            while (first >= equals + 3 && tokens[first - 1] == "*" && get_value(tokens[first - 2], value))
+            {
+                coefficient *= value;
+                first -= 2;
+            }
+            const string& before = tokens[first - 1];
+            if (first - 1 != equals
+                && !((before == "+" || before == "-") && (first - 2 == equals || ends_operand(tokens[first - 2]))))
+            {
+                return false;
+            }
+            size_t last = i + 1;
+            if (last < tokens.size() && tokens[last][0] == '.' && tokens[last].size() > 1
+                && isalpha(static_cast<unsigned char>(tokens[last][1])))
+            {
+                last++; // (a component, e.g. laplacian_a.x)
+            }
+            while (last + 1 < tokens.size() && (tokens[last] == "*" || tokens[last] == "/")
+                && get_value(tokens[last + 1], value) && (tokens[last] == "*" || value != 0.0))
+            {
+                coefficient = tokens[last] == "*" ? coefficient * value : coefficient / value;
+                last += 2;
+            }
+            if (last < tokens.size() && tokens[last] != "+" && tokens[last] != "-")
+            {
+                return false;
+            }
+            radius += fabs(coefficient) * keyword_radii.at(tokens[i]);
+        }
+    }
+    spectral_radius = 0.0;
+    for (const pair<const string, double>& delta_radius : delta_radii)
+    {
+        spectral_radius = max(spectral_radius, delta_radius.second);
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------
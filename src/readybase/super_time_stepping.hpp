@@ -0,0 +1,52 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __SUPERTIMESTEPPING__
+#define __SUPERTIMESTEPPING__
+
+// local:
+#include "AbstractRD.hpp"
+
+// STL:
+#include <map>
+#include <string>
+#include <vector>
+
+/// Runge-Kutta-Legendre super-time-stepping (RKL1, Meyer, Balsara & Aslam 2014). A step of dt is taken in s explicit
+/// stages, and is stable if the right-hand side's spectrum lies on the negative real axis within dt*|lambda| <= s*s+s,
+/// so s stages go (s*s+s)/2 times further than s forward-Euler steps. This suits formulas where diffusion limits the
+/// timestep, as long as the rest (e.g. the reaction terms) is not stiff.
+struct RKL1Stage
+{
+    double mu, nu, mu_tilde; ///< Y_j = mu * Y_{j-1} + nu * Y_{j-2} + mu_tilde * dt * F(Y_{j-1})
+};
+
+/// The coefficients of stage j (from 1 to s) of an s-stage step. With s = 1 this is a forward-Euler step.
+RKL1Stage GetRKL1Stage(int j, int s);
+
+/// The fewest stages that are stable for a step of dt, given the spectral radius of the right-hand side.
+int GetNumberOfRKL1Stages(double dt, double spectral_radius);
+
+/// Estimates the spectral radius of the right-hand side of a formula, from the operators it uses (keyword_radii
+/// gives the spectral radius of each, e.g. of "laplacian_a") and the parameters or numbers they are multiplied by,
+/// e.g. "D_a * laplacian_a". The operators added to each delta_ are summed, and the largest sum is returned. Returns
+/// false if an operator is used in a way whose contribution can't be bounded, e.g. "a * laplacian_a", "(laplacian_a)"
+/// or "float lap = laplacian_a;", or if a statement reads a delta_.
+bool EstimateFormulaSpectralRadius(const std::string& formula, const std::vector<AbstractRD::Parameter>& parameters,
+    const std::map<std::string, double>& keyword_radii, double& spectral_radius);
+
+#endif
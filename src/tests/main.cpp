@@ -0,0 +1,537 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// STL:
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// readybase:
+#include <AMRImageRD.hpp>
+#include <DisplacedSurfaceFilter.hpp>
+#include <FormulaOpenCLImageRD.hpp>
+#include <GrayScottMeshRD.hpp>
+#include <MeshGenerators.hpp>
+#include <MeshRelaxation.hpp>
+#include <NativeKernelImageRD.hpp>
+#include <OpenCL_utils.hpp>
+#include <OutOfCoreImageRD.hpp>
+#include <Properties.hpp>
+#include <scene_items.hpp>
+#include <SparseImageRD.hpp>
+#include <super_time_stepping.hpp>
+
+// VTK:
+#include <vtkCellData.h>
+#include <vtkDataArray.h>
+#include <vtkImageData.h>
+#include <vtkMath.h>
+#include <vtkPointData.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkSmartPointer.h>
+#include <vtkUnstructuredGrid.h>
+#include <vtkXMLDataElement.h>
+#include <vtkXMLUtilities.h>
+
+using namespace std;
+
+// -------------------------------------------------------------------------------------------------------------
+/*
+        Checks of readybase that can't be made by running rdy on a pattern file, e.g. because they need to hold on
+        to the system's data between calls. Each test either returns normally, throws with a description of what
+        went wrong, or throws TestSkipped if it can't run here (e.g. there is no OpenCL device).
+*/
+// -------------------------------------------------------------------------------------------------------------
+
+struct TestSkipped : public runtime_error
+{
+    TestSkipped(const string& reason) : runtime_error(reason) {}
+};
+
+// -------------------------------------------------------------------------------------------------------------
+
+static void Check(bool condition, const string& description)
+{
+    if (!condition)
+        throw runtime_error("check failed: " + description);
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+static vector<float> GetValues(vtkDataArray* array)
+{
+    vector<float> values(array->GetNumberOfTuples());
+    for (vtkIdType i = 0; i < array->GetNumberOfTuples(); i++)
+        values[i] = static_cast<float>(array->GetComponent(i, 0));
+    return values;
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// A shallow copy of the system's mesh must keep its values when the system reallocates its OpenCL buffers, even
+/// on devices where the chemicals live in the buffers' host memory. (Best run under AddressSanitizer.)
+static void TestReallocatingWhileShallowCopyIsHeld()
+{
+    if (!OpenCL_utils::IsOpenCLAvailable())
+        throw TestSkipped("no OpenCL");
+    FormulaOpenCLImageRD system(0, 0, VTK_FLOAT); // (Gray-Scott, on the first device)
+    system.SetDimensionsAndNumberOfChemicals(64, 64, 1, 2);
+    system.BlankImage(1.0f);
+    Properties render_settings("render_settings");
+    SetDefaultRenderSettings(render_settings);
+    render_settings.GetProperty("active_chemical").SetChemical("b");
+    system.SetValuesInRadius(0.5f, 0.5f, 0.5f, 0.1f, 0.5f, render_settings);
+    system.Update(20);
+
+    vtkSmartPointer<vtkPolyData> held = vtkSmartPointer<vtkPolyData>::New();
+    system.GetAsMesh(held, render_settings);
+    vtkDataArray* held_values = held->GetPointData()->GetScalars();
+    Check(held_values != nullptr, "the mesh has values");
+    const vector<float> expected = GetValues(held_values);
+
+    // (both of these release the buffers, and the new ones are then written to, perhaps reusing the memory)
+    system.SetDimensions(32, 32, 1);
+    system.Update(20);
+    system.SetDimensions(64, 64, 1);
+    system.Update(20);
+
+    Check(GetValues(held_values) == expected, "the held mesh keeps its values after the buffers are reallocated");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// The chemicals are copied back while the next update runs, which mustn't change the values that arrive: a run of
+/// updates ends with the same values whether or not they were read in between.
+static void TestReadbackOverlappingTheNextUpdate()
+{
+    if (!OpenCL_utils::IsOpenCLAvailable())
+        throw TestSkipped("no OpenCL");
+    Properties render_settings("render_settings");
+    SetDefaultRenderSettings(render_settings);
+    render_settings.GetProperty("active_chemical").SetChemical("b");
+    FormulaOpenCLImageRD read_between(0, 0, VTK_FLOAT); // (Gray-Scott, on the first device)
+    FormulaOpenCLImageRD read_at_end(0, 0, VTK_FLOAT);
+    for (FormulaOpenCLImageRD* system : { &read_between, &read_at_end })
+    {
+        system->SetDimensionsAndNumberOfChemicals(64, 64, 1, 2);
+        system->BlankImage(1.0f);
+        system->SetValuesInRadius(0.5f, 0.5f, 0.5f, 0.1f, 0.5f, render_settings);
+    }
+    const vector<float> start = read_between.GetData(1);
+
+    for (int i = 0; i < 10; i++)
+    {
+        const int n_steps = 1 + i % 3; // (odd and even, so that the reads are of either buffer)
+        read_between.Update(n_steps);
+        read_between.GetData(1);
+        read_at_end.Update(n_steps);
+    }
+
+    const vector<float> end = read_at_end.GetData(1);
+    Check(end != start, "the values arrive back on the host");
+    Check(end == read_between.GetData(1), "the values are the same whether or not they were read between updates");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// The statistics are reduced on the device, so a run that only looks at them doesn't copy the chemicals back. The
+/// chemicals are copied when they are asked for, and agree with the statistics.
+static void TestStatisticsWithoutReadback()
+{
+    if (!OpenCL_utils::IsOpenCLAvailable())
+        throw TestSkipped("no OpenCL");
+    Properties render_settings("render_settings");
+    SetDefaultRenderSettings(render_settings);
+    render_settings.GetProperty("active_chemical").SetChemical("b");
+    FormulaOpenCLImageRD system(0, 0, VTK_FLOAT); // (Gray-Scott, on the first device)
+    system.SetDimensionsAndNumberOfChemicals(64, 64, 1, 2);
+    system.BlankImage(1.0f);
+    system.SetValuesInRadius(0.5f, 0.5f, 0.5f, 0.1f, 0.5f, render_settings);
+    system.SetStatisticsInterval(1);
+    system.Update(1); // (the images were looked at by the painting, so this copy is started anyway)
+
+    system.ResetPerformanceCounters();
+    for (int i = 0; i < 10; i++)
+        system.Update(1 + i % 2);
+    Check(system.GetPerformanceCounters().readbacks == 0, "the chemicals aren't copied back for the statistics");
+
+    const vector<float> b = system.GetData(1);
+    double sum = 0.0;
+    for (float value : b)
+        sum += value;
+    Check(system.GetStatisticsTimestep() == system.GetTimestepsTaken(), "the statistics are up to date");
+    Check(fabs(sum / b.size() - system.GetStatistics()[1].mean) < 1e-5, "the chemicals agree with the statistics");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Whether the chemicals are kept in images is saved with the pattern and restored when it is loaded.
+static void TestImageStorageRoundTrip()
+{
+    if (!OpenCL_utils::IsOpenCLAvailable())
+        throw TestSkipped("no OpenCL");
+    for (const bool use_image_storage : { true, false })
+    {
+        FormulaOpenCLImageRD system(0, 0, VTK_FLOAT);
+        system.SetDimensionsAndNumberOfChemicals(64, 64, 1, 2);
+        system.SetUseImageStorage(use_image_storage);
+        vtkSmartPointer<vtkXMLDataElement> xml = system.GetAsXML(false);
+
+        FormulaOpenCLImageRD loaded(0, 0, VTK_FLOAT);
+        bool warn_to_update = false;
+        loaded.InitializeFromXML(xml, warn_to_update);
+        Check(loaded.GetUseImageStorage() == use_image_storage,
+            string("use_image_storage is restored when ") + (use_image_storage ? "true" : "false"));
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// A kernel run without OpenCL can share local memory between the work-items of a group: here each one reads its
+/// neighbor's value back out of it, which only works if the neighbor has written it before the barrier lets it on.
+static void TestNativeKernelLocalMemoryAndBarriers()
+{
+    NativeKernel::SetAllowed(true);
+    if (!NativeKernel::IsSupported())
+        throw TestSkipped("no C++ compiler");
+    NativeKernelImageRD system(VTK_FLOAT);
+    system.SetDimensionsAndNumberOfChemicals(64, 32, 1, 1);
+    system.SetFormula(R"(
+        kernel void rd_compute(global float* a_in,global float* a_out)
+        {
+            const int i = get_global_size(0) * get_global_id(1) + get_global_id(0);
+            const int lx = get_local_id(0);
+            const int ly = get_local_id(1);
+            local float values[LY][LX];
+            values[ly][lx] = a_in[i];
+            barrier(CLK_LOCAL_MEM_FENCE);
+            a_out[i] = 0.5f * (a_in[i] + values[ly][(lx + 1) % LX]);
+        })");
+    system.SetUseLocalMemory(true);
+
+    vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+    image->SetDimensions(64, 32, 1);
+    image->AllocateScalars(VTK_FLOAT, 1);
+    float* values = static_cast<float*>(image->GetScalarPointer());
+    for (int i = 0; i < 64 * 32; i++)
+        values[i] = static_cast<float>(i % 7);
+    system.CopyFromImage(image);
+    const vector<float> before = system.GetData(0);
+    system.Update(1);
+    const vector<float> after = system.GetData(0);
+
+    // (the work-groups are 8x8 here)
+    for (int y = 0; y < 32; y++)
+        for (int x = 0; x < 64; x++)
+        {
+            const float neighbor = before[64 * y + x - x % 8 + (x + 1) % 8];
+            Check(after[64 * y + x] == 0.5f * (before[64 * y + x] + neighbor),
+                "each work-item sees the value its neighbor wrote to local memory");
+        }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// An out-of-core system whose kernel reads further than its stencil_radius says would go wrong near the edges of
+/// each tile, so it refuses to run.
+static void TestOutOfCoreChecksTheStencilRadius()
+{
+    NativeKernel::SetAllowed(true);
+    if (!NativeKernel::IsSupported())
+        throw TestSkipped("no C++ compiler");
+    for (const int stencil_radius : { 1, 2 })
+    {
+        // (the kernel reads two cells away)
+        const string rd_xml = "<RD format_version=\"6\"><rule type=\"kernel\" name=\"test\">"
+            "<kernel number_of_chemicals=\"1\" block_size_x=\"1\" block_size_y=\"1\" block_size_z=\"1\">"
+            "kernel void rd_compute(global float* a_in,global float* a_out) {"
+            " const int X = get_global_size(0); const int x = get_global_id(0); const int i = X * get_global_id(1) + x;"
+            " a_out[i] = 0.5f * (a_in[i] + a_in[i - x + (x + 2) % X]); }</kernel>"
+            "<out_of_core dimension_x=\"64\" dimension_y=\"64\" dimension_z=\"1\" brick_size=\"16\" tile_size=\"32\""
+            " steps_per_pass=\"1\" stencil_radius=\"" + to_string(stencil_radius) + "\"/></rule></RD>";
+        vtkSmartPointer<vtkXMLDataElement> rd = vtkSmartPointer<vtkXMLDataElement>::Take(
+            vtkXMLUtilities::ReadElementFromString(rd_xml.c_str()));
+        OutOfCoreImageRD system(VTK_FLOAT);
+        bool warn_to_update = false;
+        system.InitializeFromXML(rd, warn_to_update);
+        system.SetDimensionsAndNumberOfChemicals(16, 16, 1, 1);
+        system.BlankImage(1.0f);
+        bool refused = false;
+        try
+        {
+            system.Update(1);
+        }
+        catch (const exception& e)
+        {
+            refused = string(e.what()).find("stencil_radius") != string::npos;
+        }
+        Check(refused == (stencil_radius == 1), "a stencil_radius of " + to_string(stencil_radius) + " is "
+            + (stencil_radius == 1 ? "refused" : "accepted"));
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// With refluxing, refining the grid keeps the total of a chemical whose formula conserves it, for float and double
+/// data.
+static void TestAMRConservesMass()
+{
+    NativeKernel::SetAllowed(true);
+    if (!NativeKernel::IsSupported())
+        throw TestSkipped("no C++ compiler");
+    for (const int data_type : { VTK_FLOAT, VTK_DOUBLE })
+    {
+        vector<float> results[2];
+        for (const int levels : { 1, 3 })
+        {
+            const string rd_xml = "<RD format_version=\"6\"><rule type=\"formula\" name=\"test\">"
+                "<param name=\"timestep\">0.2</param>"
+                "<formula number_of_chemicals=\"1\">delta_a = laplacian_a;</formula>"
+                "<amr levels=\"" + to_string(levels) + "\" block_size=\"8\" time_refinement=\"4\" regrid_interval=\"4\""
+                " refine_chemical=\"a\" refine_threshold=\"0.02\"/></rule></RD>";
+            vtkSmartPointer<vtkXMLDataElement> rd = vtkSmartPointer<vtkXMLDataElement>::Take(
+                vtkXMLUtilities::ReadElementFromString(rd_xml.c_str()));
+            AMRImageRD system(data_type);
+            bool warn_to_update = false;
+            system.InitializeFromXML(rd, warn_to_update);
+            system.SetDimensionsAndNumberOfChemicals(64, 64, 1, 1);
+
+            // (a narrow bump away from the middle, so that only part of the grid is refined)
+            vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+            image->SetDimensions(64, 64, 1);
+            image->AllocateScalars(data_type, 1);
+            for (int y = 0; y < 64; y++)
+                for (int x = 0; x < 64; x++)
+                    image->SetScalarComponentFromDouble(x, y, 0, 0,
+                        exp(-((x - 20) * (x - 20) + (y - 40) * (y - 40)) / 8.0));
+            system.CopyFromImage(image);
+            double before = 0.0;
+            for (const float value : system.GetData(0))
+                before += value;
+            system.Update(40);
+            results[levels > 1] = system.GetData(0);
+            double after = 0.0;
+            for (const float value : results[levels > 1])
+                after += value;
+            Check(fabs(after - before) <= 1e-5 * before, "the total is kept with " + to_string(levels) + " level(s) ("
+                + to_string(before) + " before, " + to_string(after) + " after)");
+        }
+        float largest_difference = 0.0f;
+        for (size_t i = 0; i < results[0].size(); i++)
+            largest_difference = max(largest_difference, fabs(results[1][i] - results[0][i]));
+        Check(largest_difference > 1e-4f, "the refined levels change the result");
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// A sparse system wakes the bricks that a change spreads into, and puts them back to sleep once it has died away.
+static void TestSparseWakesAndSleeps()
+{
+    NativeKernel::SetAllowed(true);
+    if (!NativeKernel::IsSupported())
+        throw TestSkipped("no C++ compiler");
+    const string rd_xml = "<RD format_version=\"6\"><rule type=\"formula\" name=\"test\">"
+        "<param name=\"timestep\">0.2</param>"
+        "<formula number_of_chemicals=\"1\">delta_a = laplacian_a - 0.1f*a;</formula>"
+        "<sparse brick_size=\"8\" tolerance=\"0.0001\"/></rule></RD>";
+    vtkSmartPointer<vtkXMLDataElement> rd = vtkSmartPointer<vtkXMLDataElement>::Take(
+        vtkXMLUtilities::ReadElementFromString(rd_xml.c_str()));
+    SparseImageRD system(VTK_FLOAT);
+    bool warn_to_update = false;
+    system.InitializeFromXML(rd, warn_to_update);
+    system.SetDimensionsAndNumberOfChemicals(64, 64, 1, 1);
+
+    // (a bump inside one of the 64 bricks)
+    vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+    image->SetDimensions(64, 64, 1);
+    image->AllocateScalars(VTK_FLOAT, 1);
+    image->GetPointData()->GetScalars()->FillComponent(0, 0.0);
+    for (int y = 10; y < 14; y++)
+        for (int x = 10; x < 14; x++)
+            image->SetScalarComponentFromFloat(x, y, 0, 0, 1.0f);
+    system.CopyFromImage(image);
+
+    system.Update(1);
+    const size_t at_first = system.GetNumberOfActiveBricks();
+    Check(at_first >= 1 && at_first < 64, "only the bricks near the bump are stepped at first ("
+        + to_string(at_first) + ")");
+    system.Update(20);
+    Check(system.GetNumberOfActiveBricks() > at_first, "the bricks the bump spreads into are woken ("
+        + to_string(system.GetNumberOfActiveBricks()) + ")");
+    system.Update(1000);
+    Check(system.GetNumberOfActiveBricks() == 0, "every brick sleeps once the bump has died away ("
+        + to_string(system.GetNumberOfActiveBricks()) + " awake)");
+    float largest = 0.0f;
+    for (const float value : system.GetData(0))
+        largest = max(largest, fabs(value));
+    Check(largest < 1e-3f, "the images show the bump died away (" + to_string(largest) + ")");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// The spectral radius that sets the number of super-time-stepping stages must not be underestimated, so a formula
+/// that uses an operator in a way whose contribution can't be bounded gets no estimate.
+static void TestSpectralRadiusEstimateIsConservative()
+{
+    const vector<AbstractRD::Parameter> parameters = { { "D_a", 0.5f }, { "D_b", 0.25f } };
+    const map<string, double> keyword_radii = { { "laplacian_a", 8.0 }, { "laplacian_b", 8.0 } };
+    double spectral_radius;
+    Check(EstimateFormulaSpectralRadius("delta_a = D_a * laplacian_a - a*b*b;\ndelta_b = D_b * laplacian_b + a*b*b;",
+        parameters, keyword_radii, spectral_radius) && fabs(spectral_radius - 4.0) < 1e-6, "Gray-Scott is estimated");
+    Check(EstimateFormulaSpectralRadius("delta_a = laplacian_a / 2 + 1e+2f * laplacian_b;\n"
+        "delta_a -= D_a * laplacian_a;", parameters, keyword_radii, spectral_radius)
+        && fabs(spectral_radius - 808.0) < 1e-6, "the terms added to a delta_ are summed");
+    for (const string formula : { "delta_a = a * laplacian_a;", "delta_a = D_a * (laplacian_a + laplacian_b);",
+        "float4 lap = laplacian_a;\ndelta_a = D_a * lap;", "delta_a = D_a * laplacian_a;\ndelta_a *= 10.0f;",
+        "delta_a = laplacian_a;\ndelta_b = delta_a * 100;", "delta_a = a > 0.5f ? laplacian_a : 0.0f;" })
+    {
+        Check(!EstimateFormulaSpectralRadius(formula, parameters, keyword_radii, spectral_radius),
+            "no estimate for: " + formula);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// The displaced surface is rewritten in place between updates, unless a shallow copy of the last one is still held.
+static void TestDisplacedSurfaceReusesItsArrays()
+{
+    vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+    image->SetDimensions(16, 16, 1);
+    image->AllocateScalars(VTK_FLOAT, 1);
+    vtkDataArray* values = image->GetPointData()->GetScalars();
+    values->FillComponent(0, 1.0);
+    vtkSmartPointer<DisplacedSurfaceFilter> surface = vtkSmartPointer<DisplacedSurfaceFilter>::New();
+    surface->SetInputData(image);
+    surface->Update();
+
+    vtkSmartPointer<vtkPolyData> held = vtkSmartPointer<vtkPolyData>::New();
+    held->ShallowCopy(surface->GetOutput());
+    const double held_z = held->GetPoint(0)[2];
+    values->FillComponent(0, 2.0);
+    image->Modified();
+    surface->Update();
+    Check(surface->GetOutput()->GetPoints() != held->GetPoints(), "the held points are left alone");
+    Check(held->GetPoint(0)[2] == held_z, "the held surface keeps its heights");
+    Check(surface->GetOutput()->GetPoint(0)[2] != held_z, "the new surface has the new heights");
+
+    held = nullptr;
+    vtkPoints* points = surface->GetOutput()->GetPoints();
+    values->FillComponent(0, 3.0);
+    image->Modified();
+    surface->Update();
+    Check(surface->GetOutput()->GetPoints() == points, "the points are rewritten in place when no-one holds them");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Evening out the cells of a random mesh lengthens the stable timestep when the neighbors are weighted by distance.
+/// With the default equal weights the timestep depends only on how the cells are connected, which relaxing keeps.
+static void TestRelaxingLengthensTheStableTimestep()
+{
+    vtkMath::RandomSeed(1);
+    vtkSmartPointer<vtkUnstructuredGrid> mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
+    MeshGenerators::GetRandomVoronoi2D(1000, mesh, 2, VTK_FLOAT);
+    GrayScottMeshRD system;
+    system.CopyFromMesh(mesh);
+    const double equal_weights = system.EstimateMaximumStableTimestep();
+    system.RelaxMesh(MeshRelaxation::Method::EqualizeCellSizes, 20);
+    Check(fabs(system.EstimateMaximumStableTimestep() - equal_weights) <= 1e-3 * equal_weights,
+        "with equal weights relaxing leaves the stable timestep alone");
+
+    system.CopyFromMesh(mesh);
+    system.SetDistanceWeightedNeighbors(true);
+    const double before = system.EstimateMaximumStableTimestep();
+    system.RelaxMesh(MeshRelaxation::Method::EqualizeCellSizes, 20);
+    const double after = system.EstimateMaximumStableTimestep();
+    Check(before > 0.0, "the stable timestep is known");
+    Check(after > before, "relaxing the mesh lengthens the stable timestep (" + to_string(before) + " before, "
+        + to_string(after) + " after)");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+/// Lloyd's algorithm, from the same random sites, gives cells that are more even in size.
+static void TestLloydIterationsEvenOutVoronoiCells()
+{
+    vtkSmartPointer<vtkUnstructuredGrid> plain = vtkSmartPointer<vtkUnstructuredGrid>::New();
+    vtkSmartPointer<vtkUnstructuredGrid> lloyd = vtkSmartPointer<vtkUnstructuredGrid>::New();
+    vtkMath::RandomSeed(1);
+    MeshGenerators::GetRandomVoronoi2D(1000, plain, 2, VTK_FLOAT);
+    vtkMath::RandomSeed(1);
+    MeshGenerators::GetRandomVoronoi2D(1000, lloyd, 2, VTK_FLOAT, 10);
+
+    Check(lloyd->GetNumberOfCells() > 500, "most of the sites keep their cell");
+    vtkDataArray* a = lloyd->GetCellData()->GetArray("a");
+    Check(a != nullptr && a->GetNumberOfTuples() == lloyd->GetNumberOfCells(), "each cell has a value of each chemical");
+    double plain_smallest, plain_largest, lloyd_smallest, lloyd_largest;
+    MeshRelaxation::GetCellAreaRange(plain, plain_smallest, plain_largest);
+    MeshRelaxation::GetCellAreaRange(lloyd, lloyd_smallest, lloyd_largest);
+    Check(lloyd_smallest > 0.0, "no cell collapses");
+    Check(lloyd_smallest / lloyd_largest > 2.0 * plain_smallest / plain_largest, "the cells are more even in size");
+
+    GrayScottMeshRD plain_system, lloyd_system;
+    plain_system.CopyFromMesh(plain);
+    lloyd_system.CopyFromMesh(lloyd);
+    Check(lloyd_system.EstimateMaximumStableTimestep() > plain_system.EstimateMaximumStableTimestep(),
+        "the even cells allow a longer timestep");
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
+int main()
+{
+    const pair<string, function<void()>> tests[] = {
+        { "OpenCLImageRD/reallocate_while_shallow_copy_held", TestReallocatingWhileShallowCopyIsHeld },
+        { "OpenCLImageRD/readback_overlapping_the_next_update", TestReadbackOverlappingTheNextUpdate },
+        { "OpenCLImageRD/statistics_without_readback", TestStatisticsWithoutReadback },
+        { "FormulaOpenCLImageRD/image_storage_round_trip", TestImageStorageRoundTrip },
+        { "NativeKernelImageRD/local_memory_and_barriers", TestNativeKernelLocalMemoryAndBarriers },
+        { "OutOfCoreImageRD/checks_the_stencil_radius", TestOutOfCoreChecksTheStencilRadius },
+        { "AMRImageRD/conserves_mass", TestAMRConservesMass },
+        { "SparseImageRD/wakes_and_sleeps", TestSparseWakesAndSleeps },
+        { "super_time_stepping/spectral_radius_estimate_is_conservative", TestSpectralRadiusEstimateIsConservative },
+        { "DisplacedSurfaceFilter/reuses_its_arrays", TestDisplacedSurfaceReusesItsArrays },
+        { "MeshRD/relaxing_lengthens_the_stable_timestep", TestRelaxingLengthensTheStableTimestep },
+        { "MeshGenerators/lloyd_evens_out_voronoi_cells", TestLloydIterationsEvenOutVoronoiCells },
+    };
+    int n_failed = 0;
+    for (const auto& test : tests)
+    {
+        try
+        {
+            test.second();
+            cout << "passed:  " << test.first << endl;
+        }
+        catch (const TestSkipped& e)
+        {
+            cout << "skipped: " << test.first << " (" << e.what() << ")" << endl;
+        }
+        catch (const exception& e)
+        {
+            cout << "FAILED:  " << test.first << " : " << e.what() << endl;
+            n_failed++;
+        }
+    }
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}